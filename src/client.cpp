@@ -420,7 +420,8 @@ void Client::step(float dtime)
 			// [3] u8[20] player_name
 			// [23] u8[28] password (new in some version)
 			// [51] u16 client network protocol version (new in some version)
-			SharedBuffer<u8> data(2+1+PLAYERNAME_SIZE+PASSWORD_SIZE+2);
+			// [53] u16 supported compression codecs (new in some version)
+			SharedBuffer<u8> data(2+1+PLAYERNAME_SIZE+PASSWORD_SIZE+2+2);
 			writeU16(&data[0], TOSERVER_INIT);
 			writeU8(&data[2], SER_FMT_VER_HIGHEST);
 
@@ -436,6 +437,8 @@ void Client::step(float dtime)
 			// This should be incremented in each version
 			writeU16(&data[51], 3);
 
+			writeU16(&data[53], CODECS_SUPPORTED);
+
 			// Send as unreliable
 			Send(0, data, false);
 		}
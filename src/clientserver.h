@@ -234,6 +234,8 @@ enum ToServerCommand
 		[3] u8[20] player_name
 		[23] u8[28] password (new in some version)
 		[51] u16 client network protocol version (new in some version)
+		[53] u16 supported compression codecs, bit (1<<codec) for each
+		     CompressionCodec (new in some version)
 	*/
 
 	TOSERVER_INIT2 = 0x11,
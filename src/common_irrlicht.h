@@ -57,10 +57,12 @@ typedef core::vector2d<f32> v2f32;
 #ifdef _MSC_VER
 	// Windows
 	typedef unsigned long long u64;
+	typedef signed long long s64;
 #else
 	// Posix
 	#include <stdint.h>
 	typedef uint64_t u64;
+	typedef int64_t s64;
 	//typedef unsigned long long u64;
 #endif
 
@@ -0,0 +1,305 @@
+/*
+Minetest-c55
+Copyright (C) 2010-2011 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "content_abm.h"
+#include "environment.h"
+#include "content_mapnode.h"
+#include "content_sao.h"
+#include "mapblock.h"
+#include "mapgen.h"
+#include "settings.h"
+#include "log.h"
+
+#define PP(x) "("<<(x).X<<","<<(x).Y<<","<<(x).Z<<")"
+
+/*
+	Convert mud under proper lighting to grass
+*/
+class GrowGrassABM : public ActiveBlockModifier
+{
+public:
+	const char * getName()
+	{
+		return "grow grass";
+	}
+	content_t getTriggerContent(u32 i)
+	{
+		return CONTENT_MUD;
+	}
+	float getActiveInterval()
+	{
+		return 10.0;
+	}
+	u32 getActiveChance()
+	{
+		return 20;
+	}
+	void triggerEvent(ServerEnvironment *env, v3s16 p, MapNode n,
+			u32 active_object_count_wider)
+	{
+		ServerMap &map = env->getServerMap();
+		MapNode n_top = map.getNodeNoEx(p+v3s16(0,1,0));
+		if(content_features(n_top).air_equivalent &&
+				n_top.getLightBlend(env->getDayNightRatio()) >= 13)
+		{
+			n.setContent(CONTENT_GRASS);
+			map.addNodeWithEvent(p, n);
+		}
+	}
+};
+
+/*
+	Convert grass into mud if under something else than air
+*/
+class RemoveGrassABM : public ActiveBlockModifier
+{
+public:
+	const char * getName()
+	{
+		return "remove grass";
+	}
+	content_t getTriggerContent(u32 i)
+	{
+		return CONTENT_GRASS;
+	}
+	float getActiveInterval()
+	{
+		return 10.0;
+	}
+	u32 getActiveChance()
+	{
+		return 1;
+	}
+	void triggerEvent(ServerEnvironment *env, v3s16 p, MapNode n,
+			u32 active_object_count_wider)
+	{
+		ServerMap &map = env->getServerMap();
+		MapNode n_top = map.getNodeNoEx(p+v3s16(0,1,0));
+		if(content_features(n_top).air_equivalent == false)
+		{
+			n.setContent(CONTENT_MUD);
+			map.addNodeWithEvent(p, n);
+		}
+	}
+};
+
+/*
+	Rats spawn around regular trees
+*/
+class SpawnRatsAroundTreesABM : public ActiveBlockModifier
+{
+public:
+	const char * getName()
+	{
+		return "spawn rats around trees";
+	}
+	u32 getTriggerContentCount()
+	{
+		return 2;
+	}
+	content_t getTriggerContent(u32 i)
+	{
+		if(i == 0)
+			return CONTENT_TREE;
+		return CONTENT_JUNGLETREE;
+	}
+	float getActiveInterval()
+	{
+		return 10.0;
+	}
+	u32 getActiveChance()
+	{
+		return 200;
+	}
+	void triggerEvent(ServerEnvironment *env, v3s16 p, MapNode n,
+			u32 active_object_count_wider)
+	{
+		if(active_object_count_wider != 0)
+			return;
+		ServerMap &map = env->getServerMap();
+		v3s16 p1 = p + v3s16(myrand_range(-2, 2),
+				0, myrand_range(-2, 2));
+		MapNode n1 = map.getNodeNoEx(p1);
+		MapNode n1b = map.getNodeNoEx(p1+v3s16(0,-1,0));
+		if(n1b.getContent() == CONTENT_GRASS &&
+				n1.getContent() == CONTENT_AIR)
+		{
+			v3f pos = intToFloat(p1, BS);
+			ServerActiveObject *obj = new RatSAO(env, 0, pos);
+			env->addActiveObject(obj);
+		}
+	}
+};
+
+static void getMob_dungeon_master(Settings &properties)
+{
+	properties.set("looks", "dungeon_master");
+	properties.setFloat("yaw", 1.57);
+	properties.setFloat("hp", 30);
+	properties.setBool("bright_shooting", true);
+	properties.set("shoot_type", "fireball");
+	properties.set("shoot_y", "0.7");
+	properties.set("player_hit_damage", "1");
+	properties.set("player_hit_distance", "1.0");
+	properties.set("player_hit_interval", "0.5");
+	properties.setBool("mindless_rage", myrand_range(0,100)==0);
+}
+
+/*
+	Fun things spawn in caves and dungeons
+*/
+class SpawnInCavesABM : public ActiveBlockModifier
+{
+public:
+	const char * getName()
+	{
+		return "spawn in caves";
+	}
+	u32 getTriggerContentCount()
+	{
+		return 2;
+	}
+	content_t getTriggerContent(u32 i)
+	{
+		if(i == 0)
+			return CONTENT_STONE;
+		return CONTENT_MOSSYCOBBLE;
+	}
+	float getActiveInterval()
+	{
+		return 10.0;
+	}
+	u32 getActiveChance()
+	{
+		return 200;
+	}
+	void triggerEvent(ServerEnvironment *env, v3s16 p, MapNode n,
+			u32 active_object_count_wider)
+	{
+		if(active_object_count_wider != 0)
+			return;
+		ServerMap &map = env->getServerMap();
+		v3s16 p1 = p + v3s16(0,1,0);
+		MapNode n1a = map.getNodeNoEx(p1+v3s16(0,0,0));
+		if(n1a.getLightBlend(env->getDayNightRatio()) > 3)
+			return;
+		MapNode n1b = map.getNodeNoEx(p1+v3s16(0,1,0));
+		if(n1a.getContent() != CONTENT_AIR ||
+				n1b.getContent() != CONTENT_AIR)
+			return;
+
+		v3f pos = intToFloat(p1, BS);
+		int i = myrand()%5;
+		if(i == 0 || i == 1){
+			actionstream<<"A dungeon master spawns at "
+					<<PP(p1)<<std::endl;
+			Settings properties;
+			getMob_dungeon_master(properties);
+			ServerActiveObject *obj = new MobV2SAO(
+					env, 0, pos, &properties);
+			env->addActiveObject(obj);
+		} else if(i == 2 || i == 3){
+			actionstream<<"Rats spawn at "
+					<<PP(p1)<<std::endl;
+			for(int j=0; j<3; j++){
+				ServerActiveObject *obj = new RatSAO(
+						env, 0, pos);
+				env->addActiveObject(obj);
+			}
+		} else {
+			actionstream<<"An oerkki spawns at "
+					<<PP(p1)<<std::endl;
+			ServerActiveObject *obj = new Oerkki1SAO(
+					env, 0, pos);
+			env->addActiveObject(obj);
+		}
+	}
+};
+
+/*
+	Make trees from saplings!
+*/
+class MakeTreesFromSaplingsABM : public ActiveBlockModifier
+{
+public:
+	const char * getName()
+	{
+		return "make trees from saplings";
+	}
+	content_t getTriggerContent(u32 i)
+	{
+		return CONTENT_SAPLING;
+	}
+	float getActiveInterval()
+	{
+		return 10.0;
+	}
+	u32 getActiveChance()
+	{
+		return 50;
+	}
+	void triggerEvent(ServerEnvironment *env, v3s16 p, MapNode n,
+			u32 active_object_count_wider)
+	{
+		actionstream<<"A sapling grows into a tree at "
+				<<PP(p)<<std::endl;
+
+		ServerMap *map = &env->getServerMap();
+		core::map<v3s16, MapBlock*> modified_blocks;
+		v3s16 tree_p = p;
+		ManualMapVoxelManipulator vmanip(map);
+		v3s16 tree_blockp = getNodeBlockPos(tree_p);
+		vmanip.initialEmerge(tree_blockp - v3s16(1,1,1), tree_blockp + v3s16(1,1,1));
+		bool is_apple_tree = myrand()%4 == 0;
+		mapgen::make_tree(vmanip, tree_p, is_apple_tree);
+		vmanip.blitBackAll(&modified_blocks);
+
+		// update lighting
+		core::map<v3s16, MapBlock*> lighting_modified_blocks;
+		for(core::map<v3s16, MapBlock*>::Iterator
+			i = modified_blocks.getIterator();
+			i.atEnd() == false; i++)
+		{
+			lighting_modified_blocks.insert(i.getNode()->getKey(), i.getNode()->getValue());
+		}
+		map->updateLighting(lighting_modified_blocks, modified_blocks);
+
+		// Send a MEET_OTHER event
+		MapEditEvent event;
+		event.type = MEET_OTHER;
+		for(core::map<v3s16, MapBlock*>::Iterator
+			i = modified_blocks.getIterator();
+			i.atEnd() == false; i++)
+		{
+			v3s16 p = i.getNode()->getKey();
+			event.modified_blocks.insert(p, true);
+		}
+		map->dispatchEvent(&event);
+	}
+};
+
+void add_content_abms(ServerEnvironment *env)
+{
+	env->addActiveBlockModifier(new GrowGrassABM());
+	env->addActiveBlockModifier(new RemoveGrassABM());
+	env->addActiveBlockModifier(new SpawnRatsAroundTreesABM());
+	env->addActiveBlockModifier(new SpawnInCavesABM());
+	env->addActiveBlockModifier(new MakeTreesFromSaplingsABM());
+}
+
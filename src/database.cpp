@@ -0,0 +1,321 @@
+/*
+Minetest-c55
+Copyright (C) 2010-2011 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#include "database.h"
+#include "database_sqlite3.h"
+#include "database_folders.h"
+#include "database_region.h"
+#include "exceptions.h"
+#include "log.h"
+#include "utility.h"
+#include <iostream>
+#include <cstdio>
+
+/*
+	Database
+*/
+
+BlockKeyEncoding parseBlockKeyEncoding(const std::string &name)
+{
+	if(name == "linear")
+		return BLOCKKEY_LINEAR;
+	if(name == "morton")
+		return BLOCKKEY_MORTON;
+	errorstream<<"Unknown block key encoding \""<<name<<"\""<<std::endl;
+	throw BaseException("Unknown block key encoding");
+}
+
+const char * getBlockKeyEncodingName(BlockKeyEncoding enc)
+{
+	switch(enc)
+	{
+		case BLOCKKEY_LINEAR: return "linear";
+		case BLOCKKEY_MORTON: return "morton";
+	}
+	return "";
+}
+
+// Spreads the low 12 bits of v to every third bit
+static u64 mortonSpread(u64 v)
+{
+	v &= 0xfff;
+	v = (v | (v << 16)) & 0x1f0000ff0000ffULL;
+	v = (v | (v << 8)) & 0x100f00f00f00f00fULL;
+	v = (v | (v << 4)) & 0x10c30c30c30c30c3ULL;
+	v = (v | (v << 2)) & 0x1249249249249249ULL;
+	return v;
+}
+
+// Inverse of mortonSpread()
+static u64 mortonCompact(u64 v)
+{
+	v &= 0x1249249249249249ULL;
+	v = (v | (v >> 2)) & 0x10c30c30c30c30c3ULL;
+	v = (v | (v >> 4)) & 0x100f00f00f00f00fULL;
+	v = (v | (v >> 8)) & 0x1f0000ff0000ffULL;
+	v = (v | (v >> 16)) & 0x1f00000000ffffULL;
+	return v & 0xfff;
+}
+
+s64 Database::getBlockAsInteger(const v3s16 pos, BlockKeyEncoding enc)
+{
+	if(enc == BLOCKKEY_MORTON)
+	{
+		return (s64)(mortonSpread(pos.X + 2048)
+				| (mortonSpread(pos.Y + 2048) << 1)
+				| (mortonSpread(pos.Z + 2048) << 2));
+	}
+	return (s64)pos.Z*16777216 +
+		(s64)pos.Y*4096 + (s64)pos.X;
+}
+
+static s32 unsignedToSigned(s32 i, s32 max_positive)
+{
+	if(i < max_positive)
+		return i;
+	else
+		return i - 2*max_positive;
+}
+
+// modulo of a negative number does not work consistently in C
+static s64 pythonmodulo(s64 i, s64 mod)
+{
+	if(i >= 0)
+		return i % mod;
+	return mod - ((-i) % mod);
+}
+
+v3s16 Database::getIntegerAsBlock(s64 i, BlockKeyEncoding enc)
+{
+	if(enc == BLOCKKEY_MORTON)
+	{
+		return v3s16(mortonCompact(i) - 2048,
+				mortonCompact(i >> 1) - 2048,
+				mortonCompact(i >> 2) - 2048);
+	}
+	s32 x = unsignedToSigned(pythonmodulo(i, 4096), 2048);
+	i = (i - x) / 4096;
+	s32 y = unsignedToSigned(pythonmodulo(i, 4096), 2048);
+	i = (i - y) / 4096;
+	s32 z = unsignedToSigned(pythonmodulo(i, 4096), 2048);
+	return v3s16(x,y,z);
+}
+
+void Database::loadBlocks(const core::list<v3s16> &blocks,
+		core::map<v3s16, std::string> &dst)
+{
+	std::string data;
+	for(core::list<v3s16>::ConstIterator i = blocks.begin();
+			i != blocks.end(); i++)
+	{
+		if(loadBlock(*i, data))
+			dst[*i] = data;
+	}
+}
+
+/*
+	MemoryDatabase
+*/
+
+void MemoryDatabase::saveBlock(v3s16 blockpos, const std::string &data)
+{
+	m_blocks[blockpos] = data;
+}
+
+bool MemoryDatabase::loadBlock(v3s16 blockpos, std::string &data)
+{
+	core::map<v3s16, std::string>::Node *n = m_blocks.find(blockpos);
+	if(n == NULL)
+		return false;
+	data = n->getValue();
+	return true;
+}
+
+void MemoryDatabase::deleteBlock(v3s16 blockpos)
+{
+	m_blocks.remove(blockpos);
+}
+
+void MemoryDatabase::listAllLoadableBlocks(core::list<v3s16> &dst)
+{
+	for(core::map<v3s16, std::string>::Iterator i = m_blocks.getIterator();
+			i.atEnd() == false; i++)
+	{
+		dst.push_back(i.getNode()->getKey());
+	}
+}
+
+/*
+	BlockPresenceFilter
+*/
+
+// Bits per block and probes per lookup; about 0.3% false positives
+#define PRESENCE_FILTER_BITS_PER_BLOCK 16
+#define PRESENCE_FILTER_PROBES 4
+
+BlockPresenceFilter::BlockPresenceFilter():
+	m_mask(0),
+	m_count(0),
+	m_capacity(0)
+{
+	reset(0);
+}
+
+void BlockPresenceFilter::reset(u32 block_count)
+{
+	// A power of two number of bits, at least 128kB worth
+	u32 bits = 1<<20;
+	while(bits / PRESENCE_FILTER_BITS_PER_BLOCK < block_count
+			&& bits < 0x80000000)
+		bits <<= 1;
+	m_bits.assign(bits / 32, 0);
+	m_mask = bits - 1;
+	m_count = 0;
+	m_capacity = bits / PRESENCE_FILTER_BITS_PER_BLOCK;
+}
+
+// 64-bit finalizer of MurmurHash3
+static u64 presenceHash(v3s16 p)
+{
+	u64 h = (u64)Database::getBlockAsInteger(p);
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+void BlockPresenceFilter::add(v3s16 p)
+{
+	u64 h = presenceHash(p);
+	u32 h1 = h & 0xffffffff;
+	u32 h2 = (h >> 32) | 1;
+	for(u32 i=0; i<PRESENCE_FILTER_PROBES; i++)
+	{
+		u32 b = (h1 + i * h2) & m_mask;
+		m_bits[b / 32] |= 1u << (b % 32);
+	}
+	m_count++;
+}
+
+bool BlockPresenceFilter::mayContain(v3s16 p) const
+{
+	u64 h = presenceHash(p);
+	u32 h1 = h & 0xffffffff;
+	u32 h2 = (h >> 32) | 1;
+	for(u32 i=0; i<PRESENCE_FILTER_PROBES; i++)
+	{
+		u32 b = (h1 + i * h2) & m_mask;
+		if((m_bits[b / 32] & (1u << (b % 32))) == 0)
+			return false;
+	}
+	return true;
+}
+
+/*
+	BlockJournal
+*/
+
+BlockJournal::BlockJournal()
+{
+}
+
+void BlockJournal::load(const std::string &path)
+{
+	std::ifstream is(path.c_str(), std::ios_base::binary);
+	u8 buf[6];
+	while(is.read((char*)buf, 6))
+		m_blocks.insert(readV3S16(buf), true);
+}
+
+void BlockJournal::open(const std::string &path)
+{
+	m_path = path;
+	m_blocks.clear();
+	load(m_path + ".old");
+	load(m_path);
+	m_file.open(m_path.c_str(), std::ios_base::binary | std::ios_base::app);
+	if(m_file.good() == false)
+		errorstream<<"BlockJournal: Can't open "<<m_path<<std::endl;
+	infostream<<"BlockJournal: "<<m_blocks.size()<<" blocks in "
+			<<m_path<<std::endl;
+}
+
+void BlockJournal::add(v3s16 p)
+{
+	if(m_blocks.find(p) != NULL)
+		return;
+	m_blocks.insert(p, true);
+	u8 buf[6];
+	writeV3S16(buf, p);
+	m_file.write((char*)buf, 6);
+}
+
+void BlockJournal::flush()
+{
+	m_file.flush();
+}
+
+void BlockJournal::rotate(core::map<v3s16, bool> &dst)
+{
+	m_file.close();
+
+	// This also replaces the positions of an interrupted backup
+	{
+		std::string oldpath = m_path + ".old";
+		std::ofstream os(oldpath.c_str(),
+				std::ios_base::binary | std::ios_base::trunc);
+		for(core::map<v3s16, bool>::Iterator i = m_blocks.getIterator();
+				i.atEnd() == false; i++)
+		{
+			u8 buf[6];
+			writeV3S16(buf, i.getNode()->getKey());
+			os.write((char*)buf, 6);
+			dst.insert(i.getNode()->getKey(), true);
+		}
+	}
+	m_blocks.clear();
+
+	m_file.open(m_path.c_str(), std::ios_base::binary | std::ios_base::trunc);
+	if(m_file.good() == false)
+		errorstream<<"BlockJournal: Can't open "<<m_path<<std::endl;
+}
+
+void BlockJournal::rotationDone()
+{
+	remove((m_path + ".old").c_str());
+}
+
+Database * createDatabase(const std::string &name, const std::string &savedir,
+		BlockKeyEncoding key_encoding)
+{
+	if(name == "sqlite3")
+		return new SQLiteDatabase(savedir, key_encoding);
+	if(name == "folders")
+		return new FolderDatabase(savedir);
+	if(name == "region")
+		return new RegionDatabase(savedir);
+	if(name == "memory")
+		return new MemoryDatabase();
+	errorstream<<"Unknown map backend \""<<name<<"\""<<std::endl;
+	throw BaseException("Unknown map backend");
+}
+
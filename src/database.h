@@ -0,0 +1,226 @@
+/*
+Minetest-c55
+Copyright (C) 2010-2011 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#ifndef DATABASE_HEADER
+#define DATABASE_HEADER
+
+#include "common_irrlicht.h"
+#include <string>
+#include <vector>
+#include <fstream>
+
+/*
+	Ways of turning a block position into a single integer key.
+	The encoding of a map is stored in its map_meta.txt.
+
+	BLOCKKEY_LINEAR: z*0x1000000 + y*0x1000 + x. Blocks next to each
+	other in X or Y are far apart.
+	BLOCKKEY_MORTON: the bits of x, y and z (offset to 0...4095)
+	interleaved, so that any aligned cube of blocks is one contiguous
+	key range.
+*/
+enum BlockKeyEncoding
+{
+	BLOCKKEY_LINEAR,
+	BLOCKKEY_MORTON
+};
+
+// Throws BaseException if name is unknown
+BlockKeyEncoding parseBlockKeyEncoding(const std::string &name);
+const char * getBlockKeyEncodingName(BlockKeyEncoding enc);
+
+/*
+	Map block storage backend.
+
+	Blocks are stored as the blobs written by ServerMap::saveBlock():
+		[0] u8 serialization version
+		[1] data
+	Implementations don't need to be thread-safe; ServerMap locks
+	around every call.
+*/
+class Database
+{
+public:
+	virtual ~Database() {}
+
+	// Call these before and after saving of many blocks
+	virtual void beginSave() = 0;
+	virtual void endSave() = 0;
+	/*
+		Makes grouped writes permanent if they have waited long enough.
+		force=true makes them permanent unconditionally.
+	*/
+	virtual void flush(bool force) {}
+
+	virtual void saveBlock(v3s16 blockpos, const std::string &data) = 0;
+	// Returns false if the block is not stored
+	virtual bool loadBlock(v3s16 blockpos, std::string &data) = 0;
+	/*
+		Adds the blocks of the list that are stored to dst.
+		Backends that can fetch many blocks at once override this.
+	*/
+	virtual void loadBlocks(const core::list<v3s16> &blocks,
+			core::map<v3s16, std::string> &dst);
+	virtual void deleteBlock(v3s16 blockpos) = 0;
+	virtual void listAllLoadableBlocks(core::list<v3s16> &dst) = 0;
+
+	// For debug printing and map_meta.txt
+	virtual const char * getName() = 0;
+
+	/*
+		Rewrites all stored keys in another encoding.
+		Backends that don't use integer keys ignore this.
+	*/
+	virtual void convertKeys(BlockKeyEncoding to) {}
+
+	/*
+		Gives unused space back to the file system. Can take long.
+		Backends that can't do it ignore this.
+	*/
+	virtual void compact() {}
+
+	/*
+		Online copy of the whole database into a new map directory,
+		made by backupStep() a little at a time so that the database
+		can be used in between. Backends that can't do this return
+		false from startBackup().
+	*/
+	virtual bool startBackup(const std::string &savedir) { return false; }
+	/*
+		Copies about amount more. Returns false when the copy is done;
+		failed is set if it had to be given up.
+	*/
+	virtual bool backupStep(u32 amount, bool &failed) { return false; }
+
+	/*
+		Block positions as single integers, for backends that want
+		a numeric key. Three signed 12 bit values.
+	*/
+	static s64 getBlockAsInteger(const v3s16 pos,
+			BlockKeyEncoding enc = BLOCKKEY_LINEAR);
+	static v3s16 getIntegerAsBlock(s64 i,
+			BlockKeyEncoding enc = BLOCKKEY_LINEAR);
+};
+
+/*
+	Keeps everything in memory and forgets it when deleted.
+	For tests and benchmarks that shouldn't be affected by the disk.
+*/
+class MemoryDatabase : public Database
+{
+public:
+	void beginSave() {}
+	void endSave() {}
+
+	void saveBlock(v3s16 blockpos, const std::string &data);
+	bool loadBlock(v3s16 blockpos, std::string &data);
+	void deleteBlock(v3s16 blockpos);
+	void listAllLoadableBlocks(core::list<v3s16> &dst);
+
+	const char * getName() { return "memory"; }
+
+private:
+	core::map<v3s16, std::string> m_blocks;
+};
+
+/*
+	Set of block positions that can tell without asking the backend
+	that a block is not stored.
+
+	This is a bloom filter: mayContain() can return true for a block
+	that was never added, but never false for one that was. Blocks
+	can't be removed.
+*/
+class BlockPresenceFilter
+{
+public:
+	BlockPresenceFilter();
+
+	// Empties the filter and sizes it for about block_count blocks
+	void reset(u32 block_count);
+	void add(v3s16 p);
+	bool mayContain(v3s16 p) const;
+	/*
+		True when more blocks have been added than the filter was sized
+		for; it should be filled again with a bigger reset().
+	*/
+	bool isFull() const { return m_count > m_capacity; }
+	u32 getCount() const { return m_count; }
+
+private:
+	std::vector<u32> m_bits;
+	u32 m_mask;
+	u32 m_count;
+	u32 m_capacity;
+};
+
+/*
+	Positions of the blocks written since the last backup.
+
+	Kept in memory and appended to a file in the map directory, so
+	that they survive a restart. Every position is written once per
+	backup period.
+*/
+class BlockJournal
+{
+public:
+	BlockJournal();
+
+	// Loads path and a left over path.old and appends to path from now on
+	void open(const std::string &path);
+	bool isOpen()
+	{
+		return m_file.is_open();
+	}
+	void add(v3s16 p);
+	// Pushes appended positions to the file
+	void flush();
+	u32 size()
+	{
+		return m_blocks.size();
+	}
+
+	/*
+		Moves the positions to dst and starts an empty journal.
+		They are kept in path.old until rotationDone(), so that a
+		backup that gets interrupted includes them again next time.
+	*/
+	void rotate(core::map<v3s16, bool> &dst);
+	void rotationDone();
+
+private:
+	void load(const std::string &path);
+
+	std::string m_path;
+	std::ofstream m_file;
+	core::map<v3s16, bool> m_blocks;
+};
+
+/*
+	Creates the backend called name ("sqlite3", "folders", "region" or
+	"memory") for the map directory savedir, using the given key
+	encoding if the backend has integer keys.
+	Throws BaseException if name is unknown.
+*/
+Database * createDatabase(const std::string &name, const std::string &savedir,
+		BlockKeyEncoding key_encoding);
+
+#endif
+
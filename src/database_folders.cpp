@@ -0,0 +1,212 @@
+/*
+Minetest-c55
+Copyright (C) 2010-2011 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#include "database_folders.h"
+#include "filesys.h"
+#include "exceptions.h"
+#include "log.h"
+#include "debug.h"
+#include <fstream>
+#include <sstream>
+#include <cstdio>
+
+FolderDatabase::FolderDatabase(const std::string &savedir):
+	m_savedir(savedir)
+{
+}
+
+void FolderDatabase::saveBlock(v3s16 blockpos, const std::string &data)
+{
+	std::string sectordir = getSectorDir(m_savedir,
+			v2s16(blockpos.X, blockpos.Z));
+	if(fs::CreateAllDirs(sectordir) == false)
+		throw FileNotGoodException("Cannot create sector directory");
+
+	std::string fullpath = sectordir + DIR_DELIM + getBlockFilename(blockpos);
+	std::ofstream o(fullpath.c_str(), std::ios_base::binary);
+	if(o.good() == false)
+		throw FileNotGoodException("Cannot open block data");
+	o.write(data.c_str(), data.size());
+}
+
+bool FolderDatabase::loadBlock(v3s16 blockpos, std::string &data)
+{
+	v2s16 p2d(blockpos.X, blockpos.Z);
+	std::string blockfile = getBlockFilename(blockpos);
+	// New layout first; saveBlock() writes there, so a copy in the old
+	// layout is older if there are both
+	for(int layout = 2; layout >= 1; layout--)
+	{
+		std::string fullpath = getSectorDir(m_savedir, p2d, layout)
+				+ DIR_DELIM + blockfile;
+		std::ifstream is(fullpath.c_str(), std::ios_base::binary);
+		if(is.good() == false)
+			continue;
+		std::ostringstream os(std::ios_base::binary);
+		os<<is.rdbuf();
+		data = os.str();
+		return true;
+	}
+	return false;
+}
+
+void FolderDatabase::deleteBlock(v3s16 blockpos)
+{
+	v2s16 p2d(blockpos.X, blockpos.Z);
+	std::string blockfile = getBlockFilename(blockpos);
+	for(int layout = 1; layout <= 2; layout++)
+	{
+		std::string fullpath = getSectorDir(m_savedir, p2d, layout)
+				+ DIR_DELIM + blockfile;
+		if(fs::PathExists(fullpath))
+			fs::RecursiveDelete(fullpath);
+	}
+}
+
+void FolderDatabase::listSectorBlocks(const std::string &sectordir,
+		core::list<v3s16> &dst)
+{
+	std::vector<fs::DirListNode> list = fs::GetDirListing(sectordir);
+	for(std::vector<fs::DirListNode>::iterator i = list.begin();
+			i != list.end(); i++)
+	{
+		// We want files; "meta" is the sector metadata
+		if(i->dir || i->name == "meta")
+			continue;
+		try{
+			dst.push_back(getBlockPos(sectordir, i->name));
+		}
+		catch(InvalidFilenameException &e)
+		{
+			// This catches unknown crap in directory
+		}
+	}
+}
+
+void FolderDatabase::listAllLoadableBlocks(core::list<v3s16> &dst)
+{
+	// Layout 1: sectors/xxxxzzzz/
+	std::string dir1 = m_savedir + DIR_DELIM + "sectors";
+	std::vector<fs::DirListNode> list1 = fs::GetDirListing(dir1);
+	for(std::vector<fs::DirListNode>::iterator i = list1.begin();
+			i != list1.end(); i++)
+	{
+		if(i->dir && i->name.size() == 8)
+			listSectorBlocks(dir1 + DIR_DELIM + i->name, dst);
+	}
+
+	// Layout 2: sectors2/xxx/zzz/
+	std::string dir2 = m_savedir + DIR_DELIM + "sectors2";
+	std::vector<fs::DirListNode> listx = fs::GetDirListing(dir2);
+	for(std::vector<fs::DirListNode>::iterator i = listx.begin();
+			i != listx.end(); i++)
+	{
+		if(i->dir == false || i->name.size() != 3)
+			continue;
+		std::string dirx = dir2 + DIR_DELIM + i->name;
+		std::vector<fs::DirListNode> listz = fs::GetDirListing(dirx);
+		for(std::vector<fs::DirListNode>::iterator j = listz.begin();
+				j != listz.end(); j++)
+		{
+			if(j->dir && j->name.size() == 3)
+				listSectorBlocks(dirx + DIR_DELIM + j->name, dst);
+		}
+	}
+}
+
+bool FolderDatabase::exists(const std::string &savedir)
+{
+	return fs::PathExists(savedir + DIR_DELIM + "sectors")
+			|| fs::PathExists(savedir + DIR_DELIM + "sectors2");
+}
+
+std::string FolderDatabase::getSectorDir(const std::string &savedir,
+		v2s16 pos, int layout)
+{
+	char cc[9];
+	switch(layout)
+	{
+		case 1:
+			snprintf(cc, 9, "%.4x%.4x",
+				(unsigned int)pos.X&0xffff,
+				(unsigned int)pos.Y&0xffff);
+
+			return savedir + DIR_DELIM + "sectors" + DIR_DELIM + cc;
+		case 2:
+			snprintf(cc, 9, "%.3x" DIR_DELIM "%.3x",
+				(unsigned int)pos.X&0xfff,
+				(unsigned int)pos.Y&0xfff);
+
+			return savedir + DIR_DELIM + "sectors2" + DIR_DELIM + cc;
+		default:
+			assert(false);
+	}
+	return "";
+}
+
+v2s16 FolderDatabase::getSectorPos(std::string dirname)
+{
+	unsigned int x, y;
+	int r;
+	size_t spos = dirname.rfind(DIR_DELIM_C) + 1;
+	assert(spos != std::string::npos);
+	if(dirname.size() - spos == 8)
+	{
+		// Old layout
+		r = sscanf(dirname.substr(spos).c_str(), "%4x%4x", &x, &y);
+	}
+	else if(dirname.size() - spos == 3)
+	{
+		// New layout
+		r = sscanf(dirname.substr(spos-4).c_str(), "%3x" DIR_DELIM "%3x", &x, &y);
+		// Sign-extend the 12 bit values up to 16 bits...
+		if(x&0x800) x|=0xF000;
+		if(y&0x800) y|=0xF000;
+	}
+	else
+	{
+		assert(false);
+	}
+	assert(r == 2);
+	v2s16 pos((s16)x, (s16)y);
+	return pos;
+}
+
+v3s16 FolderDatabase::getBlockPos(std::string sectordir, std::string blockfile)
+{
+	v2s16 p2d = getSectorPos(sectordir);
+
+	if(blockfile.size() != 4){
+		throw InvalidFilenameException("Invalid block filename");
+	}
+	unsigned int y;
+	int r = sscanf(blockfile.c_str(), "%4x", &y);
+	if(r != 1)
+		throw InvalidFilenameException("Invalid block filename");
+	return v3s16(p2d.X, y, p2d.Y);
+}
+
+std::string FolderDatabase::getBlockFilename(v3s16 p)
+{
+	char cc[5];
+	snprintf(cc, 5, "%.4x", (unsigned int)p.Y&0xffff);
+	return cc;
+}
+
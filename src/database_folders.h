@@ -0,0 +1,70 @@
+/*
+Minetest-c55
+Copyright (C) 2010-2011 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#ifndef DATABASE_FOLDERS_HEADER
+#define DATABASE_FOLDERS_HEADER
+
+#include "database.h"
+
+/*
+	Stores every block in its own file, the original map format:
+		sectors/xxxxzzzz/yyyy     (layout 1, read only)
+		sectors2/xxx/zzz/yyyy     (layout 2)
+	Sector metadata in the same directories is handled by ServerMap.
+*/
+class FolderDatabase : public Database
+{
+public:
+	FolderDatabase(const std::string &savedir);
+
+	void beginSave() {}
+	void endSave() {}
+
+	void saveBlock(v3s16 blockpos, const std::string &data);
+	bool loadBlock(v3s16 blockpos, std::string &data);
+	void deleteBlock(v3s16 blockpos);
+	void listAllLoadableBlocks(core::list<v3s16> &dst);
+
+	const char * getName() { return "folders"; }
+
+	// Returns true if there is a sector directory of either layout
+	static bool exists(const std::string &savedir);
+
+	/*
+		Misc. helper functions for fiddling with directory and file
+		names
+	*/
+	// returns something like "map/sectors/xxxxxxxx"
+	static std::string getSectorDir(const std::string &savedir,
+			v2s16 pos, int layout = 2);
+	// dirname: final directory name
+	static v2s16 getSectorPos(std::string dirname);
+	static v3s16 getBlockPos(std::string sectordir, std::string blockfile);
+	static std::string getBlockFilename(v3s16 p);
+
+private:
+	void listSectorBlocks(const std::string &sectordir,
+			core::list<v3s16> &dst);
+
+	std::string m_savedir;
+};
+
+#endif
+
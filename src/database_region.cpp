@@ -0,0 +1,480 @@
+/*
+Minetest-c55
+Copyright (C) 2010-2011 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#include "database_region.h"
+#include "filesys.h"
+#include "exceptions.h"
+#include "utility.h"
+#include "log.h"
+#include "debug.h"
+#include <vector>
+#include <algorithm>
+#include <cstdio>
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+	#include <io.h>
+	#define ftruncate _chsize
+	#define fsync _commit
+#else
+	#include <unistd.h>
+	#include <sys/mman.h>
+#endif
+#ifndef O_BINARY
+	#define O_BINARY 0
+#endif
+
+#define REGION_TABLE_START 8
+#define REGION_DATA_START (REGION_TABLE_START + REGION_BLOCKS*8)
+#define REGION_FIRST_SECTOR \
+	((REGION_DATA_START + REGION_SECTOR_SIZE - 1) / REGION_SECTOR_SIZE)
+
+static bool writeAt(int fd, u32 pos, const void *data, u32 len)
+{
+	if(lseek(fd, pos, SEEK_SET) != (off_t)pos)
+		return false;
+	const char *p = (const char*)data;
+	while(len > 0)
+	{
+		int r = write(fd, p, len);
+		if(r <= 0)
+			return false;
+		p += r;
+		len -= r;
+	}
+	return true;
+}
+
+static bool readAt(int fd, u32 pos, void *data, u32 len)
+{
+	if(lseek(fd, pos, SEEK_SET) != (off_t)pos)
+		return false;
+	char *p = (char*)data;
+	while(len > 0)
+	{
+		int r = read(fd, p, len);
+		if(r <= 0)
+			return false;
+		p += r;
+		len -= r;
+	}
+	return true;
+}
+
+static u32 sectorsFor(u32 bytes)
+{
+	return (bytes + REGION_SECTOR_SIZE - 1) / REGION_SECTOR_SIZE;
+}
+
+static v3s16 getRegionPos(v3s16 blockpos)
+{
+	return getContainerPos(blockpos, REGION_SIZE);
+}
+
+static u32 getBlockIndex(v3s16 blockpos)
+{
+	v3s16 p = blockpos - getRegionPos(blockpos) * REGION_SIZE;
+	return p.X + REGION_SIZE * (p.Y + REGION_SIZE * p.Z);
+}
+
+RegionDatabase::RegionDatabase(const std::string &savedir):
+	m_dir(savedir + DIR_DELIM + "regions"),
+	m_use_counter(0),
+	m_saving(false)
+{
+	if(fs::CreateAllDirs(m_dir) == false)
+		throw FileNotGoodException("Cannot create region directory");
+}
+
+RegionDatabase::~RegionDatabase()
+{
+	try{
+		writeTables();
+	}
+	catch(FileNotGoodException &e)
+	{
+		errorstream<<"RegionDatabase: "<<e.what()<<std::endl;
+	}
+	for(core::map<v3s16, Region*>::Iterator i = m_regions.getIterator();
+			i.atEnd() == false; i++)
+	{
+		closeRegion(i.getNode()->getValue());
+	}
+	m_regions.clear();
+}
+
+std::string RegionDatabase::getRegionPath(v3s16 regionpos)
+{
+	char cc[32];
+	snprintf(cc, 32, "r.%d.%d.%d", regionpos.X, regionpos.Y, regionpos.Z);
+	return m_dir + DIR_DELIM + cc;
+}
+
+RegionDatabase::Region * RegionDatabase::getRegion(v3s16 regionpos,
+		bool create)
+{
+	core::map<v3s16, Region*>::Node *n = m_regions.find(regionpos);
+	if(n != NULL)
+	{
+		Region *r = n->getValue();
+		r->last_used = ++m_use_counter;
+		return r;
+	}
+
+	Region *r = openRegion(getRegionPath(regionpos), create);
+	if(r == NULL)
+		return NULL;
+
+	// Close the least recently used one if too many are open
+	if(m_regions.size() >= REGION_MAX_OPEN)
+	{
+		core::map<v3s16, Region*>::Node *oldest = NULL;
+		for(core::map<v3s16, Region*>::Iterator i = m_regions.getIterator();
+				i.atEnd() == false; i++)
+		{
+			if(oldest == NULL || i.getNode()->getValue()->last_used
+					< oldest->getValue()->last_used)
+				oldest = i.getNode();
+		}
+		writeTable(oldest->getValue());
+		closeRegion(oldest->getValue());
+		m_regions.remove(oldest->getKey());
+	}
+
+	r->last_used = ++m_use_counter;
+	m_regions.insert(regionpos, r);
+	return r;
+}
+
+RegionDatabase::Region * RegionDatabase::openRegion(const std::string &path,
+		bool create)
+{
+	int flags = O_RDWR | O_BINARY;
+	if(create)
+		flags |= O_CREAT;
+	int fd = open(path.c_str(), flags, 0644);
+	if(fd < 0)
+	{
+		if(create == false && errno == ENOENT)
+			return NULL;
+		errorstream<<"RegionDatabase: Cannot open "<<path<<std::endl;
+		throw FileNotGoodException("Cannot open region file");
+	}
+
+	struct stat st;
+	if(fstat(fd, &st) != 0)
+	{
+		close(fd);
+		throw FileNotGoodException("Cannot stat region file");
+	}
+
+	Region *r = new Region;
+	r->fd = fd;
+	r->mapping = NULL;
+	r->mapped_size = 0;
+	r->last_used = 0;
+	r->dirty = false;
+	memset(r->offsets, 0, sizeof(r->offsets));
+	memset(r->lengths, 0, sizeof(r->lengths));
+
+	bool ok = true;
+	if(st.st_size == 0)
+	{
+		/*
+			New file: write the header and an empty table and reserve
+			some room for block data
+		*/
+		std::string header(REGION_DATA_START, '\0');
+		u8 *h = (u8*)&header[0];
+		memcpy(h, "MTRG", 4);
+		h[4] = 1;
+		h[5] = REGION_SIZE;
+		writeU16(&h[6], REGION_SECTOR_SIZE);
+		r->size = (REGION_FIRST_SECTOR + REGION_GROW_SECTORS)
+				* REGION_SECTOR_SIZE;
+		ok = writeAt(fd, 0, header.c_str(), header.size())
+				&& ftruncate(fd, r->size) == 0;
+	}
+	else
+	{
+		r->size = st.st_size / REGION_SECTOR_SIZE * REGION_SECTOR_SIZE;
+		std::string header(REGION_DATA_START, '\0');
+		u8 *h = (u8*)&header[0];
+		ok = st.st_size >= REGION_DATA_START
+				&& readAt(fd, 0, h, header.size())
+				&& memcmp(h, "MTRG", 4) == 0
+				&& h[4] == 1
+				&& h[5] == REGION_SIZE
+				&& readU16(&h[6]) == REGION_SECTOR_SIZE;
+		for(u32 i=0; ok && i<REGION_BLOCKS; i++)
+		{
+			r->offsets[i] = readU32(&h[REGION_TABLE_START + i*8]);
+			r->lengths[i] = readU32(&h[REGION_TABLE_START + i*8 + 4]);
+		}
+	}
+	if(ok == false)
+	{
+		errorstream<<"RegionDatabase: Invalid region file "<<path<<std::endl;
+		close(fd);
+		delete r;
+		throw FileNotGoodException("Invalid region file");
+	}
+
+	memcpy(r->disk_offsets, r->offsets, sizeof(r->offsets));
+	memcpy(r->disk_lengths, r->lengths, sizeof(r->lengths));
+
+	remap(r);
+	return r;
+}
+
+void RegionDatabase::closeRegion(Region *r)
+{
+#ifndef _WIN32
+	if(r->mapping)
+		munmap(r->mapping, r->mapped_size);
+#endif
+	close(r->fd);
+	delete r;
+}
+
+void RegionDatabase::remap(Region *r)
+{
+#ifndef _WIN32
+	if(r->mapping)
+		munmap(r->mapping, r->mapped_size);
+	r->mapping = NULL;
+	r->mapped_size = 0;
+	void *m = mmap(NULL, r->size, PROT_READ, MAP_SHARED, r->fd, 0);
+	if(m == MAP_FAILED)
+	{
+		// Falls back to read()
+		infostream<<"RegionDatabase: mmap failed"<<std::endl;
+		return;
+	}
+	r->mapping = (u8*)m;
+	r->mapped_size = r->size;
+#endif
+}
+
+u32 RegionDatabase::allocate(Region *r, u32 sectors)
+{
+	// Used ranges sorted by position, both old and new ones of blocks
+	// whose entries are not written yet
+	std::vector<std::pair<u32, u32> > used;
+	for(u32 i=0; i<REGION_BLOCKS; i++)
+	{
+		if(r->offsets[i] != 0)
+			used.push_back(std::pair<u32, u32>(r->offsets[i],
+					sectorsFor(r->lengths[i])));
+		if(r->disk_offsets[i] != 0 && r->disk_offsets[i] != r->offsets[i])
+			used.push_back(std::pair<u32, u32>(r->disk_offsets[i],
+					sectorsFor(r->disk_lengths[i])));
+	}
+	std::sort(used.begin(), used.end());
+
+	// First fit
+	u32 pos = REGION_FIRST_SECTOR;
+	for(u32 i=0; i<used.size(); i++)
+	{
+		if(used[i].first >= pos + sectors)
+			return pos;
+		pos = MYMAX(pos, used[i].first + used[i].second);
+	}
+
+	u32 file_sectors = r->size / REGION_SECTOR_SIZE;
+	if(pos + sectors <= file_sectors)
+		return pos;
+
+	// Grow the file
+	u32 new_size = MYMAX(pos + sectors, file_sectors + REGION_GROW_SECTORS)
+			* REGION_SECTOR_SIZE;
+	if(ftruncate(r->fd, new_size) != 0)
+		throw FileNotGoodException("Cannot grow region file");
+	r->size = new_size;
+	remap(r);
+	return pos;
+}
+
+void RegionDatabase::writeTable(Region *r)
+{
+	if(r->dirty == false)
+		return;
+
+	// The data has to be on the disk before anything points to it
+	if(fsync(r->fd) != 0)
+		throw FileNotGoodException("Cannot sync region file");
+
+	for(u32 i=0; i<REGION_BLOCKS; i++)
+	{
+		if(r->offsets[i] == r->disk_offsets[i]
+				&& r->lengths[i] == r->disk_lengths[i])
+			continue;
+		u8 buf[8];
+		writeU32(&buf[0], r->offsets[i]);
+		writeU32(&buf[4], r->lengths[i]);
+		if(writeAt(r->fd, REGION_TABLE_START + i*8, buf, 8) == false)
+			throw FileNotGoodException("Cannot write region file");
+	}
+
+	/*
+		The sectors of the old entries are given to allocate() only once
+		the new entries are on the disk; otherwise a crash could leave an
+		old entry pointing at the data of another block.
+	*/
+	if(fsync(r->fd) != 0)
+		throw FileNotGoodException("Cannot sync region file");
+
+	for(u32 i=0; i<REGION_BLOCKS; i++)
+	{
+		r->disk_offsets[i] = r->offsets[i];
+		r->disk_lengths[i] = r->lengths[i];
+	}
+	r->dirty = false;
+}
+
+void RegionDatabase::writeTables()
+{
+	for(core::map<v3s16, Region*>::Iterator i = m_regions.getIterator();
+			i.atEnd() == false; i++)
+	{
+		writeTable(i.getNode()->getValue());
+	}
+}
+
+void RegionDatabase::beginSave()
+{
+	m_saving = true;
+}
+
+void RegionDatabase::endSave()
+{
+	m_saving = false;
+	writeTables();
+}
+
+void RegionDatabase::flush(bool force)
+{
+	writeTables();
+}
+
+bool RegionDatabase::readData(Region *r, u32 i, std::string &data)
+{
+	u32 start = r->offsets[i] * REGION_SECTOR_SIZE;
+	u32 len = r->lengths[i];
+	if(start + len > r->size || start + len < start)
+	{
+		errorstream<<"RegionDatabase: Block entry "<<i
+				<<" points outside the region file"<<std::endl;
+		return false;
+	}
+	if(r->mapping && start + len <= r->mapped_size)
+	{
+		data.assign((const char*)r->mapping + start, len);
+		return true;
+	}
+	data.resize(len);
+	if(len > 0 && readAt(r->fd, start, &data[0], len) == false)
+		return false;
+	return true;
+}
+
+void RegionDatabase::saveBlock(v3s16 blockpos, const std::string &data)
+{
+	Region *r = getRegion(getRegionPos(blockpos), true);
+	u32 i = getBlockIndex(blockpos);
+
+	// The old data stays allocated until the entry is replaced
+	u32 sector = allocate(r, MYMAX(sectorsFor(data.size()), 1));
+	if(writeAt(r->fd, sector * REGION_SECTOR_SIZE,
+			data.c_str(), data.size()) == false)
+		throw FileNotGoodException("Cannot write region file");
+
+	r->offsets[i] = sector;
+	r->lengths[i] = data.size();
+	r->dirty = true;
+	if(m_saving == false)
+		writeTable(r);
+}
+
+bool RegionDatabase::loadBlock(v3s16 blockpos, std::string &data)
+{
+	Region *r = getRegion(getRegionPos(blockpos), false);
+	if(r == NULL)
+		return false;
+	u32 i = getBlockIndex(blockpos);
+	if(r->offsets[i] == 0)
+		return false;
+	return readData(r, i, data);
+}
+
+void RegionDatabase::deleteBlock(v3s16 blockpos)
+{
+	Region *r = getRegion(getRegionPos(blockpos), false);
+	if(r == NULL)
+		return;
+	u32 i = getBlockIndex(blockpos);
+	if(r->offsets[i] == 0)
+		return;
+	r->offsets[i] = 0;
+	r->lengths[i] = 0;
+	r->dirty = true;
+	if(m_saving == false)
+		writeTable(r);
+}
+
+void RegionDatabase::listAllLoadableBlocks(core::list<v3s16> &dst)
+{
+	std::vector<fs::DirListNode> list = fs::GetDirListing(m_dir);
+	for(std::vector<fs::DirListNode>::iterator i = list.begin();
+			i != list.end(); i++)
+	{
+		if(i->dir)
+			continue;
+		int x, y, z;
+		if(sscanf(i->name.c_str(), "r.%d.%d.%d", &x, &y, &z) != 3)
+			continue;
+		v3s16 regionpos(x, y, z);
+		// Skip unknown crap in directory
+		if(getRegionPath(regionpos) != m_dir + DIR_DELIM + i->name)
+			continue;
+
+		Region *r = NULL;
+		try{
+			r = getRegion(regionpos, false);
+		}
+		catch(FileNotGoodException &e)
+		{
+		}
+		if(r == NULL)
+			continue;
+		for(u32 j=0; j<REGION_BLOCKS; j++)
+		{
+			if(r->offsets[j] == 0)
+				continue;
+			v3s16 p(j % REGION_SIZE,
+					j / REGION_SIZE % REGION_SIZE,
+					j / (REGION_SIZE*REGION_SIZE));
+			dst.push_back(regionpos * REGION_SIZE + p);
+		}
+	}
+}
+
@@ -0,0 +1,120 @@
+/*
+Minetest-c55
+Copyright (C) 2010-2011 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#ifndef DATABASE_REGION_HEADER
+#define DATABASE_REGION_HEADER
+
+#include "database.h"
+
+// Blocks per region in each direction
+#define REGION_SIZE 8
+#define REGION_BLOCKS (REGION_SIZE*REGION_SIZE*REGION_SIZE)
+// Allocation unit of block data in a region file
+#define REGION_SECTOR_SIZE 256
+// Files grow at least this many sectors at a time
+#define REGION_GROW_SECTORS 64
+// Region files kept open at most
+#define REGION_MAX_OPEN 64
+
+/*
+	Stores the blocks of each REGION_SIZE^3 block region in one file:
+		regions/r.<x>.<y>.<z>    (region coordinates in decimal)
+
+	Structure of a region file:
+		[0] "MTRG"
+		[4] u8 format version (1)
+		[5] u8 REGION_SIZE
+		[6] u16 REGION_SECTOR_SIZE
+		[8] offset table, REGION_BLOCKS entries, X fastest:
+			u32 first sector (0 = block not stored)
+			u32 length in bytes
+		[8 + REGION_BLOCKS*8] block data, allocated in sectors
+
+	A block is always written to free sectors. The table entries
+	changed in a save are written by endSave(), after the block data
+	has been synced to disk, so an interrupted write leaves the old
+	version in place. Sectors the table on disk still points to are
+	not reused before that. Freed sectors are reused first-fit, files
+	grow in steps of REGION_GROW_SECTORS to keep neighbouring blocks
+	close together.
+
+	Reads are served from a read-only memory mapping of the file
+	where available.
+*/
+class RegionDatabase : public Database
+{
+public:
+	RegionDatabase(const std::string &savedir);
+	~RegionDatabase();
+
+	void beginSave();
+	void endSave();
+	void flush(bool force);
+
+	void saveBlock(v3s16 blockpos, const std::string &data);
+	bool loadBlock(v3s16 blockpos, std::string &data);
+	void deleteBlock(v3s16 blockpos);
+	void listAllLoadableBlocks(core::list<v3s16> &dst);
+
+	const char * getName() { return "region"; }
+
+private:
+	struct Region
+	{
+		int fd;
+		// File size in bytes, always whole sectors
+		u32 size;
+		u8 *mapping;
+		u32 mapped_size;
+		u32 offsets[REGION_BLOCKS];
+		u32 lengths[REGION_BLOCKS];
+		// The table as it is synced to the file
+		u32 disk_offsets[REGION_BLOCKS];
+		u32 disk_lengths[REGION_BLOCKS];
+		// Some entries differ from the file
+		bool dirty;
+		u32 last_used;
+	};
+
+	// Returns NULL if create=false and the file doesn't exist
+	Region * getRegion(v3s16 regionpos, bool create);
+	// Throws FileNotGoodException if the file is invalid
+	Region * openRegion(const std::string &path, bool create);
+	void closeRegion(Region *r);
+	// Returns the first sector of a free range of the given length
+	u32 allocate(Region *r, u32 sectors);
+	// Syncs the block data, then writes and syncs the changed table entries
+	void writeTable(Region *r);
+	void writeTables();
+	void remap(Region *r);
+	// Returns false if the entry points outside the file
+	bool readData(Region *r, u32 i, std::string &data);
+
+	std::string getRegionPath(v3s16 regionpos);
+
+	std::string m_dir;
+	core::map<v3s16, Region*> m_regions;
+	u32 m_use_counter;
+	// Between beginSave() and endSave()
+	bool m_saving;
+};
+
+#endif
+
@@ -0,0 +1,548 @@
+/*
+Minetest-c55
+Copyright (C) 2010-2011 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#include "database_sqlite3.h"
+#include "main.h"
+#include "settings.h"
+#include "filesys.h"
+#include "porting.h"
+#include "profiler.h"
+#include "utility.h"
+#include "log.h"
+#include "debug.h"
+
+SQLiteDatabase::SQLiteDatabase(const std::string &savedir,
+		BlockKeyEncoding key_encoding, bool read_only):
+	m_key_encoding(key_encoding),
+	m_database(NULL),
+	m_database_read(NULL),
+	m_database_read_many(NULL),
+	m_database_write(NULL),
+	m_database_list(NULL),
+	m_database_delete(NULL),
+	m_transaction_open(false),
+	m_transaction_blocks(0),
+	m_transaction_start_ms(0),
+	m_save_depth(0),
+	m_wal(false),
+	m_last_checkpoint_ms(0),
+	m_backup_database(NULL),
+	m_backup(NULL)
+{
+	m_commit_max_blocks = rangelim(
+			g_settings->getS32("sqlite_group_commit_max_blocks"), 1, 100000);
+	m_commit_max_time_ms = rangelim(
+			g_settings->getFloat("sqlite_group_commit_max_time"), 0, 600)
+			* 1000;
+	m_checkpoint_interval_ms = rangelim(
+			g_settings->getFloat("sqlite_wal_checkpoint_interval"), 0, 3600)
+			* 1000;
+
+	std::string dbp = savedir + DIR_DELIM + "map.sqlite";
+	bool needs_create = false;
+	int d;
+	
+	/*
+		Open the database connection
+	*/
+
+	if(read_only == false && fs::CreateAllDirs(savedir) == false)
+		throw FileNotGoodException("Cannot create map directory");
+
+	if(!fs::PathExists(dbp))
+		needs_create = true;
+
+	int flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE;
+	if(read_only)
+		flags = SQLITE_OPEN_READONLY;
+	d = sqlite3_open_v2(dbp.c_str(), &m_database, flags, NULL);
+	if(d != SQLITE_OK) {
+		infostream<<"WARNING: Database failed to open: "<<sqlite3_errmsg(m_database)<<std::endl;
+		sqlite3_close(m_database);
+		throw FileNotGoodException("Cannot open database file");
+	}
+	
+	if(read_only == false)
+	{
+		setOptions();
+
+		if(needs_create)
+			createDatabase();
+	}
+
+	prepareStatements();
+	
+	infostream<<"Server: Database opened"<<std::endl;
+}
+
+SQLiteDatabase::~SQLiteDatabase()
+{
+	finishBackup();
+	flush(true);
+
+	finalizeStatements();
+	sqlite3_close(m_database);
+}
+
+void SQLiteDatabase::prepareStatements()
+{
+	prepare("SELECT `data` FROM `blocks` WHERE `pos`=? LIMIT 1", &m_database_read);
+	prepare("REPLACE INTO `blocks` VALUES(?, ?)", &m_database_write);
+	prepare("SELECT `pos` FROM `blocks`", &m_database_list);
+	prepare("DELETE FROM `blocks` WHERE `pos`=?", &m_database_delete);
+
+	std::string sql = "SELECT `pos`, `data` FROM `blocks` WHERE `pos` IN (?";
+	for(u32 i=1; i<SQLITE_READ_MANY_COUNT; i++)
+		sql += ",?";
+	sql += ")";
+	prepare(sql.c_str(), &m_database_read_many);
+}
+
+void SQLiteDatabase::finalizeStatements()
+{
+	sqlite3_stmt **stmts[] = {&m_database_read, &m_database_read_many,
+			&m_database_write, &m_database_list, &m_database_delete};
+	for(u32 i=0; i<sizeof(stmts)/sizeof(stmts[0]); i++)
+	{
+		if(*stmts[i])
+			sqlite3_finalize(*stmts[i]);
+		*stmts[i] = NULL;
+	}
+}
+
+void SQLiteDatabase::createDatabase()
+{
+	int e;
+	assert(m_database);
+	e = sqlite3_exec(m_database,
+		"CREATE TABLE IF NOT EXISTS `blocks` ("
+			"`pos` INT NOT NULL PRIMARY KEY,"
+			"`data` BLOB"
+		");"
+	, NULL, NULL, NULL);
+	if(e == SQLITE_ABORT)
+		throw FileNotGoodException("Could not create database structure");
+	else
+		infostream<<"Server: Database structure was created"<<std::endl;
+}
+
+void SQLiteDatabase::prepare(const char *sql, sqlite3_stmt **stmt)
+{
+	int d = sqlite3_prepare(m_database, sql, -1, stmt, NULL);
+	if(d != SQLITE_OK) {
+		infostream<<"WARNING: Database statement \""<<sql
+				<<"\" failed to prepare: "<<sqlite3_errmsg(m_database)<<std::endl;
+		throw FileNotGoodException("Cannot prepare database statement");
+	}
+}
+
+void SQLiteDatabase::setOptions()
+{
+	/*
+		Journal mode. "wal" lets readers proceed during writes and turns
+		a commit into a sequential append, which makes small frequent
+		commits a lot cheaper than with the rollback journal.
+	*/
+	std::string mode = lowercase(trim(
+			g_settings->get("sqlite_journal_mode")));
+	if(mode != "delete" && mode != "truncate" && mode != "persist"
+			&& mode != "wal")
+	{
+		infostream<<"WARNING: Unknown sqlite_journal_mode \""<<mode
+				<<"\", using \"delete\""<<std::endl;
+		mode = "delete";
+	}
+	std::string sql = "PRAGMA journal_mode = " + mode + ";";
+	if(sqlite3_exec(m_database, sql.c_str(), NULL, NULL, NULL) != SQLITE_OK)
+	{
+		infostream<<"WARNING: Could not set database journal mode: "
+				<<sqlite3_errmsg(m_database)<<std::endl;
+		mode = "delete";
+	}
+	m_wal = (mode == "wal");
+
+	/*
+		Durability: 0 = off, 1 = normal, 2 = full.
+		With WAL, 1 is still safe against corruption and only risks
+		losing the last commits on power failure.
+	*/
+	s32 sync = rangelim(g_settings->getS32("sqlite_synchronous"), 0, 2);
+	sql = "PRAGMA synchronous = " + itos(sync) + ";";
+	if(sqlite3_exec(m_database, sql.c_str(), NULL, NULL, NULL) != SQLITE_OK)
+		infostream<<"WARNING: Could not set database synchronous level: "
+				<<sqlite3_errmsg(m_database)<<std::endl;
+
+	m_last_checkpoint_ms = porting::getTimeMs();
+
+	infostream<<"Server: Database journal_mode="<<mode
+			<<" synchronous="<<sync
+			<<" group commit: max_blocks="<<m_commit_max_blocks
+			<<" max_time_ms="<<m_commit_max_time_ms<<std::endl;
+}
+
+void SQLiteDatabase::openTransaction()
+{
+	if(m_transaction_open)
+		return;
+	if(sqlite3_exec(m_database, "BEGIN;", NULL, NULL, NULL) != SQLITE_OK)
+	{
+		infostream<<"WARNING: beginSave() failed, saving might be slow: "
+				<<sqlite3_errmsg(m_database)<<std::endl;
+		return;
+	}
+	m_transaction_open = true;
+	m_transaction_blocks = 0;
+	m_transaction_start_ms = porting::getTimeMs();
+}
+
+void SQLiteDatabase::commitTransaction()
+{
+	if(m_transaction_open == false)
+		return;
+	{
+		ScopeProfiler sp(g_profiler, "SQLiteDatabase: commit avg", SPT_AVG);
+		if(sqlite3_exec(m_database, "COMMIT;", NULL, NULL, NULL) != SQLITE_OK)
+			infostream<<"WARNING: endSave() failed, map might not have saved: "
+					<<sqlite3_errmsg(m_database)<<std::endl;
+	}
+	g_profiler->avg("SQLiteDatabase: blocks per commit avg",
+			m_transaction_blocks);
+	// A failed COMMIT (eg. SQLITE_BUSY) leaves the transaction open
+	m_transaction_open = (sqlite3_get_autocommit(m_database) == 0);
+	m_transaction_blocks = 0;
+}
+
+void SQLiteDatabase::checkpointIfDue()
+{
+	// Checkpointing is only possible between transactions
+	if(m_wal == false || m_transaction_open
+			|| m_checkpoint_interval_ms == 0)
+		return;
+
+	u32 now = porting::getTimeMs();
+	if(now >= m_last_checkpoint_ms
+			&& now - m_last_checkpoint_ms < m_checkpoint_interval_ms)
+		return;
+
+	ScopeProfiler sp(g_profiler, "SQLiteDatabase: checkpoint avg", SPT_AVG);
+	if(sqlite3_exec(m_database, "PRAGMA wal_checkpoint;",
+			NULL, NULL, NULL) != SQLITE_OK)
+		infostream<<"WARNING: WAL checkpoint failed: "
+				<<sqlite3_errmsg(m_database)<<std::endl;
+	m_last_checkpoint_ms = now;
+}
+
+void SQLiteDatabase::beginSave()
+{
+	m_save_depth++;
+	openTransaction();
+}
+
+void SQLiteDatabase::endSave()
+{
+	assert(m_save_depth > 0);
+	m_save_depth--;
+	if(m_save_depth == 0)
+		flush(m_commit_max_time_ms == 0);
+}
+
+void SQLiteDatabase::flush(bool force)
+{
+	if(m_transaction_open)
+	{
+		u32 now = porting::getTimeMs();
+		// getTimeMs() can wrap around; treat that as timed out
+		bool timed_out = (now < m_transaction_start_ms
+				|| now - m_transaction_start_ms >= m_commit_max_time_ms);
+		if(force || timed_out
+				|| m_transaction_blocks >= m_commit_max_blocks)
+			commitTransaction();
+	}
+
+	checkpointIfDue();
+}
+
+void SQLiteDatabase::saveBlock(v3s16 blockpos, const std::string &data)
+{
+	// Writes outside beginSave()/endSave() are grouped too
+	openTransaction();
+
+	const char *bytes = data.c_str();
+	
+	if(sqlite3_bind_int64(m_database_write, 1, getBlockAsInteger(blockpos, m_key_encoding)) != SQLITE_OK)
+		infostream<<"WARNING: Block position failed to bind: "<<sqlite3_errmsg(m_database)<<std::endl;
+	if(sqlite3_bind_blob(m_database_write, 2, (void *)bytes, data.size(), NULL) != SQLITE_OK)
+		infostream<<"WARNING: Block data failed to bind: "<<sqlite3_errmsg(m_database)<<std::endl;
+	int written = sqlite3_step(m_database_write);
+	if(written != SQLITE_DONE)
+		infostream<<"WARNING: Block failed to save ("<<blockpos.X<<", "<<blockpos.Y<<", "<<blockpos.Z<<") "
+		<<sqlite3_errmsg(m_database)<<std::endl;
+	// Make ready for later reuse
+	sqlite3_reset(m_database_write);
+
+	m_transaction_blocks++;
+	if(m_transaction_blocks >= m_commit_max_blocks
+			|| (m_save_depth == 0 && m_commit_max_time_ms == 0))
+		commitTransaction();
+}
+
+bool SQLiteDatabase::loadBlock(v3s16 blockpos, std::string &data)
+{
+	if(sqlite3_bind_int64(m_database_read, 1, getBlockAsInteger(blockpos, m_key_encoding)) != SQLITE_OK)
+		infostream<<"WARNING: Could not bind block position for load: "
+			<<sqlite3_errmsg(m_database)<<std::endl;
+	bool found = false;
+	if(sqlite3_step(m_database_read) == SQLITE_ROW) {
+		const char * bytes = (const char *)sqlite3_column_blob(m_database_read, 0);
+		size_t len = sqlite3_column_bytes(m_database_read, 0);
+		data.assign(bytes, len);
+		found = true;
+	}
+	// We should never get more than 1 row, so ok to reset
+	sqlite3_reset(m_database_read);
+	return found;
+}
+
+void SQLiteDatabase::loadBlocks(const core::list<v3s16> &blocks,
+		core::map<v3s16, std::string> &dst)
+{
+	core::list<v3s16>::ConstIterator i = blocks.begin();
+	while(i != blocks.end())
+	{
+		/*
+			Bind the next SQLITE_READ_MANY_COUNT positions; if there
+			are less, the rest repeat the first one.
+		*/
+		s64 first = getBlockAsInteger(*i, m_key_encoding);
+		for(u32 j=0; j<SQLITE_READ_MANY_COUNT; j++)
+		{
+			s64 key = first;
+			if(i != blocks.end())
+			{
+				key = getBlockAsInteger(*i, m_key_encoding);
+				i++;
+			}
+			if(sqlite3_bind_int64(m_database_read_many, j+1, key) != SQLITE_OK)
+				infostream<<"WARNING: Could not bind block position for load: "
+					<<sqlite3_errmsg(m_database)<<std::endl;
+		}
+		while(sqlite3_step(m_database_read_many) == SQLITE_ROW)
+		{
+			v3s16 p = getIntegerAsBlock(
+					sqlite3_column_int64(m_database_read_many, 0),
+					m_key_encoding);
+			const char *bytes = (const char*)sqlite3_column_blob(
+					m_database_read_many, 1);
+			size_t len = sqlite3_column_bytes(m_database_read_many, 1);
+			dst[p] = std::string(bytes, len);
+		}
+		sqlite3_reset(m_database_read_many);
+	}
+}
+
+void SQLiteDatabase::deleteBlock(v3s16 blockpos)
+{
+	openTransaction();
+
+	if(sqlite3_bind_int64(m_database_delete, 1, getBlockAsInteger(blockpos, m_key_encoding)) != SQLITE_OK)
+		infostream<<"WARNING: Could not bind block position for delete: "
+			<<sqlite3_errmsg(m_database)<<std::endl;
+	if(sqlite3_step(m_database_delete) != SQLITE_DONE)
+		infostream<<"WARNING: Block failed to delete ("<<blockpos.X<<", "<<blockpos.Y<<", "<<blockpos.Z<<") "
+		<<sqlite3_errmsg(m_database)<<std::endl;
+	sqlite3_reset(m_database_delete);
+
+	m_transaction_blocks++;
+	if(m_transaction_blocks >= m_commit_max_blocks
+			|| (m_save_depth == 0 && m_commit_max_time_ms == 0))
+		commitTransaction();
+}
+
+void SQLiteDatabase::listAllLoadableBlocks(core::list<v3s16> &dst)
+{
+	while(sqlite3_step(m_database_list) == SQLITE_ROW)
+	{
+		sqlite3_int64 block_i = sqlite3_column_int64(m_database_list, 0);
+		v3s16 p = getIntegerAsBlock(block_i, m_key_encoding);
+		//dstream<<"block_i="<<block_i<<" p="<<PP(p)<<std::endl;
+		dst.push_back(p);
+	}
+	sqlite3_reset(m_database_list);
+}
+
+void SQLiteDatabase::compact()
+{
+	flush(true);
+
+	infostream<<"SQLiteDatabase: Vacuuming"<<std::endl;
+	if(sqlite3_exec(m_database, "VACUUM;", NULL, NULL, NULL) != SQLITE_OK)
+		errorstream<<"SQLiteDatabase: VACUUM failed: "
+				<<sqlite3_errmsg(m_database)<<std::endl;
+}
+
+bool SQLiteDatabase::startBackup(const std::string &savedir)
+{
+	finishBackup();
+
+	/*
+		Blocks written before the start belong into the backup. Later
+		writes of this connection get into the copy by themselves once
+		they are committed.
+	*/
+	flush(true);
+
+	std::string path = savedir + DIR_DELIM + "map.sqlite";
+	if(sqlite3_open_v2(path.c_str(), &m_backup_database,
+			SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, NULL) != SQLITE_OK)
+	{
+		errorstream<<"SQLiteDatabase: Can't open backup "<<path<<": "
+				<<sqlite3_errmsg(m_backup_database)<<std::endl;
+		finishBackup();
+		return false;
+	}
+	m_backup = sqlite3_backup_init(m_backup_database, "main",
+			m_database, "main");
+	if(m_backup == NULL)
+	{
+		errorstream<<"SQLiteDatabase: Can't start backup to "<<path<<": "
+				<<sqlite3_errmsg(m_backup_database)<<std::endl;
+		finishBackup();
+		return false;
+	}
+	return true;
+}
+
+bool SQLiteDatabase::backupStep(u32 amount, bool &failed)
+{
+	failed = false;
+	if(m_backup == NULL)
+		return false;
+
+	// Would only be SQLITE_BUSY; see startBackup()
+	if(m_transaction_open)
+		return true;
+
+	int r = sqlite3_backup_step(m_backup, amount);
+	if(r == SQLITE_OK || r == SQLITE_BUSY || r == SQLITE_LOCKED)
+		return true;
+	if(r != SQLITE_DONE)
+	{
+		errorstream<<"SQLiteDatabase: Backup failed: "
+				<<sqlite3_errmsg(m_backup_database)<<std::endl;
+		failed = true;
+	}
+	finishBackup();
+	return false;
+}
+
+void SQLiteDatabase::finishBackup()
+{
+	if(m_backup)
+		sqlite3_backup_finish(m_backup);
+	m_backup = NULL;
+	if(m_backup_database)
+		sqlite3_close(m_backup_database);
+	m_backup_database = NULL;
+}
+
+void SQLiteDatabase::convertKeys(BlockKeyEncoding to)
+{
+	if(to == m_key_encoding)
+		return;
+
+	flush(true);
+
+	infostream<<"SQLiteDatabase: Converting block keys from "
+			<<getBlockKeyEncodingName(m_key_encoding)<<" to "
+			<<getBlockKeyEncodingName(to)<<std::endl;
+
+	/*
+		Copy everything to a new table and swap it in. Going through
+		a second table avoids collisions between old and new keys.
+	*/
+	if(sqlite3_exec(m_database,
+			"BEGIN;"
+			"DROP TABLE IF EXISTS `blocks_new`;"
+			"CREATE TABLE `blocks_new` ("
+				"`pos` INT NOT NULL PRIMARY KEY,"
+				"`data` BLOB"
+			");",
+			NULL, NULL, NULL) != SQLITE_OK)
+	{
+		errorstream<<"SQLiteDatabase: Could not create new table: "
+				<<sqlite3_errmsg(m_database)<<std::endl;
+		sqlite3_exec(m_database, "ROLLBACK;", NULL, NULL, NULL);
+		throw FileNotGoodException("Cannot convert database keys");
+	}
+
+	sqlite3_stmt *select = NULL;
+	sqlite3_stmt *insert = NULL;
+	prepare("SELECT `pos`, `data` FROM `blocks`", &select);
+	prepare("INSERT INTO `blocks_new` VALUES(?, ?)", &insert);
+
+	u32 count = 0;
+	bool ok = true;
+	int r;
+	while(ok && (r = sqlite3_step(select)) == SQLITE_ROW)
+	{
+		v3s16 p = getIntegerAsBlock(sqlite3_column_int64(select, 0),
+				m_key_encoding);
+		ok = sqlite3_bind_int64(insert, 1, getBlockAsInteger(p, to)) == SQLITE_OK
+				&& sqlite3_bind_blob(insert, 2,
+					sqlite3_column_blob(select, 1),
+					sqlite3_column_bytes(select, 1),
+					SQLITE_TRANSIENT) == SQLITE_OK
+				&& sqlite3_step(insert) == SQLITE_DONE;
+		sqlite3_reset(insert);
+		count++;
+	}
+	if(ok && r != SQLITE_DONE)
+		ok = false;
+	sqlite3_finalize(select);
+	sqlite3_finalize(insert);
+
+	/*
+		The prepared statements refer to the old table; they are
+		prepared again after the swap.
+	*/
+	finalizeStatements();
+
+	if(ok)
+		ok = sqlite3_exec(m_database,
+				"DROP TABLE `blocks`;"
+				"ALTER TABLE `blocks_new` RENAME TO `blocks`;"
+				"COMMIT;",
+				NULL, NULL, NULL) == SQLITE_OK;
+	if(ok == false)
+	{
+		errorstream<<"SQLiteDatabase: Converting block keys failed: "
+				<<sqlite3_errmsg(m_database)<<std::endl;
+		sqlite3_exec(m_database, "ROLLBACK;", NULL, NULL, NULL);
+	}
+
+	prepareStatements();
+
+	if(ok == false)
+		throw FileNotGoodException("Cannot convert database keys");
+
+	m_key_encoding = to;
+	infostream<<"SQLiteDatabase: Converted "<<count<<" blocks"<<std::endl;
+}
+
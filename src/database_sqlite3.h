@@ -0,0 +1,123 @@
+/*
+Minetest-c55
+Copyright (C) 2010-2011 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#ifndef DATABASE_SQLITE3_HEADER
+#define DATABASE_SQLITE3_HEADER
+
+#include "database.h"
+
+// Number of positions in the statement used by loadBlocks()
+#define SQLITE_READ_MANY_COUNT 32
+
+extern "C" {
+	#include "sqlite3.h"
+}
+
+/*
+	Stores blocks in map.sqlite.
+
+	Structure of map.sqlite:
+	Tables:
+		blocks
+			(PK) INT pos
+			BLOB data
+
+	Block writes are collected into one transaction that is committed
+	when it holds sqlite_group_commit_max_blocks writes or gets older
+	than sqlite_group_commit_max_time. Nested beginSave()/endSave()
+	pairs only count the depth.
+*/
+class SQLiteDatabase : public Database
+{
+public:
+	/*
+		Opens or creates map.sqlite in savedir. read_only opens an
+		existing one without changing anything in it, not even the
+		journal mode.
+	*/
+	SQLiteDatabase(const std::string &savedir, BlockKeyEncoding key_encoding,
+			bool read_only=false);
+	~SQLiteDatabase();
+
+	void beginSave();
+	void endSave();
+	void flush(bool force);
+
+	void saveBlock(v3s16 blockpos, const std::string &data);
+	bool loadBlock(v3s16 blockpos, std::string &data);
+	// Fetches up to SQLITE_READ_MANY_COUNT blocks per query
+	void loadBlocks(const core::list<v3s16> &blocks,
+			core::map<v3s16, std::string> &dst);
+	void deleteBlock(v3s16 blockpos);
+	void listAllLoadableBlocks(core::list<v3s16> &dst);
+
+	const char * getName() { return "sqlite3"; }
+
+	// Rewrites the whole table in one transaction
+	void convertKeys(BlockKeyEncoding to);
+	// VACUUM
+	void compact();
+	/*
+		With the online backup API; amount is in pages. The copy can
+		only proceed while no transaction is open; one that is open
+		only has writes made after the start, which go into the next
+		backup, so it is left to be committed by group commit.
+	*/
+	bool startBackup(const std::string &savedir);
+	bool backupStep(u32 amount, bool &failed);
+
+private:
+	// Create the database structure
+	void createDatabase();
+	void prepare(const char *sql, sqlite3_stmt **stmt);
+	void prepareStatements();
+	void finalizeStatements();
+	void setOptions();
+	void openTransaction();
+	void commitTransaction();
+	void checkpointIfDue();
+	void finishBackup();
+
+	BlockKeyEncoding m_key_encoding;
+
+	sqlite3 *m_database;
+	sqlite3_stmt *m_database_read;
+	sqlite3_stmt *m_database_read_many;
+	sqlite3_stmt *m_database_write;
+	sqlite3_stmt *m_database_list;
+	sqlite3_stmt *m_database_delete;
+
+	bool m_transaction_open;
+	u32 m_transaction_blocks;
+	u32 m_transaction_start_ms;
+	u32 m_save_depth;
+	u32 m_commit_max_blocks;
+	u32 m_commit_max_time_ms;
+	bool m_wal;
+	u32 m_checkpoint_interval_ms;
+	u32 m_last_checkpoint_ms;
+
+	// Destination of a running backup
+	sqlite3 *m_backup_database;
+	sqlite3_backup *m_backup;
+};
+
+#endif
+
@@ -103,10 +103,40 @@ void set_default_settings(Settings *settings)
 	settings->setDefault("max_simultaneous_block_sends_server_total", "8");
 	settings->setDefault("max_block_send_distance", "7");
 	settings->setDefault("max_block_generate_distance", "5");
+	settings->setDefault("block_send_cache_max_blocks", "2048");
+	settings->setDefault("block_send_cache_timeout", "10");
+	settings->setDefault("network_compression_codec", "lz4");
+	settings->setDefault("network_compression_level", "1");
+	settings->setDefault("num_emerge_threads", "2");
+	settings->setDefault("emerge_prefetch_max_blocks", "32");
+	settings->setDefault("emerge_prefetch_distance", "2");
+	settings->setDefault("mapgen_sector_cache_size", "1024");
+	settings->setDefault("pregen_max_queued", "16");
+	settings->setDefault("pregen_max_step_time", "50");
+	settings->setDefault("num_active_block_threads", "1");
+	settings->setDefault("liquid_max_step_time", "50");
 	settings->setDefault("time_send_interval", "20");
 	settings->setDefault("time_speed", "96");
 	settings->setDefault("server_unload_unused_data_timeout", "60");
 	settings->setDefault("server_map_save_interval", "10");
+	settings->setDefault("map_backend", "sqlite3");
+	settings->setDefault("map_block_keys", "linear");
+	settings->setDefault("sqlite_journal_mode", "delete");
+	settings->setDefault("sqlite_synchronous", "2");
+	settings->setDefault("sqlite_group_commit_max_blocks", "256");
+	settings->setDefault("sqlite_group_commit_max_time", "0");
+	settings->setDefault("sqlite_wal_checkpoint_interval", "60");
+	settings->setDefault("map_save_thread", "true");
+	settings->setDefault("map_save_queue_max_blocks", "1024");
+	settings->setDefault("map_presence_filter", "true");
+	settings->setDefault("map_compression_codec", "zlib");
+	settings->setDefault("map_compression_level", "-1");
+	settings->setDefault("map_skip_pristine_blocks", "false");
+	settings->setDefault("map_journal", "true");
+	settings->setDefault("backup_interval", "0");
+	settings->setDefault("backup_full_every", "24");
+	settings->setDefault("backup_path", "");
+	settings->setDefault("backup_step_size", "64");
 	settings->setDefault("full_block_send_enable_min_time_from_building", "2.0");
 	settings->setDefault("enable_experimental", "false");
 	settings->setDefault("crafted_teleports", "4");
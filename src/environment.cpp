@@ -29,6 +29,8 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "settings.h"
 #include "log.h"
 #include "profiler.h"
+#include "jobpool.h"
+#include "noise.h"
 
 #define PP(x) "("<<(x).X<<","<<(x).Y<<","<<(x).Z<<")"
 
@@ -272,9 +274,16 @@ ServerEnvironment::ServerEnvironment(ServerMap *map, Server *server):
 	m_server(server),
 	m_random_spawn_timer(3),
 	m_send_recommended_timer(0),
+	m_abm_pass(0),
 	m_game_time(0),
 	m_game_time_fraction_counter(0)
 {
+	m_job_pool = new JobPool(rangelim(
+			g_settings->getS32("num_active_block_threads"), 0, 32));
+
+	m_abm_contents.reallocate(MAX_CONTENT+1);
+	for(u32 i=0; i<MAX_CONTENT+1; i++)
+		m_abm_contents.push_back(core::array<u16>());
 }
 
 ServerEnvironment::~ServerEnvironment()
@@ -288,6 +297,11 @@ ServerEnvironment::~ServerEnvironment()
 
 	// Drop/delete map
 	m_map->drop();
+
+	for(u32 i=0; i<m_abms.size(); i++)
+		delete m_abms[i];
+
+	delete m_job_pool;
 }
 
 void ServerEnvironment::serializePlayers(const std::string &savedir)
@@ -653,6 +667,36 @@ void ServerEnvironment::activateBlock(MapBlock *block, u32 additional_dtime)
 	}
 }
 
+void ServerEnvironment::addActiveBlockModifier(ActiveBlockModifier *abm)
+{
+	assert(abm->getActiveChance() != 0);
+	u16 index = m_abms.size();
+	m_abms.push_back(abm);
+	for(u32 i=0; i<abm->getTriggerContentCount(); i++)
+	{
+		content_t c = abm->getTriggerContent(i);
+		assert(c <= MAX_CONTENT);
+		m_abm_contents[c].push_back(index);
+	}
+}
+
+u32 ServerEnvironment::countObjectsAround(v3s16 blockpos)
+{
+	u32 count = 0;
+	for(s16 x=-1; x<=1; x++)
+	for(s16 y=-1; y<=1; y++)
+	for(s16 z=-1; z<=1; z++)
+	{
+		MapBlock *block = m_map->getBlockNoCreateNoEx(
+				blockpos + v3s16(x,y,z));
+		if(block==NULL)
+			continue;
+		count += block->m_static_objects.m_active.size()
+				+ block->m_static_objects.m_stored.size();
+	}
+	return count;
+}
+
 void ServerEnvironment::clearAllObjects()
 {
 	infostream<<"ServerEnvironment::clearAllObjects(): "
@@ -739,19 +783,76 @@ void ServerEnvironment::clearAllObjects()
 			<<" in "<<num_blocks_cleared<<" blocks"<<std::endl;
 }
 
-static void getMob_dungeon_master(Settings &properties)
+/*
+	Steps the node metadata of an active block
+*/
+class NodeMetadataStepJob : public Job
 {
-	properties.set("looks", "dungeon_master");
-	properties.setFloat("yaw", 1.57);
-	properties.setFloat("hp", 30);
-	properties.setBool("bright_shooting", true);
-	properties.set("shoot_type", "fireball");
-	properties.set("shoot_y", "0.7");
-	properties.set("player_hit_damage", "1");
-	properties.set("player_hit_distance", "1.0");
-	properties.set("player_hit_interval", "0.5");
-	properties.setBool("mindless_rage", myrand_range(0,100)==0);
-}
+public:
+	MapBlock *block;
+	float dtime;
+	// Output: whether the metadata changed
+	bool changed;
+
+	void run()
+	{
+		changed = block->m_node_metadata.step(dtime);
+	}
+};
+
+// A node an ActiveBlockModifier is to be triggered on
+struct ABMTrigger
+{
+	u16 abm;
+	v3s16 p;
+	MapNode n;
+};
+
+/*
+	Finds the nodes of an active block that the due ActiveBlockModifiers
+	are triggered on. The chances come from a generator seeded for the
+	block, so that the result doesn't depend on the thread it runs in.
+*/
+class ABMScanJob : public Job
+{
+public:
+	MapBlock *block;
+	// For each content, the indices of the modifiers triggered by it
+	core::array<core::array<u16> > *abm_contents;
+	// The chance of each modifier
+	core::array<u32> *chances;
+	// Whether each modifier is due
+	core::array<u8> due;
+	int seed;
+	// Output
+	core::array<ABMTrigger> triggers;
+
+	void run()
+	{
+		PseudoRandom pr(seed);
+		v3s16 p0;
+		for(p0.X=0; p0.X<MAP_BLOCKSIZE; p0.X++)
+		for(p0.Y=0; p0.Y<MAP_BLOCKSIZE; p0.Y++)
+		for(p0.Z=0; p0.Z<MAP_BLOCKSIZE; p0.Z++)
+		{
+			MapNode n = block->getNodeNoEx(p0);
+			core::array<u16> &abms = (*abm_contents)[n.getContent()];
+			for(u32 k=0; k<abms.size(); k++)
+			{
+				u16 j = abms[k];
+				if(due[j] == 0)
+					continue;
+				if(pr.next() % (*chances)[j] != 0)
+					continue;
+				ABMTrigger t;
+				t.abm = j;
+				t.p = p0 + block->getPosRelative();
+				t.n = n;
+				triggers.push_back(t);
+			}
+		}
+	}
+};
 
 void ServerEnvironment::step(float dtime)
 {
@@ -891,7 +992,13 @@ void ServerEnvironment::step(float dtime)
 	}
 
 	/*
-		Mess around in active blocks
+		Mess around in active blocks.
+
+		The per-block work of the passes below is done by jobs in
+		m_job_pool. The jobs only read the map and change their own
+		block's node metadata; what they find is applied to the map
+		afterwards in the order of the blocks, so that the result
+		doesn't depend on the number of threads.
 	*/
 	if(m_active_blocks_nodemetadata_interval.step(dtime, 1.0))
 	{
@@ -899,6 +1006,7 @@ void ServerEnvironment::step(float dtime)
 		
 		float dtime = 1.0;
 
+		core::array<NodeMetadataStepJob> jobs;
 		for(core::map<v3s16, bool>::Iterator
 				i = m_active_blocks.m_list.getIterator();
 				i.atEnd()==false; i++)
@@ -918,230 +1026,156 @@ void ServerEnvironment::step(float dtime)
 			// Set current time as timestamp
 			block->setTimestampNoChangedFlag(m_game_time);
 
-			// Run node metadata
-			bool changed = block->m_node_metadata.step(dtime);
-			if(changed)
-			{
-				MapEditEvent event;
-				event.type = MEET_BLOCK_NODE_METADATA_CHANGED;
-				event.p = p;
-				m_map->dispatchEvent(&event);
+			NodeMetadataStepJob job;
+			job.block = block;
+			job.dtime = dtime;
+			job.changed = false;
+			jobs.push_back(job);
+		}
 
-				block->setChangedFlag();
-			}
+		// Run node metadata
+		core::array<Job*> jobptrs;
+		for(u32 i=0; i<jobs.size(); i++)
+			jobptrs.push_back(&jobs[i]);
+		m_job_pool->run(jobptrs);
+
+		for(u32 i=0; i<jobs.size(); i++)
+		{
+			if(jobs[i].changed == false)
+				continue;
+			MapBlock *block = jobs[i].block;
+
+			MapEditEvent event;
+			event.type = MEET_BLOCK_NODE_METADATA_CHANGED;
+			event.p = block->getPos();
+			m_map->dispatchEvent(&event);
+
+			block->setChangedFlag();
 		}
 	}
 	
-	if(m_active_blocks_test_interval.step(dtime, 10.0))
+	/*
+		Run the ActiveBlockModifiers. One with an interval of n seconds
+		runs on each active block once in n passes. The blocks are
+		spread over the passes by their position, so that the work
+		doesn't come all at once. The nodes of a block are only looked
+		at if it has the contents of a modifier that is due.
+	*/
+	if(m_active_blocks_test_interval.step(dtime, 1.0))
 	{
-		ScopeProfiler sp(g_profiler, "SEnv: modify in blocks avg /10s", SPT_AVG);
-		//float dtime = 10.0;
-		
+		ScopeProfiler sp(g_profiler, "SEnv: modify in blocks avg /1s", SPT_AVG);
+
+		u32 abm_count = m_abms.size();
+		core::array<u32> periods;
+		core::array<u32> chances;
+		core::array<u32> time_us;
+		core::array<u32> triggers;
+		for(u32 j=0; j<abm_count; j++)
+		{
+			periods.push_back(MYMAX(1,
+					(u32)(m_abms[j]->getActiveInterval() + 0.5)));
+			chances.push_back(m_abms[j]->getActiveChance());
+			time_us.push_back(0);
+			triggers.push_back(0);
+		}
+		// Varies the chances from one pass to another
+		u32 pass_seed = myrand();
+
+		core::array<ABMScanJob> jobs;
 		for(core::map<v3s16, bool>::Iterator
 				i = m_active_blocks.m_list.getIterator();
 				i.atEnd()==false; i++)
 		{
 			v3s16 p = i.getNode()->getKey();
-			
-			/*infostream<<"Server: Block ("<<p.X<<","<<p.Y<<","<<p.Z
-					<<") being handled"<<std::endl;*/
 
 			MapBlock *block = m_map->getBlockNoCreateNoEx(p);
 			if(block==NULL)
 				continue;
+
+			// Blocks without the contents of any due modifier are skipped
+			u32 hash = (u32)(p.X * 73856093) ^ (u32)(p.Y * 19349663)
+					^ (u32)(p.Z * 83492791);
+			core::array<u8> due;
+			bool any_due = false;
+			for(u32 j=0; j<abm_count; j++)
+			{
+				due.push_back(0);
+				if((hash + m_abm_pass) % periods[j] != 0)
+					continue;
+				ActiveBlockModifier *abm = m_abms[j];
+				for(u32 k=0; k<abm->getTriggerContentCount(); k++)
+				{
+					if(block->hasContent(abm->getTriggerContent(k)))
+					{
+						due[j] = 1;
+						any_due = true;
+						break;
+					}
+				}
+			}
+			if(any_due == false)
+				continue;
+			
+			/*infostream<<"Server: Block ("<<p.X<<","<<p.Y<<","<<p.Z
+					<<") being handled"<<std::endl;*/
 			
 			// Set current time as timestamp
 			block->setTimestampNoChangedFlag(m_game_time);
 
-			/*
-				Do stuff!
+			ABMScanJob job;
+			job.block = block;
+			job.abm_contents = &m_abm_contents;
+			job.chances = &chances;
+			job.due = due;
+			job.seed = hash ^ pass_seed;
+			jobs.push_back(job);
+		}
+
+		// Find the nodes to trigger the modifiers on
+		core::array<Job*> jobptrs;
+		for(u32 i=0; i<jobs.size(); i++)
+			jobptrs.push_back(&jobs[i]);
+		m_job_pool->run(jobptrs);
 
-				Note that map modifications should be done using the event-
-				making map methods so that the server gets information
-				about them.
+		/*
+			Note that map modifications should be done using the event-
+			making map methods so that the server gets information
+			about them.
+		*/
+		for(u32 i=0; i<jobs.size(); i++)
+		{
+			core::array<ABMTrigger> &found = jobs[i].triggers;
+			if(found.size() == 0)
+				continue;
 
-				Reading can be done quickly directly from the block.
+			// Objects in this and the neighboring blocks
+			u32 active_object_count_wider =
+					countObjectsAround(jobs[i].block->getPos());
 
-				Everything should bind to inside this single content
-				searching loop to keep things fast.
-			*/
-			// TODO: Implement usage of ActiveBlockModifier
-			
-			// Find out how many objects the block contains
-			//u32 active_object_count = block->m_static_objects.m_active.size();
-			// Find out how many objects this and all the neighbors contain
-			u32 active_object_count_wider = 0;
-			for(s16 x=-1; x<=1; x++)
-			for(s16 y=-1; y<=1; y++)
-			for(s16 z=-1; z<=1; z++)
+			for(u32 k=0; k<found.size(); k++)
 			{
-				MapBlock *block = m_map->getBlockNoCreateNoEx(p+v3s16(x,y,z));
-				if(block==NULL)
+				ABMTrigger &t = found[k];
+				// An earlier modifier may have changed the node
+				if(m_map->getNodeNoEx(t.p).getContent() != t.n.getContent())
 					continue;
-				active_object_count_wider +=
-						block->m_static_objects.m_active.size()
-						+ block->m_static_objects.m_stored.size();
-				
-				/*if(block->m_static_objects.m_stored.size() != 0){
-					errorstream<<"ServerEnvironment::step(): "
-							<<PP(block->getPos())<<" contains "
-							<<block->m_static_objects.m_stored.size()
-							<<" stored objects; "
-							<<"when spawning objects, when counting active "
-							<<"objects in wide area. relative position: "
-							<<"("<<x<<","<<y<<","<<z<<")"<<std::endl;
-				}*/
-			}
 
-			v3s16 p0;
-			for(p0.X=0; p0.X<MAP_BLOCKSIZE; p0.X++)
-			for(p0.Y=0; p0.Y<MAP_BLOCKSIZE; p0.Y++)
-			for(p0.Z=0; p0.Z<MAP_BLOCKSIZE; p0.Z++)
-			{
-				v3s16 p = p0 + block->getPosRelative();
-				MapNode n = block->getNodeNoEx(p0);
-
-				/*
-					Test something:
-					Convert mud under proper lighting to grass
-				*/
-				if(n.getContent() == CONTENT_MUD)
-				{
-					if(myrand()%20 == 0)
-					{
-						MapNode n_top = m_map->getNodeNoEx(p+v3s16(0,1,0));
-						if(content_features(n_top).air_equivalent &&
-								n_top.getLightBlend(getDayNightRatio()) >= 13)
-						{
-							n.setContent(CONTENT_GRASS);
-							m_map->addNodeWithEvent(p, n);
-						}
-					}
-				}
-				/*
-					Convert grass into mud if under something else than air
-				*/
-				if(n.getContent() == CONTENT_GRASS)
-				{
-					//if(myrand()%20 == 0)
-					{
-						MapNode n_top = m_map->getNodeNoEx(p+v3s16(0,1,0));
-						if(content_features(n_top).air_equivalent == false)
-						{
-							n.setContent(CONTENT_MUD);
-							m_map->addNodeWithEvent(p, n);
-						}
-					}
-				}
-				/*
-					Rats spawn around regular trees
-				*/
-				if(n.getContent() == CONTENT_TREE ||
-						n.getContent() == CONTENT_JUNGLETREE)
-				{
-   					if(myrand()%200 == 0 && active_object_count_wider == 0)
-					{
-						v3s16 p1 = p + v3s16(myrand_range(-2, 2),
-								0, myrand_range(-2, 2));
-						MapNode n1 = m_map->getNodeNoEx(p1);
-						MapNode n1b = m_map->getNodeNoEx(p1+v3s16(0,-1,0));
-						if(n1b.getContent() == CONTENT_GRASS &&
-								n1.getContent() == CONTENT_AIR)
-						{
-							v3f pos = intToFloat(p1, BS);
-							ServerActiveObject *obj = new RatSAO(this, 0, pos);
-							addActiveObject(obj);
-						}
-					}
-				}
-				/*
-					Fun things spawn in caves and dungeons
-				*/
-				if(n.getContent() == CONTENT_STONE ||
-						n.getContent() == CONTENT_MOSSYCOBBLE)
-				{
-   					if(myrand()%200 == 0 && active_object_count_wider == 0)
-					{
-						v3s16 p1 = p + v3s16(0,1,0);
-						MapNode n1a = m_map->getNodeNoEx(p1+v3s16(0,0,0));
-						if(n1a.getLightBlend(getDayNightRatio()) <= 3){
-							MapNode n1b = m_map->getNodeNoEx(p1+v3s16(0,1,0));
-							if(n1a.getContent() == CONTENT_AIR &&
-									n1b.getContent() == CONTENT_AIR)
-							{
-								v3f pos = intToFloat(p1, BS);
-								int i = myrand()%5;
-								if(i == 0 || i == 1){
-									actionstream<<"A dungeon master spawns at "
-											<<PP(p1)<<std::endl;
-									Settings properties;
-									getMob_dungeon_master(properties);
-									ServerActiveObject *obj = new MobV2SAO(
-											this, 0, pos, &properties);
-									addActiveObject(obj);
-								} else if(i == 2 || i == 3){
-									actionstream<<"Rats spawn at "
-											<<PP(p1)<<std::endl;
-									for(int j=0; j<3; j++){
-										ServerActiveObject *obj = new RatSAO(
-												this, 0, pos);
-										addActiveObject(obj);
-									}
-								} else {
-									actionstream<<"An oerkki spawns at "
-											<<PP(p1)<<std::endl;
-									ServerActiveObject *obj = new Oerkki1SAO(
-											this, 0, pos);
-									addActiveObject(obj);
-								}
-							}
-						}
-					}
-				}
-				/*
-					Make trees from saplings!
-				*/
-				if(n.getContent() == CONTENT_SAPLING)
-				{
-					if(myrand()%50 == 0)
-					{
-						actionstream<<"A sapling grows into a tree at "
-								<<PP(p)<<std::endl;
-
-						core::map<v3s16, MapBlock*> modified_blocks;
-						v3s16 tree_p = p;
-						ManualMapVoxelManipulator vmanip(m_map);
-						v3s16 tree_blockp = getNodeBlockPos(tree_p);
-						vmanip.initialEmerge(tree_blockp - v3s16(1,1,1), tree_blockp + v3s16(1,1,1));
-						bool is_apple_tree = myrand()%4 == 0;
-						mapgen::make_tree(vmanip, tree_p, is_apple_tree);
-						vmanip.blitBackAll(&modified_blocks);
-
-						// update lighting
-						core::map<v3s16, MapBlock*> lighting_modified_blocks;
-						for(core::map<v3s16, MapBlock*>::Iterator
-							i = modified_blocks.getIterator();
-							i.atEnd() == false; i++)
-						{
-							lighting_modified_blocks.insert(i.getNode()->getKey(), i.getNode()->getValue());
-						}
-						m_map->updateLighting(lighting_modified_blocks, modified_blocks);
-
-						// Send a MEET_OTHER event
-						MapEditEvent event;
-						event.type = MEET_OTHER;
-						for(core::map<v3s16, MapBlock*>::Iterator
-							i = modified_blocks.getIterator();
-							i.atEnd() == false; i++)
-						{
-							v3s16 p = i.getNode()->getKey();
-							event.modified_blocks.insert(p, true);
-						}
-						m_map->dispatchEvent(&event);
-					}
-				}
+				u32 start_us = porting::getTimeUs();
+				m_abms[t.abm]->triggerEvent(this, t.p, t.n,
+						active_object_count_wider);
+				time_us[t.abm] += porting::getTimeUs() - start_us;
+				triggers[t.abm]++;
 			}
 		}
+
+		m_abm_pass++;
+
+		for(u32 j=0; j<abm_count; j++)
+		{
+			std::string name = m_abms[j]->getName();
+			g_profiler->avg("SEnv: ABM "+name+" avg /1s",
+					(float)time_us[j] / 1000000.0);
+			g_profiler->add("SEnv: ABM "+name+" triggers", triggers[j]);
+		}
 	}
 	
 	/*
@@ -41,6 +41,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 
 class Server;
 class ActiveBlockModifier;
+class JobPool;
 class ServerActiveObject;
 
 class Environment
@@ -142,6 +143,11 @@ class ServerEnvironment : public Environment
 		return *m_map;
 	}
 
+	JobPool * getJobPool()
+	{
+		return m_job_pool;
+	}
+
 	Server * getServer()
 	{
 		return m_server;
@@ -219,10 +225,11 @@ class ServerEnvironment : public Environment
 	void activateBlock(MapBlock *block, u32 additional_dtime=0);
 
 	/*
-		ActiveBlockModifiers (TODO)
+		ActiveBlockModifiers
 		-------------------------------------------
 	*/
 
+	// The environment deletes abm
 	void addActiveBlockModifier(ActiveBlockModifier *abm);
 
 	/* Other stuff */
@@ -270,6 +277,11 @@ class ServerEnvironment : public Environment
 	*/
 	void deactivateFarObjects(bool force_delete);
 
+	/*
+		Objects active or stored in the block and its neighbors
+	*/
+	u32 countObjectsAround(v3s16 blockpos);
+
 	/*
 		Member variables
 	*/
@@ -291,6 +303,15 @@ class ServerEnvironment : public Environment
 	IntervalLimiter m_active_blocks_management_interval;
 	IntervalLimiter m_active_blocks_test_interval;
 	IntervalLimiter m_active_blocks_nodemetadata_interval;
+	// ActiveBlockModifiers and, for each content, the indices of the
+	// ones triggered by it
+	core::array<ActiveBlockModifier*> m_abms;
+	core::array<core::array<u16> > m_abm_contents;
+	// ActiveBlockModifier passes run so far
+	u32 m_abm_pass;
+	// Runs the work of the active blocks and of the liquids
+	// (num_active_block_threads)
+	JobPool *m_job_pool;
 	// Time from the beginning of the game in seconds.
 	// Incremented in step().
 	u32 m_game_time;
@@ -311,14 +332,22 @@ class ActiveBlockModifier
 	ActiveBlockModifier(){};
 	virtual ~ActiveBlockModifier(){};
 
-	//virtual core::list<u8> update(ServerEnvironment *env) = 0;
+	// For the profiler
+	virtual const char * getName() = 0;
+	// The contents of the nodes it is triggered on
 	virtual u32 getTriggerContentCount(){ return 1;}
-	virtual u8 getTriggerContent(u32 i) = 0;
+	virtual content_t getTriggerContent(u32 i) = 0;
+	// Seconds between the runs on an active block
 	virtual float getActiveInterval() = 0;
 	// chance of (1 / return value), 0 is disallowed
 	virtual u32 getActiveChance() = 0;
-	// This is called usually at interval for 1/chance of the nodes
-	virtual void triggerEvent(ServerEnvironment *env, v3s16 p) = 0;
+	/*
+		This is called usually at interval for 1/chance of the nodes.
+		active_object_count_wider is the number of objects in the
+		block of p and its neighbors.
+	*/
+	virtual void triggerEvent(ServerEnvironment *env, v3s16 p, MapNode n,
+			u32 active_object_count_wider) = 0;
 };
 
 #ifndef SERVER
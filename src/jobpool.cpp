@@ -0,0 +1,127 @@
+/*
+Minetest-c55
+Copyright (C) 2010-2011 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "jobpool.h"
+#include "debug.h"
+#include "log.h"
+
+/*
+	JobPoolThread
+*/
+
+void * JobPoolThread::Thread()
+{
+	ThreadStarted();
+
+	log_register_thread("JobPoolThread");
+
+	DSTACK(__FUNCTION_NAME);
+
+	BEGIN_DEBUG_EXCEPTION_HANDLER
+
+	while(getRun())
+	{
+		m_pool->m_jobs_sem.Wait();
+		while(m_pool->runNext());
+	}
+
+	END_DEBUG_EXCEPTION_HANDLER(errorstream)
+
+	return NULL;
+}
+
+/*
+	JobPool
+*/
+
+JobPool::JobPool(u32 thread_count):
+	m_jobs(NULL),
+	m_next(0),
+	m_unfinished(0)
+{
+	m_mutex.Init();
+	m_jobs_sem.Init();
+	m_done_sem.Init();
+	for(u32 i=0; i<thread_count; i++)
+	{
+		JobPoolThread *t = new JobPoolThread(this);
+		t->Start();
+		m_threads.push_back(t);
+	}
+}
+
+JobPool::~JobPool()
+{
+	for(u32 i=0; i<m_threads.size(); i++)
+		m_threads[i]->setRun(false);
+	// Wake them up to notice it
+	for(u32 i=0; i<m_threads.size(); i++)
+		m_jobs_sem.Post();
+	for(u32 i=0; i<m_threads.size(); i++)
+	{
+		m_threads[i]->stop();
+		delete m_threads[i];
+	}
+}
+
+void JobPool::run(core::array<Job*> &jobs)
+{
+	if(jobs.size() == 0)
+		return;
+
+	{
+		JMutexAutoLock lock(m_mutex);
+		m_jobs = &jobs;
+		m_next = 0;
+		m_unfinished = jobs.size();
+	}
+
+	// The rest of the threads would find nothing to do
+	u32 wake = MYMIN(m_threads.size(), jobs.size() - 1);
+	for(u32 i=0; i<wake; i++)
+		m_jobs_sem.Post();
+
+	while(runNext());
+
+	// Wait for the jobs the threads are still running
+	m_done_sem.Wait();
+
+	JMutexAutoLock lock(m_mutex);
+	m_jobs = NULL;
+}
+
+bool JobPool::runNext()
+{
+	Job *job = NULL;
+	{
+		JMutexAutoLock lock(m_mutex);
+		if(m_jobs == NULL || m_next >= m_jobs->size())
+			return false;
+		job = (*m_jobs)[m_next];
+		m_next++;
+	}
+
+	job->run();
+
+	JMutexAutoLock lock(m_mutex);
+	m_unfinished--;
+	if(m_unfinished == 0)
+		m_done_sem.Post();
+	return true;
+}
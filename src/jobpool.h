@@ -0,0 +1,101 @@
+/*
+Minetest-c55
+Copyright (C) 2010-2011 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef JOBPOOL_HEADER
+#define JOBPOOL_HEADER
+
+#include "common_irrlicht.h"
+#include "utility.h"
+#include <jsemaphore.h>
+
+/*
+	A piece of work for JobPool. The jobs run at the same time must not
+	change anything that the others use.
+*/
+class Job
+{
+public:
+	virtual ~Job(){}
+	virtual void run() = 0;
+};
+
+class JobPool;
+
+class JobPoolThread : public SimpleThread
+{
+	JobPool *m_pool;
+
+public:
+
+	JobPoolThread(JobPool *pool):
+		SimpleThread(),
+		m_pool(pool)
+	{
+	}
+
+	void * Thread();
+};
+
+/*
+	Runs a list of jobs in a number of threads. Each thread, including
+	the one calling run(), takes the next job from the list when it has
+	finished its previous one, so that a few slow jobs don't hold the
+	others up. The threads sleep on a semaphore between the runs, and
+	run() on another one until the last job has finished.
+
+	run() is meant to be called from one thread.
+*/
+class JobPool
+{
+public:
+	// thread_count=0 runs the jobs in the thread calling run()
+	JobPool(u32 thread_count);
+	// Stops the threads
+	~JobPool();
+
+	// Runs the jobs and returns when all have finished
+	void run(core::array<Job*> &jobs);
+
+	u32 getThreadCount()
+	{
+		return m_threads.size();
+	}
+
+private:
+	// Runs the next job; returns false if there was none
+	bool runNext();
+
+	friend class JobPoolThread;
+
+	JMutex m_mutex;
+	// Posted for the threads when there are jobs
+	JSemaphore m_jobs_sem;
+	// Posted when the last job of a run() has finished
+	JSemaphore m_done_sem;
+	// The jobs of the running run(), or NULL
+	core::array<Job*> *m_jobs;
+	// Index of the next job to run in m_jobs
+	u32 m_next;
+	// Jobs of m_jobs that haven't finished yet
+	u32 m_unfinished;
+	core::array<JobPoolThread*> m_threads;
+};
+
+#endif
+
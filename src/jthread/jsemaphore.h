@@ -0,0 +1,53 @@
+/*
+Minetest-c55
+Copyright (C) 2010-2011 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef JSEMAPHORE_H
+
+#define JSEMAPHORE_H
+
+#if (defined(WIN32) || defined(_WIN32_WCE))
+	#include <winsock2.h>
+	#include <windows.h>
+#else // using pthread
+	#include <semaphore.h>
+#endif // WIN32
+
+#define ERR_JSEMAPHORE_ALREADYINIT					-1
+#define ERR_JSEMAPHORE_NOTINIT						-2
+#define ERR_JSEMAPHORE_CANTCREATESEMAPHORE				-3
+
+class JSemaphore
+{
+public:
+	JSemaphore();
+	~JSemaphore();
+	int Init();
+	int Post();
+	int Wait();
+	bool IsInitialized() 						{ return initialized; }
+private:
+#if (defined(WIN32) || defined(_WIN32_WCE))
+	HANDLE semaphore;
+#else // pthread
+	sem_t semaphore;
+#endif // WIN32
+	bool initialized;
+};
+
+#endif // JSEMAPHORE_H
@@ -0,0 +1,63 @@
+/*
+Minetest-c55
+Copyright (C) 2010-2011 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "jsemaphore.h"
+#include <errno.h>
+
+JSemaphore::JSemaphore()
+{
+	initialized = false;
+}
+
+JSemaphore::~JSemaphore()
+{
+	if (initialized)
+		sem_destroy(&semaphore);
+}
+
+int JSemaphore::Init()
+{
+	if (initialized)
+		return ERR_JSEMAPHORE_ALREADYINIT;
+	
+	if (sem_init(&semaphore,0,0) != 0)
+		return ERR_JSEMAPHORE_CANTCREATESEMAPHORE;
+	initialized = true;
+	return 0;
+}
+
+int JSemaphore::Post()
+{
+	if (!initialized)
+		return ERR_JSEMAPHORE_NOTINIT;
+	
+	sem_post(&semaphore);
+	return 0;
+}
+
+int JSemaphore::Wait()
+{
+	if (!initialized)
+		return ERR_JSEMAPHORE_NOTINIT;
+	
+	// Interrupted by a signal
+	while (sem_wait(&semaphore) != 0 && errno == EINTR)
+		;
+	return 0;
+}
@@ -311,8 +311,6 @@ FIXME: Block send distance configuration does not take effect for some reason
 
 TODO: Add proper hooks to when adding and removing active blocks
 
-TODO: Finish the ActiveBlockModifier stuff and use it for something
-
 Objects:
 --------
 
@@ -37,24 +37,22 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "settings.h"
 #include "log.h"
 #include "profiler.h"
+#include "database_folders.h"
+#include "database_sqlite3.h"
+#include "mapmigrate.h"
+#include "jobpool.h"
+#include <ctime>
 
 #define PP(x) "("<<(x).X<<","<<(x).Y<<","<<(x).Z<<")"
 
 /*
-	SQLite format specification:
-	- Initially only replaces sectors/ and sectors2/
+	Map storage:
+	- Blocks are stored in a Database backend (database.h), map.sqlite
+	  by default. Sector metadata stays in sectors2/.
 	
-	If map.sqlite does not exist in the save dir
-	or the block was not found in the database
-	the map will try to load from sectors folder.
-	In either case, map.sqlite will be created
-	and all future saves will save there.
-	
-	Structure of map.sqlite:
-	Tables:
-		blocks
-			(PK) INT pos
-			BLOB data
+	If a block is not found in the backend, it is looked up in the
+	sectors/ and sectors2/ folders of old versions. If found there,
+	it is moved to the backend.
 */
 
 /*
@@ -69,6 +67,9 @@ Map::Map(std::ostream &dout):
 	assert(m_sector_mutex.IsInitialized());*/
 }
 
+// Defined after LiquidBlockJob
+static void deleteLiquidJobs(core::array<LiquidBlockJob*> &jobs);
+
 Map::~Map()
 {
 	/*
@@ -80,6 +81,8 @@ Map::~Map()
 		MapSector *sector = i.getNode()->getValue();
 		delete sector;
 	}
+
+	deleteLiquidJobs(m_liquid_jobs);
 }
 
 void Map::addEventReceiver(MapEventReceiver *event_receiver)
@@ -1468,6 +1471,7 @@ void Map::timerUpdate(float dtime, float unload_timeout,
 
 				// Delete from memory
 				sector->deleteBlock(block);
+				m_dirty_blocks.remove(p);
 
 				if(unloaded_blocks)
 					unloaded_blocks->push_back(p);
@@ -1591,247 +1595,505 @@ struct NodeNeighbor {
 	v3s16 p;
 };
 
-void Map::transformLiquids(core::map<v3s16, MapBlock*> & modified_blocks)
+// Edge of the nodes LiquidBlockJob has: a block and one node around it
+#define LIQUID_JOB_EDGE (MAP_BLOCKSIZE+2)
+#define LIQUID_JOB_NODES (LIQUID_JOB_EDGE * LIQUID_JOB_EDGE * LIQUID_JOB_EDGE)
+// Nodes taken from the queue for a round of Map::transformLiquids() at most
+#define LIQUID_ROUND_MAX_NODES 4096
+// LiquidBlockJobs kept by a Map for the next rounds at most
+#define LIQUID_JOBS_KEPT 64
+
+/*
+	Transforms the queued liquid nodes of a block. It works on a copy of
+	the nodes of the block and the ones around it, so that the jobs of
+	different blocks can run at the same time. Only the nodes of the
+	block are changed; the nodes of other blocks that are to be
+	transformed are left to the caller.
+
+	A node is copied from its block when the job first reads it, as a
+	job usually looks at only a few of the nodes. A job can be used
+	again for another block after reset().
+*/
+class LiquidBlockJob : public Job
 {
-	DSTACK(__FUNCTION_NAME);
-	//TimeTaker timer("transformLiquids()");
+public:
+	LiquidBlockJob()
+	{
+		reset(v3s16(0,0,0));
+	}
 
-	u32 loopcount = 0;
-	u32 initial_size = m_transforming_liquid.size();
+	// Empties the job and makes it transform the nodes of blockpos
+	void reset(v3s16 blockpos);
+	// Gets the blocks from the map. Call before run(), with the map
+	// locked; the blocks must not change until the job has run.
+	void load(Map *map);
 
-	/*if(initial_size != 0)
-		infostream<<"transformLiquids(): initial_size="<<initial_size<<std::endl;*/
+	v3s16 getBlockPos()
+	{
+		return m_blockpos;
+	}
+	MapNode getNode(v3s16 p)
+	{
+		u32 i = index(p);
+		if(m_loaded[i] == false)
+		{
+			m_nodes[i] = readNode(p);
+			m_loaded[i] = true;
+		}
+		return m_nodes[i];
+	}
 
-	// list of nodes that due to viscosity have not reached their max level height
-	UniqueQueue<v3s16> must_reflow;
-	
-	// List of MapBlocks that will require a lighting update (due to lava)
-	core::map<v3s16, MapBlock*> lighting_modified_blocks;
+	// Input: nodes of the block to transform
+	UniqueQueue<v3s16> queue;
+	// Nodes popped from queue at most
+	u32 max_loops;
 
-	while(m_transforming_liquid.size() != 0)
+	/*
+		Output: the changed nodes, the nodes of other blocks to transform,
+		the nodes that haven't reached their level due to viscosity and
+		the number of nodes transformed. Nodes left in queue weren't
+		transformed.
+	*/
+	core::map<v3s16, bool> changed;
+	core::list<v3s16> outside;
+	core::list<v3s16> must_reflow;
+	u32 loopcount;
+
+	void run();
+
+private:
+	u32 index(v3s16 p)
 	{
-		// This should be done here so that it is done when continue is used
-		if(loopcount >= initial_size * 3)
+		v3s16 r = p - m_origin + v3s16(1,1,1);
+		return (r.Z * LIQUID_JOB_EDGE + r.Y) * LIQUID_JOB_EDGE + r.X;
+	}
+	bool isInside(v3s16 p)
+	{
+		return getNodeBlockPos(p) == m_blockpos;
+	}
+	void push(v3s16 p)
+	{
+		if(isInside(p))
+			queue.push_back(p);
+		else
+			outside.push_back(p);
+	}
+	MapNode readNode(v3s16 p);
+	void transform(v3s16 p0);
+
+	v3s16 m_blockpos;
+	v3s16 m_origin;
+	// The block and its neighbors, [z*9 + y*3 + x]
+	MapBlock *m_blocks[27];
+	MapNode m_nodes[LIQUID_JOB_NODES];
+	bool m_loaded[LIQUID_JOB_NODES];
+};
+
+static void deleteLiquidJobs(core::array<LiquidBlockJob*> &jobs)
+{
+	for(u32 i=0; i<jobs.size(); i++)
+		delete jobs[i];
+	jobs.clear();
+}
+
+void LiquidBlockJob::reset(v3s16 blockpos)
+{
+	m_blockpos = blockpos;
+	m_origin = blockpos * MAP_BLOCKSIZE;
+	for(u32 i=0; i<27; i++)
+		m_blocks[i] = NULL;
+	memset(m_loaded, 0, sizeof(m_loaded));
+	while(queue.size() != 0)
+		queue.pop_front();
+	max_loops = 0;
+	changed.clear();
+	outside.clear();
+	must_reflow.clear();
+	loopcount = 0;
+}
+
+void LiquidBlockJob::load(Map *map)
+{
+	for(s16 z=-1; z<=1; z++)
+	for(s16 y=-1; y<=1; y++)
+	for(s16 x=-1; x<=1; x++)
+	{
+		MapBlock *block = map->getBlockNoCreateNoEx(
+				m_blockpos + v3s16(x,y,z));
+		if(block != NULL && block->isDummy())
+			block = NULL;
+		m_blocks[(z+1)*9 + (y+1)*3 + (x+1)] = block;
+	}
+}
+
+MapNode LiquidBlockJob::readNode(v3s16 p)
+{
+	v3s16 r = p - m_origin;
+	s16 bx = r.X < 0 ? 0 : (r.X < MAP_BLOCKSIZE ? 1 : 2);
+	s16 by = r.Y < 0 ? 0 : (r.Y < MAP_BLOCKSIZE ? 1 : 2);
+	s16 bz = r.Z < 0 ? 0 : (r.Z < MAP_BLOCKSIZE ? 1 : 2);
+	MapBlock *block = m_blocks[bz*9 + by*3 + bx];
+	if(block == NULL)
+		return MapNode(CONTENT_IGNORE);
+	return block->getNodeNoCheck(r - v3s16(bx-1, by-1, bz-1) * MAP_BLOCKSIZE);
+}
+
+void LiquidBlockJob::run()
+{
+	loopcount = 0;
+	while(queue.size() != 0)
+	{
+		if(loopcount >= max_loops)
 			break;
 		loopcount++;
+		transform(queue.pop_front());
+	}
+}
 
-		/*
-			Get a queued transforming liquid node
-		*/
-		v3s16 p0 = m_transforming_liquid.pop_front();
+void LiquidBlockJob::transform(v3s16 p0)
+{
+	MapNode n0 = getNode(p0);
 
-		MapNode n0 = getNodeNoEx(p0);
+	/*
+		Collect information about current node
+	 */
+	s8 liquid_level = -1;
+	u8 liquid_kind = CONTENT_IGNORE;
+	LiquidType liquid_type = content_features(n0.getContent()).liquid_type;
+	switch (liquid_type) {
+		case LIQUID_SOURCE:
+			liquid_level = LIQUID_LEVEL_SOURCE;
+			liquid_kind = content_features(n0.getContent()).liquid_alternative_flowing;
+			break;
+		case LIQUID_FLOWING:
+			liquid_level = (n0.param2 & LIQUID_LEVEL_MASK);
+			liquid_kind = n0.getContent();
+			break;
+		case LIQUID_NONE:
+			// if this is an air node, it *could* be transformed into a liquid. otherwise,
+			// continue with the next node.
+			if (n0.getContent() != CONTENT_AIR)
+				return;
+			liquid_kind = CONTENT_AIR;
+			break;
+	}
 
-		/*
-			Collect information about current node
-		 */
-		s8 liquid_level = -1;
-		u8 liquid_kind = CONTENT_IGNORE;
-		LiquidType liquid_type = content_features(n0.getContent()).liquid_type;
-		switch (liquid_type) {
-			case LIQUID_SOURCE:
-				liquid_level = LIQUID_LEVEL_SOURCE;
-				liquid_kind = content_features(n0.getContent()).liquid_alternative_flowing;
+	/*
+		Collect information about the environment
+	 */
+	const v3s16 *dirs = g_6dirs;
+	NodeNeighbor sources[6]; // surrounding sources
+	int num_sources = 0;
+	NodeNeighbor flows[6]; // surrounding flowing liquid nodes
+	int num_flows = 0;
+	NodeNeighbor airs[6]; // surrounding air
+	int num_airs = 0;
+	NodeNeighbor neutrals[6]; // nodes that are solid or another kind of liquid
+	int num_neutrals = 0;
+	bool flowing_down = false;
+	for (u16 i = 0; i < 6; i++) {
+		NeighborType nt = NEIGHBOR_SAME_LEVEL;
+		switch (i) {
+			case 1:
+				nt = NEIGHBOR_UPPER;
 				break;
-			case LIQUID_FLOWING:
-				liquid_level = (n0.param2 & LIQUID_LEVEL_MASK);
-				liquid_kind = n0.getContent();
+			case 4:
+				nt = NEIGHBOR_LOWER;
 				break;
+		}
+		v3s16 npos = p0 + dirs[i];
+		NodeNeighbor nb = {getNode(npos), nt, npos};
+		switch (content_features(nb.n.getContent()).liquid_type) {
 			case LIQUID_NONE:
-				// if this is an air node, it *could* be transformed into a liquid. otherwise,
-				// continue with the next node.
-				if (n0.getContent() != CONTENT_AIR)
-					continue;
-				liquid_kind = CONTENT_AIR;
+				if (nb.n.getContent() == CONTENT_AIR) {
+					airs[num_airs++] = nb;
+					// if the current node is a water source the neighbor
+					// should be enqueded for transformation regardless of whether the
+					// current node changes or not.
+					if (nb.t != NEIGHBOR_UPPER && liquid_type != LIQUID_NONE)
+						push(npos);
+					// if the current node happens to be a flowing node, it will start to flow down here.
+					if (nb.t == NEIGHBOR_LOWER) {
+						flowing_down = true;
+					}
+				} else {
+					neutrals[num_neutrals++] = nb;
+				}
+				break;
+			case LIQUID_SOURCE:
+				// if this node is not (yet) of a liquid type, choose the first liquid type we encounter 
+				if (liquid_kind == CONTENT_AIR)
+					liquid_kind = content_features(nb.n.getContent()).liquid_alternative_flowing;
+				if (content_features(nb.n.getContent()).liquid_alternative_flowing !=liquid_kind) {
+					neutrals[num_neutrals++] = nb;
+				} else {
+					sources[num_sources++] = nb;
+				}
+				break;
+			case LIQUID_FLOWING:
+				// if this node is not (yet) of a liquid type, choose the first liquid type we encounter
+				if (liquid_kind == CONTENT_AIR)
+					liquid_kind = content_features(nb.n.getContent()).liquid_alternative_flowing;
+				if (content_features(nb.n.getContent()).liquid_alternative_flowing != liquid_kind) {
+					neutrals[num_neutrals++] = nb;
+				} else {
+					flows[num_flows++] = nb;
+					if (nb.t == NEIGHBOR_LOWER)
+						flowing_down = true;
+				}
 				break;
 		}
+	}
 
-		/*
-			Collect information about the environment
-		 */
-		const v3s16 *dirs = g_6dirs;
-		NodeNeighbor sources[6]; // surrounding sources
-		int num_sources = 0;
-		NodeNeighbor flows[6]; // surrounding flowing liquid nodes
-		int num_flows = 0;
-		NodeNeighbor airs[6]; // surrounding air
-		int num_airs = 0;
-		NodeNeighbor neutrals[6]; // nodes that are solid or another kind of liquid
-		int num_neutrals = 0;
-		bool flowing_down = false;
-		for (u16 i = 0; i < 6; i++) {
-			NeighborType nt = NEIGHBOR_SAME_LEVEL;
-			switch (i) {
-				case 1:
-					nt = NEIGHBOR_UPPER;
-					break;
-				case 4:
-					nt = NEIGHBOR_LOWER;
-					break;
-			}
-			v3s16 npos = p0 + dirs[i];
-			NodeNeighbor nb = {getNodeNoEx(npos), nt, npos};
-			switch (content_features(nb.n.getContent()).liquid_type) {
-				case LIQUID_NONE:
-					if (nb.n.getContent() == CONTENT_AIR) {
-						airs[num_airs++] = nb;
-						// if the current node is a water source the neighbor
-						// should be enqueded for transformation regardless of whether the
-						// current node changes or not.
-						if (nb.t != NEIGHBOR_UPPER && liquid_type != LIQUID_NONE)
-							m_transforming_liquid.push_back(npos);
-						// if the current node happens to be a flowing node, it will start to flow down here.
-						if (nb.t == NEIGHBOR_LOWER) {
-							flowing_down = true;
-						}
-					} else {
-						neutrals[num_neutrals++] = nb;
-					}
+	/*
+		decide on the type (and possibly level) of the current node
+	 */
+	content_t new_node_content;
+	s8 new_node_level = -1;
+	s8 max_node_level = -1;
+	if (num_sources >= 2 || liquid_type == LIQUID_SOURCE) {
+		// liquid_kind will be set to either the flowing alternative of the node (if it's a liquid)
+		// or the flowing alternative of the first of the surrounding sources (if it's air), so
+		// it's perfectly safe to use liquid_kind here to determine the new node content.
+		new_node_content = content_features(liquid_kind).liquid_alternative_source;
+	} else if (num_sources == 1 && sources[0].t != NEIGHBOR_LOWER) {
+		// liquid_kind is set properly, see above
+		new_node_content = liquid_kind;
+		max_node_level = new_node_level = LIQUID_LEVEL_MAX;
+	} else {
+		// no surrounding sources, so get the maximum level that can flow into this node
+		for (u16 i = 0; i < num_flows; i++) {
+			u8 nb_liquid_level = (flows[i].n.param2 & LIQUID_LEVEL_MASK);
+			switch (flows[i].t) {
+				case NEIGHBOR_UPPER:
+					if (nb_liquid_level + WATER_DROP_BOOST > max_node_level) {
+						max_node_level = LIQUID_LEVEL_MAX;
+						if (nb_liquid_level + WATER_DROP_BOOST < LIQUID_LEVEL_MAX)
+							max_node_level = nb_liquid_level + WATER_DROP_BOOST;
+					} else if (nb_liquid_level > max_node_level)
+						max_node_level = nb_liquid_level;
 					break;
-				case LIQUID_SOURCE:
-					// if this node is not (yet) of a liquid type, choose the first liquid type we encounter 
-					if (liquid_kind == CONTENT_AIR)
-						liquid_kind = content_features(nb.n.getContent()).liquid_alternative_flowing;
-					if (content_features(nb.n.getContent()).liquid_alternative_flowing !=liquid_kind) {
-						neutrals[num_neutrals++] = nb;
-					} else {
-						sources[num_sources++] = nb;
-					}
+				case NEIGHBOR_LOWER:
 					break;
-				case LIQUID_FLOWING:
-					// if this node is not (yet) of a liquid type, choose the first liquid type we encounter
-					if (liquid_kind == CONTENT_AIR)
-						liquid_kind = content_features(nb.n.getContent()).liquid_alternative_flowing;
-					if (content_features(nb.n.getContent()).liquid_alternative_flowing != liquid_kind) {
-						neutrals[num_neutrals++] = nb;
-					} else {
-						flows[num_flows++] = nb;
-						if (nb.t == NEIGHBOR_LOWER)
-							flowing_down = true;
+				case NEIGHBOR_SAME_LEVEL:
+					if ((flows[i].n.param2 & LIQUID_FLOW_DOWN_MASK) != LIQUID_FLOW_DOWN_MASK &&
+						nb_liquid_level > 0 && nb_liquid_level - 1 > max_node_level) {
+						max_node_level = nb_liquid_level - 1;
 					}
 					break;
 			}
 		}
 
-		/*
-			decide on the type (and possibly level) of the current node
-		 */
-		content_t new_node_content;
-		s8 new_node_level = -1;
-		s8 max_node_level = -1;
-		if (num_sources >= 2 || liquid_type == LIQUID_SOURCE) {
-			// liquid_kind will be set to either the flowing alternative of the node (if it's a liquid)
-			// or the flowing alternative of the first of the surrounding sources (if it's air), so
-			// it's perfectly safe to use liquid_kind here to determine the new node content.
-			new_node_content = content_features(liquid_kind).liquid_alternative_source;
-		} else if (num_sources == 1 && sources[0].t != NEIGHBOR_LOWER) {
-			// liquid_kind is set properly, see above
+		u8 viscosity = content_features(liquid_kind).liquid_viscosity;
+		if (viscosity > 1 && max_node_level != liquid_level) {
+			// amount to gain, limited by viscosity
+			// must be at least 1 in absolute value
+			s8 level_inc = max_node_level - liquid_level;
+			if (level_inc < -viscosity || level_inc > viscosity)
+				new_node_level = liquid_level + level_inc/viscosity;
+			else if (level_inc < 0)
+				new_node_level = liquid_level - 1;
+			else if (level_inc > 0)
+				new_node_level = liquid_level + 1;
+			if (new_node_level != max_node_level)
+				must_reflow.push_back(p0);
+		} else
+			new_node_level = max_node_level;
+
+		if (new_node_level >= 0)
 			new_node_content = liquid_kind;
-			max_node_level = new_node_level = LIQUID_LEVEL_MAX;
-		} else {
-			// no surrounding sources, so get the maximum level that can flow into this node
-			for (u16 i = 0; i < num_flows; i++) {
-				u8 nb_liquid_level = (flows[i].n.param2 & LIQUID_LEVEL_MASK);
-				switch (flows[i].t) {
-					case NEIGHBOR_UPPER:
-						if (nb_liquid_level + WATER_DROP_BOOST > max_node_level) {
-							max_node_level = LIQUID_LEVEL_MAX;
-							if (nb_liquid_level + WATER_DROP_BOOST < LIQUID_LEVEL_MAX)
-								max_node_level = nb_liquid_level + WATER_DROP_BOOST;
-						} else if (nb_liquid_level > max_node_level)
-							max_node_level = nb_liquid_level;
-						break;
-					case NEIGHBOR_LOWER:
-						break;
-					case NEIGHBOR_SAME_LEVEL:
-						if ((flows[i].n.param2 & LIQUID_FLOW_DOWN_MASK) != LIQUID_FLOW_DOWN_MASK &&
-							nb_liquid_level > 0 && nb_liquid_level - 1 > max_node_level) {
-							max_node_level = nb_liquid_level - 1;
-						}
-						break;
-				}
-			}
+		else
+			new_node_content = CONTENT_AIR;
 
-			u8 viscosity = content_features(liquid_kind).liquid_viscosity;
-			if (viscosity > 1 && max_node_level != liquid_level) {
-				// amount to gain, limited by viscosity
-				// must be at least 1 in absolute value
-				s8 level_inc = max_node_level - liquid_level;
-				if (level_inc < -viscosity || level_inc > viscosity)
-					new_node_level = liquid_level + level_inc/viscosity;
-				else if (level_inc < 0)
-					new_node_level = liquid_level - 1;
-				else if (level_inc > 0)
-					new_node_level = liquid_level + 1;
-				if (new_node_level != max_node_level)
-					must_reflow.push_back(p0);
-			} else
-				new_node_level = max_node_level;
-
-			if (new_node_level >= 0)
-				new_node_content = liquid_kind;
-			else
-				new_node_content = CONTENT_AIR;
+	}
 
-		}
+	/*
+		check if anything has changed. if not, just continue with the next node.
+	 */
+	if (new_node_content == n0.getContent() && (content_features(n0.getContent()).liquid_type != LIQUID_FLOWING ||
+									 ((n0.param2 & LIQUID_LEVEL_MASK) == (u8)new_node_level &&
+									 ((n0.param2 & LIQUID_FLOW_DOWN_MASK) == LIQUID_FLOW_DOWN_MASK)
+									 == flowing_down)))
+		return;
 
-		/*
-			check if anything has changed. if not, just continue with the next node.
-		 */
-		if (new_node_content == n0.getContent() && (content_features(n0.getContent()).liquid_type != LIQUID_FLOWING ||
-										 ((n0.param2 & LIQUID_LEVEL_MASK) == (u8)new_node_level &&
-										 ((n0.param2 & LIQUID_FLOW_DOWN_MASK) == LIQUID_FLOW_DOWN_MASK)
-										 == flowing_down)))
-			continue;
 
+	/*
+		update the current node
+	 */
+	if (content_features(new_node_content).liquid_type == LIQUID_FLOWING) {
+		// set level to last 3 bits, flowing down bit to 4th bit
+		n0.param2 = (flowing_down ? LIQUID_FLOW_DOWN_MASK : 0x00) | (new_node_level & LIQUID_LEVEL_MASK);
+	} else {
+		// set the liquid level and flow bit to 0
+		n0.param2 = ~(LIQUID_LEVEL_MASK | LIQUID_FLOW_DOWN_MASK);
+	}
+	n0.setContent(new_node_content);
+	m_nodes[index(p0)] = n0;
+	changed[p0] = true;
 
-		/*
-			update the current node
-		 */
-		bool flow_down_enabled = (flowing_down && ((n0.param2 & LIQUID_FLOW_DOWN_MASK) != LIQUID_FLOW_DOWN_MASK));
-		if (content_features(new_node_content).liquid_type == LIQUID_FLOWING) {
-			// set level to last 3 bits, flowing down bit to 4th bit
-			n0.param2 = (flowing_down ? LIQUID_FLOW_DOWN_MASK : 0x00) | (new_node_level & LIQUID_LEVEL_MASK);
-		} else {
-			// set the liquid level and flow bit to 0
-			n0.param2 = ~(LIQUID_LEVEL_MASK | LIQUID_FLOW_DOWN_MASK);
+	/*
+		enqueue neighbors for update if neccessary
+	 */
+	switch (content_features(n0.getContent()).liquid_type) {
+		case LIQUID_SOURCE:
+		case LIQUID_FLOWING:
+			// make sure source flows into all neighboring nodes
+			for (u16 i = 0; i < num_flows; i++)
+				if (flows[i].t != NEIGHBOR_UPPER)
+					push(flows[i].p);
+			for (u16 i = 0; i < num_airs; i++)
+				if (airs[i].t != NEIGHBOR_UPPER)
+					push(airs[i].p);
+			break;
+		case LIQUID_NONE:
+			// this flow has turned to air; neighboring flows might need to do the same
+			for (u16 i = 0; i < num_flows; i++)
+				push(flows[i].p);
+			break;
+	}
+
+	/*
+		The jobs of the neighboring blocks saw the node as it was;
+		have them look at it again
+	*/
+	for (u16 i = 0; i < 6; i++) {
+		v3s16 npos = p0 + dirs[i];
+		if (isInside(npos) == false)
+			outside.push_back(npos);
+	}
+}
+
+void Map::transformLiquids(core::map<v3s16, MapBlock*> & modified_blocks,
+		JobPool *pool, u32 max_time_ms)
+{
+	DSTACK(__FUNCTION_NAME);
+	//TimeTaker timer("transformLiquids()");
+
+	u32 start_ms = porting::getTimeMs();
+	u32 loopcount = 0;
+	u32 initial_size = m_transforming_liquid.size();
+	g_profiler->avg("Map: liquid queue size", initial_size);
+
+	/*if(initial_size != 0)
+		infostream<<"transformLiquids(): initial_size="<<initial_size<<std::endl;*/
+
+	// list of nodes that due to viscosity have not reached their max level height
+	UniqueQueue<v3s16> must_reflow;
+	
+	// List of MapBlocks that will require a lighting update (due to lava)
+	core::map<v3s16, MapBlock*> lighting_modified_blocks;
+
+	/*
+		The queued nodes are transformed in rounds. In a round, the
+		nodes of each block are transformed by a job of their own, and
+		what the jobs found is applied to the map in the order of the
+		blocks, so that the result doesn't depend on the number of
+		threads. The nodes the jobs queue in other blocks are left to
+		the next round.
+
+		As many nodes are transformed in a pass as there were queued
+		times three, unless the pass takes longer than max_time_ms; the
+		rest is left to the next pass.
+	*/
+	while(m_transforming_liquid.size() != 0)
+	{
+		if(loopcount >= initial_size * 3)
+			break;
+		if(porting::getTimeMs() - start_ms >= max_time_ms)
+			break;
+
+		core::map<v3s16, LiquidBlockJob*> jobs;
+		for(u32 i=0; i<LIQUID_ROUND_MAX_NODES; i++)
+		{
+			if(m_transforming_liquid.size() == 0)
+				break;
+			v3s16 p = m_transforming_liquid.pop_front();
+			v3s16 blockpos = getNodeBlockPos(p);
+			core::map<v3s16, LiquidBlockJob*>::Node *n = jobs.find(blockpos);
+			LiquidBlockJob *job = NULL;
+			if(n == NULL)
+			{
+				MapBlock *block = getBlockNoCreateNoEx(blockpos);
+				if(block == NULL || block->isDummy())
+					continue;
+				if(m_liquid_jobs.size() != 0)
+				{
+					job = m_liquid_jobs[m_liquid_jobs.size() - 1];
+					m_liquid_jobs.erase(m_liquid_jobs.size() - 1);
+				}
+				else
+				{
+					job = new LiquidBlockJob();
+				}
+				job->reset(blockpos);
+				jobs[blockpos] = job;
+			}
+			else
+			{
+				job = n->getValue();
+			}
+			job->queue.push_back(p);
 		}
-		n0.setContent(new_node_content);
-		setNode(p0, n0);
-		v3s16 blockpos = getNodeBlockPos(p0);
-		MapBlock *block = getBlockNoCreateNoEx(blockpos);
-		if(block != NULL) {
-			modified_blocks.insert(blockpos, block);
-			// If node emits light, MapBlock requires lighting update
-			if(content_features(n0).light_source != 0)
-				lighting_modified_blocks[block->getPos()] = block;
+
+		core::array<Job*> jobptrs;
+		for(core::map<v3s16, LiquidBlockJob*>::Iterator
+				i = jobs.getIterator(); i.atEnd() == false; i++)
+		{
+			LiquidBlockJob *job = i.getNode()->getValue();
+			job->load(this);
+			job->max_loops = job->queue.size() * 3;
+			jobptrs.push_back(job);
 		}
 
-		/*
-			enqueue neighbors for update if neccessary
-		 */
-		switch (content_features(n0.getContent()).liquid_type) {
-			case LIQUID_SOURCE:
-			case LIQUID_FLOWING:
-				// make sure source flows into all neighboring nodes
-				for (u16 i = 0; i < num_flows; i++)
-					if (flows[i].t != NEIGHBOR_UPPER)
-						m_transforming_liquid.push_back(flows[i].p);
-				for (u16 i = 0; i < num_airs; i++)
-					if (airs[i].t != NEIGHBOR_UPPER)
-						m_transforming_liquid.push_back(airs[i].p);
-				break;
-			case LIQUID_NONE:
-				// this flow has turned to air; neighboring flows might need to do the same
-				for (u16 i = 0; i < num_flows; i++)
-					m_transforming_liquid.push_back(flows[i].p);
-				break;
+		pool->run(jobptrs);
+
+		for(core::map<v3s16, LiquidBlockJob*>::Iterator
+				i = jobs.getIterator(); i.atEnd() == false; i++)
+		{
+			LiquidBlockJob *job = i.getNode()->getValue();
+			loopcount += job->loopcount;
+
+			MapBlock *block = getBlockNoCreateNoEx(job->getBlockPos());
+			assert(block);
+			for(core::map<v3s16, bool>::Iterator
+					j = job->changed.getIterator(); j.atEnd() == false; j++)
+			{
+				v3s16 p = j.getNode()->getKey();
+				MapNode n = job->getNode(p);
+				block->setNodeNoCheck(p - block->getPosRelative(), n);
+				// If node emits light, MapBlock requires lighting update
+				if(content_features(n).light_source != 0)
+					lighting_modified_blocks[block->getPos()] = block;
+			}
+			if(job->changed.size() != 0)
+				modified_blocks.insert(block->getPos(), block);
+
+			for(core::list<v3s16>::Iterator j = job->outside.begin();
+					j != job->outside.end(); j++)
+				m_transforming_liquid.push_back(*j);
+			while(job->queue.size() != 0)
+				m_transforming_liquid.push_back(job->queue.pop_front());
+			for(core::list<v3s16>::Iterator j = job->must_reflow.begin();
+					j != job->must_reflow.end(); j++)
+				must_reflow.push_back(*j);
+
+			if(m_liquid_jobs.size() < LIQUID_JOBS_KEPT)
+				m_liquid_jobs.push_back(job);
+			else
+				delete job;
 		}
 	}
 	//infostream<<"Map::transformLiquids(): loopcount="<<loopcount<<std::endl;
 	while (must_reflow.size() > 0)
 		m_transforming_liquid.push_back(must_reflow.pop_front());
 	updateLighting(lighting_modified_blocks, modified_blocks);
+
+	u32 time_ms = porting::getTimeMs() - start_ms;
+	g_profiler->add("Map: liquid nodes transformed", loopcount);
+	if(loopcount != 0)
+		g_profiler->avg("Map: liquid nodes per second",
+				(float)loopcount * 1000.0 / MYMAX(time_ms, 1));
+	g_profiler->avg("Map: liquid backlog", m_transforming_liquid.size());
 }
 
 NodeMetadata* Map::getNodeMetadata(v3s16 p)
@@ -1871,6 +2133,7 @@ void Map::setNodeMetadata(v3s16 p, NodeMetadata *meta)
 		return;
 	}
 	block->m_node_metadata.set(p_rel, meta);
+	block->raiseModified(MOD_STATE_WRITE_NEEDED);
 }
 
 void Map::removeNodeMetadata(v3s16 p)
@@ -1885,6 +2148,7 @@ void Map::removeNodeMetadata(v3s16 p)
 		return;
 	}
 	block->m_node_metadata.remove(p_rel);
+	block->raiseModified(MOD_STATE_WRITE_NEEDED);
 }
 
 void Map::nodeMetadataStep(float dtime,
@@ -1916,6 +2180,205 @@ void Map::nodeMetadataStep(float dtime,
 	}
 }
 
+/*
+	BlockSaveQueue
+*/
+
+BlockSaveQueue::BlockSaveQueue():
+	m_next_id(0),
+	m_space_waiters(0)
+{
+	m_mutex.Init();
+	assert(m_mutex.IsInitialized());
+	m_space_sem.Init();
+	assert(m_space_sem.IsInitialized());
+}
+
+void BlockSaveQueue::push(v3s16 p, const std::string &data, bool pristine,
+		bool delete_legacy)
+{
+	JMutexAutoLock lock(m_mutex);
+
+	core::map<v3s16, Entry>::Node *n = m_blocks.find(p);
+	if(n == NULL)
+	{
+		m_blocks.insert(p, Entry());
+		n = m_blocks.find(p);
+		n->getValue().queued = false;
+		n->getValue().delete_legacy = false;
+	}
+	Entry &e = n->getValue();
+	e.data = data;
+	e.id = m_next_id++;
+	e.pristine = pristine;
+	// Kept until a snapshot is handed out for writing
+	e.delete_legacy = e.delete_legacy || delete_legacy;
+	// An older snapshot may be in the queue or being written already
+	if(e.queued == false)
+	{
+		m_order.push_back(p);
+		e.queued = true;
+	}
+}
+
+bool BlockSaveQueue::get(v3s16 p, std::string &data)
+{
+	JMutexAutoLock lock(m_mutex);
+
+	core::map<v3s16, Entry>::Node *n = m_blocks.find(p);
+	if(n == NULL)
+		return false;
+	data = n->getValue().data;
+	return true;
+}
+
+u32 BlockSaveQueue::getBatch(u32 max_count, core::list<PendingBlockSave> &dst)
+{
+	JMutexAutoLock lock(m_mutex);
+
+	u32 count = 0;
+	while(count < max_count && m_order.size() != 0)
+	{
+		core::list<v3s16>::Iterator i = m_order.begin();
+		v3s16 p = *i;
+		m_order.erase(i);
+
+		core::map<v3s16, Entry>::Node *n = m_blocks.find(p);
+		assert(n);
+		Entry &e = n->getValue();
+		e.queued = false;
+
+		PendingBlockSave b;
+		b.p = p;
+		b.data = e.data;
+		b.id = e.id;
+		b.pristine = e.pristine;
+		b.delete_legacy = e.delete_legacy;
+		e.delete_legacy = false;
+		dst.push_back(b);
+		count++;
+	}
+	return count;
+}
+
+void BlockSaveQueue::written(core::list<PendingBlockSave> &batch)
+{
+	JMutexAutoLock lock(m_mutex);
+
+	for(core::list<PendingBlockSave>::Iterator i = batch.begin();
+			i != batch.end(); i++)
+	{
+		core::map<v3s16, Entry>::Node *n = m_blocks.find(i->p);
+		if(n == NULL)
+			continue;
+		// Leave newer snapshots for the next batch
+		if(n->getValue().id != i->id)
+			continue;
+		m_blocks.remove(i->p);
+	}
+
+	// Let the waiting threads look at the size again
+	for(; m_space_waiters != 0; m_space_waiters--)
+		m_space_sem.Post();
+}
+
+void BlockSaveQueue::listPending(core::list<v3s16> &dst)
+{
+	JMutexAutoLock lock(m_mutex);
+
+	for(core::map<v3s16, Entry>::Iterator i = m_blocks.getIterator();
+			i.atEnd() == false; i++)
+	{
+		dst.push_back(i.getNode()->getKey());
+	}
+}
+
+u32 BlockSaveQueue::size()
+{
+	JMutexAutoLock lock(m_mutex);
+	return m_blocks.size();
+}
+
+u32 BlockSaveQueue::queuedCount()
+{
+	JMutexAutoLock lock(m_mutex);
+	return m_order.size();
+}
+
+void BlockSaveQueue::waitForSpace(u32 max_size)
+{
+	for(;;)
+	{
+		{
+			JMutexAutoLock lock(m_mutex);
+			if(m_blocks.size() < max_size)
+				return;
+			m_space_waiters++;
+		}
+		// A post made before this is kept by the semaphore
+		m_space_sem.Wait();
+	}
+}
+
+/*
+	MapSaveThread
+*/
+
+void * MapSaveThread::Thread()
+{
+	ThreadStarted();
+
+	log_register_thread("MapSaveThread");
+
+	DSTACK(__FUNCTION_NAME);
+
+	BEGIN_DEBUG_EXCEPTION_HANDLER
+
+	u32 batch_max = rangelim(
+			g_settings->getS32("sqlite_group_commit_max_blocks"), 1, 100000);
+	u32 wait_ms = rangelim(
+			g_settings->getFloat("sqlite_group_commit_max_time"), 0, 600)
+			* 1000;
+
+	while(getRun())
+	{
+		g_profiler->avg("ServerMap: save queue length avg",
+				m_map->getSaveQueueSize());
+
+		u32 written = m_map->writePendingBlocks();
+
+		// Backups are copied in small steps in between the writes
+		if(m_map->backupStep())
+		{
+			if(written < batch_max)
+				sleep_ms(1);
+			continue;
+		}
+
+		if(written >= batch_max)
+			continue;
+
+		/*
+			Let more blocks gather so that they go into the same
+			transaction, unless there already are enough for one.
+		*/
+		u32 waited = 0;
+		do{
+			sleep_ms(10);
+			waited += 10;
+		}
+		while(getRun() && waited < wait_ms
+				&& m_map->getSaveQueueSize() < batch_max);
+	}
+
+	// Write everything that is left
+	while(m_map->writePendingBlocks() != 0);
+
+	END_DEBUG_EXCEPTION_HANDLER(errorstream)
+
+	return NULL;
+}
+
 /*
 	ServerMap
 */
@@ -1925,13 +2388,45 @@ ServerMap::ServerMap(std::string savedir):
 	m_seed(0),
 	m_map_metadata_changed(true),
 	m_database(NULL),
-	m_database_read(NULL),
-	m_database_write(NULL)
+	m_legacy_database(NULL),
+	m_legacy_checked(false),
+	m_presence_filter_filled(false),
+	m_backup_running(false),
+	m_backup_native(false),
+	m_backup_database(NULL),
+	m_backup_copied(0),
+	m_backup_start_ms(0),
+	m_save_thread(this)
 {
 	infostream<<__FUNCTION_NAME<<std::endl;
 
 	//m_chunksize = 8; // Takes a few seconds
 
+	m_backend_name = lowercase(trim(g_settings->get("map_backend")));
+	m_block_key_encoding = parseBlockKeyEncoding(
+			lowercase(trim(g_settings->get("map_block_keys"))));
+	m_save_batch_max_blocks = rangelim(
+			g_settings->getS32("sqlite_group_commit_max_blocks"), 1, 100000);
+	m_save_thread_enabled = g_settings->getBool("map_save_thread");
+	m_save_queue_max_blocks = rangelim(
+			g_settings->getS32("map_save_queue_max_blocks"), 1, 1000000);
+	m_presence_filter_enabled = g_settings->getBool("map_presence_filter");
+	m_compression_codec = parseCompressionCodec(
+			lowercase(trim(g_settings->get("map_compression_codec"))));
+	m_compression_level = g_settings->getS32("map_compression_level");
+	m_journal_enabled = g_settings->getBool("map_journal");
+	m_backup_step = rangelim(
+			g_settings->getS32("backup_step_size"), 1, 100000);
+	m_skip_pristine_blocks = g_settings->getBool("map_skip_pristine_blocks");
+	m_sector_noise_cache = new mapgen::SectorNoiseCache(rangelim(
+			g_settings->getS32("mapgen_sector_cache_size"), 1, 100000));
+	infostream<<"ServerMap: Sector noise cache takes at most "
+			<<(m_sector_noise_cache->getMaxBytes()/1024)<<" KiB"
+			<<std::endl;
+
+	m_database_mutex.Init();
+	assert(m_database_mutex.IsInitialized());
+
 	if (g_settings->get("fixed_map_seed").empty())
 	{
 		m_seed = (((u64)(myrand()%0xffff)<<0)
@@ -2055,14 +2550,31 @@ ServerMap::~ServerMap()
 	}
 
 	/*
-		Close database if it was opened
+		Let the save thread write everything that is queued
+	*/
+	m_save_thread.stop();
+	assert(m_save_queue.size() == 0);
+
+	/*
+		A backup that didn't finish stays incomplete; its blocks are
+		still in the journal for the next one
+	*/
+	if(m_backup_running)
+	{
+		errorstream<<"ServerMap: Backup to "<<m_backup_dir
+				<<" was interrupted"<<std::endl;
+		delete m_backup_database;
+	}
+
+	/*
+		Close database if it was opened
 	*/
-	if(m_database_read)
-		sqlite3_finalize(m_database_read);
-	if(m_database_write)
-		sqlite3_finalize(m_database_write);
 	if(m_database)
-		sqlite3_close(m_database);
+		flushSave(true);
+	delete m_database;
+	delete m_legacy_database;
+
+	delete m_sector_noise_cache;
 
 #if 0
 	/*
@@ -2095,6 +2607,9 @@ void ServerMap::initBlockMake(mapgen::BlockMakeData *data, v3s16 blockpos)
 	data->no_op = false;
 	data->seed = m_seed;
 	data->blockpos = blockpos;
+	data->sector_noise_cache = m_sector_noise_cache;
+
+	u32 start_us = porting::getTimeUs();
 
 	/*
 		Create the whole area of this and the neighboring blocks
@@ -2126,7 +2641,8 @@ void ServerMap::initBlockMake(mapgen::BlockMakeData *data, v3s16 blockpos)
 
 						Refer to the map generator heuristics.
 					*/
-					bool ug = mapgen::block_is_underground(data->seed, p);
+					bool ug = mapgen::block_is_underground(data->seed, p,
+							m_sector_noise_cache);
 					block->setIsUnderground(ug);
 				}
 
@@ -2158,6 +2674,9 @@ void ServerMap::initBlockMake(mapgen::BlockMakeData *data, v3s16 blockpos)
 		data->vmanip->initialEmerge(bigarea_blocks_min, bigarea_blocks_max);
 	}
 
+	data->phase_us[mapgen::MAPGEN_PHASE_INIT] +=
+			porting::getTimeUs() - start_us;
+
 	// Data is ready now.
 }
 
@@ -2183,11 +2702,14 @@ MapBlock* ServerMap::finishBlockMake(mapgen::BlockMakeData *data,
 		Blit generated stuff to map
 		NOTE: blitBackAll adds nearly everything to changed_blocks
 	*/
+	u32 phase_start_us = porting::getTimeUs();
 	{
 		// 70ms @cs=8
 		//TimeTaker timer("finishBlockMake() blitBackAll");
 		data->vmanip->blitBackAll(&changed_blocks);
 	}
+	data->phase_us[mapgen::MAPGEN_PHASE_BLIT] +=
+			porting::getTimeUs() - phase_start_us;
 
 	if(enable_mapgen_debug_info)
 		infostream<<"finishBlockMake: changed_blocks.size()="
@@ -2240,6 +2762,7 @@ MapBlock* ServerMap::finishBlockMake(mapgen::BlockMakeData *data,
 		Update lighting
 		NOTE: This takes ~60ms, TODO: Investigate why
 	*/
+	phase_start_us = porting::getTimeUs();
 	{
 		TimeTaker t("finishBlockMake lighting update");
 
@@ -2290,12 +2813,17 @@ MapBlock* ServerMap::finishBlockMake(mapgen::BlockMakeData *data,
 		for(s16 z=-1; z<=1; z++)
 		{
 			v3s16 p = block->getPos()+v3s16(x,y,z);
-			getBlockNoCreateNoEx(p)->setLightingExpired(false);
+			MapBlock *b = getBlockNoCreateNoEx(p);
+			if(b)
+				b->setLightingExpired(false);
 		}
 
 		if(enable_mapgen_debug_info == false)
 			t.stop(true); // Hide output
 	}
+	data->phase_us[mapgen::MAPGEN_PHASE_LIGHTING] +=
+			porting::getTimeUs() - phase_start_us;
+	phase_start_us = porting::getTimeUs();
 
 	/*
 		Add random objects to block
@@ -2324,6 +2852,16 @@ MapBlock* ServerMap::finishBlockMake(mapgen::BlockMakeData *data,
 		Set central block as generated
 	*/
 	block->setGenerated(true);
+
+	/*
+		Nothing but the map generator has touched it yet. This only
+		tells saveBlock() it is worth checking whether it can be stored
+		as a marker.
+	*/
+	block->setPristine(true);
+
+	data->phase_us[mapgen::MAPGEN_PHASE_FINISH] +=
+			porting::getTimeUs() - phase_start_us;
 	
 	/*
 		Save changed parts of map
@@ -2677,86 +3215,90 @@ s16 ServerMap::findGroundLevel(v2s16 p2d)
 		Determine from map generator noise functions
 	*/
 	
-	s16 level = mapgen::find_ground_level_from_noise(m_seed, p2d, 1);
+	s16 level = m_sector_noise_cache->getGroundLevel(m_seed, p2d, 1);
 	return level;
 
 	//double level = base_rock_level_2d(m_seed, p2d) + AVERAGE_MUD_AMOUNT;
 	//return (s16)level;
 }
 
-void ServerMap::createDatabase() {
-	int e;
-	assert(m_database);
-	e = sqlite3_exec(m_database,
-		"CREATE TABLE IF NOT EXISTS `blocks` ("
-			"`pos` INT NOT NULL PRIMARY KEY,"
-			"`data` BLOB"
-		");"
-	, NULL, NULL, NULL);
-	if(e == SQLITE_ABORT)
-		throw FileNotGoodException("Could not create database structure");
-	else
-		infostream<<"Server: Database structure was created";
-}
-
-void ServerMap::verifyDatabase() {
+// m_database_mutex must be locked when calling this
+void ServerMap::verifyDatabase()
+{
 	if(m_database)
 		return;
 	
+	createDirs(m_savedir);
+
+	m_database = createDatabase(m_backend_name, m_savedir,
+			m_block_key_encoding);
+
+	infostream<<"ServerMap: Using map backend \""<<m_database->getName()
+			<<"\""<<std::endl;
+
+	if(m_journal_enabled)
+		m_journal.open(m_savedir + DIR_DELIM + "map_journal");
+}
+
+// m_database_mutex must be locked when calling this
+Database * ServerMap::getLegacyDatabase()
+{
+	if(m_legacy_checked == false)
 	{
-		std::string dbp = m_savedir + DIR_DELIM + "map.sqlite";
-		bool needs_create = false;
-		int d;
-		
-		/*
-			Open the database connection
-		*/
-	
-		createDirs(m_savedir);
-	
-		if(!fs::PathExists(dbp))
-			needs_create = true;
-	
-		d = sqlite3_open_v2(dbp.c_str(), &m_database, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, NULL);
-		if(d != SQLITE_OK) {
-			infostream<<"WARNING: Database failed to open: "<<sqlite3_errmsg(m_database)<<std::endl;
-			throw FileNotGoodException("Cannot open database file");
-		}
-		
-		if(needs_create)
-			createDatabase();
-	
-		d = sqlite3_prepare(m_database, "SELECT `data` FROM `blocks` WHERE `pos`=? LIMIT 1", -1, &m_database_read, NULL);
-		if(d != SQLITE_OK) {
-			infostream<<"WARNING: Database read statment failed to prepare: "<<sqlite3_errmsg(m_database)<<std::endl;
-			throw FileNotGoodException("Cannot prepare read statement");
-		}
-		
-		d = sqlite3_prepare(m_database, "REPLACE INTO `blocks` VALUES(?, ?)", -1, &m_database_write, NULL);
-		if(d != SQLITE_OK) {
-			infostream<<"WARNING: Database write statment failed to prepare: "<<sqlite3_errmsg(m_database)<<std::endl;
-			throw FileNotGoodException("Cannot prepare write statement");
-		}
-		
-		d = sqlite3_prepare(m_database, "SELECT `pos` FROM `blocks`", -1, &m_database_list, NULL);
-		if(d != SQLITE_OK) {
-			infostream<<"WARNING: Database list statment failed to prepare: "<<sqlite3_errmsg(m_database)<<std::endl;
-			throw FileNotGoodException("Cannot prepare read statement");
-		}
-		
-		infostream<<"Server: Database opened"<<std::endl;
+		m_legacy_checked = true;
+		if(m_backend_name != "folders" && FolderDatabase::exists(m_savedir))
+			m_legacy_database = new FolderDatabase(m_savedir);
 	}
+	return m_legacy_database;
 }
 
-bool ServerMap::loadFromFolders() {
-	if(!m_database && !fs::PathExists(m_savedir + DIR_DELIM + "map.sqlite"))
+// m_database_mutex must be locked when calling this
+bool ServerMap::mayBeStored(v3s16 p)
+{
+	if(m_presence_filter_enabled == false)
 		return true;
+	if(m_presence_filter_filled == false)
+		fillPresenceFilter();
+	if(m_presence_filter.mayContain(p))
+		return true;
+	g_profiler->add("ServerMap: loads skipped by presence filter", 1);
 	return false;
 }
 
-sqlite3_int64 ServerMap::getBlockAsInteger(const v3s16 pos) {
-	return (sqlite3_int64)pos.Z*16777216 +
-		(sqlite3_int64)pos.Y*4096 + (sqlite3_int64)pos.X;
+// m_database_mutex must be locked when calling this
+void ServerMap::addStored(v3s16 p)
+{
+	if(m_journal.isOpen())
+		m_journal.add(p);
+
+	if(m_presence_filter_filled == false)
+		return;
+	m_presence_filter.add(p);
+	if(m_presence_filter.isFull())
+		fillPresenceFilter();
+}
+
+// m_database_mutex must be locked when calling this
+void ServerMap::fillPresenceFilter()
+{
+	TimeTaker timer("ServerMap: fill presence filter");
+
+	core::list<v3s16> stored;
+	verifyDatabase();
+	m_database->listAllLoadableBlocks(stored);
+	Database *legacy = getLegacyDatabase();
+	if(legacy)
+		legacy->listAllLoadableBlocks(stored);
+
+	// Leave room for the map to grow before this has to be done again
+	m_presence_filter.reset(stored.size() * 2);
+	for(core::list<v3s16>::Iterator i = stored.begin();
+			i != stored.end(); i++)
+		m_presence_filter.add(*i);
+	m_presence_filter_filled = true;
+
+	infostream<<"ServerMap: Presence filter filled with "
+			<<stored.size()<<" blocks"<<std::endl;
 }
 
 void ServerMap::createDirs(std::string path)
@@ -2771,73 +3313,12 @@ void ServerMap::createDirs(std::string path)
 
 std::string ServerMap::getSectorDir(v2s16 pos, int layout)
 {
-	char cc[9];
-	switch(layout)
-	{
-		case 1:
-			snprintf(cc, 9, "%.4x%.4x",
-				(unsigned int)pos.X&0xffff,
-				(unsigned int)pos.Y&0xffff);
-
-			return m_savedir + DIR_DELIM + "sectors" + DIR_DELIM + cc;
-		case 2:
-			snprintf(cc, 9, "%.3x" DIR_DELIM "%.3x",
-				(unsigned int)pos.X&0xfff,
-				(unsigned int)pos.Y&0xfff);
-
-			return m_savedir + DIR_DELIM + "sectors2" + DIR_DELIM + cc;
-		default:
-			assert(false);
-	}
+	return FolderDatabase::getSectorDir(m_savedir, pos, layout);
 }
 
 v2s16 ServerMap::getSectorPos(std::string dirname)
 {
-	unsigned int x, y;
-	int r;
-	size_t spos = dirname.rfind(DIR_DELIM_C) + 1;
-	assert(spos != std::string::npos);
-	if(dirname.size() - spos == 8)
-	{
-		// Old layout
-		r = sscanf(dirname.substr(spos).c_str(), "%4x%4x", &x, &y);
-	}
-	else if(dirname.size() - spos == 3)
-	{
-		// New layout
-		r = sscanf(dirname.substr(spos-4).c_str(), "%3x" DIR_DELIM "%3x", &x, &y);
-		// Sign-extend the 12 bit values up to 16 bits...
-		if(x&0x800) x|=0xF000;
-		if(y&0x800) y|=0xF000;
-	}
-	else
-	{
-		assert(false);
-	}
-	assert(r == 2);
-	v2s16 pos((s16)x, (s16)y);
-	return pos;
-}
-
-v3s16 ServerMap::getBlockPos(std::string sectordir, std::string blockfile)
-{
-	v2s16 p2d = getSectorPos(sectordir);
-
-	if(blockfile.size() != 4){
-		throw InvalidFilenameException("Invalid block filename");
-	}
-	unsigned int y;
-	int r = sscanf(blockfile.c_str(), "%4x", &y);
-	if(r != 1)
-		throw InvalidFilenameException("Invalid block filename");
-	return v3s16(p2d.X, y, p2d.Y);
-}
-
-std::string ServerMap::getBlockFilename(v3s16 p)
-{
-	char cc[5];
-	snprintf(cc, 5, "%.4x", (unsigned int)p.Y&0xffff);
-	return cc;
+	return FolderDatabase::getSectorPos(dirname);
 }
 
 void ServerMap::save(bool only_changed)
@@ -2860,46 +3341,73 @@ void ServerMap::save(bool only_changed)
 
 	u32 sector_meta_count = 0;
 	u32 block_count = 0;
-	u32 block_count_all = 0; // Number of blocks in memory
+	u32 block_count_all = 0; // Number of blocks looked at
 	
 	beginSave();
-	core::map<v2s16, MapSector*>::Iterator i = m_sectors.getIterator();
-	for(; i.atEnd() == false; i++)
+	if(only_changed)
 	{
-		ServerMapSector *sector = (ServerMapSector*)i.getNode()->getValue();
-		assert(sector->getId() == MAPSECTOR_SERVER);
-	
-		if(sector->differs_from_disk || only_changed == false)
-		{
-			saveSectorMeta(sector);
-			sector_meta_count++;
-		}
-		core::list<MapBlock*> blocks;
-		sector->getBlocks(blocks);
-		core::list<MapBlock*>::Iterator j;
-		
-		//sqlite3_exec(m_database, "BEGIN;", NULL, NULL, NULL);
-		for(j=blocks.begin(); j!=blocks.end(); j++)
+		/*
+			Only the dirty blocks can need saving. Sector metadata
+			isn't changed after the sector has been created.
+		*/
+		core::list<v3s16> dirty;
+		for(core::map<v3s16, bool>::Iterator i = m_dirty_blocks.getIterator();
+				i.atEnd() == false; i++)
+			dirty.push_back(i.getNode()->getKey());
+
+		for(core::list<v3s16>::Iterator i = dirty.begin();
+				i != dirty.end(); i++)
 		{
-			MapBlock *block = *j;
+			MapBlock *block = getBlockNoCreateNoEx(*i);
 			
 			block_count_all++;
 
-			if(block->getModified() >= MOD_STATE_WRITE_NEEDED 
-					|| only_changed == false)
+			if(block && block->getModified() >= MOD_STATE_WRITE_NEEDED)
 			{
 				saveBlock(block);
 				block_count++;
+			}
 
-				/*infostream<<"ServerMap: Written block ("
-						<<block->getPos().X<<","
-						<<block->getPos().Y<<","
-						<<block->getPos().Z<<")"
-						<<std::endl;*/
+			// Blocks left at MOD_STATE_WRITE_AT_UNLOAD stay in the set
+			if(block == NULL || block->isDummy()
+					|| block->getModified() == MOD_STATE_CLEAN)
+			{
+				m_dirty_blocks.remove(*i);
+				if(block)
+					block->removedFromDirtySet();
 			}
-		//sqlite3_exec(m_database, "COMMIT;", NULL, NULL, NULL);
 		}
 	}
+	else
+	{
+		core::map<v2s16, MapSector*>::Iterator i = m_sectors.getIterator();
+		for(; i.atEnd() == false; i++)
+		{
+			ServerMapSector *sector = (ServerMapSector*)i.getNode()->getValue();
+			assert(sector->getId() == MAPSECTOR_SERVER);
+		
+			saveSectorMeta(sector);
+			sector_meta_count++;
+
+			core::list<MapBlock*> blocks;
+			sector->getBlocks(blocks);
+			core::list<MapBlock*>::Iterator j;
+			
+			for(j=blocks.begin(); j!=blocks.end(); j++)
+			{
+				MapBlock *block = *j;
+				
+				block_count_all++;
+
+				saveBlock(block);
+				block_count++;
+
+				// Everything is clean now, except dummies that aren't saved
+				block->removedFromDirtySet();
+			}
+		}
+		m_dirty_blocks.clear();
+	}
 	endSave();
 
 	/*
@@ -2911,58 +3419,47 @@ void ServerMap::save(bool only_changed)
 		infostream<<"ServerMap: Written: "
 				<<sector_meta_count<<" sector metadata files, "
 				<<block_count<<" block files"
-				<<", "<<block_count_all<<" blocks in memory."
+				<<", "<<block_count_all<<" blocks looked at."
 				<<std::endl;
 	}
 }
 
-static s32 unsignedToSigned(s32 i, s32 max_positive)
-{
-	if(i < max_positive)
-		return i;
-	else
-		return i - 2*max_positive;
-}
-
-// modulo of a negative number does not work consistently in C
-static sqlite3_int64 pythonmodulo(sqlite3_int64 i, sqlite3_int64 mod)
+void ServerMap::listAllLoadableBlocks(core::list<v3s16> &dst)
 {
-	if(i >= 0)
-		return i % mod;
-	return mod - ((-i) % mod);
-}
+	core::list<v3s16> found;
+	{
+		JMutexAutoLock lock(m_database_mutex);
 
-v3s16 ServerMap::getIntegerAsBlock(sqlite3_int64 i)
-{
-	s32 x = unsignedToSigned(pythonmodulo(i, 4096), 2048);
-	i = (i - x) / 4096;
-	s32 y = unsignedToSigned(pythonmodulo(i, 4096), 2048);
-	i = (i - y) / 4096;
-	s32 z = unsignedToSigned(pythonmodulo(i, 4096), 2048);
-	return v3s16(x,y,z);
-}
+		verifyDatabase();
+		m_database->listAllLoadableBlocks(found);
 
-void ServerMap::listAllLoadableBlocks(core::list<v3s16> &dst)
-{
-	if(loadFromFolders()){
-		errorstream<<"Map::listAllLoadableBlocks(): Result will be missing "
-				<<"all blocks that are stored in flat files"<<std::endl;
+		Database *legacy = getLegacyDatabase();
+		if(legacy)
+			legacy->listAllLoadableBlocks(found);
 	}
-	
+
+	// Add blocks that have not reached the database yet
+	m_save_queue.listPending(found);
+
+	// A block can be in more than one of the above
+	core::map<v3s16, bool> listed;
+	for(core::list<v3s16>::Iterator i = found.begin();
+			i != found.end(); i++)
 	{
-		verifyDatabase();
-		
-		while(sqlite3_step(m_database_list) == SQLITE_ROW)
-		{
-			sqlite3_int64 block_i = sqlite3_column_int64(m_database_list, 0);
-			v3s16 p = getIntegerAsBlock(block_i);
-			//dstream<<"block_i="<<block_i<<" p="<<PP(p)<<std::endl;
-			dst.push_back(p);
-		}
+		if(listed.find(*i) != NULL)
+			continue;
+		listed.insert(*i, true);
+		dst.push_back(*i);
 	}
 }
 
 void ServerMap::saveMapMeta()
+{
+	saveMapMeta(m_savedir, m_backend_name);
+}
+
+void ServerMap::saveMapMeta(const std::string &savedir,
+		const std::string &backend_name)
 {
 	DSTACK(__FUNCTION_NAME);
 	
@@ -2970,9 +3467,9 @@ void ServerMap::saveMapMeta()
 			<<"seed="<<m_seed
 			<<std::endl;
 
-	createDirs(m_savedir);
+	createDirs(savedir);
 	
-	std::string fullpath = m_savedir + DIR_DELIM + "map_meta.txt";
+	std::string fullpath = savedir + DIR_DELIM + "map_meta.txt";
 	std::ofstream os(fullpath.c_str(), std::ios_base::binary);
 	if(os.good() == false)
 	{
@@ -2983,22 +3480,21 @@ void ServerMap::saveMapMeta()
 	
 	Settings params;
 	params.setU64("seed", m_seed);
+	params.set("backend", backend_name);
+	params.set("block_keys", getBlockKeyEncodingName(m_block_key_encoding));
 
 	params.writeLines(os);
 
 	os<<"[end_of_params]\n";
 	
-	m_map_metadata_changed = false;
+	if(savedir == m_savedir)
+		m_map_metadata_changed = false;
 }
 
-void ServerMap::loadMapMeta()
+// Reads map_meta.txt of the map in savedir
+static void readMapMeta(const std::string &savedir, Settings &params)
 {
-	DSTACK(__FUNCTION_NAME);
-	
-	infostream<<"ServerMap::loadMapMeta(): Loading map metadata"
-			<<std::endl;
-
-	std::string fullpath = m_savedir + DIR_DELIM + "map_meta.txt";
+	std::string fullpath = savedir + DIR_DELIM + "map_meta.txt";
 	std::ifstream is(fullpath.c_str(), std::ios_base::binary);
 	if(is.good() == false)
 	{
@@ -3007,8 +3503,6 @@ void ServerMap::loadMapMeta()
 		throw FileNotGoodException("Cannot open map metadata");
 	}
 
-	Settings params;
-
 	for(;;)
 	{
 		if(is.eof())
@@ -3021,10 +3515,34 @@ void ServerMap::loadMapMeta()
 			break;
 		params.parseConfigLine(line);
 	}
+}
+
+void ServerMap::loadMapMeta()
+{
+	DSTACK(__FUNCTION_NAME);
+	
+	infostream<<"ServerMap::loadMapMeta(): Loading map metadata"
+			<<std::endl;
+
+	Settings params;
+	readMapMeta(m_savedir, params);
 
 	m_seed = params.getU64("seed");
+	// Maps from before backends were selectable are sqlite3 maps
+	if(params.exists("backend"))
+		m_backend_name = lowercase(trim(params.get("backend")));
+	else
+		m_backend_name = "sqlite3";
+	if(params.exists("block_keys"))
+		m_block_key_encoding = parseBlockKeyEncoding(
+				lowercase(trim(params.get("block_keys"))));
+	else
+		m_block_key_encoding = BLOCKKEY_LINEAR;
 
-	infostream<<"ServerMap::loadMapMeta(): "<<"seed="<<m_seed<<std::endl;
+	infostream<<"ServerMap::loadMapMeta(): "<<"seed="<<m_seed
+			<<" backend="<<m_backend_name
+			<<" block_keys="<<getBlockKeyEncodingName(m_block_key_encoding)
+			<<std::endl;
 }
 
 void ServerMap::saveSectorMeta(ServerMapSector *sector)
@@ -3192,30 +3710,814 @@ bool ServerMap::loadSectorFull(v2s16 p2d)
 		}
 	}
 
-	if(loadlayout != 2)
+	if(loadlayout != 2)
+	{
+		infostream<<"Sector converted to new layout - deleting "<<
+			sectordir1<<std::endl;
+		fs::RecursiveDelete(sectordir1);
+	}
+
+	return true;
+}
+#endif
+
+/*
+	With the save thread, the backend is only written by the thread,
+	so these only matter when writing directly.
+*/
+
+void ServerMap::beginSave() {
+	if(m_save_thread_enabled)
+		return;
+	JMutexAutoLock lock(m_database_mutex);
+	verifyDatabase();
+	m_database->beginSave();
+}
+
+void ServerMap::endSave() {
+	if(m_save_thread_enabled)
+		return;
+	JMutexAutoLock lock(m_database_mutex);
+	verifyDatabase();
+	m_database->endSave();
+	m_journal.flush();
+}
+
+void ServerMap::flushSave(bool force)
+{
+	JMutexAutoLock lock(m_database_mutex);
+	if(m_database)
+		m_database->flush(force);
+	m_journal.flush();
+}
+
+void ServerMap::convertBlockKeys(BlockKeyEncoding to)
+{
+	// Everything has to be in the database first
+	while(writePendingBlocks() != 0)
+		;
+	{
+		JMutexAutoLock lock(m_database_mutex);
+		verifyDatabase();
+		m_database->convertKeys(to);
+		m_block_key_encoding = to;
+	}
+	saveMapMeta();
+}
+
+// Saves the blocks of batch in db and deletes batch
+static void saveBatch(Database *db, BlockBatch *batch)
+{
+	db->beginSave();
+	for(core::map<v3s16, std::string>::Iterator
+			i = batch->blocks.getIterator();
+			i.atEnd() == false; i++)
+		db->saveBlock(i.getNode()->getKey(), i.getNode()->getValue());
+	db->endSave();
+	delete batch;
+}
+
+void ServerMap::migrate(const std::string &dst_savedir,
+		const std::string &dst_backend, u32 thread_count,
+		bool rewrite, bool compact)
+{
+	if(fs::PathExists(dst_savedir + DIR_DELIM + "map_meta.txt"))
+	{
+		errorstream<<"There already is a map in "<<dst_savedir<<std::endl;
+		throw BaseException("Migration destination is not empty");
+	}
+
+	// Everything has to be in the database first
+	while(writePendingBlocks() != 0)
+		;
+
+	createDirs(dst_savedir);
+	Database *dst = createDatabase(dst_backend, dst_savedir,
+			m_block_key_encoding);
+
+	/*
+		Blocks of m_database, then those of the legacy database that
+		haven't been moved to m_database yet
+	*/
+	core::list<v3s16> positions;
+	core::list<v3s16> legacy_positions;
+	Database *legacy = NULL;
+	{
+		JMutexAutoLock lock(m_database_mutex);
+		verifyDatabase();
+		m_database->listAllLoadableBlocks(positions);
+		legacy = getLegacyDatabase();
+		if(legacy)
+		{
+			core::map<v3s16, bool> in_database;
+			for(core::list<v3s16>::Iterator i = positions.begin();
+					i != positions.end(); i++)
+				in_database.insert(*i, true);
+			core::list<v3s16> all;
+			legacy->listAllLoadableBlocks(all);
+			for(core::list<v3s16>::Iterator i = all.begin();
+					i != all.end(); i++)
+			{
+				if(in_database.find(*i) == NULL)
+					legacy_positions.push_back(*i);
+			}
+		}
+	}
+	u32 total = positions.size() + legacy_positions.size();
+	actionstream<<"Migrating "<<total<<" blocks from "<<m_backend_name
+			<<" in "<<m_savedir<<" to "<<dst_backend<<" in "<<dst_savedir
+			<<std::endl;
+
+	// Blocks read from the source in one go
+	const u32 batch_size = 256;
+	// Batches waiting for or in the rewrite threads
+	const u32 max_in_flight = thread_count * 4;
+
+	BlockRewritePool *pool = NULL;
+	if(rewrite)
+		pool = new BlockRewritePool(thread_count, m_compression_codec,
+				m_compression_level);
+
+	u32 written = 0;
+	u32 failed = 0;
+	u32 start_ms = porting::getTimeMs();
+	u32 last_report_ms = start_ms;
+
+	for(u32 source=0; source<2; source++)
+	{
+		core::list<v3s16> &list = source == 0 ? positions : legacy_positions;
+		core::list<v3s16>::Iterator next = list.begin();
+		for(;;)
+		{
+			/*
+				Write finished batches. When the threads have enough
+				to do, wait for them instead of reading more.
+			*/
+			bool reading_done = (next == list.end());
+			while(pool && pool->inFlight() != 0)
+			{
+				bool wait = reading_done || pool->inFlight() >= max_in_flight;
+				BlockBatch *batch = pool->pop(wait ? 100 : 0);
+				if(batch == NULL)
+				{
+					if(wait)
+						continue;
+					break;
+				}
+				written += batch->blocks.size();
+				failed += batch->failed;
+				saveBatch(dst, batch);
+			}
+			if(reading_done)
+				break;
+
+			core::list<v3s16> wanted;
+			for(; next != list.end() && wanted.size() < batch_size; next++)
+				wanted.push_back(*next);
+
+			BlockBatch *batch = new BlockBatch;
+			{
+				JMutexAutoLock lock(m_database_mutex);
+				if(source == 0)
+					m_database->loadBlocks(wanted, batch->blocks);
+				else
+					legacy->loadBlocks(wanted, batch->blocks);
+			}
+
+			if(pool)
+			{
+				pool->push(batch);
+			}
+			else
+			{
+				written += batch->blocks.size();
+				saveBatch(dst, batch);
+			}
+
+			u32 now = porting::getTimeMs();
+			if(now - last_report_ms >= 5000)
+			{
+				actionstream<<"Migrated "<<written<<"/"<<total<<" blocks"
+						<<std::endl;
+				last_report_ms = now;
+			}
+		}
+	}
+
+	delete pool;
+
+	dst->flush(true);
+	if(compact)
+		dst->compact();
+	delete dst;
+
+	saveMapMeta(dst_savedir, dst_backend);
+
+	actionstream<<"Migrated "<<written<<" blocks in "
+			<<(porting::getTimeMs() - start_ms) / 1000<<"s";
+	if(failed != 0)
+		actionstream<<", "<<failed<<" of them could not be read and were"
+				<<" copied as they were";
+	actionstream<<std::endl;
+}
+
+void ServerMap::benchmarkCompression(u32 max_blocks)
+{
+	core::list<v3s16> positions;
+	listAllLoadableBlocks(positions);
+
+	core::array<MapBlock*> blocks;
+	for(core::list<v3s16>::Iterator i = positions.begin();
+			i != positions.end() && blocks.size() < max_blocks; i++)
+	{
+		MapBlock *block = loadBlock(*i);
+		if(block != NULL && block->isDummy() == false)
+			blocks.push_back(block);
+	}
+	if(blocks.size() == 0)
+	{
+		errorstream<<"No blocks to benchmark in "<<m_savedir<<std::endl;
+		return;
+	}
+	actionstream<<"Benchmarking compression of "<<blocks.size()
+			<<" blocks (serialization version "<<(int)SER_FMT_VER_HIGHEST
+			<<")"<<std::endl;
+
+	struct Setup
+	{
+		u8 codec;
+		s32 level;
+	};
+	const Setup setups[] = {
+		{CODEC_NONE, 0},
+		{CODEC_LZ4, 8},
+		{CODEC_LZ4, 1},
+		{CODEC_ZLIB, 1},
+		{CODEC_ZLIB, -1},
+		{CODEC_ZLIB, 9},
+	};
+	const u32 setup_count = sizeof(setups) / sizeof(setups[0]);
+	// Repeat each measurement until this much time has passed
+	const u32 min_time_ms = 500;
+
+	u32 raw_bytes = 0;
+	for(u32 si=0; si<setup_count; si++)
+	{
+		const Setup &setup = setups[si];
+
+		std::vector<std::string> serialized(blocks.size());
+		u32 bytes = 0;
+		u32 rounds = 0;
+		u32 t0 = porting::getTimeMs();
+		u32 compress_ms = 0;
+		do{
+			bytes = 0;
+			for(u32 i=0; i<blocks.size(); i++)
+			{
+				std::ostringstream os(std::ios_base::binary);
+				blocks[i]->serialize(os, SER_FMT_VER_HIGHEST,
+						setup.codec, setup.level);
+				serialized[i] = os.str();
+				bytes += serialized[i].size();
+			}
+			rounds++;
+			compress_ms = porting::getTimeMs() - t0;
+		}while(compress_ms < min_time_ms);
+		if(setup.codec == CODEC_NONE)
+			raw_bytes = bytes;
+
+		MapBlock tmp(this, v3s16(0,0,0));
+		u32 decompress_rounds = 0;
+		t0 = porting::getTimeMs();
+		u32 decompress_ms = 0;
+		do{
+			for(u32 i=0; i<blocks.size(); i++)
+			{
+				std::istringstream is(serialized[i], std::ios_base::binary);
+				tmp.deSerialize(is, SER_FMT_VER_HIGHEST);
+			}
+			decompress_rounds++;
+			decompress_ms = porting::getTimeMs() - t0;
+		}while(decompress_ms < min_time_ms);
+
+		actionstream<<getCompressionCodecName(setup.codec)
+				<<" level "<<setup.level<<": "
+				<<bytes<<" bytes ("
+				<<(raw_bytes ? 100.0 * bytes / raw_bytes : 100.0)<<"%), "
+				<<"write "<<(compress_ms * 1000.0 / rounds / blocks.size())
+				<<"us/block, "
+				<<"read "<<(decompress_ms * 1000.0 / decompress_rounds
+						/ blocks.size())
+				<<"us/block"<<std::endl;
+	}
+}
+
+void ServerMap::benchmarkMapgen(s16 radius)
+{
+	core::array<v3s16> positions;
+	for(s16 x=-radius; x<=radius; x++)
+	for(s16 z=-radius; z<=radius; z++)
+	for(s16 y=2; y>=-2; y--)
+		positions.push_back(v3s16(x,y,z));
+
+	actionstream<<"Benchmarking the map generator on "<<positions.size()
+			<<" blocks with seed "<<m_seed<<std::endl;
+
+	u32 phase_us[mapgen::MAPGEN_PHASE_COUNT];
+	for(u32 i=0; i<mapgen::MAPGEN_PHASE_COUNT; i++)
+		phase_us[i] = 0;
+	u32 start_us = porting::getTimeUs();
+	for(u32 i=0; i<positions.size(); i++)
+	{
+		mapgen::BlockMakeData data;
+		initBlockMake(&data, positions[i]);
+		mapgen::make_block(&data);
+		core::map<v3s16, MapBlock*> modified_blocks;
+		finishBlockMake(&data, modified_blocks);
+		for(u32 j=0; j<mapgen::MAPGEN_PHASE_COUNT; j++)
+			phase_us[j] += data.phase_us[j];
+	}
+	u32 total_us = porting::getTimeUs() - start_us;
+
+	/*
+		FNV-1a of the nodes of the blocks in the order they were made.
+		Changes that leave the generated world as it was keep it the same.
+	*/
+	u64 hash = 14695981039346656037ULL;
+	for(u32 i=0; i<positions.size(); i++)
+	{
+		MapBlock *block = getBlockNoCreateNoEx(positions[i]);
+		if(block == NULL)
+			continue;
+		for(s16 z=0; z<MAP_BLOCKSIZE; z++)
+		for(s16 y=0; y<MAP_BLOCKSIZE; y++)
+		for(s16 x=0; x<MAP_BLOCKSIZE; x++)
+		{
+			MapNode n = block->getNodeNoEx(v3s16(x,y,z));
+			u8 bytes[3] = {n.param0, n.param1, n.param2};
+			for(u32 j=0; j<3; j++)
+			{
+				hash ^= bytes[j];
+				hash *= 1099511628211ULL;
+			}
+		}
+	}
+
+	actionstream<<"Generated "<<positions.size()<<" blocks in "
+			<<(total_us / 1000)<<"ms, "
+			<<(positions.size() * 1000000.0 / total_us)<<" blocks/s"
+			<<std::endl;
+	u32 phases_us = 0;
+	for(u32 i=0; i<mapgen::MAPGEN_PHASE_COUNT; i++)
+	{
+		actionstream<<"  "<<mapgen::get_phase_name(i)<<": "
+				<<(phase_us[i] / 1000)<<"ms ("
+				<<(100.0 * phase_us[i] / total_us)<<"%)"<<std::endl;
+		phases_us += phase_us[i];
+	}
+	actionstream<<"  other: "<<((total_us - phases_us) / 1000)<<"ms ("
+			<<(100.0 * (total_us - phases_us) / total_us)<<"%)"
+			<<std::endl;
+	char hash_hex[17];
+	snprintf(hash_hex, 17, "%016llx", (unsigned long long)hash);
+	actionstream<<"Node hash: "<<hash_hex<<std::endl;
+}
+
+/*
+	Returns true if backup_path has no complete full backup or if
+	full_every incremental ones have been made after the last one.
+	The names sort in the order the backups were made in.
+*/
+static bool backupNeedsFull(const std::string &path, u32 full_every)
+{
+	std::vector<fs::DirListNode> list = fs::GetDirListing(path);
+	std::string last_full;
+	for(u32 i=0; i<list.size(); i++)
+	{
+		const std::string &name = list[i].name;
+		if(list[i].dir == false || name.size() < 5
+				|| name.substr(name.size() - 5) != "-full")
+			continue;
+		if(fs::PathExists(path + DIR_DELIM + name + DIR_DELIM
+				+ "map_meta.txt") == false)
+			continue;
+		if(name > last_full)
+			last_full = name;
+	}
+	if(last_full == "")
+		return true;
+	if(full_every == 0)
+		return false;
+
+	u32 incremental = 0;
+	for(u32 i=0; i<list.size(); i++)
+	{
+		const std::string &name = list[i].name;
+		if(list[i].dir && name > last_full && name.size() >= 5
+				&& name.substr(name.size() - 5) == "-incr")
+			incremental++;
+	}
+	return incremental >= full_every;
+}
+
+std::string ServerMap::startBackup(bool full)
+{
+	JMutexAutoLock lock(m_database_mutex);
+
+	if(m_backup_running)
+		return "";
+
+	verifyDatabase();
+
+	std::string path = g_settings->get("backup_path");
+	if(path == "")
+		path = m_savedir + DIR_DELIM + "backups";
+
+	// Without a journal there is no way to know what has changed
+	if(m_journal.isOpen() == false || backupNeedsFull(path,
+			g_settings->getU16("backup_full_every")))
+		full = true;
+
+	char timestr[20];
+	time_t t = time(NULL);
+	strftime(timestr, sizeof(timestr), "%Y%m%d-%H%M%S", localtime(&t));
+	std::string dir = path + DIR_DELIM + "map-" + timestr
+			+ (full ? "-full" : "-incr");
+	if(fs::PathExists(dir))
+		return "";
+	createDirs(dir);
+
+	/*
+		Blocks written from now on go into the next backup. Those
+		written during a full backup are in both.
+	*/
+	core::map<v3s16, bool> changed;
+	if(m_journal.isOpen())
+		m_journal.rotate(changed);
+
+	m_backup_todo.clear();
+	m_backup_native = false;
+	if(full)
+	{
+		m_backup_native = m_database->startBackup(dir);
+		if(m_backup_native == false)
+			m_database->listAllLoadableBlocks(m_backup_todo);
+	}
+	else
+	{
+		for(core::map<v3s16, bool>::Iterator i = changed.getIterator();
+				i.atEnd() == false; i++)
+			m_backup_todo.push_back(i.getNode()->getKey());
+	}
+	if(m_backup_native == false)
+		m_backup_database = createDatabase("sqlite3", dir,
+				m_block_key_encoding);
+
+	m_backup_running = true;
+	m_backup_dir = dir;
+	m_backup_copied = 0;
+	m_backup_start_ms = porting::getTimeMs();
+
+	actionstream<<"Backing up "
+			<<(full ? "the map" : itos(changed.size()) + " changed blocks")
+			<<" to "<<dir<<std::endl;
+
+	m_save_thread.trigger();
+
+	return dir;
+}
+
+bool ServerMap::isBackupRunning()
+{
+	JMutexAutoLock lock(m_database_mutex);
+	return m_backup_running;
+}
+
+bool ServerMap::backupStep()
+{
+	JMutexAutoLock lock(m_database_mutex);
+
+	if(m_backup_running == false)
+		return false;
+
+	ScopeProfiler sp(g_profiler, "ServerMap: backup step avg", SPT_AVG);
+
+	if(m_backup_native)
+	{
+		bool failed = false;
+		if(m_database->backupStep(m_backup_step, failed))
+			return true;
+		finishBackup(failed);
+		return false;
+	}
+
+	if(m_backup_todo.size() == 0)
+	{
+		finishBackup(false);
+		return false;
+	}
+
+	core::list<v3s16> wanted;
+	while(m_backup_todo.size() != 0 && wanted.size() < m_backup_step)
+	{
+		core::list<v3s16>::Iterator i = m_backup_todo.begin();
+		wanted.push_back(*i);
+		m_backup_todo.erase(i);
+	}
+
+	// Blocks that have been deleted since are left out
+	core::map<v3s16, std::string> blocks;
+	m_database->loadBlocks(wanted, blocks);
+
+	m_backup_database->beginSave();
+	for(core::map<v3s16, std::string>::Iterator i = blocks.getIterator();
+			i.atEnd() == false; i++)
+		m_backup_database->saveBlock(i.getNode()->getKey(),
+				i.getNode()->getValue());
+	m_backup_database->endSave();
+	m_backup_copied += blocks.size();
+
+	return true;
+}
+
+// m_database_mutex must be locked when calling this
+void ServerMap::finishBackup(bool failed)
+{
+	assert(m_backup_running);
+
+	if(m_backup_database)
+	{
+		m_backup_database->flush(true);
+		delete m_backup_database;
+		m_backup_database = NULL;
+	}
+	m_backup_todo.clear();
+	m_backup_running = false;
+
+	if(failed)
+	{
+		errorstream<<"ServerMap: Backup to "<<m_backup_dir
+				<<" failed"<<std::endl;
+		return;
+	}
+
+	saveMapMeta(m_backup_dir, "sqlite3");
+	m_journal.rotationDone();
+
+	actionstream<<"Backup to "<<m_backup_dir<<" done";
+	if(m_backup_native == false)
+		actionstream<<", "<<m_backup_copied<<" blocks";
+	actionstream<<" in "<<(porting::getTimeMs() - m_backup_start_ms)<<"ms"
+			<<std::endl;
+}
+
+void ServerMap::importBlocks(const std::string &src_savedir)
+{
+	// Everything has to be in the database first
+	while(writePendingBlocks() != 0)
+		;
+
+	/*
+		Only the database of the source is opened; a ServerMap would
+		write its journal and metadata into it
+	*/
+	Settings params;
+	readMapMeta(src_savedir, params);
+	std::string backend = "sqlite3";
+	if(params.exists("backend"))
+		backend = lowercase(trim(params.get("backend")));
+	BlockKeyEncoding key_encoding = BLOCKKEY_LINEAR;
+	if(params.exists("block_keys"))
+		key_encoding = parseBlockKeyEncoding(
+				lowercase(trim(params.get("block_keys"))));
+	Database *src;
+	if(backend == "sqlite3")
+		src = new SQLiteDatabase(src_savedir, key_encoding, true);
+	else
+		src = createDatabase(backend, src_savedir, key_encoding);
+
+	core::list<v3s16> positions;
+	src->listAllLoadableBlocks(positions);
+
+	u32 count = 0;
+	core::list<v3s16>::Iterator i = positions.begin();
+	while(i != positions.end())
+	{
+		core::list<v3s16> wanted;
+		for(; i != positions.end() && wanted.size() < 256; i++)
+			wanted.push_back(*i);
+
+		core::map<v3s16, std::string> blocks;
+		src->loadBlocks(wanted, blocks);
+
+		JMutexAutoLock lock(m_database_mutex);
+		verifyDatabase();
+		m_database->beginSave();
+		for(core::map<v3s16, std::string>::Iterator
+				j = blocks.getIterator(); j.atEnd() == false; j++)
+		{
+			m_database->saveBlock(j.getNode()->getKey(),
+					j.getNode()->getValue());
+			addStored(j.getNode()->getKey());
+		}
+		m_database->endSave();
+		count += blocks.size();
+	}
+
+	{
+		JMutexAutoLock lock(m_database_mutex);
+		verifyDatabase();
+		m_database->flush(true);
+		m_journal.flush();
+	}
+
+	delete src;
+
+	actionstream<<"Imported "<<count<<" blocks from "<<src_savedir
+			<<std::endl;
+}
+
+u32 ServerMap::writePendingBlocks()
+{
+	core::list<PendingBlockSave> batch;
+	m_save_queue.getBatch(m_save_batch_max_blocks, batch);
+	if(batch.size() == 0)
+	{
+		flushSave(false);
+		return 0;
+	}
+
+	/*
+		Making the markers generates the blocks again, so do it before
+		locking the database
+	*/
+	for(core::list<PendingBlockSave>::Iterator i = batch.begin();
+			i != batch.end(); i++)
+	{
+		if(i->pristine)
+			makeMarker(i->p, i->data);
+	}
+
+	{
+		JMutexAutoLock lock(m_database_mutex);
+		ScopeProfiler sp(g_profiler, "ServerMap: write queued blocks avg",
+				SPT_AVG);
+		verifyDatabase();
+		m_database->beginSave();
+		for(core::list<PendingBlockSave>::Iterator i = batch.begin();
+				i != batch.end(); i++)
+		{
+			m_database->saveBlock(i->p, i->data);
+			addStored(i->p);
+		}
+		m_database->endSave();
+		m_database->flush(true);
+		m_journal.flush();
+
+		// The blocks are committed, so the old files can go
+		for(core::list<PendingBlockSave>::Iterator i = batch.begin();
+				i != batch.end(); i++)
+		{
+			if(i->delete_legacy && m_legacy_database)
+				m_legacy_database->deleteBlock(i->p);
+		}
+	}
+
+	// Only now it is safe to read them from the database
+	m_save_queue.written(batch);
+
+	return batch.size();
+}
+
+/*
+	Generated blocks that have been left as the map generator made them
+	can be stored as markers, which only have what
+	mapgen::make_block_alone() doesn't make again from the seed:
+		[0] u8 SER_FMT_VER_GENERATED
+		[1] u16 mapgen::MAPGEN_VERSION
+		[3] u8 flags: 0x01 is_underground, 0x02 lighting_expired
+		[4] u8 codec, light (param1) of the nodes compressed with it
+		[..] MapBlock::serializeDiskExtra() in SER_FMT_VER_HIGHEST
+*/
+
+/*
+	Replaces the stored block data (as written by ServerMap::saveBlock())
+	with a marker if the block is just what make_block_alone() makes.
+	Returns false and leaves data as it is otherwise.
+*/
+static bool makeGeneratedMarker(u64 seed, v3s16 p, std::string &data,
+		mapgen::SectorNoiseCache *cache)
+{
+	if(data.size() == 0 || (u8)data[0] == SER_FMT_VER_GENERATED)
+		return false;
+
+	MapBlock block(NULL, p);
+	try{
+		std::istringstream is(data, std::ios_base::binary);
+		u8 version = SER_FMT_VER_INVALID;
+		is.read((char*)&version, 1);
+		block.deSerialize(is, version);
+		block.deSerializeDiskExtra(is, version);
+	}
+	catch(SerializationError &e)
 	{
-		infostream<<"Sector converted to new layout - deleting "<<
-			sectordir1<<std::endl;
-		fs::RecursiveDelete(sectordir1);
+		return false;
 	}
 
+	// Nothing but the nodes is made again
+	if(block.getOwner() != 0 || block.m_node_metadata.size() != 0
+			|| block.m_static_objects.m_stored.size() != 0
+			|| block.m_static_objects.m_active.size() != 0)
+		return false;
+
+	MapBlock made(NULL, p);
+	mapgen::make_block_alone(seed, p, &made, cache);
+
+	std::string light;
+	light.reserve(MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE);
+	for(s16 z=0; z<MAP_BLOCKSIZE; z++)
+	for(s16 y=0; y<MAP_BLOCKSIZE; y++)
+	for(s16 x=0; x<MAP_BLOCKSIZE; x++)
+	{
+		MapNode n = block.getNodeNoEx(v3s16(x,y,z));
+		MapNode n2 = made.getNodeNoEx(v3s16(x,y,z));
+		if(n.param0 != n2.param0 || n.param2 != n2.param2)
+			return false;
+		light += (char)n.param1;
+	}
+
+	std::ostringstream os(std::ios_base::binary);
+	writeU8(os, SER_FMT_VER_GENERATED);
+	writeU16(os, mapgen::MAPGEN_VERSION);
+	u8 flags = 0;
+	if(block.getIsUnderground())
+		flags |= 0x01;
+	if(block.getLightingExpired())
+		flags |= 0x02;
+	writeU8(os, flags);
+	compressWithCodec(light, os, CODEC_ZLIB, -1);
+	block.serializeDiskExtra(os, SER_FMT_VER_HIGHEST);
+
+	data = os.str();
 	return true;
 }
-#endif
 
-void ServerMap::beginSave() {
-	verifyDatabase();
-	if(sqlite3_exec(m_database, "BEGIN;", NULL, NULL, NULL) != SQLITE_OK)
-		infostream<<"WARNING: beginSave() failed, saving might be slow.";
+/*
+	Reads a marker made by makeGeneratedMarker() after its first byte
+	into block. Returns false if the marker was made by another version
+	of the map generator.
+*/
+static bool loadGeneratedMarker(std::istream &is, u64 seed, MapBlock *block,
+		mapgen::SectorNoiseCache *cache)
+{
+	if(readU16(is) != mapgen::MAPGEN_VERSION)
+		return false;
+	u8 flags = readU8(is);
+	std::ostringstream light_os(std::ios_base::binary);
+	decompressWithCodec(is, light_os);
+	std::string light = light_os.str();
+	if(light.size() != MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE)
+		throw SerializationError("loadGeneratedMarker: Invalid light data");
+
+	if(block->isDummy())
+		block->unDummify();
+	mapgen::make_block_alone(seed, block->getPos(), block, cache);
+
+	u32 i = 0;
+	for(s16 z=0; z<MAP_BLOCKSIZE; z++)
+	for(s16 y=0; y<MAP_BLOCKSIZE; y++)
+	for(s16 x=0; x<MAP_BLOCKSIZE; x++)
+	{
+		MapNode n = block->getNodeNoEx(v3s16(x,y,z));
+		n.param1 = light[i++];
+		block->setNodeNoCheck(v3s16(x,y,z), n);
+	}
+	block->setIsUnderground(flags & 0x01);
+	block->setLightingExpired(flags & 0x02);
+	block->updateDayNightDiff();
+	block->setGenerated(true);
+
+	block->deSerializeDiskExtra(is, SER_FMT_VER_HIGHEST);
+
+	block->setPristine(true);
+	return true;
 }
 
-void ServerMap::endSave() {
-	verifyDatabase();
-	if(sqlite3_exec(m_database, "COMMIT;", NULL, NULL, NULL) != SQLITE_OK)
-		infostream<<"WARNING: endSave() failed, map might not have saved.";
+void ServerMap::makeMarker(v3s16 p, std::string &data)
+{
+	ScopeProfiler sp(g_profiler, "ServerMap: make marker avg", SPT_AVG);
+	if(makeGeneratedMarker(m_seed, p, data, m_sector_noise_cache))
+		g_profiler->add("ServerMap: blocks stored as markers", 1);
+	else
+		g_profiler->add("ServerMap: pristine blocks not reproduced", 1);
 }
 
 void ServerMap::saveBlock(MapBlock *block)
+{
+	saveBlock(block, false);
+}
+
+void ServerMap::saveBlock(MapBlock *block, bool delete_legacy)
 {
 	DSTACK(__FUNCTION_NAME);
 	/*
@@ -3229,6 +4531,8 @@ void ServerMap::saveBlock(MapBlock *block)
 		return;
 	}
 
+	ScopeProfiler sp(g_profiler, "ServerMap: saveBlock avg", SPT_AVG);
+
 	// Format used for writing
 	u8 version = SER_FMT_VER_HIGHEST;
 	// Get destination
@@ -3251,135 +4555,106 @@ void ServerMap::saveBlock(MapBlock *block)
 		[1] data
 	*/
 	
-	verifyDatabase();
-	
 	std::ostringstream o(std::ios_base::binary);
 	
 	o.write((char*)&version, 1);
 	
 	// Write basic data
-	block->serialize(o, version);
+	block->serialize(o, version, m_compression_codec, m_compression_level);
 	
 	// Write extra data stored on disk
 	block->serializeDiskExtra(o, version);
 	
-	// Write block to database
-	
-	std::string tmp = o.str();
-	const char *bytes = tmp.c_str();
-	
-	if(sqlite3_bind_int64(m_database_write, 1, getBlockAsInteger(p3d)) != SQLITE_OK)
-		infostream<<"WARNING: Block position failed to bind: "<<sqlite3_errmsg(m_database)<<std::endl;
-	if(sqlite3_bind_blob(m_database_write, 2, (void *)bytes, o.tellp(), NULL) != SQLITE_OK) // TODO this mught not be the right length
-		infostream<<"WARNING: Block data failed to bind: "<<sqlite3_errmsg(m_database)<<std::endl;
-	int written = sqlite3_step(m_database_write);
-	if(written != SQLITE_DONE)
-		infostream<<"WARNING: Block failed to save ("<<p3d.X<<", "<<p3d.Y<<", "<<p3d.Z<<") "
-		<<sqlite3_errmsg(m_database)<<std::endl;
-	// Make ready for later reuse
-	sqlite3_reset(m_database_write);
-	
-	// We just wrote it to the disk so clear modified flag
+	// The snapshot is what gets written, so the block is clean now
 	block->resetModified();
-}
 
-void ServerMap::loadBlock(std::string sectordir, std::string blockfile, MapSector *sector, bool save_after_load)
-{
-	DSTACK(__FUNCTION_NAME);
+	// Left as generated; it may be stored as a marker
+	bool pristine = m_skip_pristine_blocks && block->isPristine()
+			&& block->isGenerated();
 
-	std::string fullpath = sectordir+DIR_DELIM+blockfile;
-	try{
+	if(m_save_thread_enabled)
+	{
+		/*
+			Hand the snapshot to the save thread. If it is falling
+			behind, wait for it instead of piling up memory.
+		*/
+		if(m_save_queue.size() >= m_save_queue_max_blocks)
+		{
+			ScopeProfiler sp(g_profiler, "ServerMap: save queue full wait");
+			m_save_thread.trigger();
+			m_save_queue.waitForSpace(m_save_queue_max_blocks);
+		}
+		m_save_queue.push(p3d, o.str(), pristine, delete_legacy);
+		m_save_thread.trigger();
+		return;
+	}
 
-		std::ifstream is(fullpath.c_str(), std::ios_base::binary);
-		if(is.good() == false)
-			throw FileNotGoodException("Cannot open block file");
-		
-		v3s16 p3d = getBlockPos(sectordir, blockfile);
-		v2s16 p2d(p3d.X, p3d.Z);
-		
-		assert(sector->getPos() == p2d);
-		
-		u8 version = SER_FMT_VER_INVALID;
-		is.read((char*)&version, 1);
+	std::string data = o.str();
+	if(pristine)
+		makeMarker(p3d, data);
 
-		if(is.fail())
-			throw SerializationError("ServerMap::loadBlock(): Failed"
-					" to read MapBlock version");
+	// Write block to database
+	JMutexAutoLock lock(m_database_mutex);
+	verifyDatabase();
+	m_database->saveBlock(p3d, data);
+	addStored(p3d);
 
-		/*u32 block_size = MapBlock::serializedLength(version);
-		SharedBuffer<u8> data(block_size);
-		is.read((char*)*data, block_size);*/
+	if(delete_legacy && m_legacy_database)
+	{
+		// Commit it before deleting the old file
+		m_database->flush(true);
+		m_legacy_database->deleteBlock(p3d);
+	}
+}
 
-		// This will always return a sector because we're the server
-		//MapSector *sector = emergeSector(p2d);
+bool ServerMap::decodeBlock(std::string *blob, MapBlock *block,
+		bool &old_format)
+{
+	std::istringstream is(*blob, std::ios_base::binary);
+	
+	u8 version = SER_FMT_VER_INVALID;
+	is.read((char*)&version, 1);
 
-		MapBlock *block = NULL;
-		bool created_new = false;
-		block = sector->getBlockNoCreateNoEx(p3d.Y);
-		if(block == NULL)
-		{
-			block = sector->createBlankBlockNoInsert(p3d.Y);
-			created_new = true;
-		}
-		
-		// Read basic data
-		block->deSerialize(is, version);
+	if(is.fail())
+		throw SerializationError("ServerMap::decodeBlock(): Failed"
+				" to read MapBlock version");
 
-		// Read extra data stored on disk
-		block->deSerializeDiskExtra(is, version);
-		
-		// If it's a new block, insert it to the map
-		if(created_new)
-			sector->insertBlock(block);
-		
+	old_format = false;
+	if(version == SER_FMT_VER_GENERATED)
+	{
 		/*
-			Save blocks loaded in old format in new format
+			Generated again from the seed. If the map generator
+			has changed since, it is left to be generated anew.
 		*/
-
-		if(version < SER_FMT_VER_HIGHEST || save_after_load)
+		if(loadGeneratedMarker(is, m_seed, block,
+				m_sector_noise_cache) == false)
 		{
-			saveBlock(block);
-			
-			// Should be in database now, so delete the old file
-			fs::RecursiveDelete(fullpath);
+			v3s16 p3d = block->getPos();
+			infostream<<"ServerMap::decodeBlock(): Block ("
+					<<p3d.X<<","<<p3d.Y<<","<<p3d.Z<<") was stored"
+					<<" by another map generator version;"
+					<<" generating it again"<<std::endl;
+			return false;
 		}
-		
-		// We just loaded it from the disk, so it's up-to-date.
-		block->resetModified();
-
+		return true;
 	}
-	catch(SerializationError &e)
-	{
-		infostream<<"WARNING: Invalid block data on disk "
-				<<"fullpath="<<fullpath
-				<<" (SerializationError). "
-				<<"what()="<<e.what()
-				<<std::endl;
-				//" Ignoring. A new one will be generated.
-		assert(0);
 
-		// TODO: Backup file; name is in fullpath.
-	}
+	// Read basic data
+	block->deSerialize(is, version);
+
+	// Read extra data stored on disk
+	block->deSerializeDiskExtra(is, version);
+
+	old_format = (version < SER_FMT_VER_HIGHEST);
+	return true;
 }
 
-void ServerMap::loadBlock(std::string *blob, v3s16 p3d, MapSector *sector, bool save_after_load)
+void ServerMap::loadBlock(std::string *blob, v3s16 p3d, MapSector *sector, bool save_after_load,
+		bool delete_legacy)
 {
 	DSTACK(__FUNCTION_NAME);
 
 	try {
-		std::istringstream is(*blob, std::ios_base::binary);
-		
-		u8 version = SER_FMT_VER_INVALID;
-		is.read((char*)&version, 1);
-
-		if(is.fail())
-			throw SerializationError("ServerMap::loadBlock(): Failed"
-					" to read MapBlock version");
-
-		/*u32 block_size = MapBlock::serializedLength(version);
-		SharedBuffer<u8> data(block_size);
-		is.read((char*)*data, block_size);*/
-
 		// This will always return a sector because we're the server
 		//MapSector *sector = emergeSector(p2d);
 
@@ -3392,11 +4667,13 @@ void ServerMap::loadBlock(std::string *blob, v3s16 p3d, MapSector *sector, bool
 			created_new = true;
 		}
 		
-		// Read basic data
-		block->deSerialize(is, version);
-
-		// Read extra data stored on disk
-		block->deSerializeDiskExtra(is, version);
+		bool old_format = false;
+		if(decodeBlock(blob, block, old_format) == false)
+		{
+			if(created_new)
+				delete block;
+			return;
+		}
 		
 		// If it's a new block, insert it to the map
 		if(created_new)
@@ -3406,9 +4683,9 @@ void ServerMap::loadBlock(std::string *blob, v3s16 p3d, MapSector *sector, bool
 			Save blocks loaded in old format in new format
 		*/
 
-		if(version < SER_FMT_VER_HIGHEST || save_after_load)
+		if(old_format || save_after_load)
 		{
-			saveBlock(block);
+			saveBlock(block, delete_legacy);
 		}
 		
 		// We just loaded it from, so it's up-to-date.
@@ -3434,93 +4711,217 @@ MapBlock* ServerMap::loadBlock(v3s16 blockpos)
 
 	v2s16 p2d(blockpos.X, blockpos.Z);
 
-	if(!loadFromFolders()) {
-		verifyDatabase();
-		
-		if(sqlite3_bind_int64(m_database_read, 1, getBlockAsInteger(blockpos)) != SQLITE_OK)
-			infostream<<"WARNING: Could not bind block position for load: "
-				<<sqlite3_errmsg(m_database)<<std::endl;
-		if(sqlite3_step(m_database_read) == SQLITE_ROW) {
-			/*
-				Make sure sector is loaded
-			*/
-			MapSector *sector = createSector(p2d);
-			
-			/*
-				Load block
-			*/
-			const char * data = (const char *)sqlite3_column_blob(m_database_read, 0);
-			size_t len = sqlite3_column_bytes(m_database_read, 0);
-			
-			std::string datastr(data, len);
-			
-			loadBlock(&datastr, blockpos, sector, false);
+	/*
+		A snapshot still waiting to be written is newer than anything
+		in the database
+	*/
+	std::string datastr;
+	bool found = m_save_queue.get(blockpos, datastr);
 
-			sqlite3_step(m_database_read);
-			// We should never get more than 1 row, so ok to reset
-			sqlite3_reset(m_database_read);
+	bool from_legacy = false;
+	if(found == false)
+	{
+		JMutexAutoLock lock(m_database_mutex);
+
+		verifyDatabase();
+		bool stored = mayBeStored(blockpos);
+		if(stored)
+			found = m_database->loadBlock(blockpos, datastr);
 
-			return getBlockNoCreateNoEx(blockpos);
+		// Not found in database, try the files of old versions
+		if(stored && found == false)
+		{
+			Database *legacy = getLegacyDatabase();
+			if(legacy)
+				from_legacy = found = legacy->loadBlock(blockpos, datastr);
 		}
-		sqlite3_reset(m_database_read);
-		
-		// Not found in database, try the files
 	}
 
-	// The directory layout we're going to load from.
-	//  1 - original sectors/xxxxzzzz/
-	//  2 - new sectors2/xxx/zzz/
-	//  If we load from anything but the latest structure, we will
-	//  immediately save to the new one, and remove the old.
-	int loadlayout = 1;
-	std::string sectordir1 = getSectorDir(p2d, 1);
-	std::string sectordir;
-	if(fs::PathExists(sectordir1))
+	if(found == false)
+		return NULL;
+
+	/*
+		Make sure sector is loaded
+	*/
+	MapSector *sector = createSector(p2d);
+	
+	/*
+		Load block; blocks from the old files are saved to the
+		database right away, and the old files are deleted once they
+		are committed.
+	*/
+	loadBlock(&datastr, blockpos, sector, from_legacy, from_legacy);
+
+	return getBlockNoCreateNoEx(blockpos);
+}
+
+u32 ServerMap::loadBlocks(const core::list<v3s16> &blocks,
+		core::map<v3s16, MapBlock*> &dst)
+{
+	DSTACK(__FUNCTION_NAME);
+
+	core::map<v3s16, LoadedBlock> loaded;
+	readBlocks(blocks, loaded);
+	decodeBlocks(loaded);
+	return insertBlocks(loaded, dst);
+}
+
+void ServerMap::readBlocks(const core::list<v3s16> &blocks,
+		core::map<v3s16, LoadedBlock> &dst)
+{
+	DSTACK(__FUNCTION_NAME);
+
+	LoadedBlock loaded;
+	loaded.resave = false;
+	loaded.legacy = false;
+	loaded.block = NULL;
+
+	/*
+		Snapshots waiting to be written are newer than anything in
+		the database
+	*/
+	core::list<v3s16> unqueued;
+	for(core::list<v3s16>::ConstIterator i = blocks.begin();
+			i != blocks.end(); i++)
 	{
-		sectordir = sectordir1;
+		if(m_save_queue.get(*i, loaded.blob))
+			dst[*i] = loaded;
+		else
+			unqueued.push_back(*i);
 	}
-	else
+
+	if(unqueued.size() == 0)
+		return;
+
+	JMutexAutoLock lock(m_database_mutex);
+
+	verifyDatabase();
+	core::list<v3s16> from_db;
+	for(core::list<v3s16>::Iterator i = unqueued.begin();
+			i != unqueued.end(); i++)
 	{
-		loadlayout = 2;
-		sectordir = getSectorDir(p2d, 2);
+		if(mayBeStored(*i))
+			from_db.push_back(*i);
 	}
-	
-	/*
-		Make sure sector is loaded
-	*/
-	MapSector *sector = getSectorNoGenerateNoEx(p2d);
-	if(sector == NULL)
+	core::map<v3s16, std::string> blobs;
+	if(from_db.size() != 0)
+		m_database->loadBlocks(from_db, blobs);
+	for(core::map<v3s16, std::string>::Iterator i = blobs.getIterator();
+			i.atEnd() == false; i++)
 	{
-		try{
-			sector = loadSectorMeta(sectordir, loadlayout != 2);
+		loaded.blob = i.getNode()->getValue();
+		dst[i.getNode()->getKey()] = loaded;
+	}
+
+	// Try the files of old versions for the rest
+	Database *legacy = getLegacyDatabase();
+	if(legacy == NULL)
+		return;
+	loaded.resave = true;
+	loaded.legacy = true;
+	for(core::list<v3s16>::Iterator i = from_db.begin();
+			i != from_db.end(); i++)
+	{
+		if(blobs.find(*i) != NULL)
+			continue;
+		if(legacy->loadBlock(*i, loaded.blob))
+			dst[*i] = loaded;
+	}
+}
+
+void ServerMap::decodeBlocks(core::map<v3s16, LoadedBlock> &blocks)
+{
+	DSTACK(__FUNCTION_NAME);
+
+	for(core::map<v3s16, LoadedBlock>::Iterator i = blocks.getIterator();
+			i.atEnd() == false; i++)
+	{
+		v3s16 p = i.getNode()->getKey();
+		LoadedBlock &loaded = i.getNode()->getValue();
+
+		// Not in the map, so that it doesn't touch the dirty set
+		MapBlock *block = new MapBlock(NULL, p);
+		try
+		{
+			bool old_format = false;
+			if(decodeBlock(&loaded.blob, block, old_format) == false)
+			{
+				delete block;
+				continue;
+			}
+			if(old_format)
+				loaded.resave = true;
+			loaded.block = block;
 		}
-		catch(InvalidFilenameException &e)
+		catch(SerializationError &e)
 		{
-			return false;
+			infostream<<"WARNING: Invalid block data in database "
+					<<" (SerializationError). "
+					<<"what()="<<e.what()
+					<<std::endl;
+			assert(0);
+			delete block;
 		}
-		catch(FileNotGoodException &e)
+	}
+}
+
+u32 ServerMap::insertBlocks(core::map<v3s16, LoadedBlock> &blocks,
+		core::map<v3s16, MapBlock*> &dst)
+{
+	DSTACK(__FUNCTION_NAME);
+
+	u32 count = 0;
+	for(core::map<v3s16, LoadedBlock>::Iterator i = blocks.getIterator();
+			i.atEnd() == false; i++)
+	{
+		v3s16 p = i.getNode()->getKey();
+		LoadedBlock &loaded = i.getNode()->getValue();
+		if(loaded.block == NULL)
+			continue;
+
+		MapSector *sector = createSector(v2s16(p.X, p.Z));
+		MapBlock *block = sector->getBlockNoCreateNoEx(p.Y);
+		if(block == NULL)
 		{
-			return false;
+			block = loaded.block;
+			loaded.block = NULL;
+			block->setParent(this);
+			sector->insertBlock(block);
+			if(loaded.resave)
+				saveBlock(block, loaded.legacy);
+			// We just loaded it from, so it's up-to-date.
+			block->resetModified();
 		}
-		catch(std::exception &e)
+		else if(block->isDummy() || block->isGenerated() == false)
 		{
-			return false;
+			// A placeholder was made meanwhile; fill it in
+			block->takeContents(loaded.block);
+			if(loaded.resave)
+				saveBlock(block, loaded.legacy);
+			block->resetModified();
+		}
+		else
+		{
+			// Loaded meanwhile; what is in the map is newer
+			continue;
 		}
-	}
-	
-	/*
-		Make sure file exists
-	*/
 
-	std::string blockfilename = getBlockFilename(blockpos);
-	if(fs::PathExists(sectordir+DIR_DELIM+blockfilename) == false)
-		return NULL;
+		block = getBlockNoCreateNoEx(p);
+		if(block)
+		{
+			dst[p] = block;
+			count++;
+		}
+	}
 
-	/*
-		Load block and save it to the database
-	*/
-	loadBlock(sectordir, blockfilename, sector, true);
-	return getBlockNoCreateNoEx(blockpos);
+	// The ones that weren't used
+	for(core::map<v3s16, LoadedBlock>::Iterator i = blocks.getIterator();
+			i.atEnd() == false; i++)
+	{
+		delete i.getNode()->getValue().block;
+		i.getNode()->getValue().block = NULL;
+	}
+	return count;
 }
 
 void ServerMap::PrintInfo(std::ostream &out)
@@ -4308,12 +5709,14 @@ void MapVoxelManipulator::blitBack
 
 ManualMapVoxelManipulator::ManualMapVoxelManipulator(Map *map):
 		MapVoxelManipulator(map),
-		m_create_area(false)
+		m_create_area(false),
+		m_initial(NULL)
 {
 }
 
 ManualMapVoxelManipulator::~ManualMapVoxelManipulator()
 {
+	delete m_initial;
 }
 
 void ManualMapVoxelManipulator::emerge(VoxelArea a, s32 caller_id)
@@ -4364,7 +5767,10 @@ void ManualMapVoxelManipulator::initialEmerge(
 			if(block->isDummy())
 				block_data_inexistent = true;
 			else
+			{
 				block->copyTo(*this);
+				m_block_stamps.insert(p, block->getChangeStamp());
+			}
 		}
 		catch(InvalidPositionException &e)
 		{
@@ -4390,6 +5796,17 @@ void ManualMapVoxelManipulator::initialEmerge(
 	}
 }
 
+void ManualMapVoxelManipulator::keepInitial()
+{
+	delete m_initial;
+	m_initial = new VoxelManipulator();
+	if(m_area.getExtent() == v3s16(0,0,0))
+		return;
+	m_initial->addArea(m_area);
+	m_initial->copyFrom(m_data, m_area, m_area.MinEdge, m_area.MinEdge,
+			m_area.getExtent());
+}
+
 void ManualMapVoxelManipulator::blitBackAll(
 		core::map<v3s16, MapBlock*> * modified_blocks)
 {
@@ -4423,7 +5840,30 @@ void ManualMapVoxelManipulator::blitBackAll(
 			continue;
 		}
 
-		block->copyFrom(*this);
+		core::map<v3s16, u64>::Node *n = m_block_stamps.find(p);
+		if(m_initial == NULL
+				|| (n != NULL && n->getValue() == block->getChangeStamp()))
+		{
+			block->copyFrom(*this);
+		}
+		else
+		{
+			/*
+				The block has changed in the map after it was copied
+				here. Keep that and only write what was changed here.
+			*/
+			v3s16 relpos = block->getPosRelative();
+			for(s16 z=0; z<MAP_BLOCKSIZE; z++)
+			for(s16 y=0; y<MAP_BLOCKSIZE; y++)
+			for(s16 x=0; x<MAP_BLOCKSIZE; x++)
+			{
+				u32 i = m_area.index(relpos + v3s16(x,y,z));
+				if(m_data[i] == m_initial->m_data[i])
+					continue;
+				block->setNodeNoCheck(x, y, z, m_data[i]);
+			}
+			g_profiler->add("ManualMapVoxelManipulator: merged blocks", 1);
+		}
 
 		if(modified_blocks)
 			modified_blocks->insert(p, block);
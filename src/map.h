@@ -23,6 +23,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include <jmutex.h>
 #include <jmutexautolock.h>
 #include <jthread.h>
+#include <jsemaphore.h>
 #include <iostream>
 #include <sstream>
 
@@ -31,19 +32,19 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "mapblock_nodemod.h"
 #include "constants.h"
 #include "voxel.h"
-
-extern "C" {
-	#include "sqlite3.h"
-}
+#include "database.h"
 
 class MapSector;
 class ServerMapSector;
 class ClientMapSector;
 class MapBlock;
 class NodeMetadata;
+class JobPool;
+class LiquidBlockJob;
 
 namespace mapgen{
 	struct BlockMakeData;
+	class SectorNoiseCache;
 };
 
 /*
@@ -241,6 +242,16 @@ class Map /*: public NodeContainer*/
 	// Client leaves it as no-op.
 	virtual void saveBlock(MapBlock *block){};
 
+	// Called by MapBlock when it gets modified, see m_dirty_blocks
+	void addDirtyBlock(v3s16 p)
+	{
+		m_dirty_blocks.set(p, true);
+	}
+	u32 getDirtyBlockCount()
+	{
+		return m_dirty_blocks.size();
+	}
+
 	/*
 		Updates usage timers and unloads unused blocks and sectors.
 		Saves modified blocks before unloading on MAPTYPE_SERVER.
@@ -266,7 +277,13 @@ class Map /*: public NodeContainer*/
 	// For debug printing. Prints "Map: ", "ServerMap: " or "ClientMap: "
 	virtual void PrintInfo(std::ostream &out);
 	
-	void transformLiquids(core::map<v3s16, MapBlock*> & modified_blocks);
+	/*
+		Transforms the queued liquid nodes, in the threads of pool. Stops
+		after about max_time_ms and leaves the rest queued.
+	*/
+	void transformLiquids(core::map<v3s16, MapBlock*> & modified_blocks,
+			JobPool *pool, u32 max_time_ms);
+
 
 	/*
 		Node metadata
@@ -300,8 +317,128 @@ class Map /*: public NodeContainer*/
 	MapSector *m_sector_cache;
 	v2s16 m_sector_cache_p;
 
+	/*
+		Positions of blocks that may have been modified since they
+		were last saved, so that saving doesn't look at every block in
+		memory. Blocks are added by MapBlock::raiseModified() and
+		dropped when they are found clean or gone. Like the modified
+		state of blocks, this is only used with the environment locked.
+	*/
+	core::map<v3s16, bool> m_dirty_blocks;
+
 	// Queued transforming water nodes
 	UniqueQueue<v3s16> m_transforming_liquid;
+	// Jobs of transformLiquids() kept for the next rounds
+	core::array<LiquidBlockJob*> m_liquid_jobs;
+};
+
+/*
+	A serialized block waiting to be written to the database
+*/
+struct PendingBlockSave
+{
+	v3s16 p;
+	std::string data;
+	u32 id;
+	// May be stored as a generated marker (see ServerMap::saveBlock())
+	bool pristine;
+	// The file of an old version is deleted once this is committed
+	bool delete_legacy;
+};
+
+/*
+	Serialized snapshots of blocks waiting to be written to the database.
+
+	Only the newest snapshot of each block is kept. A snapshot stays in
+	here until it has been committed, so that a load never falls through
+	to older data in the database.
+
+	This is a thread-safe class.
+*/
+class BlockSaveQueue
+{
+public:
+	BlockSaveQueue();
+
+	// Replaces an earlier snapshot of the same block
+	void push(v3s16 p, const std::string &data, bool pristine=false,
+			bool delete_legacy=false);
+	// Returns false if there is no snapshot of the block
+	bool get(v3s16 p, std::string &data);
+	// Copies up to max_count snapshots to dst in the order they were pushed
+	u32 getBatch(u32 max_count, core::list<PendingBlockSave> &dst);
+	// Removes written snapshots unless they were replaced meanwhile
+	void written(core::list<PendingBlockSave> &batch);
+	void listPending(core::list<v3s16> &dst);
+	// Number of blocks waiting
+	u32 size();
+	// Number of blocks not yet handed out by getBatch()
+	u32 queuedCount();
+	// Blocks until fewer than max_size blocks are waiting
+	void waitForSpace(u32 max_size);
+
+private:
+	struct Entry
+	{
+		std::string data;
+		u32 id;
+		bool queued;
+		bool pristine;
+		bool delete_legacy;
+	};
+	core::map<v3s16, Entry> m_blocks;
+	core::list<v3s16> m_order;
+	u32 m_next_id;
+	JMutex m_mutex;
+	// Posted by written() once for each thread in waitForSpace()
+	JSemaphore m_space_sem;
+	u32 m_space_waiters;
+};
+
+class ServerMap;
+
+/*
+	A block on its way from the database to the map; see
+	ServerMap::readBlocks()
+*/
+struct LoadedBlock
+{
+	std::string blob;
+	// Stored in an old format; written again when loaded
+	bool resave;
+	// Found in the files of an old version
+	bool legacy;
+	// Made of blob by ServerMap::decodeBlocks(), not in the map yet.
+	// NULL if it is left to be generated.
+	MapBlock *block;
+};
+
+/*
+	Writes the snapshots in ServerMap's BlockSaveQueue to the database.
+	Drains the queue before exiting.
+*/
+class MapSaveThread : public SimpleThread
+{
+	ServerMap *m_map;
+
+public:
+
+	MapSaveThread(ServerMap *map):
+		SimpleThread(),
+		m_map(map)
+	{
+	}
+
+	void * Thread();
+
+	void trigger()
+	{
+		setRun(true);
+		if(IsRunning() == false)
+		{
+			Start();
+		}
+	}
 };
 
 /*
@@ -372,26 +509,85 @@ class ServerMap : public Map
 	std::string getSectorDir(v2s16 pos, int layout = 2);
 	// dirname: final directory name
 	v2s16 getSectorPos(std::string dirname);
-	v3s16 getBlockPos(std::string sectordir, std::string blockfile);
-	static std::string getBlockFilename(v3s16 p);
 
 	/*
 		Database functions
 	*/
-	// Create the database structure
-	void createDatabase();
-	// Verify we can read/write to the database
+	// Opens the map backend if it isn't open yet
+	// m_database_mutex must be locked when calling this
 	void verifyDatabase();
-	// Get an integer suitable for a block
-	static sqlite3_int64 getBlockAsInteger(const v3s16 pos);
-	static v3s16 getIntegerAsBlock(sqlite3_int64 i);
-
-	// Returns true if the database file does not exist
-	bool loadFromFolders();
 
 	// Call these before and after saving of blocks
 	void beginSave();
 	void endSave();
+	/*
+		Lets the backend make grouped writes permanent if they have
+		waited long enough (see Database::flush()).
+		force=true makes them permanent unconditionally.
+	*/
+	void flushSave(bool force=false);
+
+	/*
+		Rewrites the database keys of the map in another encoding and
+		records it in map_meta.txt. Meant to be run on a map that
+		isn't used by a server.
+	*/
+	void convertBlockKeys(BlockKeyEncoding to);
+
+	/*
+		Copies every block of the map into a new map in dst_savedir
+		stored in dst_backend, and writes its map_meta.txt. Players
+		and other files of the world are not copied.
+		rewrite=true converts the blocks to SER_FMT_VER_HIGHEST and
+		map_compression_codec in thread_count threads.
+		compact=true lets the new backend give back unused space at
+		the end. Meant to be run on a map that isn't used by a server.
+	*/
+	void migrate(const std::string &dst_savedir,
+			const std::string &dst_backend, u32 thread_count,
+			bool rewrite, bool compact);
+
+	/*
+		Serializes and deserializes up to max_blocks blocks of the map
+		with each compression codec and prints the sizes and speeds.
+	*/
+	void benchmarkCompression(u32 max_blocks);
+
+	/*
+		Generates the blocks within radius blocks of the origin
+		horizontally and from y=2 down to y=-2 one by one, and prints
+		how long each phase took and a hash of the resulting nodes.
+		Meant for an empty map.
+	*/
+	void benchmarkMapgen(s16 radius);
+
+	/*
+		Online backups.
+
+		Backups are new map directories in backup_path named
+		map-<date>-<time>-full or -incr. A full backup has all blocks
+		of the map, an incremental one the blocks that were written
+		since the previous backup (see BlockJournal). A backup is
+		complete when it has its map_meta.txt. Blocks still in the
+		sectors/ files of old versions are not included.
+
+		startBackup() makes a full backup if full=true, if there is no
+		complete full one in backup_path yet or if backup_full_every
+		incremental ones have been made since the last full one.
+		The copying is done by the save thread in small steps.
+		Returns the directory, or "" if one can't be started now
+		because a backup is running already.
+	*/
+	std::string startBackup(bool full);
+	bool isBackupRunning();
+	// Copies the next step; returns false when no backup is running
+	bool backupStep();
+	/*
+		Writes every block of the map in src_savedir into this map, for
+		applying backups on top of each other. The source is opened
+		read-only. Meant to be run on maps that aren't used by a server.
+	*/
+	void importBlocks(const std::string &src_savedir);
 
 	void save(bool only_changed);
 	//void loadAll();
@@ -400,6 +596,9 @@ class ServerMap : public Map
 	
 	// Saves map seed and possibly other stuff
 	void saveMapMeta();
+	// The same for a map in savedir using backend_name
+	void saveMapMeta(const std::string &savedir,
+			const std::string &backend_name);
 	void loadMapMeta();
 	
 	/*void saveChunkMeta();
@@ -422,11 +621,45 @@ class ServerMap : public Map
 	//bool deFlushSector(v2s16 p2d);
 	
 	void saveBlock(MapBlock *block);
-	// This will generate a sector with getSector if not found.
-	void loadBlock(std::string sectordir, std::string blockfile, MapSector *sector, bool save_after_load=false);
+	/*
+		delete_legacy: delete the file of the block left by an old
+		version once the block has been committed to the database
+	*/
+	void saveBlock(MapBlock *block, bool delete_legacy);
+	/*
+		Writes a batch of queued snapshots to the database.
+		Called by MapSaveThread. Returns the number of blocks written.
+	*/
+	u32 writePendingBlocks();
+	// Number of blocks waiting in the save queue
+	u32 getSaveQueueSize(){ return m_save_queue.size(); }
 	MapBlock* loadBlock(v3s16 p);
+	/*
+		Loads the blocks of the list that are on disk with as few
+		database queries as possible and adds them to dst.
+		Returns the number of blocks loaded.
+	*/
+	u32 loadBlocks(const core::list<v3s16> &blocks,
+			core::map<v3s16, MapBlock*> &dst);
+	/*
+		loadBlocks() in steps, so that the slow ones can be done without
+		locking the environment:
+		- readBlocks() gets the data of the blocks of the list that are
+		  on disk
+		- decodeBlocks() makes blocks of the data, outside the map
+		- insertBlocks() adds them to the map and to dst, except the ones
+		  the map has got meanwhile, and deletes the rest. Returns the
+		  number of blocks added.
+		Only insertBlocks() needs the environment to be locked.
+	*/
+	void readBlocks(const core::list<v3s16> &blocks,
+			core::map<v3s16, LoadedBlock> &dst);
+	void decodeBlocks(core::map<v3s16, LoadedBlock> &blocks);
+	u32 insertBlocks(core::map<v3s16, LoadedBlock> &blocks,
+			core::map<v3s16, MapBlock*> &dst);
 	// Database version
-	void loadBlock(std::string *blob, v3s16 p3d, MapSector *sector, bool save_after_load=false);
+	void loadBlock(std::string *blob, v3s16 p3d, MapSector *sector, bool save_after_load=false,
+			bool delete_legacy=false);
 
 	// For debug printing
 	virtual void PrintInfo(std::ostream &out);
@@ -435,6 +668,11 @@ class ServerMap : public Map
 
 	u64 getSeed(){ return m_seed; }
 
+	mapgen::SectorNoiseCache * getSectorNoiseCache()
+	{
+		return m_sector_noise_cache;
+	}
+
 private:
 	// Seed used for all kinds of randomness
 	u64 m_seed;
@@ -457,12 +695,98 @@ class ServerMap : public Map
 	bool m_map_metadata_changed;
 	
 	/*
-		SQLite database and statements
+		Block storage backend, see database.h.
+		m_backend_name is stored in map_meta.txt; new maps get the
+		map_backend setting.
+	*/
+	Database *m_database;
+	std::string m_backend_name;
+	// Also stored in map_meta.txt; new maps get map_block_keys
+	BlockKeyEncoding m_block_key_encoding;
+	/*
+		Blocks left in sectors/ and sectors2/ by old versions. They are
+		moved to m_database when loaded.
+	*/
+	Database *m_legacy_database;
+	bool m_legacy_checked;
+	// Returns NULL if there are no legacy block files
+	Database * getLegacyDatabase();
+
+	/*
+		Reads a block from blob. Returns false if it is a marker of
+		another map generator version; the block is left to be generated
+		anew. Sets old_format if blob is in an older format than the
+		one written now. Throws SerializationError.
+	*/
+	bool decodeBlock(std::string *blob, MapBlock *block, bool &old_format);
+
+	// Codec and level of blocks written on disk
+	u8 m_compression_codec;
+	s32 m_compression_level;
+
+	/*
+		Blocks stored in m_database and m_legacy_database, so that
+		loads of blocks that were never saved don't reach the backend.
+		Filled from the backends on first use.
+	*/
+	bool m_presence_filter_enabled;
+	bool m_presence_filter_filled;
+	BlockPresenceFilter m_presence_filter;
+	// Returns false if the block is certainly not in the backends
+	bool mayBeStored(v3s16 p);
+	// Call after a block has been written to m_database
+	void addStored(v3s16 p);
+	void fillPresenceFilter();
+
+	/*
+		Positions of the blocks written since the last backup, in
+		map_journal of the map directory. Opened with the database.
 	*/
-	sqlite3 *m_database;
-	sqlite3_stmt *m_database_read;
-	sqlite3_stmt *m_database_write;
-	sqlite3_stmt *m_database_list;
+	bool m_journal_enabled;
+	BlockJournal m_journal;
+
+	// State of the running backup, see startBackup()
+	bool m_backup_running;
+	std::string m_backup_dir;
+	// The backend copies itself (Database::startBackup())
+	bool m_backup_native;
+	// Otherwise m_backup_todo is copied into m_backup_database
+	Database *m_backup_database;
+	core::list<v3s16> m_backup_todo;
+	u32 m_backup_copied;
+	u32 m_backup_step;
+	u32 m_backup_start_ms;
+	// Call when m_backup_running; failed=true keeps the journal
+	void finishBackup(bool failed);
+
+	/*
+		Blocks nothing but the map generator has touched are stored as
+		markers the block is generated again from, if generating it
+		alone gives the same nodes. See makeMarker().
+	*/
+	bool m_skip_pristine_blocks;
+	// Replaces stored block data with a marker if it can be one
+	void makeMarker(v3s16 p, std::string &data);
+
+	// Noise of the sectors generated last (mapgen_sector_cache_size)
+	mapgen::SectorNoiseCache *m_sector_noise_cache;
+
+	/*
+		The database is shared by the server, emerge and save threads.
+		The backends aren't thread-safe, so every call to them is done
+		with this locked.
+	*/
+	JMutex m_database_mutex;
+
+	/*
+		If enabled, saveBlock() only serializes the block and the
+		actual writing is done in m_save_thread.
+	*/
+	bool m_save_thread_enabled;
+	u32 m_save_queue_max_blocks;
+	u32 m_save_batch_max_blocks;
+	BlockSaveQueue m_save_queue;
+	MapSaveThread m_save_thread;
 };
 
 /*
@@ -658,12 +982,24 @@ class ManualMapVoxelManipulator : public MapVoxelManipulator
 	virtual void emerge(VoxelArea a, s32 caller_id=-1);
 
 	void initialEmerge(v3s16 blockpos_min, v3s16 blockpos_max);
+
+	/*
+		Keeps a copy of the nodes as they are now. After this,
+		blitBackAll() only writes the nodes that have changed since
+		into blocks that have changed in the map since initialEmerge(),
+		so that the map can be unlocked in between.
+	*/
+	void keepInitial();
 	
 	// This is much faster with big chunks of generated data
 	void blitBackAll(core::map<v3s16, MapBlock*> * modified_blocks);
 
 protected:
 	bool m_create_area;
+	// MapBlock::getChangeStamp() of the blocks in initialEmerge()
+	core::map<v3s16, u64> m_block_stamps;
+	// See keepInitial(); NULL if not kept
+	VoxelManipulator *m_initial;
 };
 
 #endif
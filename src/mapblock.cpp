@@ -23,15 +23,43 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "main.h"
 #include "light.h"
 #include <sstream>
+#include <cstring>
 
 /*
 	MapBlock
 */
 
+/*
+	Source of MapBlock::m_serial. Blocks are made in other threads than
+	the server thread too (see ServerMap::decodeBlocks()).
+*/
+static class BlockSerialSource
+{
+public:
+	BlockSerialSource():
+		m_next(0)
+	{
+		m_mutex.Init();
+	}
+	u32 next()
+	{
+		JMutexAutoLock lock(m_mutex);
+		return m_next++;
+	}
+private:
+	JMutex m_mutex;
+	u32 m_next;
+} g_block_serial_source;
+
 MapBlock::MapBlock(Map *parent, v3s16 pos, bool dummy):
 		m_parent(parent),
 		m_pos(pos),
+		m_content_mask(0),
 		m_modified(MOD_STATE_WRITE_NEEDED),
+		m_serial(g_block_serial_source.next()),
+		m_change_counter(0),
+		m_in_dirty_set(false),
+		m_pristine(false),
 		is_underground(false),
 		m_lighting_expired(true),
 		m_day_night_differs(false),
@@ -54,6 +82,35 @@ MapBlock::MapBlock(Map *parent, v3s16 pos, bool dummy):
 #endif
 }
 
+void MapBlock::addToDirtySet()
+{
+	m_in_dirty_set = true;
+	if(m_parent)
+		m_parent->addDirtyBlock(m_pos);
+}
+
+void MapBlock::takeContents(MapBlock *src)
+{
+	if(data)
+		delete[] data;
+	data = src->data;
+	src->data = NULL;
+
+	m_content_counts = src->m_content_counts;
+	m_content_mask = src->m_content_mask;
+	m_node_metadata.takeFrom(src->m_node_metadata);
+	m_static_objects = src->m_static_objects;
+	m_pristine = src->m_pristine;
+	is_underground = src->is_underground;
+	m_lighting_expired = src->m_lighting_expired;
+	m_day_night_differs = src->m_day_night_differs;
+	m_generated = src->m_generated;
+	m_timestamp = src->m_timestamp;
+	m_owner = src->m_owner;
+
+	m_change_counter++;
+}
+
 MapBlock::~MapBlock()
 {
 #ifndef SERVER
@@ -107,7 +164,10 @@ void MapBlock::setNodeParent(v3s16 p, MapNode & n)
 	{
 		if(data == NULL)
 			throw InvalidPositionException();
-		data[p.Z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + p.Y*MAP_BLOCKSIZE + p.X] = n;
+		MapNode &n0 = data[p.Z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + p.Y*MAP_BLOCKSIZE + p.X];
+		changeContentCount(n0.getContent(), n.getContent());
+		n0 = n;
+		m_change_counter++;
 	}
 }
 
@@ -410,6 +470,9 @@ bool MapBlock::propagateSunlight(core::map<v3s16, bool> & light_sources,
 		}
 	}
 
+	// Light was written to the nodes directly
+	m_change_counter++;
+
 	return block_below_is_valid;
 }
 
@@ -432,6 +495,8 @@ void MapBlock::copyFrom(VoxelManipulator &dst)
 	// Copy from VoxelManipulator to data
 	dst.copyTo(data, data_area, v3s16(0,0,0),
 			getPosRelative(), data_size);
+	recountContents();
+	m_change_counter++;
 }
 
 void MapBlock::updateDayNightDiff()
@@ -445,42 +510,90 @@ void MapBlock::updateDayNightDiff()
 	bool differs = false;
 
 	/*
-		Check if any lighting value differs
+		Check if any lighting value differs. If the whole thing is
+		just air, differ = false.
 	*/
-	for(u32 i=0; i<MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE; i++)
+	if(isAllContent(CONTENT_AIR) == false)
 	{
-		MapNode &n = data[i];
-		if(n.getLight(LIGHTBANK_DAY) != n.getLight(LIGHTBANK_NIGHT))
-		{
-			differs = true;
-			break;
-		}
-	}
-
-	/*
-		If some lighting values differ, check if the whole thing is
-		just air. If it is, differ = false
-	*/
-	if(differs)
-	{
-		bool only_air = true;
 		for(u32 i=0; i<MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE; i++)
 		{
 			MapNode &n = data[i];
-			if(n.getContent() != CONTENT_AIR)
+			if(n.getLight(LIGHTBANK_DAY) != n.getLight(LIGHTBANK_NIGHT))
 			{
-				only_air = false;
+				differs = true;
 				break;
 			}
 		}
-		if(only_air)
-			differs = false;
 	}
 
 	// Set member variable
+	if(differs != m_day_night_differs)
+		m_change_counter++;
 	m_day_night_differs = differs;
 }
 
+void MapBlock::changeContentCount(content_t c0, content_t c1)
+{
+	if(c0 == c1)
+		return;
+
+	for(u32 i=0; i<m_content_counts.size(); i++)
+	{
+		if(m_content_counts[i].content != c0)
+			continue;
+		m_content_counts[i].count--;
+		if(m_content_counts[i].count == 0)
+		{
+			m_content_counts.erase(i);
+			m_content_mask = 0;
+			for(u32 j=0; j<m_content_counts.size(); j++)
+				m_content_mask |= (u64)1 << (m_content_counts[j].content & 63);
+		}
+		break;
+	}
+
+	m_content_mask |= (u64)1 << (c1 & 63);
+	for(u32 i=0; i<m_content_counts.size(); i++)
+	{
+		if(m_content_counts[i].content == c1)
+		{
+			m_content_counts[i].count++;
+			return;
+		}
+	}
+	ContentCount cc;
+	cc.content = c1;
+	cc.count = 1;
+	m_content_counts.push_back(cc);
+}
+
+void MapBlock::recountContents()
+{
+	m_content_counts.clear();
+	m_content_mask = 0;
+	if(data == NULL)
+		return;
+
+	// Index of each content in m_content_counts plus one; 0 = not found
+	u16 index[MAX_CONTENT+1];
+	memset(index, 0, sizeof(index));
+
+	for(u32 i=0; i<MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE; i++)
+	{
+		content_t c = data[i].getContent();
+		if(index[c] == 0)
+		{
+			ContentCount cc;
+			cc.content = c;
+			cc.count = 0;
+			m_content_counts.push_back(cc);
+			index[c] = m_content_counts.size();
+			m_content_mask |= (u64)1 << (c & 63);
+		}
+		m_content_counts[index[c] - 1].count++;
+	}
+}
+
 s16 MapBlock::getGroundLevel(v2s16 p2d)
 {
 	if(isDummy())
@@ -511,7 +624,187 @@ s16 MapBlock::getGroundLevel(v2s16 p2d)
 	Serialization
 */
 
-void MapBlock::serialize(std::ostream &os, u8 version)
+/*
+	Node data of version 22 and up. Most blocks contain only a few
+	kinds of nodes and long stretches of equal light, so instead of
+	leaving everything to zlib:
+
+	u16 palette size n, 1...4096
+	n times (u8 param0, u8 param2): the distinct content/param2 pairs
+	if n > 1: for every node its palette index, in as few bits as hold
+	          n-1, packed starting from the lowest bit of each byte
+	u8 light format: 0 = a param1 byte for every node,
+	                 1 = runs of equal param1: u16 run count, then
+	                     for each run u16 length and u8 param1
+
+	A block of a single node type with uniform light takes 10 bytes.
+*/
+
+static u32 paletteIndexBits(u32 palette_size)
+{
+	u32 bits = 0;
+	while((1U<<bits) < palette_size)
+		bits++;
+	return bits;
+}
+
+static void serializeNodesPalette(MapNode *data, std::ostream &os, u8 version)
+{
+	u32 nodecount = MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE;
+
+	// Nodes in the wanted version
+	SharedBuffer<u8> foreign(nodecount*3);
+	for(u32 i=0; i<nodecount; i++)
+		data[i].serialize(&foreign[i*3], version);
+
+	/*
+		Build the palette. Equal nodes usually come in runs, so the
+		index of the previous node is tried first.
+	*/
+	core::array<u16> palette;
+	core::map<u16, u16> palette_indices;
+	SharedBuffer<u16> indices(nodecount);
+	u16 prev_key = 0;
+	u16 prev_index = 0;
+	for(u32 i=0; i<nodecount; i++)
+	{
+		u16 key = ((u16)foreign[i*3]<<8) | foreign[i*3+2];
+		if(palette.size() == 0 || key != prev_key)
+		{
+			core::map<u16, u16>::Node *n = palette_indices.find(key);
+			if(n == NULL)
+			{
+				prev_index = palette.size();
+				palette.push_back(key);
+				palette_indices.insert(key, prev_index);
+			}
+			else
+			{
+				prev_index = n->getValue();
+			}
+			prev_key = key;
+		}
+		indices[i] = prev_index;
+	}
+
+	writeU16(os, palette.size());
+	for(u32 i=0; i<palette.size(); i++)
+		writeU16(os, palette[i]);
+
+	u32 bits = paletteIndexBits(palette.size());
+	if(bits != 0)
+	{
+		SharedBuffer<u8> packed((nodecount*bits+7)/8);
+		memset(*packed, 0, packed.getSize());
+		u32 bitpos = 0;
+		for(u32 i=0; i<nodecount; i++)
+		{
+			for(u32 b=0; b<bits; b++, bitpos++)
+			{
+				if(indices[i] & (1<<b))
+					packed[bitpos/8] |= 1<<(bitpos%8);
+			}
+		}
+		os.write((char*)*packed, packed.getSize());
+	}
+
+	// Light
+	core::list<u32> run_starts;
+	for(u32 i=0; i<nodecount; i++)
+	{
+		if(i == 0 || foreign[i*3+1] != foreign[(i-1)*3+1])
+			run_starts.push_back(i);
+	}
+	if(run_starts.size()*3 + 2 >= nodecount)
+	{
+		writeU8(os, 0);
+		for(u32 i=0; i<nodecount; i++)
+			writeU8(os, foreign[i*3+1]);
+		return;
+	}
+	writeU8(os, 1);
+	writeU16(os, run_starts.size());
+	for(core::list<u32>::Iterator i = run_starts.begin();
+			i != run_starts.end(); i++)
+	{
+		core::list<u32>::Iterator next = i;
+		next++;
+		u32 end = (next == run_starts.end()) ? nodecount : *next;
+		writeU16(os, end - *i);
+		writeU8(os, foreign[*i*3+1]);
+	}
+}
+
+static void deSerializeNodesPalette(MapNode *data, std::istream &is, u8 version)
+{
+	u32 nodecount = MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE;
+
+	u32 palette_size = readU16(is);
+	if(palette_size == 0 || palette_size > nodecount)
+		throw SerializationError("MapBlock::deSerialize: invalid palette");
+	SharedBuffer<u16> palette(palette_size);
+	for(u32 i=0; i<palette_size; i++)
+		palette[i] = readU16(is);
+
+	SharedBuffer<u8> foreign(nodecount*3);
+
+	u32 bits = paletteIndexBits(palette_size);
+	SharedBuffer<u8> packed((nodecount*bits+7)/8 + 1);
+	is.read((char*)*packed, packed.getSize() - 1);
+	u32 bitpos = 0;
+	for(u32 i=0; i<nodecount; i++)
+	{
+		u32 index = 0;
+		for(u32 b=0; b<bits; b++, bitpos++)
+		{
+			if(packed[bitpos/8] & (1<<(bitpos%8)))
+				index |= 1<<b;
+		}
+		if(index >= palette_size)
+			throw SerializationError(
+					"MapBlock::deSerialize: invalid palette index");
+		foreign[i*3] = palette[index]>>8;
+		foreign[i*3+2] = palette[index]&0xff;
+	}
+
+	u8 light_format = readU8(is);
+	if(light_format == 0)
+	{
+		for(u32 i=0; i<nodecount; i++)
+			foreign[i*3+1] = readU8(is);
+	}
+	else if(light_format == 1)
+	{
+		u32 run_count = readU16(is);
+		u32 i = 0;
+		for(u32 r=0; r<run_count; r++)
+		{
+			u32 length = readU16(is);
+			u8 light = readU8(is);
+			if(i + length > nodecount)
+				throw SerializationError(
+						"MapBlock::deSerialize: invalid light runs");
+			for(u32 j=0; j<length; j++)
+				foreign[(i+j)*3+1] = light;
+			i += length;
+		}
+		if(i != nodecount)
+			throw SerializationError(
+					"MapBlock::deSerialize: invalid light runs");
+	}
+	else
+	{
+		throw SerializationError("MapBlock::deSerialize: invalid light format");
+	}
+
+	if(is.fail())
+		throw SerializationError("MapBlock::deSerialize: no enough input data");
+
+	for(u32 i=0; i<nodecount; i++)
+		data[i].deSerialize(&foreign[i*3], version);
+}
+
+void MapBlock::serialize(std::ostream &os, u8 version, u8 codec, s32 level)
 {
 	if(!ser_ver_supported(version))
 		throw VersionMismatchException("ERROR: MapBlock format not supported");
@@ -596,41 +889,58 @@ void MapBlock::serialize(std::ostream &os, u8 version)
 		os.write((char*)&flags, 1);
 
 		//j
-		if(version >= 21)
+		if(version >= 22)
+			writeU16(os, m_owner);
+		else if(version >= 21)
 			os << m_owner;
 
-		u32 nodecount = MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE;
-
-		/*
-			Get data
-		*/
-
-		// Serialize nodes
-		SharedBuffer<u8> databuf_nodelist(nodecount*3);
-		for(u32 i=0; i<nodecount; i++)
+		if(version >= 23)
 		{
-			data[i].serialize(&databuf_nodelist[i*3], version);
+			// Nodes and metadata are compressed as one
+			std::ostringstream oss(std::ios_base::binary);
+			serializeNodesPalette(data, oss, version);
+			m_node_metadata.serialize(oss);
+			compressWithCodec(oss.str(), os, codec, level);
 		}
-		
-		// Create buffer with different parameters sorted
-		SharedBuffer<u8> databuf(nodecount*3);
-		for(u32 i=0; i<nodecount; i++)
+		else if(version >= 22)
 		{
-			databuf[i] = databuf_nodelist[i*3];
-			databuf[i+nodecount] = databuf_nodelist[i*3+1];
-			databuf[i+nodecount*2] = databuf_nodelist[i*3+2];
+			serializeNodesPalette(data, os, version);
 		}
+		else
+		{
+			u32 nodecount = MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE;
 
-		/*
-			Compress data to output stream
-		*/
+			/*
+				Get data
+			*/
+
+			// Serialize nodes
+			SharedBuffer<u8> databuf_nodelist(nodecount*3);
+			for(u32 i=0; i<nodecount; i++)
+			{
+				data[i].serialize(&databuf_nodelist[i*3], version);
+			}
+			
+			// Create buffer with different parameters sorted
+			SharedBuffer<u8> databuf(nodecount*3);
+			for(u32 i=0; i<nodecount; i++)
+			{
+				databuf[i] = databuf_nodelist[i*3];
+				databuf[i+nodecount] = databuf_nodelist[i*3+1];
+				databuf[i+nodecount*2] = databuf_nodelist[i*3+2];
+			}
 
-		compress(databuf, os, version);
+			/*
+				Compress data to output stream
+			*/
+
+			compress(databuf, os, version);
+		}
 		
 		/*
 			NodeMetadata
 		*/
-		if(version >= 14)
+		if(version >= 14 && version <= 22)
 		{
 			if(version <= 15)
 			{
@@ -662,6 +972,8 @@ void MapBlock::deSerialize(std::istream &is, u8 version)
 	if(!ser_ver_supported(version))
 		throw VersionMismatchException("ERROR: MapBlock format not supported");
 
+	m_change_counter++;
+
 	// These have no lighting info
 	if(version <= 1)
 	{
@@ -759,32 +1071,57 @@ void MapBlock::deSerialize(std::istream &is, u8 version)
 			m_generated = (flags & 0x08) ? false : true;
 
 		//j
-		if(version >= 21)
+		if(version >= 22)
+			m_owner = readU16(is);
+		else if(version >= 21)
 			is >> m_owner;
 
-		// Uncompress data
-		std::ostringstream os(std::ios_base::binary);
-		decompress(is, os, version);
-		std::string s = os.str();
-		if(s.size() != nodecount*3)
-			throw SerializationError
-					("MapBlock::deSerialize: decompress resulted in size"
-					" other than nodecount*3");
-
-		// deserialize nodes from buffer
-		for(u32 i=0; i<nodecount; i++)
+		if(version >= 23)
+		{
+			std::ostringstream oss(std::ios_base::binary);
+			decompressWithCodec(is, oss);
+			std::istringstream iss(oss.str(), std::ios_base::binary);
+			deSerializeNodesPalette(data, iss, version);
+			// Ignore errors
+			try{
+				m_node_metadata.deSerialize(iss);
+			}
+			catch(SerializationError &e)
+			{
+				dstream<<"WARNING: MapBlock::deSerialize(): Ignoring an error"
+						<<" while deserializing node metadata"<<std::endl;
+			}
+		}
+		else if(version >= 22)
+		{
+			deSerializeNodesPalette(data, is, version);
+		}
+		else
 		{
-			u8 buf[3];
-			buf[0] = s[i];
-			buf[1] = s[i+nodecount];
-			buf[2] = s[i+nodecount*2];
-			data[i].deSerialize(buf, version);
+			// Uncompress data
+			std::ostringstream os(std::ios_base::binary);
+			decompress(is, os, version);
+			std::string s = os.str();
+			if(s.size() != nodecount*3)
+				throw SerializationError
+						("MapBlock::deSerialize: decompress resulted in size"
+						" other than nodecount*3");
+
+			// deserialize nodes from buffer
+			for(u32 i=0; i<nodecount; i++)
+			{
+				u8 buf[3];
+				buf[0] = s[i];
+				buf[1] = s[i+nodecount];
+				buf[2] = s[i+nodecount*2];
+				data[i].deSerialize(buf, version);
+			}
 		}
 		
 		/*
 			NodeMetadata
 		*/
-		if(version >= 14)
+		if(version >= 14 && version <= 22)
 		{
 			// Ignore errors
 			try{
@@ -810,6 +1147,8 @@ void MapBlock::deSerialize(std::istream &is, u8 version)
 			}
 		}
 	}
+
+	recountContents();
 }
 
 void MapBlock::serializeDiskExtra(std::ostream &os, u8 version)
@@ -131,6 +131,22 @@ class MapBlock /*: public NodeContainer*/
 	{
 		return m_parent;
 	}
+	/*
+		For blocks made without a map (see ServerMap::decodeBlocks()).
+		The block is added to the dirty set of parent when it changes
+		the next time.
+	*/
+	void setParent(Map *parent)
+	{
+		m_parent = parent;
+		m_in_dirty_set = false;
+	}
+	/*
+		Moves the nodes, metadata, objects and flags of a block that was
+		decoded outside the map into this one, e.g. a placeholder made
+		while it was being loaded. src is left a dummy.
+	*/
+	void takeContents(MapBlock *src);
 
 	void reallocate()
 	{
@@ -142,6 +158,7 @@ class MapBlock /*: public NodeContainer*/
 			//data[i] = MapNode();
 			data[i] = MapNode(CONTENT_IGNORE);
 		}
+		recountContents();
 		raiseModified(MOD_STATE_WRITE_NEEDED);
 	}
 
@@ -189,7 +206,12 @@ class MapBlock /*: public NodeContainer*/
 	// m_modified methods
 	void raiseModified(u32 mod)
 	{
+		if(m_in_dirty_set == false && mod != MOD_STATE_CLEAN)
+			addToDirtySet();
+		if(mod >= MOD_STATE_WRITE_NEEDED)
+			m_pristine = false;
 		m_modified = MYMAX(m_modified, mod);
+		m_change_counter++;
 	}
 	u32 getModified()
 	{
@@ -199,6 +221,35 @@ class MapBlock /*: public NodeContainer*/
 	{
 		m_modified = MOD_STATE_CLEAN;
 	}
+	// Called by the parent map when it drops the block from its dirty set
+	void removedFromDirtySet()
+	{
+		m_in_dirty_set = false;
+	}
+
+	/*
+		Set when the block has been left as the map generator made it.
+		Modifications that need saving clear it.
+		See ServerMap::saveBlock().
+	*/
+	void setPristine(bool pristine)
+	{
+		m_pristine = pristine;
+	}
+	bool isPristine()
+	{
+		return m_pristine;
+	}
+
+	/*
+		Identifies the current contents of the block: it changes
+		whenever the serialized form of the block may have changed, and
+		two blocks don't share it. Used for caching serializations.
+	*/
+	u64 getChangeStamp()
+	{
+		return ((u64)m_serial << 32) | m_change_counter;
+	}
 	
 	// is_underground getter/setter
 	bool getIsUnderground()
@@ -322,7 +373,9 @@ class MapBlock /*: public NodeContainer*/
 		if(x < 0 || x >= MAP_BLOCKSIZE) throw InvalidPositionException();
 		if(y < 0 || y >= MAP_BLOCKSIZE) throw InvalidPositionException();
 		if(z < 0 || z >= MAP_BLOCKSIZE) throw InvalidPositionException();
-		data[z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + y*MAP_BLOCKSIZE + x] = n;
+		MapNode &n0 = data[z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + y*MAP_BLOCKSIZE + x];
+		changeContentCount(n0.getContent(), n.getContent());
+		n0 = n;
 		raiseModified(MOD_STATE_WRITE_NEEDED);
 	}
 	
@@ -351,7 +404,9 @@ class MapBlock /*: public NodeContainer*/
 	{
 		if(data == NULL)
 			throw InvalidPositionException();
-		data[z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + y*MAP_BLOCKSIZE + x] = n;
+		MapNode &n0 = data[z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + y*MAP_BLOCKSIZE + x];
+		changeContentCount(n0.getContent(), n.getContent());
+		n0 = n;
 		raiseModified(MOD_STATE_WRITE_NEEDED);
 	}
 	
@@ -484,6 +539,45 @@ class MapBlock /*: public NodeContainer*/
 		return m_day_night_differs;
 	}
 
+	/*
+		Contents of the nodes.
+
+		The number of nodes of each content is kept up to date by the
+		methods that change the nodes, so these don't look at the nodes.
+	*/
+
+	// Number of nodes of content c
+	u32 getContentCount(content_t c)
+	{
+		if((m_content_mask & ((u64)1 << (c & 63))) == 0)
+			return 0;
+		for(u32 i=0; i<m_content_counts.size(); i++)
+		{
+			if(m_content_counts[i].content == c)
+				return m_content_counts[i].count;
+		}
+		return 0;
+	}
+	bool hasContent(content_t c)
+	{
+		return getContentCount(c) != 0;
+	}
+	// Whether every node is of content c
+	bool isAllContent(content_t c)
+	{
+		return getContentCount(c)
+				== MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE;
+	}
+	// The different contents in the block, in no particular order
+	u32 getContentTypeCount()
+	{
+		return m_content_counts.size();
+	}
+	content_t getContentType(u32 i)
+	{
+		return m_content_counts[i].content;
+	}
+
 	/*
 		Miscellaneous stuff
 	*/
@@ -536,6 +630,7 @@ class MapBlock /*: public NodeContainer*/
 	void setOwner(u16 o)
 	{
 		m_owner = o;
+		m_change_counter++;
 	}
 	u16 getOwner() const
 	{
@@ -545,7 +640,10 @@ class MapBlock /*: public NodeContainer*/
 	{
 		if(m_owner==0) return;
 		if(clansManager==NULL)return; //???
-		if(clansManager->clanDeleted(m_owner)) m_owner = 0;
+		if(clansManager->clanDeleted(m_owner)){
+			m_owner = 0;
+			m_change_counter++;
+		}
 	}
 
 
@@ -553,8 +651,10 @@ class MapBlock /*: public NodeContainer*/
 		Serialization
 	*/
 	
-	// These don't write or read version by itself
-	void serialize(std::ostream &os, u8 version);
+	// These don't write or read version by itself.
+	// The node data is compressed with codec at level from version 23 on.
+	void serialize(std::ostream &os, u8 version,
+			u8 codec=CODEC_ZLIB, s32 level=-1);
 	void deSerialize(std::istream &is, u8 version);
 	// Used after the basic ones when writing on disk (serverside)
 	void serializeDiskExtra(std::ostream &os, u8 version);
@@ -583,6 +683,11 @@ class MapBlock /*: public NodeContainer*/
 		return getNodeRef(p.X, p.Y, p.Z);
 	}
 
+	// Call when a node changes from content c0 to c1
+	void changeContentCount(content_t c0, content_t c1);
+	// Counts the contents of all nodes again
+	void recountContents();
+
 public:
 	/*
 		Public member variables
@@ -612,6 +717,19 @@ class MapBlock /*: public NodeContainer*/
 	*/
 	MapNode * data;
 
+	/*
+		Number of nodes of each content in data. A block usually has only
+		a few different contents, so they are in a short list.
+		Bit c%64 of m_content_mask is set if the list may have content c.
+	*/
+	struct ContentCount
+	{
+		content_t content;
+		u16 count;
+	};
+	core::array<ContentCount> m_content_counts;
+	u64 m_content_mask;
+
 	/*
 		- On the server, this is used for telling whether the
 		  block has been modified from the one on disk.
@@ -619,6 +737,18 @@ class MapBlock /*: public NodeContainer*/
 	*/
 	u32 m_modified;
 
+	/*
+		See getChangeStamp(). m_serial is unique to this block object
+		and m_change_counter is incremented on every change.
+	*/
+	u32 m_serial;
+	u32 m_change_counter;
+
+	// Whether the block is in Map::m_dirty_blocks of m_parent
+	bool m_in_dirty_set;
+	bool m_pristine;
+	void addToDirtySet();
+
 	/*
 		When propagating sunlight and the above block doesn't exist,
 		sunlight is assumed if this is false.
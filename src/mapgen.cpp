@@ -81,12 +81,19 @@ static s16 find_ground_level_clever(VoxelManipulator &vmanip, v2s16 p2d)
 #endif
 
 void make_tree(ManualMapVoxelManipulator &vmanip, v3s16 p0, bool is_apple_tree)
+{
+	PseudoRandom random(myrand());
+	make_tree(vmanip, p0, is_apple_tree, random);
+}
+
+void make_tree(ManualMapVoxelManipulator &vmanip, v3s16 p0, bool is_apple_tree,
+		PseudoRandom &random)
 {
 	MapNode treenode(CONTENT_TREE);
 	MapNode leavesnode(CONTENT_LEAVES);
 	MapNode applenode(CONTENT_APPLE);
 	
-	s16 trunk_h = myrand_range(4, 5);
+	s16 trunk_h = random.range(4, 5);
 	v3s16 p1 = p0;
 	for(s16 ii=0; ii<trunk_h; ii++)
 	{
@@ -121,9 +128,9 @@ void make_tree(ManualMapVoxelManipulator &vmanip, v3s16 p0, bool is_apple_tree)
 		s16 d = 1;
 
 		v3s16 p(
-			myrand_range(leaves_a.MinEdge.X, leaves_a.MaxEdge.X-d),
-			myrand_range(leaves_a.MinEdge.Y, leaves_a.MaxEdge.Y-d),
-			myrand_range(leaves_a.MinEdge.Z, leaves_a.MaxEdge.Z-d)
+			random.range(leaves_a.MinEdge.X, leaves_a.MaxEdge.X-d),
+			random.range(leaves_a.MinEdge.Y, leaves_a.MaxEdge.Y-d),
+			random.range(leaves_a.MinEdge.Z, leaves_a.MaxEdge.Z-d)
 		);
 
 		for(s16 z=0; z<=d; z++)
@@ -149,7 +156,7 @@ void make_tree(ManualMapVoxelManipulator &vmanip, v3s16 p0, bool is_apple_tree)
 			continue;
 		u32 i = leaves_a.index(x,y,z);
 		if(leaves_d[i] == 1) {
-			bool is_apple = myrand_range(0,99) < 10;
+			bool is_apple = random.range(0,99) < 10;
 			if(is_apple_tree && is_apple) {
 				vmanip.m_data[vi] = applenode;
 			} else {
@@ -159,7 +166,8 @@ void make_tree(ManualMapVoxelManipulator &vmanip, v3s16 p0, bool is_apple_tree)
 	}
 }
 
-static void make_jungletree(VoxelManipulator &vmanip, v3s16 p0)
+static void make_jungletree(VoxelManipulator &vmanip, v3s16 p0,
+		PseudoRandom &random)
 {
 	MapNode treenode(CONTENT_JUNGLETREE);
 	MapNode leavesnode(CONTENT_LEAVES);
@@ -167,7 +175,7 @@ static void make_jungletree(VoxelManipulator &vmanip, v3s16 p0)
 	for(s16 x=-1; x<=1; x++)
 	for(s16 z=-1; z<=1; z++)
 	{
-		if(myrand_range(0, 2) == 0)
+		if(random.range(0, 2) == 0)
 			continue;
 		v3s16 p1 = p0 + v3s16(x,0,z);
 		v3s16 p2 = p0 + v3s16(x,-1,z);
@@ -178,7 +186,7 @@ static void make_jungletree(VoxelManipulator &vmanip, v3s16 p0)
 			vmanip.m_data[vmanip.m_area.index(p1)] = treenode;
 	}
 
-	s16 trunk_h = myrand_range(8, 12);
+	s16 trunk_h = random.range(8, 12);
 	v3s16 p1 = p0;
 	for(s16 ii=0; ii<trunk_h; ii++)
 	{
@@ -213,9 +221,9 @@ static void make_jungletree(VoxelManipulator &vmanip, v3s16 p0)
 		s16 d = 1;
 
 		v3s16 p(
-			myrand_range(leaves_a.MinEdge.X, leaves_a.MaxEdge.X-d),
-			myrand_range(leaves_a.MinEdge.Y, leaves_a.MaxEdge.Y-d),
-			myrand_range(leaves_a.MinEdge.Z, leaves_a.MaxEdge.Z-d)
+			random.range(leaves_a.MinEdge.X, leaves_a.MaxEdge.X-d),
+			random.range(leaves_a.MinEdge.Y, leaves_a.MaxEdge.Y-d),
+			random.range(leaves_a.MinEdge.Z, leaves_a.MaxEdge.Z-d)
 		);
 
 		for(s16 z=0; z<=d; z++)
@@ -245,11 +253,11 @@ static void make_jungletree(VoxelManipulator &vmanip, v3s16 p0)
 	}
 }
 
-void make_papyrus(VoxelManipulator &vmanip, v3s16 p0)
+void make_papyrus(VoxelManipulator &vmanip, v3s16 p0, PseudoRandom &random)
 {
 	MapNode papyrusnode(CONTENT_PAPYRUS);
 
-	s16 trunk_h = myrand_range(2, 3);
+	s16 trunk_h = random.range(2, 3);
 	v3s16 p1 = p0;
 	for(s16 ii=0; ii<trunk_h; ii++)
 	{
@@ -1087,6 +1095,36 @@ bool is_cave(u64 seed, v3s16 p)
 	return d1*d2 > CAVE_NOISE_THRESHOLD;
 }
 
+/*
+	val_is_ground() with its 2D noise already made: f is the factor of
+	the density noise and h the height it is compared to
+*/
+static bool val_is_ground(double ground_noise1_val, s16 y, double f,
+		double h)
+{
+	return ((double)y - h < ground_noise1_val * f);
+}
+
+static double ground_noise_factor(double f)
+{
+	if(f < 0.01)
+		f = 0.01;
+	else if(f >= 1.0)
+		f *= 1.6;
+	return f;
+}
+
+// The 2D noise of val_is_ground() at one column
+static void ground_noise_2d(u64 seed, v2s16 p2d, double &f, double &h)
+{
+	f = ground_noise_factor(0.55 + noise2d_perlin(
+			0.5+(float)p2d.X/250, 0.5+(float)p2d.Y/250,
+			seed+920381, 3, 0.45));
+	h = WATER_LEVEL + 10 * noise2d_perlin(
+			0.5+(float)p2d.X/250, 0.5+(float)p2d.Y/250,
+			seed+84174, 4, 0.5);
+}
+
 /*
 	Ground density noise shall be interpreted by using this.
 
@@ -1098,19 +1136,39 @@ bool val_is_ground(double ground_noise1_val, v3s16 p, u64 seed)
 {
 	//return ((double)p.Y < ground_noise1_val);
 
-	double f = 0.55 + noise2d_perlin(
-			0.5+(float)p.X/250, 0.5+(float)p.Z/250,
-			seed+920381, 3, 0.45);
-	if(f < 0.01)
-		f = 0.01;
-	else if(f >= 1.0)
-		f *= 1.6;
-	double h = WATER_LEVEL + 10 * noise2d_perlin(
-			0.5+(float)p.X/250, 0.5+(float)p.Z/250,
-			seed+84174, 4, 0.5);
+	double f, h;
+	ground_noise_2d(seed, v2s16(p.X, p.Z), f, h);
 	/*double f = 1;
 	double h = 0;*/
-	return ((double)p.Y - h < ground_noise1_val * f);
+	return val_is_ground(ground_noise1_val, p.Y, f, h);
+}
+
+/*
+	Makes the 2D noise of val_is_ground() for the columns from p_min to
+	p_max at once. The value of (x,z) goes to
+	[(z-p_min.Y)*(p_max.X-p_min.X+1) + (x-p_min.X)].
+*/
+static void make_ground_noise_2d(u64 seed, v2s16 p_min, v2s16 p_max,
+		double *fs, double *hs)
+{
+	s16 size_x = p_max.X - p_min.X + 1;
+	s16 size_z = p_max.Y - p_min.Y + 1;
+	core::array<double> xs(size_x);
+	core::array<double> zs(size_z);
+	for(s16 x=0; x<size_x; x++)
+		xs.push_back(0.5+(float)(p_min.X+x)/250);
+	for(s16 z=0; z<size_z; z++)
+		zs.push_back(0.5+(float)(p_min.Y+z)/250);
+
+	noise2d_perlin_bulk(fs, 1, size_x, xs.pointer(), size_x,
+			zs.pointer(), size_z, seed+920381, 3, 0.45);
+	noise2d_perlin_bulk(hs, 1, size_x, xs.pointer(), size_x,
+			zs.pointer(), size_z, seed+84174, 4, 0.5);
+	for(s32 i=0; i<size_x*size_z; i++)
+	{
+		fs[i] = ground_noise_factor(0.55 + fs[i]);
+		hs[i] = WATER_LEVEL + 10 * hs[i];
+	}
 }
 
 /*
@@ -1122,6 +1180,15 @@ bool is_ground(u64 seed, v3s16 p)
 	return val_is_ground(val1, p, seed);
 }
 
+/*
+	is_ground() with the 2D noise of the column already made
+*/
+static bool is_ground(u64 seed, v3s16 p, double f, double h)
+{
+	double val1 = noise3d_param(get_ground_noise1_params(seed), p.X,p.Y,p.Z);
+	return val_is_ground(val1, p.Y, f, h);
+}
+
 // Amount of trees per area in nodes
 double tree_amount_2d(u64 seed, v2s16 p)
 {
@@ -1183,8 +1250,14 @@ double largestone_amount_2d(u64 seed, v2s16 p)
 s16 find_ground_level_from_noise(u64 seed, v2s16 p2d, s16 precision)
 {
 	// Start a bit fuzzy to make averaging lower precision values
-	// more useful
-	s16 level = myrand_range(-precision/2, precision/2);
+	// more useful. The same place gets the same fuzz every time, so
+	// that make_block() is deterministic.
+	PseudoRandom fuzzrandom((u32)(seed%0x100000000ULL)
+			+ p2d.Y*38134234 + p2d.X*23);
+	s16 level = fuzzrandom.range(-precision/2, precision/2);
+	// The 2D part of is_ground() is the same all the way
+	double f, h;
+	ground_noise_2d(seed, p2d, f, h);
 	s16 dec[] = {31000, 100, 20, 4, 1, 0};
 	s16 i;
 	for(i = 1; dec[i] != 0 && precision <= dec[i]; i++)
@@ -1196,7 +1269,7 @@ s16 find_ground_level_from_noise(u64 seed, v2s16 p2d, s16 precision)
 			v3s16 p(p2d.X, level, p2d.Y);
 			for(; p.Y < max; p.Y += dec[i])
 			{
-				if(!is_ground(seed, p))
+				if(!is_ground(seed, p, f, h))
 				{
 					level = p.Y;
 					break;
@@ -1210,7 +1283,7 @@ s16 find_ground_level_from_noise(u64 seed, v2s16 p2d, s16 precision)
 			v3s16 p(p2d.X, level, p2d.Y);
 			for(; p.Y>min; p.Y-=dec[i])
 			{
-				bool ground = is_ground(seed, p);
+				bool ground = is_ground(seed, p, f, h);
 				/*if(dec[i] == 1 && is_cave(seed, p))
 					ground = false;*/
 				if(ground)
@@ -1311,10 +1384,22 @@ double get_sector_minimum_ground_level(u64 seed, v2s16 sectorpos, double p)
 	return a;
 }
 
-bool block_is_underground(u64 seed, v3s16 blockpos)
+bool block_is_underground(u64 seed, v3s16 blockpos,
+		SectorNoiseCache *cache)
 {
-	s16 minimum_groundlevel = (s16)get_sector_minimum_ground_level(
-			seed, v2s16(blockpos.X, blockpos.Z));
+	v2s16 sectorpos(blockpos.X, blockpos.Z);
+	s16 minimum_groundlevel;
+	if(cache)
+	{
+		SectorNoise sectornoise;
+		cache->get(seed, sectorpos, sectornoise);
+		minimum_groundlevel = (s16)sectornoise.minimum_ground_level;
+	}
+	else
+	{
+		minimum_groundlevel = (s16)get_sector_minimum_ground_level(
+				seed, sectorpos);
+	}
 	
 	if(blockpos.Y*MAP_BLOCKSIZE + MAP_BLOCKSIZE <= minimum_groundlevel)
 		return true;
@@ -1390,6 +1475,11 @@ double get_mud_add_amount(u64 seed, v2s16 p)
 }
 #endif
 
+static bool sand_noise_has_sand(double sandnoise)
+{
+	return (sandnoise > -0.15);
+}
+
 bool get_have_sand(u64 seed, v2s16 p2d)
 {
 	// Determine whether to have sand here
@@ -1397,7 +1487,195 @@ bool get_have_sand(u64 seed, v2s16 p2d)
 			0.5+(float)p2d.X/500, 0.5+(float)p2d.Y/500,
 			seed+59420, 3, 0.50);
 
-	return (sandnoise > -0.15);
+	return sand_noise_has_sand(sandnoise);
+}
+
+/*
+	The noise of get_have_sand() for the columns from p_min to p_max,
+	indexed like in make_ground_noise_2d()
+*/
+static void make_sand_noise_2d(u64 seed, v2s16 p_min, v2s16 p_max,
+		double *sandnoise)
+{
+	s16 size_x = p_max.X - p_min.X + 1;
+	s16 size_z = p_max.Y - p_min.Y + 1;
+	core::array<double> xs(size_x);
+	core::array<double> zs(size_z);
+	for(s16 x=0; x<size_x; x++)
+		xs.push_back(0.5+(float)(p_min.X+x)/500);
+	for(s16 z=0; z<size_z; z++)
+		zs.push_back(0.5+(float)(p_min.Y+z)/500);
+
+	noise2d_perlin_bulk(sandnoise, 1, size_x,
+			xs.pointer(), size_x, zs.pointer(), size_z,
+			seed+59420, 3, 0.50);
+}
+
+void make_sector_noise(u64 seed, v2s16 sectorpos, SectorNoise &dst)
+{
+	dst.average_ground_level = get_sector_average_ground_level(
+			seed, sectorpos);
+	dst.minimum_ground_level = get_sector_minimum_ground_level(
+			seed, sectorpos);
+	dst.maximum_ground_level = get_sector_maximum_ground_level(
+			seed, sectorpos, 1);
+
+	v2s16 node_min = sectorpos*MAP_BLOCKSIZE;
+	v2s16 node_max = node_min + v2s16(1,1)*(MAP_BLOCKSIZE-1);
+	v2s16 p2d_center = node_min + v2s16(1,1)*(MAP_BLOCKSIZE/2);
+	dst.tree_amount = tree_amount_2d(seed, p2d_center);
+	dst.surface_humidity = surface_humidity_2d(seed, p2d_center);
+
+	make_ground_noise_2d(seed, node_min, node_max,
+			dst.ground_f, dst.ground_h);
+	make_sand_noise_2d(seed, node_min, node_max, dst.sandnoise);
+}
+
+/*
+	SectorNoiseCache
+*/
+
+#define GROUND_LEVEL_UNKNOWN -32768
+
+SectorNoiseCache::SectorNoiseCache(u32 max_sectors):
+	m_max_sectors(max_sectors),
+	m_seed(0),
+	m_use_counter(0),
+	m_hits(0),
+	m_misses(0)
+{
+	m_mutex.Init();
+	assert(m_mutex.IsInitialized());
+	assert(m_max_sectors >= 1);
+}
+
+SectorNoiseCache::~SectorNoiseCache()
+{
+	for(core::map<v2s16, Entry*>::Iterator i = m_entries.getIterator();
+			i.atEnd() == false; i++)
+		delete i.getNode()->getValue();
+}
+
+void SectorNoiseCache::get(u64 seed, v2s16 sectorpos, SectorNoise &dst)
+{
+	{
+		JMutexAutoLock lock(m_mutex);
+		Entry *e = getEntry(seed, sectorpos);
+		if(e->have_noise)
+		{
+			m_hits++;
+			dst = e->noise;
+			return;
+		}
+		m_misses++;
+	}
+
+	// Made without the lock so that other threads can use the cache
+	make_sector_noise(seed, sectorpos, dst);
+
+	JMutexAutoLock lock(m_mutex);
+	Entry *e = getEntry(seed, sectorpos);
+	e->noise = dst;
+	e->have_noise = true;
+}
+
+s16 SectorNoiseCache::getGroundLevel(u64 seed, v2s16 p2d, s16 precision)
+{
+	if(precision != 1 && precision != 4)
+		return find_ground_level_from_noise(seed, p2d, precision);
+
+	v2s16 sectorpos = getNodeSectorPos(p2d);
+	v2s16 rel = p2d - sectorpos*MAP_BLOCKSIZE;
+	u32 i = rel.Y*MAP_BLOCKSIZE + rel.X;
+	{
+		JMutexAutoLock lock(m_mutex);
+		Entry *e = getEntry(seed, sectorpos);
+		s16 level = (precision == 1 ?
+				e->ground_level_1[i] : e->ground_level_4[i]);
+		if(level != GROUND_LEVEL_UNKNOWN)
+		{
+			m_hits++;
+			return level;
+		}
+		m_misses++;
+	}
+
+	s16 level = find_ground_level_from_noise(seed, p2d, precision);
+
+	JMutexAutoLock lock(m_mutex);
+	Entry *e = getEntry(seed, sectorpos);
+	if(precision == 1)
+		e->ground_level_1[i] = level;
+	else
+		e->ground_level_4[i] = level;
+	return level;
+}
+
+u32 SectorNoiseCache::size()
+{
+	JMutexAutoLock lock(m_mutex);
+	return m_entries.size();
+}
+
+u32 SectorNoiseCache::getMaxBytes()
+{
+	return m_max_sectors * sizeof(Entry);
+}
+
+float SectorNoiseCache::getHitRate()
+{
+	JMutexAutoLock lock(m_mutex);
+	if(m_hits + m_misses == 0)
+		return 0;
+	return 100.0 * m_hits / (m_hits + m_misses);
+}
+
+SectorNoiseCache::Entry * SectorNoiseCache::getEntry(u64 seed,
+		v2s16 sectorpos)
+{
+	// The map's seed is known only after its metadata is loaded
+	if(seed != m_seed)
+	{
+		for(core::map<v2s16, Entry*>::Iterator i = m_entries.getIterator();
+				i.atEnd() == false; i++)
+			delete i.getNode()->getValue();
+		m_entries.clear();
+		m_seed = seed;
+	}
+
+	core::map<v2s16, Entry*>::Node *n = m_entries.find(sectorpos);
+	if(n != NULL)
+	{
+		Entry *e = n->getValue();
+		e->last_used = ++m_use_counter;
+		return e;
+	}
+
+	// Drop the least recently used one if the cache is full
+	if(m_entries.size() >= m_max_sectors)
+	{
+		core::map<v2s16, Entry*>::Node *oldest = NULL;
+		for(core::map<v2s16, Entry*>::Iterator i = m_entries.getIterator();
+				i.atEnd() == false; i++)
+		{
+			if(oldest == NULL || i.getNode()->getValue()->last_used
+					< oldest->getValue()->last_used)
+				oldest = i.getNode();
+		}
+		delete oldest->getValue();
+		m_entries.remove(oldest->getKey());
+	}
+
+	Entry *e = new Entry;
+	e->have_noise = false;
+	for(u32 i=0; i<MAP_BLOCKSIZE*MAP_BLOCKSIZE; i++)
+	{
+		e->ground_level_1[i] = GROUND_LEVEL_UNKNOWN;
+		e->ground_level_4[i] = GROUND_LEVEL_UNKNOWN;
+	}
+	e->last_used = ++m_use_counter;
+	m_entries.insert(sectorpos, e);
+	return e;
 }
 
 /*
@@ -1469,6 +1747,45 @@ void add_random_objects(MapBlock *block)
 #endif
 }
 
+const char * get_phase_name(u32 phase)
+{
+	const char *names[MAPGEN_PHASE_COUNT] = {
+		"init",
+		"noise",
+		"ground and caves",
+		"minerals",
+		"dungeons",
+		"surface",
+		"trees",
+		"blit",
+		"lighting",
+		"finish",
+	};
+	assert(phase < MAPGEN_PHASE_COUNT);
+	return names[phase];
+}
+
+/*
+	Adds the time since time_us to the phase and starts the next one
+*/
+static void end_phase(BlockMakeData *data, MapgenPhase phase, u32 &time_us)
+{
+	u32 now = porting::getTimeUs();
+	data->phase_us[phase] += now - time_us;
+	time_us = now;
+}
+
+/*
+	find_ground_level_from_noise() through the cache of data if it has one
+*/
+static s16 find_ground_level(BlockMakeData *data, v2s16 p2d, s16 precision)
+{
+	if(data->sector_noise_cache)
+		return data->sector_noise_cache->getGroundLevel(
+				data->seed, p2d, precision);
+	return find_ground_level_from_noise(data->seed, p2d, precision);
+}
+
 void make_block(BlockMakeData *data)
 {
 	if(data->no_op)
@@ -1482,6 +1799,8 @@ void make_block(BlockMakeData *data)
 	/*dstream<<"makeBlock(): ("<<blockpos.X<<","<<blockpos.Y<<","
 			<<blockpos.Z<<")"<<std::endl;*/
 
+	u32 phase_start_us = porting::getTimeUs();
+
 	ManualMapVoxelManipulator &vmanip = *(data->vmanip);
 	v3s16 blockpos_min = blockpos - v3s16(1,1,1);
 	v3s16 blockpos_max = blockpos + v3s16(1,1,1);
@@ -1496,23 +1815,32 @@ void make_block(BlockMakeData *data)
 
 	v2s16 p2d_center(node_min.X+MAP_BLOCKSIZE/2, node_min.Z+MAP_BLOCKSIZE/2);
 
+	/*
+		Get the noise of the sector, shared by the blocks of the column
+	*/
+
+	SectorNoise sectornoise;
+	if(data->sector_noise_cache)
+		data->sector_noise_cache->get(data->seed,
+				v2s16(blockpos.X, blockpos.Z), sectornoise);
+	else
+		make_sector_noise(data->seed, v2s16(blockpos.X, blockpos.Z),
+				sectornoise);
+
 	/*
 		Get average ground level from noise
 	*/
 	
-	s16 approx_groundlevel = (s16)get_sector_average_ground_level(
-			data->seed, v2s16(blockpos.X, blockpos.Z));
+	s16 approx_groundlevel = (s16)sectornoise.average_ground_level;
 	//dstream<<"approx_groundlevel="<<approx_groundlevel<<std::endl;
 	
 	s16 approx_ground_depth = approx_groundlevel - (node_min.Y+MAP_BLOCKSIZE/2);
 	
-	s16 minimum_groundlevel = (s16)get_sector_minimum_ground_level(
-			data->seed, v2s16(blockpos.X, blockpos.Z));
+	s16 minimum_groundlevel = (s16)sectornoise.minimum_ground_level;
 	// Minimum amount of ground above the top of the central block
 	s16 minimum_ground_depth = minimum_groundlevel - node_max.Y;
 
-	s16 maximum_groundlevel = (s16)get_sector_maximum_ground_level(
-			data->seed, v2s16(blockpos.X, blockpos.Z), 1);
+	s16 maximum_groundlevel = (s16)sectornoise.maximum_ground_level;
 	// Maximum amount of ground above the bottom of the central block
 	s16 maximum_ground_depth = maximum_groundlevel - node_min.Y;
 
@@ -1624,6 +1952,8 @@ void make_block(BlockMakeData *data)
 				sl.X, sl.Y, sl.Z);
 	}
 	
+	end_phase(data, MAPGEN_PHASE_NOISE, phase_start_us);
+
 	/*
 		Make base ground level
 	*/
@@ -1633,6 +1963,7 @@ void make_block(BlockMakeData *data)
 	{
 		// Node position
 		v2s16 p2d(x,z);
+		u32 column = (z-node_min.Z)*MAP_BLOCKSIZE + (x-node_min.X);
 		{
 			// Use fast index incrementing
 			v3s16 em = vmanip.m_area.getExtent();
@@ -1645,8 +1976,9 @@ void make_block(BlockMakeData *data)
 					// First priority: make air and water.
 					// This avoids caves inside water.
 					if(all_is_ground_except_caves == false
-							&& val_is_ground(noisebuf_ground.get(x,y,z),
-							v3s16(x,y,z), data->seed) == false)
+							&& val_is_ground(noisebuf_ground.get(x,y,z), y,
+							sectornoise.ground_f[column],
+							sectornoise.ground_h[column]) == false)
 					{
 						if(y <= WATER_LEVEL)
 							vmanip.m_data[i] = MapNode(CONTENT_WATERSOURCE);
@@ -1664,6 +1996,8 @@ void make_block(BlockMakeData *data)
 		}
 	}
 
+	end_phase(data, MAPGEN_PHASE_GROUND, phase_start_us);
+
 	/*
 		Add minerals
 	*/
@@ -1843,6 +2177,8 @@ void make_block(BlockMakeData *data)
 		}
 	}
 
+	end_phase(data, MAPGEN_PHASE_MINERALS, phase_start_us);
+
 	/*
 		Add dungeons
 	*/
@@ -1936,6 +2272,8 @@ void make_block(BlockMakeData *data)
 		}
 	}
 	
+	end_phase(data, MAPGEN_PHASE_DUNGEONS, phase_start_us);
+
 	/*
 		Add top and bottom side of water to transforming_liquid queue
 	*/
@@ -1995,8 +2333,10 @@ void make_block(BlockMakeData *data)
 		{
 			// Node position
 			v2s16 p2d(x,z);
+			u32 column = (z-node_min.Z)*MAP_BLOCKSIZE + (x-node_min.X);
 			{
-				bool possibly_have_sand = get_have_sand(data->seed, p2d);
+				bool possibly_have_sand =
+						sand_noise_has_sand(sectornoise.sandnoise[column]);
 				bool have_sand = false;
 				u32 current_depth = 0;
 				bool air_detected = false;
@@ -2071,14 +2411,16 @@ void make_block(BlockMakeData *data)
 			}
 		}
 
+		end_phase(data, MAPGEN_PHASE_SURFACE, phase_start_us);
+
 		/*
 			Calculate some stuff
 		*/
 		
-		float surface_humidity = surface_humidity_2d(data->seed, p2d_center);
+		float surface_humidity = sectornoise.surface_humidity;
 		bool is_jungle = surface_humidity > 0.75;
 		// Amount of trees
-		u32 tree_count = block_area_nodes * tree_amount_2d(data->seed, p2d_center);
+		u32 tree_count = block_area_nodes * sectornoise.tree_amount;
 		if(is_jungle)
 			tree_count *= 5;
 
@@ -2092,7 +2434,7 @@ void make_block(BlockMakeData *data)
 			s16 x = treerandom.range(node_min.X, node_max.X);
 			s16 z = treerandom.range(node_min.Z, node_max.Z);
 			//s16 y = find_ground_level(data->vmanip, v2s16(x,z));
-			s16 y = find_ground_level_from_noise(data->seed, v2s16(x,z), 4);
+			s16 y = find_ground_level(data, v2s16(x,z), 4);
 			// Don't make a tree under water level
 			if(y < WATER_LEVEL)
 				continue;
@@ -2130,7 +2472,7 @@ void make_block(BlockMakeData *data)
 				if(n->getContent() == CONTENT_MUD && y <= WATER_LEVEL)
 				{
 					p.Y++;
-					make_papyrus(vmanip, p);
+					make_papyrus(vmanip, p, treerandom);
 				}
 				// Trees grow only on mud and grass, on land
 				else if((n->getContent() == CONTENT_MUD || n->getContent() == CONTENT_GRASS) && y > WATER_LEVEL + 2)
@@ -2140,16 +2482,16 @@ void make_block(BlockMakeData *data)
 					if(is_jungle == false)
 					{
 						bool is_apple_tree;
-						if(myrand_range(0,4) != 0)
+						if(treerandom.range(0,4) != 0)
 							is_apple_tree = false;
 						else
 							is_apple_tree = noise2d_perlin(
 									0.5+(float)p.X/100, 0.5+(float)p.Z/100,
 									data->seed+342902, 3, 0.45) > 0.2;
-						make_tree(vmanip, p, is_apple_tree);
+						make_tree(vmanip, p, is_apple_tree, treerandom);
 					}
 					else
-						make_jungletree(vmanip, p);
+						make_jungletree(vmanip, p, treerandom);
 				}
 				// Cactii grow only on sand, on land
 				else if(n->getContent() == CONTENT_SAND && y > WATER_LEVEL + 2)
@@ -2170,7 +2512,7 @@ void make_block(BlockMakeData *data)
 			{
 				s16 x = grassrandom.range(node_min.X, node_max.X);
 				s16 z = grassrandom.range(node_min.Z, node_max.Z);
-				s16 y = find_ground_level_from_noise(data->seed, v2s16(x,z), 4);
+				s16 y = find_ground_level(data, v2s16(x,z), 4);
 				if(y < WATER_LEVEL)
 					continue;
 				if(y < node_min.Y || y > node_max.Y)
@@ -2276,15 +2618,57 @@ void make_block(BlockMakeData *data)
 			make_largestone(data->vmanip, p);
 		}
 #endif
+
+		end_phase(data, MAPGEN_PHASE_TREES, phase_start_us);
+	}
+	else
+	{
+		end_phase(data, MAPGEN_PHASE_SURFACE, phase_start_us);
 	}
+}
+
+void make_block_alone(u64 seed, v3s16 blockpos, MapBlock *dst,
+		SectorNoiseCache *cache)
+{
+	BlockMakeData data;
+	data.seed = seed;
+	data.sector_noise_cache = cache;
+	data.blockpos = blockpos;
+	data.vmanip = new ManualMapVoxelManipulator(NULL);
 
+	// Like in ServerMap::initBlockMake()
+	if(blockpos_over_limit(blockpos - v3s16(1,1,1)) ||
+		blockpos_over_limit(blockpos + v3s16(1,1,1)))
+		data.no_op = true;
+
+	/*
+		What initBlockMake() gives to make_block() when this and the
+		neighboring blocks have just been created blank
+	*/
+	VoxelArea area((blockpos-1)*MAP_BLOCKSIZE,
+			(blockpos+2)*MAP_BLOCKSIZE-v3s16(1,1,1));
+	data.vmanip->addArea(area);
+	for(s32 i=0; i<area.getVolume(); i++)
+	{
+		data.vmanip->m_data[i] = MapNode(CONTENT_IGNORE);
+		data.vmanip->m_flags[i] = 0;
+	}
+
+	make_block(&data);
+
+	dst->copyFrom(*data.vmanip);
+	dst->setIsUnderground(block_is_underground(seed, blockpos, cache));
 }
 
 BlockMakeData::BlockMakeData():
 	no_op(false),
 	vmanip(NULL),
-	seed(0)
-{}
+	seed(0),
+	sector_noise_cache(NULL)
+{
+	for(u32 i=0; i<MAPGEN_PHASE_COUNT; i++)
+		phase_us[i] = 0;
+}
 
 BlockMakeData::~BlockMakeData()
 {
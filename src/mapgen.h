@@ -22,27 +22,53 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 
 #include "common_irrlicht.h"
 #include "utility.h" // UniqueQueue
+#include "constants.h"
 
 struct BlockMakeData;
 class MapBlock;
 class ManualMapVoxelManipulator;
+class PseudoRandom;
 
 namespace mapgen
 {
+	/*
+		Version of what make_block() makes of a seed. Increase it when
+		that changes, so that blocks stored as generated markers (see
+		ServerMap::saveBlock()) aren't made again differently.
+	*/
+	const u16 MAPGEN_VERSION = 1;
+
+	class SectorNoiseCache;
+
 	// Finds precise ground level at any position
 	s16 find_ground_level_from_noise(u64 seed, v2s16 p2d, s16 precision);
 
 	// Find out if block is completely underground
-	bool block_is_underground(u64 seed, v3s16 blockpos);
+	bool block_is_underground(u64 seed, v3s16 blockpos,
+			SectorNoiseCache *cache=NULL);
 
-	// Main map generation routine
+	/*
+		Main map generation routine.
+		The result only depends on the seed, the block position and
+		what data->vmanip had in it.
+	*/
 	void make_block(BlockMakeData *data);
+
+	/*
+		Makes the block at blockpos like make_block() does when none of
+		the blocks around it have been generated yet, into dst. Only
+		the nodes (without lighting) and is_underground are set.
+	*/
+	void make_block_alone(u64 seed, v3s16 blockpos, MapBlock *dst,
+			SectorNoiseCache *cache=NULL);
 	
 	// Add objects according to block content
 	void add_random_objects(MapBlock *block);
 
 	// Add a tree
 	void make_tree(ManualMapVoxelManipulator &vmanip, v3s16 p0, bool is_apple_tree);
+	void make_tree(ManualMapVoxelManipulator &vmanip, v3s16 p0, bool is_apple_tree,
+			PseudoRandom &random);
 	
 	/*
 		These are used by FarMesh
@@ -51,12 +77,117 @@ namespace mapgen
 	double tree_amount_2d(u64 seed, v2s16 p);
 	
 
+	/*
+		What make_block() needs of a sector (a column of blocks). It only
+		depends on the seed and the position of the sector.
+	*/
+	struct SectorNoise
+	{
+		// get_sector_*_ground_level()
+		double average_ground_level;
+		double minimum_ground_level;
+		double maximum_ground_level;
+		// Amounts at the center of the sector
+		double tree_amount;
+		double surface_humidity;
+		/*
+			2D noise of val_is_ground() (factor f and height h) and of
+			get_have_sand() for each column, at [z*MAP_BLOCKSIZE+x]
+		*/
+		double ground_f[MAP_BLOCKSIZE*MAP_BLOCKSIZE];
+		double ground_h[MAP_BLOCKSIZE*MAP_BLOCKSIZE];
+		double sandnoise[MAP_BLOCKSIZE*MAP_BLOCKSIZE];
+	};
+
+	void make_sector_noise(u64 seed, v2s16 sectorpos, SectorNoise &dst);
+
+	/*
+		Keeps the SectorNoise of the sectors used last, so that the blocks
+		of a column don't make it again each, and the ground levels found
+		in them with find_ground_level_from_noise(). Thread safe.
+	*/
+	class SectorNoiseCache
+	{
+	public:
+		SectorNoiseCache(u32 max_sectors);
+		~SectorNoiseCache();
+
+		// Copies the noise of a sector to dst, making it if needed
+		void get(u64 seed, v2s16 sectorpos, SectorNoise &dst);
+		// find_ground_level_from_noise(); precisions 1 and 4 are kept
+		s16 getGroundLevel(u64 seed, v2s16 p2d, s16 precision);
+
+		u32 size();
+		// Most memory the cached sectors can take
+		u32 getMaxBytes();
+		// Percentage of get() and getGroundLevel() calls found cached
+		float getHitRate();
+
+	private:
+		struct Entry
+		{
+			bool have_noise;
+			SectorNoise noise;
+			// Found ground levels, [z*MAP_BLOCKSIZE+x]; -32768 if not yet
+			s16 ground_level_1[MAP_BLOCKSIZE*MAP_BLOCKSIZE];
+			s16 ground_level_4[MAP_BLOCKSIZE*MAP_BLOCKSIZE];
+			u32 last_used;
+		};
+
+		// m_mutex must be locked. Evicts the least recently used
+		// sector if the cache is full.
+		Entry * getEntry(u64 seed, v2s16 sectorpos);
+
+		JMutex m_mutex;
+		u32 m_max_sectors;
+		u64 m_seed;
+		core::map<v2s16, Entry*> m_entries;
+		u32 m_use_counter;
+		u32 m_hits;
+		u32 m_misses;
+	};
+
+	/*
+		Phases of generating a block, timed in BlockMakeData::phase_us
+	*/
+	enum MapgenPhase
+	{
+		/*
+			ServerMap::initBlockMake(): copying the area from the map,
+			and mostly making the noise of the sectors around for
+			block_is_underground()
+		*/
+		MAPGEN_PHASE_INIT,
+		// Noise of the sector and the 3D noise buffers
+		MAPGEN_PHASE_NOISE,
+		// Stone, air and water; caves are left out of the stone
+		MAPGEN_PHASE_GROUND,
+		// Minerals, and mud and sand in the stone
+		MAPGEN_PHASE_MINERALS,
+		MAPGEN_PHASE_DUNGEONS,
+		// Grass, mud and sand on top, and water to flow
+		MAPGEN_PHASE_SURFACE,
+		MAPGEN_PHASE_TREES,
+		// Done in ServerMap::finishBlockMake()
+		MAPGEN_PHASE_BLIT,
+		MAPGEN_PHASE_LIGHTING,
+		// Day/night differences and marking the changed blocks modified
+		MAPGEN_PHASE_FINISH,
+		MAPGEN_PHASE_COUNT
+	};
+
+	const char * get_phase_name(u32 phase);
+
 	struct BlockMakeData
 	{
 		bool no_op;
 		ManualMapVoxelManipulator *vmanip;
 		u64 seed;
 		v3s16 blockpos;
+		// NULL makes the noise of the sectors again
+		SectorNoiseCache *sector_noise_cache;
+		// Microseconds taken by each MapgenPhase
+		u32 phase_us[MAPGEN_PHASE_COUNT];
 		UniqueQueue<v3s16> transforming_liquid;
 
 		BlockMakeData();
@@ -0,0 +1,166 @@
+/*
+Minetest-c55
+Copyright (C) 2010-2011 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "mapmigrate.h"
+#include "mapblock.h"
+#include "serialization.h"
+#include "debug.h"
+#include "log.h"
+
+/*
+	BlockRewriteThread
+*/
+
+void * BlockRewriteThread::Thread()
+{
+	ThreadStarted();
+
+	log_register_thread("BlockRewriteThread");
+
+	DSTACK(__FUNCTION_NAME);
+
+	BEGIN_DEBUG_EXCEPTION_HANDLER
+
+	while(getRun())
+	{
+		BlockBatch *batch = m_pool->getWork(100);
+		if(batch == NULL)
+			continue;
+
+		for(core::map<v3s16, std::string>::Iterator
+				i = batch->blocks.getIterator();
+				i.atEnd() == false; i++)
+		{
+			v3s16 p = i.getNode()->getKey();
+			try{
+				BlockRewritePool::rewriteBlock(p, i.getNode()->getValue(),
+						m_pool->m_codec, m_pool->m_level);
+			}
+			catch(SerializationError &e)
+			{
+				errorstream<<"Can't rewrite block ("<<p.X<<","<<p.Y<<","
+						<<p.Z<<"), copying it as it is: "<<e.what()
+						<<std::endl;
+				batch->failed++;
+			}
+		}
+
+		m_pool->finished(batch);
+	}
+
+	END_DEBUG_EXCEPTION_HANDLER(errorstream)
+
+	return NULL;
+}
+
+/*
+	BlockRewritePool
+*/
+
+BlockRewritePool::BlockRewritePool(u32 thread_count, u8 codec, s32 level):
+	m_codec(codec),
+	m_level(level),
+	m_in_flight(0)
+{
+	for(u32 i=0; i<thread_count; i++)
+	{
+		BlockRewriteThread *t = new BlockRewriteThread(this);
+		t->Start();
+		m_threads.push_back(t);
+	}
+}
+
+BlockRewritePool::~BlockRewritePool()
+{
+	for(u32 i=0; i<m_threads.size(); i++)
+		m_threads[i]->setRun(false);
+	for(u32 i=0; i<m_threads.size(); i++)
+	{
+		m_threads[i]->stop();
+		delete m_threads[i];
+	}
+
+	while(m_todo.size() != 0)
+		delete m_todo.pop_front();
+	while(m_done.size() != 0)
+		delete m_done.pop_front();
+}
+
+void BlockRewritePool::push(BlockBatch *batch)
+{
+	m_in_flight++;
+	m_todo.push_back(batch);
+}
+
+BlockBatch * BlockRewritePool::pop(u32 wait_ms)
+{
+	try{
+		BlockBatch *batch = m_done.pop_front(wait_ms);
+		m_in_flight--;
+		return batch;
+	}
+	catch(ItemNotFoundException &e)
+	{
+		return NULL;
+	}
+}
+
+BlockBatch * BlockRewritePool::getWork(u32 wait_ms)
+{
+	try{
+		return m_todo.pop_front(wait_ms);
+	}
+	catch(ItemNotFoundException &e)
+	{
+		return NULL;
+	}
+}
+
+void BlockRewritePool::finished(BlockBatch *batch)
+{
+	m_done.push_back(batch);
+}
+
+void BlockRewritePool::rewriteBlock(v3s16 p, std::string &data,
+		u8 codec, s32 level)
+{
+	std::istringstream is(data, std::ios_base::binary);
+
+	u8 version = SER_FMT_VER_INVALID;
+	is.read((char*)&version, 1);
+	if(is.fail())
+		throw SerializationError("rewriteBlock: Failed to read version");
+
+	// Markers of generated blocks don't have the nodes to rewrite
+	if(version == SER_FMT_VER_GENERATED)
+		return;
+
+	MapBlock block(NULL, p);
+	block.deSerialize(is, version);
+	block.deSerializeDiskExtra(is, version);
+
+	std::ostringstream os(std::ios_base::binary);
+	version = SER_FMT_VER_HIGHEST;
+	os.write((char*)&version, 1);
+	block.serialize(os, version, codec, level);
+	block.serializeDiskExtra(os, version);
+
+	data = os.str();
+}
+
@@ -0,0 +1,107 @@
+/*
+Minetest-c55
+Copyright (C) 2010-2011 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef MAPMIGRATE_HEADER
+#define MAPMIGRATE_HEADER
+
+#include "common_irrlicht.h"
+#include "utility.h"
+#include <string>
+
+/*
+	Blocks as stored by ServerMap::saveBlock():
+		[0] u8 serialization version
+		[1] data
+	passed between ServerMap::migrate() and the rewrite threads.
+*/
+struct BlockBatch
+{
+	core::map<v3s16, std::string> blocks;
+	// Blocks that couldn't be rewritten and were left as they were
+	u32 failed;
+
+	BlockBatch():
+		failed(0)
+	{
+	}
+};
+
+class BlockRewritePool;
+
+class BlockRewriteThread : public SimpleThread
+{
+	BlockRewritePool *m_pool;
+
+public:
+
+	BlockRewriteThread(BlockRewritePool *pool):
+		SimpleThread(),
+		m_pool(pool)
+	{
+	}
+
+	void * Thread();
+};
+
+/*
+	Rewrites blocks in SER_FMT_VER_HIGHEST compressed with a given
+	codec in a pool of threads. Finished batches come out of pop() in
+	the order they were finished in.
+
+	push() and pop() are meant to be called from one thread.
+*/
+class BlockRewritePool
+{
+public:
+	BlockRewritePool(u32 thread_count, u8 codec, s32 level);
+	// Stops the threads; batches still in the pool are deleted
+	~BlockRewritePool();
+
+	void push(BlockBatch *batch);
+	// Returns NULL if no batch got finished in wait_ms
+	BlockBatch * pop(u32 wait_ms);
+	// Number of batches pushed and not popped yet
+	u32 inFlight()
+	{
+		return m_in_flight;
+	}
+
+	/*
+		Rewrites the stored block p in data.
+		Throws SerializationError if it can't be read.
+	*/
+	static void rewriteBlock(v3s16 p, std::string &data, u8 codec, s32 level);
+
+private:
+	// Called by the threads
+	BlockBatch * getWork(u32 wait_ms);
+	void finished(BlockBatch *batch);
+
+	friend class BlockRewriteThread;
+
+	u8 m_codec;
+	s32 m_level;
+	MutexedQueue<BlockBatch*> m_todo;
+	MutexedQueue<BlockBatch*> m_done;
+	core::array<BlockRewriteThread*> m_threads;
+	u32 m_in_flight;
+};
+
+#endif
+
@@ -213,6 +213,24 @@ void NodeMetadataList::set(v3s16 p, NodeMetadata *d)
 	m_data.insert(p, d);
 }
 
+void NodeMetadataList::takeFrom(NodeMetadataList &other)
+{
+	for(core::map<v3s16, NodeMetadata*>::Iterator
+			i = m_data.getIterator();
+			i.atEnd()==false; i++)
+	{
+		delete i.getNode()->getValue();
+	}
+	m_data.clear();
+	for(core::map<v3s16, NodeMetadata*>::Iterator
+			i = other.m_data.getIterator();
+			i.atEnd()==false; i++)
+	{
+		m_data.insert(i.getNode()->getKey(), i.getNode()->getValue());
+	}
+	other.m_data.clear();
+}
+
 bool NodeMetadataList::step(float dtime)
 {
 	bool something_changed = false;
@@ -93,10 +93,17 @@ class NodeMetadataList
 	void remove(v3s16 p);
 	// Deletes old data and sets a new one
 	void set(v3s16 p, NodeMetadata *d);
+	// Deletes all data and moves the data of other here
+	void takeFrom(NodeMetadataList &other);
 	
 	// A step in time. Returns true if something changed.
 	bool step(float dtime);
 
+	u32 size()
+	{
+		return m_data.size();
+	}
+
 private:
 	core::map<v3s16, NodeMetadata*> m_data;
 };
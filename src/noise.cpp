@@ -222,6 +222,150 @@ double noise3d_perlin_abs(double x, double y, double z, int seed,
 	return a;
 }
 
+/*
+	Bulk noise
+*/
+
+/*
+	The integer lattice coordinates and the positions in the cells of
+	the coordinates cs multiplied by f, like in noise2d_gradient() and
+	noise3d_gradient()
+*/
+static void noise_axis(const double *cs, int size, double f,
+		int *c0, double *cl)
+{
+	for(int i=0; i<size; i++)
+	{
+		double c = cs[i]*f;
+		c0[i] = (c > 0.0 ? (int)c : (int)c - 1);
+		cl[i] = c - (double)c0[i];
+	}
+}
+
+void noise2d_perlin_bulk(double *dst, int stride_x, int stride_y,
+		const double *xs, int size_x, const double *ys, int size_y,
+		int seed, int octaves, double persistence, bool abs)
+{
+	for(int y=0; y<size_y; y++)
+	for(int x=0; x<size_x; x++)
+		dst[x*stride_x + y*stride_y] = 0;
+
+	core::array<int> x0s, y0s;
+	x0s.set_used(size_x);
+	y0s.set_used(size_y);
+	core::array<double> txs, tys;
+	txs.set_used(size_x);
+	tys.set_used(size_y);
+	double f = 1.0;
+	double g = 1.0;
+	for(int i=0; i<octaves; i++)
+	{
+		noise_axis(xs, size_x, f, x0s.pointer(), txs.pointer());
+		noise_axis(ys, size_y, f, y0s.pointer(), tys.pointer());
+		for(int x=0; x<size_x; x++)
+			txs[x] = easeCurve(txs[x]);
+		for(int y=0; y<size_y; y++)
+			tys[y] = easeCurve(tys[y]);
+
+		for(int y=0; y<size_y; y++)
+		{
+			int y0 = y0s[y];
+			double ty = tys[y];
+			// Values for corners of the current square
+			bool have_corners = false;
+			int x0 = 0;
+			double v00 = 0, v10 = 0, v01 = 0, v11 = 0;
+			for(int x=0; x<size_x; x++)
+			{
+				if(have_corners == false || x0s[x] != x0)
+				{
+					x0 = x0s[x];
+					v00 = noise2d(x0, y0, seed+i);
+					v10 = noise2d(x0+1, y0, seed+i);
+					v01 = noise2d(x0, y0+1, seed+i);
+					v11 = noise2d(x0+1, y0+1, seed+i);
+					have_corners = true;
+				}
+				// As in biLinearInterpolation()
+				double tx = txs[x];
+				double u = linearInterpolation(v00,v10,tx);
+				double v = linearInterpolation(v01,v11,tx);
+				double n = linearInterpolation(u,v,ty);
+				if(abs)
+					n = fabs(n);
+				dst[x*stride_x + y*stride_y] += g * n;
+			}
+		}
+		f *= 2.0;
+		g *= persistence;
+	}
+}
+
+void noise3d_perlin_bulk(double *dst,
+		int stride_x, int stride_y, int stride_z,
+		const double *xs, int size_x, const double *ys, int size_y,
+		const double *zs, int size_z,
+		int seed, int octaves, double persistence, bool abs)
+{
+	for(int z=0; z<size_z; z++)
+	for(int y=0; y<size_y; y++)
+	for(int x=0; x<size_x; x++)
+		dst[x*stride_x + y*stride_y + z*stride_z] = 0;
+
+	core::array<int> x0s, y0s, z0s;
+	x0s.set_used(size_x);
+	y0s.set_used(size_y);
+	z0s.set_used(size_z);
+	core::array<double> xls, yls, zls;
+	xls.set_used(size_x);
+	yls.set_used(size_y);
+	zls.set_used(size_z);
+	double f = 1.0;
+	double g = 1.0;
+	for(int i=0; i<octaves; i++)
+	{
+		noise_axis(xs, size_x, f, x0s.pointer(), xls.pointer());
+		noise_axis(ys, size_y, f, y0s.pointer(), yls.pointer());
+		noise_axis(zs, size_z, f, z0s.pointer(), zls.pointer());
+
+		for(int z=0; z<size_z; z++)
+		for(int y=0; y<size_y; y++)
+		{
+			int y0 = y0s[y];
+			int z0 = z0s[z];
+			// Values for corners of the current cube
+			bool have_corners = false;
+			int x0 = 0;
+			double v000 = 0, v100 = 0, v010 = 0, v110 = 0;
+			double v001 = 0, v101 = 0, v011 = 0, v111 = 0;
+			for(int x=0; x<size_x; x++)
+			{
+				if(have_corners == false || x0s[x] != x0)
+				{
+					x0 = x0s[x];
+					v000 = noise3d(x0, y0, z0, seed+i);
+					v100 = noise3d(x0+1, y0, z0, seed+i);
+					v010 = noise3d(x0, y0+1, z0, seed+i);
+					v110 = noise3d(x0+1, y0+1, z0, seed+i);
+					v001 = noise3d(x0, y0, z0+1, seed+i);
+					v101 = noise3d(x0+1, y0, z0+1, seed+i);
+					v011 = noise3d(x0, y0+1, z0+1, seed+i);
+					v111 = noise3d(x0+1, y0+1, z0+1, seed+i);
+					have_corners = true;
+				}
+				double n = triLinearInterpolation(
+						v000,v100,v010,v110,v001,v101,v011,v111,
+						xls[x],yls[y],zls[z]);
+				if(abs)
+					n = fabs(n);
+				dst[x*stride_x + y*stride_y + z*stride_z] += g * n;
+			}
+		}
+		f *= 2.0;
+		g *= persistence;
+	}
+}
+
 // -1->0, 0->1, 1->0
 double contour(double v)
 {
@@ -269,6 +413,62 @@ double noise3d_param(const NoiseParams &param, double x, double y, double z)
 	else assert(0);
 }
 
+void noise3d_param_bulk(const NoiseParams &param, double *dst,
+		const double *xs, int size_x, const double *ys, int size_y,
+		const double *zs, int size_z)
+{
+	int count = size_x*size_y*size_z;
+
+	if(param.type == NOISE_CONSTANT_ONE)
+	{
+		for(int i=0; i<count; i++)
+			dst[i] = 1.0;
+		return;
+	}
+
+	// Scaled like in noise3d_param()
+	double s = param.pos_scale;
+	core::array<double> sxs(size_x);
+	core::array<double> sys(size_y);
+	core::array<double> szs(size_z);
+	for(int i=0; i<size_x; i++)
+		sxs.push_back(xs[i] / s);
+	for(int i=0; i<size_y; i++)
+		sys.push_back(ys[i] / s);
+	for(int i=0; i<size_z; i++)
+		szs.push_back(zs[i] / s);
+
+	if(param.type == NOISE_PERLIN_CONTOUR_FLIP_YZ)
+	{
+		// noise3d_perlin(x,z,y)
+		noise3d_perlin_bulk(dst, 1, size_x*size_y, size_x,
+				sxs.pointer(), size_x, szs.pointer(), size_z,
+				sys.pointer(), size_y,
+				param.seed, param.octaves, param.persistence);
+	}
+	else
+	{
+		noise3d_perlin_bulk(dst, 1, size_x, size_x*size_y,
+				sxs.pointer(), size_x, sys.pointer(), size_y,
+				szs.pointer(), size_z,
+				param.seed, param.octaves, param.persistence,
+				param.type == NOISE_PERLIN_ABS);
+	}
+
+	if(param.type == NOISE_PERLIN || param.type == NOISE_PERLIN_ABS)
+	{
+		for(int i=0; i<count; i++)
+			dst[i] = param.noise_scale*dst[i];
+	}
+	else if(param.type == NOISE_PERLIN_CONTOUR
+			|| param.type == NOISE_PERLIN_CONTOUR_FLIP_YZ)
+	{
+		for(int i=0; i<count; i++)
+			dst[i] = contour(param.noise_scale*dst[i]);
+	}
+	else assert(0);
+}
+
 /*
 	NoiseBuffer
 */
@@ -313,32 +513,34 @@ void NoiseBuffer::create(const NoiseParams &param,
 
 	m_data = new double[m_size_x*m_size_y*m_size_z];
 
-	for(int x=0; x<m_size_x; x++)
-	for(int y=0; y<m_size_y; y++)
-	for(int z=0; z<m_size_z; z++)
-	{
-		double xd = (m_start_x + (double)x*m_samplelength_x);
-		double yd = (m_start_y + (double)y*m_samplelength_y);
-		double zd = (m_start_z + (double)z*m_samplelength_z);
-		double a = noise3d_param(param, xd,yd,zd);
-		intSet(x,y,z, a);
-	}
+	fill(param, m_data);
 }
 
 void NoiseBuffer::multiply(const NoiseParams &param)
 {
 	assert(m_data != NULL);
 
+	int count = m_size_x*m_size_y*m_size_z;
+	core::array<double> a;
+	a.set_used(count);
+	fill(param, a.pointer());
+	for(int i=0; i<count; i++)
+		m_data[i] = m_data[i] * a[i];
+}
+
+void NoiseBuffer::fill(const NoiseParams &param, double *dst)
+{
+	core::array<double> xs(m_size_x);
+	core::array<double> ys(m_size_y);
+	core::array<double> zs(m_size_z);
 	for(int x=0; x<m_size_x; x++)
+		xs.push_back(m_start_x + (double)x*m_samplelength_x);
 	for(int y=0; y<m_size_y; y++)
+		ys.push_back(m_start_y + (double)y*m_samplelength_y);
 	for(int z=0; z<m_size_z; z++)
-	{
-		double xd = (m_start_x + (double)x*m_samplelength_x);
-		double yd = (m_start_y + (double)y*m_samplelength_y);
-		double zd = (m_start_z + (double)z*m_samplelength_z);
-		double a = noise3d_param(param, xd,yd,zd);
-		intMultiply(x,y,z, a);
-	}
+		zs.push_back(m_start_z + (double)z*m_samplelength_z);
+	noise3d_param_bulk(param, dst, xs.pointer(), m_size_x,
+			ys.pointer(), m_size_y, zs.pointer(), m_size_z);
 }
 
 // Deprecated
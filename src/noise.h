@@ -80,6 +80,23 @@ double noise3d_perlin(double x, double y, double z, int seed,
 double noise3d_perlin_abs(double x, double y, double z, int seed,
 		int octaves, double persistence);
 
+/*
+	Bulk versions of the above. They give the noise at every combination
+	of the coordinates given for each axis; the value at (xs[x],ys[y])
+	goes to dst[x*stride_x + y*stride_y]. The same math is done as in
+	the point by point functions, but the lattice values and the ease
+	curves are shared between the points.
+*/
+void noise2d_perlin_bulk(double *dst, int stride_x, int stride_y,
+		const double *xs, int size_x, const double *ys, int size_y,
+		int seed, int octaves, double persistence, bool abs=false);
+
+void noise3d_perlin_bulk(double *dst,
+		int stride_x, int stride_y, int stride_z,
+		const double *xs, int size_x, const double *ys, int size_y,
+		const double *zs, int size_z,
+		int seed, int octaves, double persistence, bool abs=false);
+
 enum NoiseType
 {
 	NOISE_CONSTANT_ONE,
@@ -113,6 +130,14 @@ struct NoiseParams
 
 double noise3d_param(const NoiseParams &param, double x, double y, double z);
 
+/*
+	noise3d_param() at every combination of the coordinates, into dst
+	with x fastest: dst[(z*size_y + y)*size_x + x]
+*/
+void noise3d_param_bulk(const NoiseParams &param, double *dst,
+		const double *xs, int size_x, const double *ys, int size_y,
+		const double *zs, int size_z);
+
 class NoiseBuffer
 {
 public:
@@ -139,6 +164,9 @@ class NoiseBuffer
 	//bool contains(double x, double y, double z);
 
 private:
+	// Puts the noise at the sample points into dst
+	void fill(const NoiseParams &param, double *dst);
+
 	double *m_data;
 	double m_start_x, m_start_y, m_start_z;
 	double m_samplelength_x, m_samplelength_y, m_samplelength_z;
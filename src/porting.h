@@ -94,6 +94,16 @@ void initializePaths();
 	{
 		return GetTickCount();
 	}
+	// For measuring short times; wraps around every 71 minutes
+	inline u32 getTimeUs()
+	{
+		LARGE_INTEGER freq, count;
+		QueryPerformanceFrequency(&freq);
+		QueryPerformanceCounter(&count);
+		// count * 1000000 would overflow after some days of uptime
+		return (u32)(count.QuadPart / freq.QuadPart * 1000000
+				+ count.QuadPart % freq.QuadPart * 1000000 / freq.QuadPart);
+	}
 #else // Posix
 	#include <sys/time.h>
 	inline u32 getTimeMs()
@@ -102,6 +112,13 @@ void initializePaths();
 		gettimeofday(&tv, NULL);
 		return tv.tv_sec * 1000 + tv.tv_usec / 1000;
 	}
+	// For measuring short times; wraps around every 71 minutes
+	inline u32 getTimeUs()
+	{
+		struct timeval tv;
+		gettimeofday(&tv, NULL);
+		return tv.tv_sec * 1000000 + tv.tv_usec;
+	}
 	/*#include <sys/timeb.h>
 	inline u32 getTimeMs()
 	{
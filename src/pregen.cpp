@@ -0,0 +1,168 @@
+/*
+Minetest-c55
+Copyright (C) 2010-2011 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "pregen.h"
+#include <fstream>
+#include <cstdio>
+#include "settings.h"
+#include "filesys.h"
+#include "utility.h"
+#include "log.h"
+
+MapPregenerator::MapPregenerator(const std::string &path):
+	m_path(path),
+	m_running(false),
+	m_min(0,0,0),
+	m_max(0,0,0),
+	m_next(0)
+{
+	load();
+}
+
+bool MapPregenerator::start(v3s16 p_min, v3s16 p_max)
+{
+	v3s16 a(MYMIN(p_min.X, p_max.X), MYMIN(p_min.Y, p_max.Y),
+			MYMIN(p_min.Z, p_max.Z));
+	v3s16 b(MYMAX(p_min.X, p_max.X), MYMAX(p_min.Y, p_max.Y),
+			MYMAX(p_min.Z, p_max.Z));
+	// The index of a block has to fit in m_next
+	u64 total = (u64)(b.X - a.X + 1) * (u64)(b.Y - a.Y + 1)
+			* (u64)(b.Z - a.Z + 1);
+	if(total > 0x7fffffff)
+		return false;
+
+	m_min = a;
+	m_max = b;
+	m_next = 0;
+	m_running = true;
+	m_in_flight.clear();
+	return true;
+}
+
+void MapPregenerator::stop()
+{
+	m_running = false;
+	m_in_flight.clear();
+}
+
+u32 MapPregenerator::getTotal()
+{
+	return (u32)(m_max.X - m_min.X + 1) * (u32)(m_max.Y - m_min.Y + 1)
+			* (u32)(m_max.Z - m_min.Z + 1);
+}
+
+bool MapPregenerator::next(v3s16 &p)
+{
+	if(m_running == false)
+		return false;
+	if(m_next >= getTotal())
+	{
+		m_running = false;
+		return false;
+	}
+
+	u32 h = m_max.Y - m_min.Y + 1;
+	u32 d = m_max.Z - m_min.Z + 1;
+	u32 column = m_next / h;
+	p.Y = m_max.Y - (s16)(m_next % h);
+	p.Z = m_min.Z + (s16)(column % d);
+	p.X = m_min.X + (s16)(column / d);
+	m_next++;
+	return true;
+}
+
+void MapPregenerator::setQueued(v3s16 p)
+{
+	assert(m_next > 0);
+	m_in_flight[p] = m_next - 1;
+}
+
+void MapPregenerator::setGenerated(v3s16 p)
+{
+	m_in_flight.remove(p);
+}
+
+void MapPregenerator::getInFlight(core::list<v3s16> &dst)
+{
+	for(core::map<v3s16, u32>::Iterator i = m_in_flight.getIterator();
+			i.atEnd() == false; i++)
+		dst.push_back(i.getNode()->getKey());
+}
+
+void MapPregenerator::save()
+{
+	// Kept until the last blocks have been generated
+	if(m_running == false && m_in_flight.size() == 0)
+	{
+		if(fs::PathExists(m_path))
+			remove(m_path.c_str());
+		return;
+	}
+
+	std::ofstream os(m_path.c_str(), std::ios_base::binary);
+	if(os.good() == false)
+	{
+		errorstream<<"MapPregenerator: Failed to open "<<m_path<<std::endl;
+		return;
+	}
+
+	Settings args;
+	args.setV3F("min", v3f(m_min.X, m_min.Y, m_min.Z));
+	args.setV3F("max", v3f(m_max.X, m_max.Y, m_max.Z));
+	u32 next = m_next;
+	for(core::map<v3s16, u32>::Iterator i = m_in_flight.getIterator();
+			i.atEnd() == false; i++)
+		next = MYMIN(next, i.getNode()->getValue());
+	args.setU64("next", next);
+	args.writeLines(os);
+}
+
+void MapPregenerator::load()
+{
+	m_running = false;
+	if(fs::PathExists(m_path) == false)
+		return;
+
+	Settings args;
+	if(args.readConfigFile(m_path.c_str()) == false)
+		return;
+	v3f p_min, p_max;
+	u32 next;
+	try{
+		p_min = args.getV3F("min");
+		p_max = args.getV3F("max");
+		next = args.getU64("next");
+	}
+	catch(SettingNotFoundException &e)
+	{
+		errorstream<<"MapPregenerator: Invalid "<<m_path<<std::endl;
+		return;
+	}
+	if(start(v3s16(p_min.X, p_min.Y, p_min.Z),
+			v3s16(p_max.X, p_max.Y, p_max.Z)) == false)
+	{
+		errorstream<<"MapPregenerator: Invalid "<<m_path<<std::endl;
+		return;
+	}
+	m_next = next;
+
+	infostream<<"MapPregenerator: Resuming at block "<<m_next
+			<<" of "<<getTotal()<<std::endl;
+}
+
@@ -0,0 +1,108 @@
+/*
+Minetest-c55
+Copyright (C) 2010-2011 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef PREGEN_HEADER
+#define PREGEN_HEADER
+
+#include "common_irrlicht.h"
+#include <string>
+
+/*
+	Walks through the blocks of a box for pre-generating them in the
+	background (the /#pregen command). The server queues the blocks
+	one by one while it has time to spare.
+
+	The blocks of a column are walked from the top down and the columns
+	in x,z order, so that the map generator can reuse the noise of the
+	column. The progress is kept in a file, so that a pre-generation
+	goes on after a restart.
+
+	Not thread-safe; used by the server thread.
+*/
+class MapPregenerator
+{
+public:
+	// Loads the progress from the file at path if there is one
+	MapPregenerator(const std::string &path);
+
+	/*
+		Starts over with the blocks from p_min to p_max.
+		Returns false if the box has too many blocks.
+	*/
+	bool start(v3s16 p_min, v3s16 p_max);
+	void stop();
+	bool isRunning()
+	{
+		return m_running;
+	}
+
+	/*
+		Gets the next block to queue. Returns false and stops when all
+		blocks have been walked through.
+	*/
+	bool next(v3s16 &p);
+
+	/*
+		The block last returned by next() has been queued for
+		generating. It is in flight until setGenerated() is called.
+	*/
+	void setQueued(v3s16 p);
+	void setGenerated(v3s16 p);
+	void getInFlight(core::list<v3s16> &dst);
+	u32 getInFlightCount()
+	{
+		return m_in_flight.size();
+	}
+
+	v3s16 getMin()
+	{
+		return m_min;
+	}
+	v3s16 getMax()
+	{
+		return m_max;
+	}
+	// Blocks walked through so far
+	u32 getDone()
+	{
+		return m_next;
+	}
+	u32 getTotal();
+
+	/*
+		Writes the progress to the file, or removes the file if nothing
+		is running or in flight. Walking goes on from the first block
+		still in flight after a restart.
+	*/
+	void save();
+	void load();
+
+private:
+	std::string m_path;
+	bool m_running;
+	v3s16 m_min;
+	v3s16 m_max;
+	// Index of the next block
+	u32 m_next;
+	// Queued and not generated yet; value = index
+	core::map<v3s16, u32> m_in_flight;
+};
+
+#endif
+
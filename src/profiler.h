@@ -23,6 +23,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "common_irrlicht.h"
 #include <string>
 #include "utility.h"
+#include "porting.h"
 #include <jmutex.h>
 #include <jmutexautolock.h>
 
@@ -188,5 +189,60 @@ class ScopeProfiler
 	enum ScopeProfilerType m_type;
 };
 
+/*
+	Profiler names of a lock for ProfiledAutoLock. They are built once so
+	that taking the lock does not build strings.
+*/
+struct ProfiledLockNames
+{
+	ProfiledLockNames(const char *name):
+		wait(std::string("Lock: ") + name + " wait"),
+		wait_avg(std::string("Lock: ") + name + " wait avg")
+	{
+	}
+	std::string wait;
+	std::string wait_avg;
+};
+
+/*
+	Waits shorter than this are not recorded; the lock was most likely
+	free and recording them would only cost time in the common case.
+*/
+#define PROFILED_LOCK_MIN_WAIT_US 100
+
+/*
+	Locks a mutex like JMutexAutoLock and adds the time waited for it to
+	the profiler as "Lock: <name> wait" (total) and "Lock: <name> wait
+	avg", in seconds. Only waits of at least PROFILED_LOCK_MIN_WAIT_US
+	are recorded, so the average is over the waits that blocked.
+*/
+class ProfiledAutoLock
+{
+public:
+	ProfiledAutoLock(Profiler *profiler, JMutex &mutex,
+			const ProfiledLockNames &names):
+		m_mutex(mutex)
+	{
+		u32 start_us = porting::getTimeUs();
+		m_mutex.Lock();
+		if(profiler)
+		{
+			u32 wait_us = porting::getTimeUs() - start_us;
+			if(wait_us >= PROFILED_LOCK_MIN_WAIT_US)
+			{
+				float wait = (float)wait_us / 1000000.0;
+				profiler->add(names.wait, wait);
+				profiler->avg(names.wait_avg, wait);
+			}
+		}
+	}
+	~ProfiledAutoLock()
+	{
+		m_mutex.Unlock();
+	}
+private:
+	JMutex &m_mutex;
+};
+
 #endif
 
@@ -23,6 +23,30 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 	#define ZLIB_WINAPI
 #endif
 #include "zlib.h"
+#include "log.h"
+
+CompressionCodec parseCompressionCodec(const std::string &name)
+{
+	if(name == "none")
+		return CODEC_NONE;
+	if(name == "zlib")
+		return CODEC_ZLIB;
+	if(name == "lz4")
+		return CODEC_LZ4;
+	errorstream<<"Unknown compression codec \""<<name<<"\""<<std::endl;
+	throw BaseException("Unknown compression codec");
+}
+
+const char * getCompressionCodecName(u8 codec)
+{
+	switch(codec)
+	{
+		case CODEC_NONE: return "none";
+		case CODEC_ZLIB: return "zlib";
+		case CODEC_LZ4: return "lz4";
+	}
+	return "";
+}
 
 /* report a zlib or i/o error */
 void zerr(int ret)
@@ -52,13 +76,12 @@ void zerr(int ret)
     }
 }
 
-void compressZlib(SharedBuffer<u8> data, std::ostream &os)
+void compressZlib(SharedBuffer<u8> data, std::ostream &os, s32 level)
 {
 	z_stream z;
 	const s32 bufsize = 16384;
 	//char input_buffer[bufsize];
 	char output_buffer[bufsize];
-	int input_i = 0;
 	int status = 0;
 	int ret;
 
@@ -66,32 +89,22 @@ void compressZlib(SharedBuffer<u8> data, std::ostream &os)
 	z.zfree = Z_NULL;
 	z.opaque = Z_NULL;
 
-	ret = deflateInit(&z, -1);
+	ret = deflateInit(&z, level);
 	if(ret != Z_OK)
 		throw SerializationError("compressZlib: deflateInit failed");
 	
-	z.avail_in = 0;
+	// All of the input is available at once
+	z.next_in = (Bytef*)*data;
+	z.avail_in = data.getSize();
 	
 	for(;;)
 	{
-		int flush = Z_NO_FLUSH;
 		z.next_out = (Bytef*)output_buffer;
 		z.avail_out = bufsize;
 
-		if(z.avail_in == 0)
-		{
-			//z.next_in = (char*)&data[input_i];
-			z.next_in = (Bytef*)&data[input_i];
-			z.avail_in = data.getSize() - input_i;
-			input_i += z.avail_in;
-			if(input_i == (int)data.getSize())
-				flush = Z_FINISH;
-		}
-		if(z.avail_in == 0)
-			break;
-		status = deflate(&z, flush);
+		status = deflate(&z, Z_FINISH);
 		if(status == Z_NEED_DICT || status == Z_DATA_ERROR
-				|| status == Z_MEM_ERROR)
+				|| status == Z_MEM_ERROR || status == Z_STREAM_ERROR)
 		{
 			zerr(status);
 			throw SerializationError("compressZlib: deflate failed");
@@ -99,16 +112,19 @@ void compressZlib(SharedBuffer<u8> data, std::ostream &os)
 		int count = bufsize - z.avail_out;
 		if(count)
 			os.write(output_buffer, count);
+		// Also an empty input gets an end marker
+		if(status == Z_STREAM_END)
+			break;
 	}
 
 	deflateEnd(&z);
 
 }
 
-void compressZlib(const std::string &data, std::ostream &os)
+void compressZlib(const std::string &data, std::ostream &os, s32 level)
 {
 	SharedBuffer<u8> databuf((u8*)data.c_str(), data.size());
-	compressZlib(databuf, os);
+	compressZlib(databuf, os, level);
 }
 
 void decompressZlib(std::istream &is, std::ostream &os)
@@ -193,6 +209,280 @@ void decompressZlib(std::istream &is, std::ostream &os)
 	inflateEnd(&z);
 }
 
+/*
+	LZ4 block format, written from the format description so that no
+	library is needed. The data is framed as
+		u32 uncompressed size
+		u32 compressed size
+		block
+	A block is a list of sequences:
+		u8 token: literal count << 4 | (match length - 4)
+		[u8...] more literal count if it was 15 (255 = keep adding)
+		literals
+		u16 match offset, little endian (missing in the last sequence)
+		[u8...] more match length if it was 15
+	The last 5 bytes are always literals and no match starts within
+	the last 12 bytes, as the format requires.
+*/
+
+#define LZ4_MIN_MATCH 4
+#define LZ4_LAST_LITERALS 5
+#define LZ4_MF_LIMIT 12
+#define LZ4_MAX_OFFSET 65535
+#define LZ4_HASH_BITS 12
+// Largest block that compressLZ4() can make of size bytes
+#define LZ4_COMPRESSBOUND(size) ((size) + (size) / 255 + 16)
+/*
+	Largest uncompressed size accepted. Far more than a map block
+	holds; keeps a corrupt header from allocating gigabytes.
+*/
+#define LZ4_MAX_SIZE (64 * 1024 * 1024)
+
+static inline u32 lz4Read32(const u8 *p)
+{
+	return (u32)p[0] | ((u32)p[1]<<8) | ((u32)p[2]<<16) | ((u32)p[3]<<24);
+}
+
+static inline u32 lz4Hash(u32 sequence)
+{
+	return (sequence * 2654435761U) >> (32 - LZ4_HASH_BITS);
+}
+
+static inline void lz4WriteLength(std::string &dst, u32 len)
+{
+	while(len >= 255)
+	{
+		dst += (char)255;
+		len -= 255;
+	}
+	dst += (char)len;
+}
+
+static void lz4WriteSequence(std::string &dst, const u8 *literals,
+		u32 literal_count, u32 offset, u32 match_length)
+{
+	u32 ml = match_length >= LZ4_MIN_MATCH ? match_length - LZ4_MIN_MATCH : 0;
+	u8 token = (u8)((literal_count < 15 ? literal_count : 15) << 4);
+	if(offset != 0)
+		token |= (u8)(ml < 15 ? ml : 15);
+	dst += (char)token;
+	if(literal_count >= 15)
+		lz4WriteLength(dst, literal_count - 15);
+	dst.append((const char*)literals, literal_count);
+	// The last sequence has no match
+	if(offset == 0)
+		return;
+	dst += (char)(offset & 0xff);
+	dst += (char)(offset >> 8);
+	if(ml >= 15)
+		lz4WriteLength(dst, ml - 15);
+}
+
+void compressLZ4(const std::string &data, std::ostream &os,
+		s32 acceleration)
+{
+	if(acceleration < 1)
+		acceleration = 1;
+
+	const u8 *src = (const u8*)data.c_str();
+	u32 size = data.size();
+
+	std::string dst;
+	dst.reserve(LZ4_COMPRESSBOUND(size));
+
+	u32 anchor = 0;
+	if(size > LZ4_MF_LIMIT)
+	{
+		// Last position seen for each hashed 4-byte sequence
+		u32 table[1<<LZ4_HASH_BITS];
+		memset(table, 0, sizeof(table));
+
+		const u32 match_limit = size - LZ4_LAST_LITERALS;
+		const u32 search_limit = size - LZ4_MF_LIMIT;
+		u32 misses = 0;
+		u32 i = 0;
+		while(i < search_limit)
+		{
+			u32 sequence = lz4Read32(&src[i]);
+			u32 h = lz4Hash(sequence);
+			u32 ref = table[h];
+			table[h] = i;
+			if(ref >= i || i - ref > LZ4_MAX_OFFSET
+					|| lz4Read32(&src[ref]) != sequence)
+			{
+				// Skip faster through data that doesn't compress
+				misses++;
+				i += acceleration + (misses >> 6);
+				continue;
+			}
+			misses = 0;
+
+			// Extend the match backwards into the literals
+			while(i > anchor && ref > 0 && src[i-1] == src[ref-1])
+			{
+				i--;
+				ref--;
+			}
+			u32 length = LZ4_MIN_MATCH;
+			while(i + length < match_limit
+					&& src[i+length] == src[ref+length])
+				length++;
+
+			lz4WriteSequence(dst, &src[anchor], i - anchor, i - ref, length);
+			i += length;
+			anchor = i;
+		}
+	}
+	lz4WriteSequence(dst, &src[anchor], size - anchor, 0, 0);
+
+	u8 header[8];
+	writeU32(&header[0], size);
+	writeU32(&header[4], dst.size());
+	os.write((char*)header, 8);
+	os.write(dst.c_str(), dst.size());
+}
+
+void decompressLZ4(std::istream &is, std::ostream &os)
+{
+	u8 header[8];
+	is.read((char*)header, 8);
+	if(is.gcount() != 8)
+		throw SerializationError("decompressLZ4: no header");
+	u32 size = readU32(&header[0]);
+	u32 compressed_size = readU32(&header[4]);
+	// An LZ4 block can't expand data more than 255 times
+	if(size > LZ4_MAX_SIZE || compressed_size == 0
+			|| size / 255 > compressed_size
+			|| compressed_size > LZ4_COMPRESSBOUND(size))
+		throw SerializationError("decompressLZ4: invalid header");
+
+	SharedBuffer<u8> src(compressed_size);
+	is.read((char*)*src, compressed_size);
+	if((u32)is.gcount() != compressed_size)
+		throw SerializationError("decompressLZ4: stream ended halfway");
+
+	SharedBuffer<u8> dst(size);
+	u32 ip = 0;
+	u32 op = 0;
+	for(;;)
+	{
+		if(ip >= compressed_size)
+			throw SerializationError("decompressLZ4: invalid data");
+		u8 token = src[ip++];
+
+		u32 literal_count = token >> 4;
+		if(literal_count == 15)
+		{
+			u8 b;
+			do{
+				if(ip >= compressed_size)
+					throw SerializationError("decompressLZ4: invalid data");
+				b = src[ip++];
+				literal_count += b;
+			}while(b == 255);
+		}
+		if(literal_count > compressed_size - ip || literal_count > size - op)
+			throw SerializationError("decompressLZ4: invalid data");
+		if(literal_count != 0)
+			memcpy(&dst[op], &src[ip], literal_count);
+		ip += literal_count;
+		op += literal_count;
+
+		// The last sequence ends with the literals
+		if(ip == compressed_size)
+			break;
+
+		if(compressed_size - ip < 2)
+			throw SerializationError("decompressLZ4: invalid data");
+		u32 offset = (u32)src[ip] | ((u32)src[ip+1] << 8);
+		ip += 2;
+		if(offset == 0 || offset > op)
+			throw SerializationError("decompressLZ4: invalid offset");
+
+		u32 length = token & 0x0f;
+		if(length == 15)
+		{
+			u8 b;
+			do{
+				if(ip >= compressed_size)
+					throw SerializationError("decompressLZ4: invalid data");
+				b = src[ip++];
+				length += b;
+			}while(b == 255);
+		}
+		length += LZ4_MIN_MATCH;
+		if(length > size - op)
+			throw SerializationError("decompressLZ4: invalid data");
+		// The match may overlap what it writes, so copy byte by byte
+		for(u32 i=0; i<length; i++, op++)
+			dst[op] = dst[op - offset];
+	}
+	if(op != size)
+		throw SerializationError("decompressLZ4: size mismatch");
+
+	os.write((char*)*dst, size);
+}
+
+void compressWithCodec(const std::string &data, std::ostream &os,
+		u8 codec, s32 level)
+{
+	u8 c = codec;
+	os.write((char*)&c, 1);
+	switch(codec)
+	{
+		case CODEC_NONE:
+		{
+			u8 tmp[4];
+			writeU32(tmp, data.size());
+			os.write((char*)tmp, 4);
+			os.write(data.c_str(), data.size());
+			break;
+		}
+		case CODEC_ZLIB:
+			compressZlib(data, os, rangelim(level, -1, 9));
+			break;
+		case CODEC_LZ4:
+			compressLZ4(data, os, level);
+			break;
+		default:
+			throw SerializationError("compressWithCodec: unknown codec");
+	}
+}
+
+void decompressWithCodec(std::istream &is, std::ostream &os)
+{
+	u8 codec;
+	is.read((char*)&codec, 1);
+	if(is.gcount() != 1)
+		throw SerializationError("decompressWithCodec: no codec");
+	switch(codec)
+	{
+		case CODEC_NONE:
+		{
+			u8 tmp[4];
+			is.read((char*)tmp, 4);
+			if(is.gcount() != 4)
+				throw SerializationError("decompressWithCodec: no size");
+			u32 size = readU32(tmp);
+			SharedBuffer<u8> buf(size);
+			is.read((char*)*buf, size);
+			if((u32)is.gcount() != size)
+				throw SerializationError
+						("decompressWithCodec: stream ended halfway");
+			os.write((char*)*buf, size);
+			break;
+		}
+		case CODEC_ZLIB:
+			decompressZlib(is, os);
+			break;
+		case CODEC_LZ4:
+			decompressLZ4(is, os);
+			break;
+		default:
+			throw SerializationError("decompressWithCodec: unknown codec");
+	}
+}
+
 void compress(SharedBuffer<u8> data, std::ostream &os, u8 version)
 {
 	if(version >= 11)
@@ -57,24 +57,69 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 	19: new content type handling
 	20: many existing content types translated to extended ones
 	21: MapBlocks contain ownership information
+	22: MapBlock nodes as a palette with packed indices and light runs,
+	    owner as binary u16
+	23: MapBlock nodes and metadata compressed together with a codec
+	    that is named in the data (see CompressionCodec)
 */
 // This represents an uninitialized or invalid format
 #define SER_FMT_VER_INVALID 255
 // Highest supported serialization version
-#define SER_FMT_VER_HIGHEST 21
+#define SER_FMT_VER_HIGHEST 23
 // Lowest supported serialization version
 #define SER_FMT_VER_LOWEST 0
 
 #define ser_ver_supported(v) (v >= SER_FMT_VER_LOWEST && v <= SER_FMT_VER_HIGHEST)
 
+/*
+	First byte of blocks stored on disk as markers of generated blocks,
+	which are made again from the map seed when loaded (see
+	ServerMap::saveBlock())
+*/
+#define SER_FMT_VER_GENERATED 254
+
+/*
+	Compression codecs
+
+	The id is written in front of the data by compressWithCodec(), so
+	the reader doesn't have to know which codec the writer used.
+	Never renumber these.
+*/
+enum CompressionCodec
+{
+	CODEC_NONE = 0,
+	CODEC_ZLIB = 1,
+	// LZ4 block format; much faster than zlib, compresses less
+	CODEC_LZ4 = 2,
+	CODEC_COUNT
+};
+
+// Bit (1<<codec) is set for every codec this build can decompress
+#define CODECS_SUPPORTED ((1<<CODEC_NONE)|(1<<CODEC_ZLIB)|(1<<CODEC_LZ4))
+
+CompressionCodec parseCompressionCodec(const std::string &name);
+const char * getCompressionCodecName(u8 codec);
+
 /*
 	Misc. serialization functions
 */
 
-void compressZlib(SharedBuffer<u8> data, std::ostream &os);
-void compressZlib(const std::string &data, std::ostream &os);
+// level: 0...9, -1 = zlib default
+void compressZlib(SharedBuffer<u8> data, std::ostream &os, s32 level=-1);
+void compressZlib(const std::string &data, std::ostream &os, s32 level=-1);
 void decompressZlib(std::istream &is, std::ostream &os);
 
+// acceleration: 1 = best compression, larger values skip more input
+void compressLZ4(const std::string &data, std::ostream &os,
+		s32 acceleration=1);
+void decompressLZ4(std::istream &is, std::ostream &os);
+
+// Writes u8 codec followed by the data compressed with it.
+// level is the zlib level or the LZ4 acceleration.
+void compressWithCodec(const std::string &data, std::ostream &os,
+		u8 codec, s32 level);
+void decompressWithCodec(std::istream &is, std::ostream &os);
+
 // These choose between zlib and a self-made one according to version
 void compress(SharedBuffer<u8> data, std::ostream &os, u8 version);
 //void compress(const std::string &data, std::ostream &os, u8 version);
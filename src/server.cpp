@@ -34,15 +34,19 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "content_mapnode.h"
 #include "content_craft.h"
 #include "content_nodemeta.h"
+#include "content_abm.h"
 #include "mapblock.h"
 #include "serverobject.h"
 #include "settings.h"
 #include "profiler.h"
+#include "mapgen.h"
 #include "log.h"
 
 #define PP(x) "("<<(x).X<<","<<(x).Y<<","<<(x).Z<<")"
 
-#define BLOCK_EMERGE_FLAG_FROMDISK (1<<0)
+// Profiler names of the environment and connection locks
+static ProfiledLockNames g_env_lock_names("env");
+static ProfiledLockNames g_con_lock_names("con");
 
 class MapEditEventIgnorer
 {
@@ -69,6 +73,319 @@ class MapEditEventIgnorer
 	bool *m_flag;
 };
 
+/*
+	BlockEmergeQueue
+*/
+
+// Number of wait times kept for getWaitPercentile()
+#define EMERGE_WAIT_TIMES_KEPT 1000
+// Emerge requests of a client not sent within this are forgotten
+#define EMERGE_REQUEST_MAX_AGE_MS 60000
+
+BlockEmergeQueue::BlockEmergeQueue():
+	m_wait_times_next(0)
+{
+	m_mutex.Init();
+}
+
+BlockEmergeQueue::~BlockEmergeQueue()
+{
+	JMutexAutoLock lock(m_mutex);
+
+	core::list<QueuedBlockEmerge*>::Iterator i;
+	for(i=m_queue.begin(); i!=m_queue.end(); i++)
+	{
+		QueuedBlockEmerge *q = *i;
+		delete q;
+	}
+}
+
+s16 BlockEmergeQueue::getPriority(s16 d, u8 flags)
+{
+	if(flags & BLOCK_EMERGE_FLAG_FROMDISK)
+		return d + BLOCK_EMERGE_FROMDISK_PRIORITY;
+	return d;
+}
+
+void BlockEmergeQueue::addBlock(u16 peer_id, v3s16 pos, u8 flags, s16 d)
+{
+	DSTACK(__FUNCTION_NAME);
+
+	JMutexAutoLock lock(m_mutex);
+
+	s16 priority = getPriority(d, flags);
+
+	if(peer_id != 0)
+	{
+		/*
+			Find if block is already in queue.
+			If it is, update the peer to it and quit.
+		*/
+		core::list<QueuedBlockEmerge*>::Iterator i;
+		for(i=m_queue.begin(); i!=m_queue.end(); i++)
+		{
+			QueuedBlockEmerge *q = *i;
+			if(q->pos == pos)
+			{
+				q->peer_ids[peer_id] = flags;
+				if(priority < q->priority)
+					q->priority = priority;
+				return;
+			}
+		}
+	}
+	
+	/*
+		Add the block
+	*/
+	QueuedBlockEmerge *q = new QueuedBlockEmerge;
+	q->pos = pos;
+	if(peer_id != 0)
+		q->peer_ids[peer_id] = flags;
+	else
+		q->generate = ((flags & BLOCK_EMERGE_FLAG_FROMDISK) == 0);
+	q->priority = priority;
+	m_queue.push_back(q);
+}
+
+QueuedBlockEmerge * BlockEmergeQueue::pop()
+{
+	JMutexAutoLock lock(m_mutex);
+
+	// The first one of the lowest priority
+	core::list<QueuedBlockEmerge*>::Iterator best = m_queue.end();
+	core::list<QueuedBlockEmerge*>::Iterator i;
+	for(i=m_queue.begin(); i!=m_queue.end(); i++)
+	{
+		QueuedBlockEmerge *q = *i;
+		if(best != m_queue.end() && q->priority >= (*best)->priority)
+			continue;
+		if(isNearEmerging(q->pos))
+			continue;
+		best = i;
+	}
+	if(best == m_queue.end())
+		return NULL;
+	QueuedBlockEmerge *q = *best;
+	m_queue.erase(best);
+	m_emerging.insert(q->pos, true);
+	return q;
+}
+
+void BlockEmergeQueue::done(QueuedBlockEmerge *q)
+{
+	JMutexAutoLock lock(m_mutex);
+
+	m_emerging.remove(q->pos);
+}
+
+void BlockEmergeQueue::addWaitTime(u32 wait_ms)
+{
+	JMutexAutoLock lock(m_mutex);
+
+	if(m_wait_times.size() < EMERGE_WAIT_TIMES_KEPT)
+		m_wait_times.push_back(wait_ms);
+	else
+		m_wait_times[m_wait_times_next] = wait_ms;
+	m_wait_times_next = (m_wait_times_next + 1) % EMERGE_WAIT_TIMES_KEPT;
+}
+
+u32 BlockEmergeQueue::reprioritize(
+		core::map<u16, v3s16> &peer_blockpos, s16 max_d)
+{
+	JMutexAutoLock lock(m_mutex);
+
+	u32 removed = 0;
+	core::list<QueuedBlockEmerge*>::Iterator i = m_queue.begin();
+	while(i != m_queue.end())
+	{
+		QueuedBlockEmerge *q = *i;
+		// Blocks queued with nobody to send to are left as they are
+		if(q->peer_ids.size() == 0)
+		{
+			i++;
+			continue;
+		}
+
+		core::list<u16> unwanted;
+		s16 priority = 32767;
+		for(core::map<u16, u8>::Iterator
+				j = q->peer_ids.getIterator();
+				j.atEnd() == false; j++)
+		{
+			u16 peer_id = j.getNode()->getKey();
+			core::map<u16, v3s16>::Node *n = peer_blockpos.find(peer_id);
+			if(n == NULL)
+			{
+				unwanted.push_back(peer_id);
+				continue;
+			}
+			v3s16 d = q->pos - n->getValue();
+			s16 dist = MYMAX(MYMAX(abs(d.X), abs(d.Y)), abs(d.Z));
+			if(dist > max_d)
+			{
+				unwanted.push_back(peer_id);
+				continue;
+			}
+			s16 p = getPriority(dist, j.getNode()->getValue());
+			if(p < priority)
+				priority = p;
+		}
+		for(core::list<u16>::Iterator j = unwanted.begin();
+				j != unwanted.end(); j++)
+			q->peer_ids.remove(*j);
+
+		if(q->peer_ids.size() == 0)
+		{
+			delete q;
+			i = m_queue.erase(i);
+			removed++;
+			continue;
+		}
+		q->priority = priority;
+		i++;
+	}
+	return removed;
+}
+
+void BlockEmergeQueue::getNear(v3s16 p, s16 d, u32 max_count,
+		core::list<v3s16> &dst)
+{
+	JMutexAutoLock lock(m_mutex);
+
+	u32 count = 0;
+	core::list<QueuedBlockEmerge*>::Iterator i;
+	for(i=m_queue.begin(); i!=m_queue.end() && count<max_count; i++)
+	{
+		v3s16 d2 = (*i)->pos - p;
+		if(d2.X < -d || d2.X > d || d2.Y < -d || d2.Y > d
+				|| d2.Z < -d || d2.Z > d)
+			continue;
+		dst.push_back((*i)->pos);
+		count++;
+	}
+}
+
+u32 BlockEmergeQueue::peerItemCount(u16 peer_id)
+{
+	JMutexAutoLock lock(m_mutex);
+
+	u32 count = 0;
+
+	core::list<QueuedBlockEmerge*>::Iterator i;
+	for(i=m_queue.begin(); i!=m_queue.end(); i++)
+	{
+		QueuedBlockEmerge *q = *i;
+		if(q->peer_ids.find(peer_id) != NULL)
+			count++;
+	}
+
+	return count;
+}
+
+u32 BlockEmergeQueue::getWaitPercentile(u32 percentile)
+{
+	core::array<u32> sorted;
+	{
+		JMutexAutoLock lock(m_mutex);
+		sorted = m_wait_times;
+	}
+	if(sorted.size() == 0)
+		return 0;
+	sorted.sort();
+	u32 i = (sorted.size() - 1) * MYMIN(percentile, 100) / 100;
+	return sorted[i];
+}
+
+bool BlockEmergeQueue::isNearEmerging(v3s16 p)
+{
+	for(core::map<v3s16, bool>::Iterator
+			i = m_emerging.getIterator();
+			i.atEnd() == false; i++)
+	{
+		v3s16 d = i.getNode()->getKey() - p;
+		if(d.X >= -2 && d.X <= 2 && d.Y >= -2 && d.Y <= 2
+				&& d.Z >= -2 && d.Z <= 2)
+			return true;
+	}
+	return false;
+}
+
+/*
+	BlockSendCache
+*/
+
+BlockSendCache::BlockSendCache():
+	m_max_blocks(0),
+	m_compression_level(-1)
+{
+}
+
+void BlockSendCache::setMaxBlocks(u32 max_blocks)
+{
+	m_max_blocks = max_blocks;
+	if(m_packets.size() > m_max_blocks)
+		m_packets.clear();
+}
+
+SharedBuffer<u8> BlockSendCache::get(MapBlock *block, u8 ver, u8 codec)
+{
+	v3s16 p = block->getPos();
+	u64 stamp = block->getChangeStamp();
+
+	core::map<v3s16, CachedPacket>::Node *n = m_packets.find(p);
+	if(n != NULL && n->getValue().stamp == stamp
+			&& n->getValue().ver == ver && n->getValue().codec == codec)
+	{
+		g_profiler->add("Server: block send cache hits", 1);
+		n->getValue().unused_time = 0;
+		return n->getValue().data;
+	}
+	g_profiler->add("Server: block send cache misses", 1);
+
+	/*
+		Create a packet with the block in the right format
+	*/
+	
+	std::ostringstream os(std::ios_base::binary);
+	u8 header[8];
+	writeU16(&header[0], TOCLIENT_BLOCKDATA);
+	writeV3S16(&header[2], p);
+	os.write((char*)header, 8);
+	block->serialize(os, ver, codec, m_compression_level);
+	std::string s = os.str();
+	SharedBuffer<u8> data((u8*)s.c_str(), s.size());
+
+	CachedPacket c;
+	c.stamp = stamp;
+	c.ver = ver;
+	c.codec = codec;
+	c.data = data;
+	c.unused_time = 0;
+	if(n != NULL)
+		n->setValue(c);
+	else if(m_packets.size() < m_max_blocks)
+		m_packets.insert(p, c);
+
+	return data;
+}
+
+void BlockSendCache::removeUnused(float dtime, float max_age)
+{
+	core::list<v3s16> unused;
+	for(core::map<v3s16, CachedPacket>::Iterator i = m_packets.getIterator();
+			i.atEnd() == false; i++)
+	{
+		CachedPacket &c = i.getNode()->getValue();
+		c.unused_time += dtime;
+		if(c.unused_time > max_age)
+			unused.push_back(i.getNode()->getKey());
+	}
+	for(core::list<v3s16>::Iterator i = unused.begin();
+			i != unused.end(); i++)
+		m_packets.remove(*i);
+}
+
 void * ServerThread::Thread()
 {
 	ThreadStarted();
@@ -106,6 +423,27 @@ void * ServerThread::Thread()
 	return NULL;
 }
 
+void EmergeThread::activateEmerged(MapBlock *block,
+		bool enable_mapgen_debug_info)
+{
+	if(enable_mapgen_debug_info)
+		infostream<<"EmergeThread: ended up with: "
+				<<analyze_block(block)<<std::endl;
+
+	if(block == NULL)
+		return;
+
+	/*
+		Ignore map edit events, they will not need to be
+		sent to anybody because the block hasn't been sent
+		to anybody
+	*/
+	MapEditEventIgnorer ign(&m_server->m_ignore_map_edit_events);
+	
+	// Activate objects and stuff
+	m_server->m_env.activateBlock(block, 3600);
+}
+
 void * EmergeThread::Thread()
 {
 	ThreadStarted();
@@ -117,18 +455,33 @@ void * EmergeThread::Thread()
 	BEGIN_DEBUG_EXCEPTION_HANDLER
 
 	bool enable_mapgen_debug_info = g_settings->getBool("enable_mapgen_debug_info");
+	u32 prefetch_max = rangelim(
+			g_settings->getS32("emerge_prefetch_max_blocks"), 0, 1024);
+	s16 prefetch_distance = rangelim(
+			g_settings->getS16("emerge_prefetch_distance"), 0, 16);
 	
 	/*
 		Get block info from queue, emerge them and send them
 		to clients.
 
 		After queue is empty, exit.
+
+		There can be many of these threads. Blocks are read from the
+		database and generated without locking the environment; it is
+		locked only for adding loaded blocks to the map and for copying
+		the area of the block from and back to the map.
 	*/
 	while(getRun())
 	{
 		QueuedBlockEmerge *qptr = m_server->m_emerge_queue.pop();
 		if(qptr == NULL)
-			break;
+		{
+			// Wait if the rest are near blocks other threads emerge
+			if(m_server->m_emerge_queue.size() == 0)
+				break;
+			sleep_ms(10);
+			continue;
+		}
 		
 		SharedPtr<QueuedBlockEmerge> q(qptr);
 
@@ -144,7 +497,10 @@ void * EmergeThread::Thread()
 		|| p.Y > MAP_GENERATION_LIMIT / MAP_BLOCKSIZE
 		|| p.Z < -MAP_GENERATION_LIMIT / MAP_BLOCKSIZE
 		|| p.Z > MAP_GENERATION_LIMIT / MAP_BLOCKSIZE)
+		{
+			m_server->m_emerge_queue.done(qptr);
 			continue;
+		}
 			
 		//infostream<<"EmergeThread::Thread(): running"<<std::endl;
 
@@ -164,7 +520,7 @@ void * EmergeThread::Thread()
 			Also decrement the emerge queue count in clients.
 		*/
 
-		bool only_from_disk = true;
+		bool only_from_disk = (q->generate == false);
 
 		{
 			core::map<u16, u8>::Iterator i;
@@ -193,12 +549,21 @@ void * EmergeThread::Thread()
 		MapBlock *block = NULL;
 		bool got_block = true;
 		core::map<v3s16, MapBlock*> modified_blocks;
+		// Set up if the block is generated
+		mapgen::BlockMakeData data;
+		bool generate = false;
 		
 		/*
-			Fetch block from map or generate a single block
+			Fetch block from map or generate a single block.
+
+			The blocks to load are read from the database and decoded
+			without locking the environment, so that the server doesn't
+			wait for the database.
 		*/
+		core::list<v3s16> batch;
 		{
-			JMutexAutoLock envlock(m_server->m_env_mutex);
+			ProfiledAutoLock envlock(g_profiler, m_server->m_env_mutex,
+					g_env_lock_names);
 			
 			// Load sector if it isn't loaded
 			if(map.getSectorNoGenerateNoEx(p2d) == NULL)
@@ -211,61 +576,126 @@ void * EmergeThread::Thread()
 				if(enable_mapgen_debug_info)
 					infostream<<"EmergeThread: not in memory, loading"<<std::endl;
 
-				// Get, load or create sector
-				/*ServerMapSector *sector =
-						(ServerMapSector*)map.createSector(p2d);*/
-
-				// Load/generate block
-
-				/*block = map.emergeBlock(p, sector, changed_blocks,
-						lighting_invalidated_blocks);*/
-
-				block = map.loadBlock(p);
-				
-				if(only_from_disk == false)
+				batch.push_back(p);
+				if(prefetch_max != 0)
 				{
-					if(block == NULL || block->isGenerated() == false)
+					/*
+						Load queued blocks around this one together
+						with it. Requests come in clusters when a
+						player joins or moves, and the database can
+						fetch many blocks in one go.
+					*/
+					core::list<v3s16> near;
+					m_server->m_emerge_queue.getNear(p, prefetch_distance,
+							prefetch_max, near);
+					for(core::list<v3s16>::Iterator i = near.begin();
+							i != near.end(); i++)
 					{
-						if(enable_mapgen_debug_info)
-							infostream<<"EmergeThread: generating"<<std::endl;
-						block = map.generateBlock(p, modified_blocks);
+						MapBlock *b = map.getBlockNoCreateNoEx(*i);
+						if(b == NULL || b->isDummy() || !b->isGenerated())
+							batch.push_back(*i);
 					}
 				}
+			}
+		}
 
-				if(enable_mapgen_debug_info)
-					infostream<<"EmergeThread: ended up with: "
-							<<analyze_block(block)<<std::endl;
+		core::map<v3s16, LoadedBlock> stored;
+		if(batch.size() != 0)
+		{
+			u32 time_ms = porting::getTimeMs();
+			{
+				ScopeProfiler sp(g_profiler,
+						"EmergeThread: batch load avg", SPT_AVG);
+				map.readBlocks(batch, stored);
+				map.decodeBlocks(stored);
+			}
+			time_ms = porting::getTimeMs() - time_ms;
+			g_profiler->avg("EmergeThread: blocks per batch load avg",
+					batch.size());
+			g_profiler->add("EmergeThread: batch load time (ms)", time_ms);
+		}
 
-				if(block == NULL)
+		if(batch.size() != 0)
+		{
+			ProfiledAutoLock envlock(g_profiler, m_server->m_env_mutex,
+					g_env_lock_names);
+
+			core::map<v3s16, MapBlock*> loaded;
+			map.insertBlocks(stored, loaded);
+			g_profiler->add("EmergeThread: blocks loaded", loaded.size());
+
+			block = map.getBlockNoCreateNoEx(p);
+			// Loaded and activated by another thread meanwhile
+			bool activated = (loaded.find(p) == NULL && block != NULL
+					&& !block->isDummy() && block->isGenerated());
+
+			/*
+				The other blocks won't go through here again
+				since they are now in memory, so activate them
+				now
+			*/
+			{
+				MapEditEventIgnorer ign(&m_server->m_ignore_map_edit_events);
+				for(core::map<v3s16, MapBlock*>::Iterator
+						i = loaded.getIterator();
+						i.atEnd() == false; i++)
 				{
-					got_block = false;
+					MapBlock *b = i.getNode()->getValue();
+					if(b != block && b->isGenerated())
+						m_server->m_env.activateBlock(b, 3600);
 				}
-				else
+			}
+			
+			if(only_from_disk == false)
+			{
+				if(block == NULL || block->isGenerated() == false)
 				{
-					/*
-						Ignore map edit events, they will not need to be
-						sent to anybody because the block hasn't been sent
-						to anybody
-					*/
-					MapEditEventIgnorer ign(&m_server->m_ignore_map_edit_events);
-					
-					// Activate objects and stuff
-					m_server->m_env.activateBlock(block, 3600);
+					if(enable_mapgen_debug_info)
+						infostream<<"EmergeThread: generating"<<std::endl;
+					// Copy the area of the block from the map
+					map.initBlockMake(&data, p);
+					generate = true;
 				}
 			}
-			else
+
+			if(generate == false)
 			{
-				/*if(block->getLightingExpired()){
-					lighting_invalidated_blocks[block->getPos()] = block;
-				}*/
+				if(activated == false)
+					activateEmerged(block, enable_mapgen_debug_info);
+				if(block == NULL)
+					got_block = false;
 			}
 
 			// TODO: Some additional checking and lighting updating,
 			//       see emergeBlock
 		}
 
+		/*
+			Generate the block without locking the environment
+		*/
+		if(generate && data.no_op == false)
+		{
+			// The map may change meanwhile; don't overwrite that
+			data.vmanip->keepInitial();
+
+			ScopeProfiler sp(g_profiler, "EmergeThread: make_block avg",
+					SPT_AVG);
+			mapgen::make_block(&data);
+		}
+
 		{//envlock
-		JMutexAutoLock envlock(m_server->m_env_mutex);
+		ProfiledAutoLock envlock(g_profiler, m_server->m_env_mutex,
+				g_env_lock_names);
+
+		if(generate)
+		{
+			// Blit it back on the map, update lighting and whatever
+			map.finishBlockMake(&data, modified_blocks);
+			block = map.getBlockNoCreateNoEx(p);
+			activateEmerged(block, enable_mapgen_debug_info);
+			if(block == NULL)
+				got_block = false;
+		}
 		
 		if(got_block)
 		{
@@ -310,7 +740,7 @@ void * EmergeThread::Thread()
 		*/
 	
 		// NOTE: Server's clients are also behind the connection mutex
-		JMutexAutoLock lock(m_server->m_con_mutex);
+		ProfiledAutoLock lock(g_profiler, m_server->m_con_mutex, g_con_lock_names);
 
 		/*
 			Add the originally fetched block to the modified list
@@ -336,7 +766,8 @@ void * EmergeThread::Thread()
 				client->SetBlocksNotSent(modified_blocks);
 			}
 		}
-		
+
+		m_server->m_emerge_queue.done(qptr);
 	}
 
 	END_DEBUG_EXCEPTION_HANDLER(errorstream)
@@ -693,8 +1124,11 @@ void RemoteClient::GetNextBlocks(Server *server, float dtime,
 					if(generate == false)
 						flags |= BLOCK_EMERGE_FLAG_FROMDISK;
 					
-					server->m_emerge_queue.addBlock(peer_id, p, flags);
-					server->m_emergethread.trigger();
+					server->m_emerge_queue.addBlock(peer_id, p, flags, d);
+					server->triggerEmergeThreads();
+
+					if(m_emerge_requests.find(p) == NULL)
+						m_emerge_requests.insert(p, porting::getTimeMs());
 
 					if(nearest_emerged_d == -1)
 						nearest_emerged_d = d;
@@ -878,6 +1312,31 @@ void RemoteClient::SentBlock(v3s16 p)
 				" already in m_blocks_sending"<<std::endl;
 }
 
+bool RemoteClient::takeEmergeRequest(v3s16 p, u32 &wait_ms)
+{
+	core::map<v3s16, u32>::Node *n = m_emerge_requests.find(p);
+	if(n == NULL)
+		return false;
+	wait_ms = porting::getTimeMs() - n->getValue();
+	m_emerge_requests.remove(p);
+	return true;
+}
+
+void RemoteClient::removeOldEmergeRequests(u32 max_age_ms)
+{
+	u32 now = porting::getTimeMs();
+	core::list<v3s16> old;
+	for(core::map<v3s16, u32>::Iterator
+			i = m_emerge_requests.getIterator();
+			i.atEnd()==false; i++)
+	{
+		if(now - i.getNode()->getValue() > max_age_ms)
+			old.push_back(i.getNode()->getKey());
+	}
+	for(core::list<v3s16>::Iterator i = old.begin(); i != old.end(); i++)
+		m_emerge_requests.remove(*i);
+}
+
 void RemoteClient::SetBlockNotSent(v3s16 p)
 {
 	m_nearest_unsent_d = 0;
@@ -952,8 +1411,8 @@ Server::Server(
 	m_con(PROTOCOL_ID, 512, CONNECTION_TIMEOUT, this),
 	m_authmanager(mapsavedir+"/auth.txt"),
 	m_banmanager(mapsavedir+"/ipban.txt"),
+	m_pregen(mapsavedir+"/pregen.txt"),
 	m_thread(this),
-	m_emergethread(this),
 	m_time_counter(0),
 	m_time_of_day_send_timer(0),
 	m_uptime(0),
@@ -967,16 +1426,33 @@ Server::Server(
 	m_print_info_timer = 0.0;
 	m_objectdata_timer = 0.0;
 	m_emergethread_trigger_timer = 0.0;
+	m_emerge_reprioritize_timer = 0.0;
 	m_savemap_timer = 0.0;
+	m_backup_timer = 0.0;
+	m_step_time_us = 0;
+	m_block_send_cache.setMaxBlocks(rangelim(
+			g_settings->getS32("block_send_cache_max_blocks"), 0, 100000));
+	m_block_send_cache.setCompressionLevel(
+			g_settings->getS32("network_compression_level"));
+	m_compression_codec = parseCompressionCodec(lowercase(trim(
+			g_settings->get("network_compression_codec"))));
 	
 	m_env_mutex.Init();
 	m_con_mutex.Init();
 	m_step_dtime_mutex.Init();
 	m_step_dtime = 0.0;
+
+	u32 emerge_thread_count = rangelim(
+			g_settings->getS32("num_emerge_threads"), 1, 32);
+	for(u32 i=0; i<emerge_thread_count; i++)
+		m_emergethreads.push_back(new EmergeThread(this));
 	
 	// Register us to receive map edit events
 	m_env.getMap().addEventReceiver(this);
 
+	// Add the modifiers of the built-in content
+	add_content_abms(&m_env);
+
 	// If file exists, load environment metadata
 	if(fs::PathExists(m_mapsavedir+"/env_meta.txt"))
 	{
@@ -997,7 +1473,7 @@ Server::~Server()
 		Send shutdown message
 	*/
 	{
-		JMutexAutoLock conlock(m_con_mutex);
+		ProfiledAutoLock conlock(g_profiler, m_con_mutex, g_con_lock_names);
 		
 		std::wstring line = L"*** Server shutting down";
 
@@ -1023,7 +1499,7 @@ Server::~Server()
 	}
 
 	{
-		JMutexAutoLock envlock(m_env_mutex);
+		ProfiledAutoLock envlock(g_profiler, m_env_mutex, g_env_lock_names);
 
 	/*
 		Save players
@@ -1036,18 +1512,25 @@ Server::~Server()
 	*/
 		infostream<<"Server: Saving environment metadata"<<std::endl;
 	m_env.saveMeta(m_mapsavedir);
+
+	// Progress of the pre-generation
+	updatePregenInFlight();
+	m_pregen.save();
 	}
 	
 	/*
 		Stop threads
 	*/
 	stop();
+
+	for(u32 i=0; i<m_emergethreads.size(); i++)
+		delete m_emergethreads[i];
 	
 	/*
 		Delete clients
 	*/
 	{
-		JMutexAutoLock clientslock(m_con_mutex);
+		ProfiledAutoLock clientslock(g_profiler, m_con_mutex, g_con_lock_names);
 
 		for(core::map<u16, RemoteClient*>::Iterator
 			i = m_clients.getIterator();
@@ -1092,9 +1575,11 @@ void Server::stop()
 
 	// Stop threads (set run=false first so both start stopping)
 	m_thread.setRun(false);
-	m_emergethread.setRun(false);
+	for(u32 i=0; i<m_emergethreads.size(); i++)
+		m_emergethreads[i]->setRun(false);
 	m_thread.stop();
-	m_emergethread.stop();
+	for(u32 i=0; i<m_emergethreads.size(); i++)
+		m_emergethreads[i]->stop();
 	
 	infostream<<"Server: Threads stopped"<<std::endl;
 }
@@ -1133,6 +1618,8 @@ void Server::AsyncRunStep()
 		return;
 
 	g_profiler->add("Server::AsyncRunStep with dtime (num)", 1);
+
+	u32 step_start_us = porting::getTimeUs();
 	
 	//infostream<<"Server steps "<<dtime<<std::endl;
 	//infostream<<"Server::AsyncRunStep(): dtime="<<dtime<<std::endl;
@@ -1151,7 +1638,7 @@ void Server::AsyncRunStep()
 	
 	{
 		// Process connection's timeouts
-		JMutexAutoLock lock2(m_con_mutex);
+		ProfiledAutoLock lock2(g_profiler, m_con_mutex, g_con_lock_names);
 		ScopeProfiler sp(g_profiler, "Server: connection timeout processing");
 		m_con.RunTimeouts(dtime);
 	}
@@ -1166,7 +1653,7 @@ void Server::AsyncRunStep()
 		Update m_time_of_day and overall game time
 	*/
 	{
-		JMutexAutoLock envlock(m_env_mutex);
+		ProfiledAutoLock envlock(g_profiler, m_env_mutex, g_env_lock_names);
 
 		m_time_counter += dtime;
 		f32 speed = g_settings->getFloat("time_speed") * 24000./(24.*3600);
@@ -1187,7 +1674,7 @@ void Server::AsyncRunStep()
 			m_time_of_day_send_timer = g_settings->getFloat("time_send_interval");
 
 			//JMutexAutoLock envlock(m_env_mutex);
-			JMutexAutoLock conlock(m_con_mutex);
+			ProfiledAutoLock conlock(g_profiler, m_con_mutex, g_con_lock_names);
 
 			for(core::map<u16, RemoteClient*>::Iterator
 				i = m_clients.getIterator();
@@ -1205,7 +1692,7 @@ void Server::AsyncRunStep()
 	}
 
 	{
-		JMutexAutoLock lock(m_env_mutex);
+		ProfiledAutoLock lock(g_profiler, m_env_mutex, g_env_lock_names);
 		// Step environment
 		ScopeProfiler sp(g_profiler, "SEnv step");
 		ScopeProfiler sp2(g_profiler, "SEnv step avg", SPT_AVG);
@@ -1215,12 +1702,20 @@ void Server::AsyncRunStep()
 	const float map_timer_and_unload_dtime = 5.15;
 	if(m_map_timer_and_unload_interval.step(dtime, map_timer_and_unload_dtime))
 	{
-		JMutexAutoLock lock(m_env_mutex);
+		ProfiledAutoLock lock(g_profiler, m_env_mutex, g_env_lock_names);
 		// Run Map's timers and unload unused data
 		ScopeProfiler sp(g_profiler, "Server: map timer and unload");
 		m_env.getMap().timerUpdate(map_timer_and_unload_dtime,
 				g_settings->getFloat("server_unload_unused_data_timeout"));
 	}
+
+	/*
+		Commit grouped block writes that have waited long enough
+	*/
+	{
+		ProfiledAutoLock lock(g_profiler, m_env_mutex, g_env_lock_names);
+		m_env.getServerMap().flushSave();
+	}
 	
 	/*
 		Do background stuff
@@ -1234,12 +1729,14 @@ void Server::AsyncRunStep()
 	{
 		m_liquid_transform_timer -= 1.00;
 		
-		JMutexAutoLock lock(m_env_mutex);
+		ProfiledAutoLock lock(g_profiler, m_env_mutex, g_env_lock_names);
 
 		ScopeProfiler sp(g_profiler, "Server: liquid transform");
 
 		core::map<v3s16, MapBlock*> modified_blocks;
-		m_env.getMap().transformLiquids(modified_blocks);
+		m_env.getMap().transformLiquids(modified_blocks, m_env.getJobPool(),
+				rangelim(g_settings->getS32("liquid_max_step_time"),
+				1, 10000));
 #if 0		
 		/*
 			Update lighting
@@ -1261,7 +1758,7 @@ void Server::AsyncRunStep()
 			Set the modified blocks unsent for all the clients
 		*/
 		
-		JMutexAutoLock lock2(m_con_mutex);
+		ProfiledAutoLock lock2(g_profiler, m_con_mutex, g_con_lock_names);
 
 		for(core::map<u16, RemoteClient*>::Iterator
 				i = m_clients.getIterator();
@@ -1285,7 +1782,7 @@ void Server::AsyncRunStep()
 		{
 			counter = 0.0;
 
-			JMutexAutoLock lock2(m_con_mutex);
+			ProfiledAutoLock lock2(g_profiler, m_con_mutex, g_con_lock_names);
 
 			if(m_clients.size() != 0)
 				infostream<<"Players:"<<std::endl;
@@ -1312,8 +1809,8 @@ void Server::AsyncRunStep()
 	*/
 	{
 		//infostream<<"Server: Checking added and deleted active objects"<<std::endl;
-		JMutexAutoLock envlock(m_env_mutex);
-		JMutexAutoLock conlock(m_con_mutex);
+		ProfiledAutoLock envlock(g_profiler, m_env_mutex, g_env_lock_names);
+		ProfiledAutoLock conlock(g_profiler, m_con_mutex, g_con_lock_names);
 
 		ScopeProfiler sp(g_profiler, "Server: checking added and deleted objs");
 
@@ -1461,8 +1958,8 @@ void Server::AsyncRunStep()
 		Send object messages
 	*/
 	{
-		JMutexAutoLock envlock(m_env_mutex);
-		JMutexAutoLock conlock(m_con_mutex);
+		ProfiledAutoLock envlock(g_profiler, m_env_mutex, g_env_lock_names);
+		ProfiledAutoLock conlock(g_profiler, m_con_mutex, g_con_lock_names);
 
 		//ScopeProfiler sp(g_profiler, "Server: sending object messages");
 
@@ -1701,8 +2198,8 @@ void Server::AsyncRunStep()
 		counter += dtime;
 		if(counter >= g_settings->getFloat("objectdata_interval"))
 		{
-			JMutexAutoLock lock1(m_env_mutex);
-			JMutexAutoLock lock2(m_con_mutex);
+			ProfiledAutoLock lock1(g_profiler, m_env_mutex, g_env_lock_names);
+			ProfiledAutoLock lock2(g_profiler, m_con_mutex, g_con_lock_names);
 
 			//ScopeProfiler sp(g_profiler, "Server: sending player positions");
 
@@ -1712,6 +2209,49 @@ void Server::AsyncRunStep()
 		}
 	}
 	
+	/*
+		Emerge the blocks near to where the players are now first and
+		forget the ones nobody wants any more
+	*/
+	{
+		float &counter = m_emerge_reprioritize_timer;
+		counter += dtime;
+		if(counter >= 1.0)
+		{
+			counter = 0.0;
+
+			core::map<u16, v3s16> peer_blockpos;
+			{
+				ProfiledAutoLock lock1(g_profiler, m_env_mutex, g_env_lock_names);
+				ProfiledAutoLock lock2(g_profiler, m_con_mutex, g_con_lock_names);
+
+				for(core::map<u16, RemoteClient*>::Iterator
+					i = m_clients.getIterator();
+					i.atEnd() == false; i++)
+				{
+					u16 peer_id = i.getNode()->getKey();
+					// Requests that were cancelled or not sent
+					i.getNode()->getValue()->removeOldEmergeRequests(
+							EMERGE_REQUEST_MAX_AGE_MS);
+					Player *player = m_env.getPlayer(peer_id);
+					if(player == NULL)
+						continue;
+					v3s16 p = getNodeBlockPos(
+							floatToInt(player->getPosition(), BS));
+					peer_blockpos.insert(peer_id, p);
+				}
+			}
+
+			// The clients look one block ahead of the player
+			s16 max_d = g_settings->getS16("max_block_send_distance") + 1;
+			u32 removed = m_emerge_queue.reprioritize(peer_blockpos, max_d);
+
+			g_profiler->avg("Server: emerge queue size avg",
+					m_emerge_queue.size());
+			g_profiler->add("Server: emerge requests cancelled", removed);
+		}
+	}
+
 	/*
 		Trigger emergethread (it somehow gets to a non-triggered but
 		bysy state sometimes)
@@ -1723,7 +2263,7 @@ void Server::AsyncRunStep()
 		{
 			counter = 0.0;
 			
-			m_emergethread.trigger();
+			triggerEmergeThreads();
 		}
 	}
 
@@ -1746,7 +2286,7 @@ void Server::AsyncRunStep()
 				m_banmanager.save();
 			
 			// Map
-			JMutexAutoLock lock(m_env_mutex);
+			ProfiledAutoLock lock(g_profiler, m_env_mutex, g_env_lock_names);
 
 			/*// Unload unused data (delete from memory)
 			m_env.getMap().unloadUnusedData(
@@ -1770,8 +2310,79 @@ void Server::AsyncRunStep()
 			
 			// Save environment metadata
 			m_env.saveMeta(m_mapsavedir);
+
+			// Progress of the pre-generation
+			updatePregenInFlight();
+			m_pregen.save();
+		}
+	}
+
+	// Start a backup of the map; it is done by the map save thread
+	{
+		float interval = g_settings->getFloat("backup_interval");
+		float &counter = m_backup_timer;
+		counter += dtime;
+		if(interval > 0 && counter >= interval)
+		{
+			counter = 0.0;
+			m_env.getServerMap().startBackup(false);
 		}
 	}
+
+	/*
+		Queue blocks of the pre-generation. The emerge threads make
+		them after the blocks the players want. None are queued while
+		the emerge queue is long or the steps of the server take longer
+		than pregen_max_step_time, and queueing stops when the step has
+		taken that long. This only limits the queueing; generating
+		takes the environment lock now and then, which makes the steps
+		longer, so a long step stops the queueing of the next one.
+	*/
+	if(m_pregen.isRunning())
+	{
+		u32 max_step_us = 1000 * rangelim(
+				g_settings->getS32("pregen_max_step_time"), 1, 10000);
+		u32 max_queued = rangelim(
+				g_settings->getS32("pregen_max_queued"), 1, 1000);
+
+		if(m_step_time_us < max_step_us)
+		{
+			ProfiledAutoLock envlock(g_profiler, m_env_mutex, g_env_lock_names);
+			ScopeProfiler sp(g_profiler, "Server: queue pregen blocks");
+
+			updatePregenInFlight();
+
+			u32 queued = 0;
+			// Blocks in memory are skipped; don't walk too many at once
+			for(u32 walked=0; walked<1000; walked++)
+			{
+				if(m_emerge_queue.size() >= max_queued)
+					break;
+				if(porting::getTimeUs() - step_start_us >= max_step_us)
+					break;
+				v3s16 p;
+				if(m_pregen.next(p) == false)
+				{
+					actionstream<<"Pre-generation of "<<m_pregen.getTotal()
+							<<" blocks done"<<std::endl;
+					m_pregen.save();
+					break;
+				}
+				MapBlock *block = m_env.getMap().getBlockNoCreateNoEx(p);
+				if(block && block->isGenerated())
+					continue;
+				m_emerge_queue.addBlock(0, p, 0,
+						BLOCK_EMERGE_PREGEN_PRIORITY);
+				m_pregen.setQueued(p);
+				queued++;
+			}
+			if(queued > 0)
+				triggerEmergeThreads();
+			g_profiler->add("Server: pregen blocks queued", queued);
+		}
+	}
+
+	m_step_time_us = porting::getTimeUs() - step_start_us;
 }
 
 void Server::Receive()
@@ -1783,7 +2394,7 @@ void Server::Receive()
 	u32 datasize;
 	try{
 		{
-			JMutexAutoLock conlock(m_con_mutex);
+			ProfiledAutoLock conlock(g_profiler, m_con_mutex, g_con_lock_names);
 			datasize = m_con.Receive(peer_id, *data, data_maxsize);
 		}
 
@@ -1855,8 +2466,8 @@ void Server::ProcessData(u8 *data, u32 datasize, u16 peer_id)
 {
 	DSTACK(__FUNCTION_NAME);
 	// Environment is locked first.
-	JMutexAutoLock envlock(m_env_mutex);
-	JMutexAutoLock conlock(m_con_mutex);
+	ProfiledAutoLock envlock(g_profiler, m_env_mutex, g_env_lock_names);
+	ProfiledAutoLock conlock(g_profiler, m_con_mutex, g_con_lock_names);
 	
 	try{
 		Address address = m_con.GetPeerAddress(peer_id);
@@ -1894,6 +2505,8 @@ void Server::ProcessData(u8 *data, u32 datasize, u16 peer_id)
 		// [2] u8 SER_FMT_VER_HIGHEST
 		// [3] u8[20] player_name
 		// [23] u8[28] password <--- can be sent without this, from old versions
+		// [51] u16 client network protocol version
+		// [53] u16 supported compression codecs <--- new, optional
 
 		if(datasize < 2+1+PLAYERNAME_SIZE)
 			return;
@@ -1936,6 +2549,23 @@ void Server::ProcessData(u8 *data, u32 datasize, u16 peer_id)
 
 		getClient(peer_id)->net_proto_version = net_proto_version;
 
+		/*
+			Choose the codec of the block data: the configured one if
+			the client supports it, zlib otherwise
+		*/
+
+		u16 client_codecs = 1<<CODEC_ZLIB;
+		if(datasize >= 2+1+PLAYERNAME_SIZE+PASSWORD_SIZE+2+2)
+		{
+			client_codecs = readU16(&data[2+1+PLAYERNAME_SIZE+PASSWORD_SIZE+2]);
+		}
+		u8 codec = m_compression_codec;
+		if((client_codecs & (1<<codec)) == 0)
+			codec = CODEC_ZLIB;
+		getClient(peer_id)->compression_codec = codec;
+		infostream<<"Server: Using "<<getCompressionCodecName(codec)
+				<<" compression with peer "<<peer_id<<std::endl;
+
 		if(net_proto_version == 0)
 		{
 			SendAccessDenied(m_con, peer_id,
@@ -3621,6 +4251,10 @@ void Server::inventoryModified(InventoryContext *c, std::string id)
 		if(meta)
 			meta->inventoryModified();
 
+		MapBlock *block = m_env.getMap().getBlockNoCreateNoEx(blockpos);
+		if(block)
+			block->raiseModified(MOD_STATE_WRITE_NEEDED);
+
 		for(core::map<u16, RemoteClient*>::Iterator
 			i = m_clients.getIterator();
 			i.atEnd()==false; i++)
@@ -3638,8 +4272,8 @@ void Server::inventoryModified(InventoryContext *c, std::string id)
 core::list<PlayerInfo> Server::getPlayerInfo()
 {
 	DSTACK(__FUNCTION_NAME);
-	JMutexAutoLock envlock(m_env_mutex);
-	JMutexAutoLock conlock(m_con_mutex);
+	ProfiledAutoLock envlock(g_profiler, m_env_mutex, g_env_lock_names);
+	ProfiledAutoLock conlock(g_profiler, m_con_mutex, g_con_lock_names);
 	
 	core::list<PlayerInfo> list;
 
@@ -4271,7 +4905,7 @@ void Server::setBlockNotSent(v3s16 p)
 	}
 }
 
-void Server::SendBlockNoLock(u16 peer_id, MapBlock *block, u8 ver)
+void Server::SendBlockNoLock(u16 peer_id, MapBlock *block, u8 ver, u8 codec)
 {
 	DSTACK(__FUNCTION_NAME);
 
@@ -4279,17 +4913,7 @@ void Server::SendBlockNoLock(u16 peer_id, MapBlock *block, u8 ver)
 	
 #if 0
 	// Analyze it a bit
-	bool completely_air = true;
-	for(s16 z0=0; z0<MAP_BLOCKSIZE; z0++)
-	for(s16 x0=0; x0<MAP_BLOCKSIZE; x0++)
-	for(s16 y0=0; y0<MAP_BLOCKSIZE; y0++)
-	{
-		if(block->getNodeNoEx(v3s16(x0,y0,z0)).d != CONTENT_AIR)
-		{
-			completely_air = false;
-			x0 = y0 = z0 = MAP_BLOCKSIZE; // Break out
-		}
-	}
+	bool completely_air = block->isAllContent(CONTENT_AIR);
 
 	// Print result
 	infostream<<"Server: Sending block ("<<p.X<<","<<p.Y<<","<<p.Z<<"): ";
@@ -4299,24 +4923,13 @@ void Server::SendBlockNoLock(u16 peer_id, MapBlock *block, u8 ver)
 #endif
 
 	/*
-		Create a packet with the block in the right format
+		Get a packet with the block in the right format
 	*/
 	
-	std::ostringstream os(std::ios_base::binary);
-	block->serialize(os, ver);
-	std::string s = os.str();
-	SharedBuffer<u8> blockdata((u8*)s.c_str(), s.size());
-
-	u32 replysize = 8 + blockdata.getSize();
-	SharedBuffer<u8> reply(replysize);
-	writeU16(&reply[0], TOCLIENT_BLOCKDATA);
-	writeS16(&reply[2], p.X);
-	writeS16(&reply[4], p.Y);
-	writeS16(&reply[6], p.Z);
-	memcpy(&reply[8], *blockdata, blockdata.getSize());
+	SharedBuffer<u8> reply = m_block_send_cache.get(block, ver, codec);
 
 	/*infostream<<"Server: Sending block ("<<p.X<<","<<p.Y<<","<<p.Z<<")"
-			<<":  \tpacket size: "<<replysize<<std::endl;*/
+			<<":  \tpacket size: "<<reply.getSize()<<std::endl;*/
 	
 	/*
 		Send packet
@@ -4324,15 +4937,26 @@ void Server::SendBlockNoLock(u16 peer_id, MapBlock *block, u8 ver)
 	m_con.Send(peer_id, 1, reply, true);
 }
 
+void Server::triggerEmergeThreads()
+{
+	for(u32 i=0; i<m_emergethreads.size(); i++)
+		m_emergethreads[i]->trigger();
+}
+
 void Server::SendBlocks(float dtime)
 {
 	DSTACK(__FUNCTION_NAME);
 
-	JMutexAutoLock envlock(m_env_mutex);
-	JMutexAutoLock conlock(m_con_mutex);
+	ProfiledAutoLock envlock(g_profiler, m_env_mutex, g_env_lock_names);
+	ProfiledAutoLock conlock(g_profiler, m_con_mutex, g_con_lock_names);
 
 	//TimeTaker timer("Server::SendBlocks");
 
+	m_block_send_cache.removeUnused(dtime,
+			g_settings->getFloat("block_send_cache_timeout"));
+	g_profiler->avg("Server: block send cache size",
+			m_block_send_cache.size());
+
 	core::array<PrioritySortedBlockTransfer> queue;
 
 	s32 total_sending = 0;
@@ -4382,10 +5006,16 @@ void Server::SendBlocks(float dtime)
 
 		RemoteClient *client = getClient(q.peer_id);
 
-		SendBlockNoLock(q.peer_id, block, client->serialization_version);
+		SendBlockNoLock(q.peer_id, block, client->serialization_version,
+				client->compression_codec);
 
 		client->SentBlock(q.pos);
 
+		// Time from the client asking for the block to getting it
+		u32 wait_ms = 0;
+		if(client->takeEmergeRequest(q.pos, wait_ms))
+			m_emerge_queue.addWaitTime(wait_ms);
+
 		total_sending++;
 	}
 }
@@ -4493,6 +5123,52 @@ RemoteClient* Server::getClient(u16 peer_id)
 	return n->getValue();
 }
 
+bool Server::startPregen(v3s16 p_min, v3s16 p_max)
+{
+	if(m_pregen.start(p_min, p_max) == false)
+		return false;
+	m_pregen.save();
+	return true;
+}
+
+void Server::stopPregen()
+{
+	m_pregen.stop();
+	m_pregen.save();
+}
+
+void Server::updatePregenInFlight()
+{
+	core::list<v3s16> in_flight;
+	m_pregen.getInFlight(in_flight);
+	for(core::list<v3s16>::Iterator i = in_flight.begin();
+			i != in_flight.end(); i++)
+	{
+		MapBlock *block = m_env.getMap().getBlockNoCreateNoEx(*i);
+		if(block && block->isGenerated())
+			m_pregen.setGenerated(*i);
+	}
+}
+
+std::wstring Server::getPregenStatus()
+{
+	std::wostringstream os(std::ios_base::binary);
+	if(m_pregen.isRunning() == false)
+	{
+		os<<L"no pre-generation running";
+		return os.str();
+	}
+	v3s16 p_min = m_pregen.getMin();
+	v3s16 p_max = m_pregen.getMax();
+	u32 total = m_pregen.getTotal();
+	os<<L"pre-generating blocks ("<<p_min.X<<L","<<p_min.Y<<L","<<p_min.Z
+			<<L")...("<<p_max.X<<L","<<p_max.Y<<L","<<p_max.Z<<L"): "
+			<<m_pregen.getDone()<<L"/"<<total<<L" queued ("
+			<<(u32)((u64)m_pregen.getDone() * 100 / total)<<L"%), "
+			<<m_pregen.getInFlightCount()<<L" being generated";
+	return os.str();
+}
+
 std::wstring Server::getStatusString()
 {
 	std::wostringstream os(std::ios_base::binary);
@@ -4501,6 +5177,25 @@ std::wstring Server::getStatusString()
 	os<<L"version="<<narrow_to_wide(VERSION_STRING);
 	// Uptime
 	os<<L", uptime="<<m_uptime.get();
+	// Blocks that may need saving
+	os<<L", dirty_blocks="<<m_env.getMap().getDirtyBlockCount();
+	// Emerge queue and milliseconds from request to sent block
+	os<<L", emerge_queue="<<m_emerge_queue.size();
+	os<<L", emerge_wait_ms_p50/p90/p99="
+			<<m_emerge_queue.getWaitPercentile(50)<<L"/"
+			<<m_emerge_queue.getWaitPercentile(90)<<L"/"
+			<<m_emerge_queue.getWaitPercentile(99);
+	// Sector noise cache of the map generator
+	{
+		mapgen::SectorNoiseCache *cache =
+				m_env.getServerMap().getSectorNoiseCache();
+		os<<L", mapgen_sector_cache="<<cache->size()
+				<<L" ("<<(cache->getMaxBytes()/1024)<<L" KiB max)"
+				<<L", hit_rate="<<(u32)cache->getHitRate()<<L"%";
+	}
+	// Progress of the pre-generation
+	if(m_pregen.isRunning())
+		os<<L", pregen="<<m_pregen.getDone()<<L"/"<<m_pregen.getTotal();
 	// Information about clients
 	os<<L", clients={";
 	for(core::map<u16, RemoteClient*>::Iterator
@@ -4702,8 +5397,8 @@ Player *Server::emergePlayer(const char *name, const char *password, u16 peer_id
 
 void Server::handlePeerChange(PeerChange &c)
 {
-	JMutexAutoLock envlock(m_env_mutex);
-	JMutexAutoLock conlock(m_con_mutex);
+	ProfiledAutoLock envlock(g_profiler, m_env_mutex, g_env_lock_names);
+	ProfiledAutoLock conlock(g_profiler, m_con_mutex, g_con_lock_names);
 	
 	if(c.type == PEER_ADDED)
 	{
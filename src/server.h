@@ -29,12 +29,28 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "inventory.h"
 #include "auth.h"
 #include "ban.h"
+#include "pregen.h"
 
 /*
 	Some random functions
 */
 v3f findSpawnPos(ServerMap &map);
 
+// The block is only loaded from disk, not generated
+#define BLOCK_EMERGE_FLAG_FROMDISK (1<<0)
+
+/*
+	Blocks only loaded from disk are emerged as if they were this many
+	blocks further away than blocks to be generated
+*/
+#define BLOCK_EMERGE_FROMDISK_PRIORITY 4
+
+/*
+	Blocks queued by the pre-generation are emerged as if they were
+	this many blocks away, after the blocks the players want
+*/
+#define BLOCK_EMERGE_PREGEN_PRIORITY 1000
+
 /*
 	A structure containing the data needed for queueing the fetching
 	of blocks.
@@ -44,6 +60,19 @@ struct QueuedBlockEmerge
 	v3s16 pos;
 	// key = peer_id, value = flags
 	core::map<u16, u8> peer_ids;
+	/*
+		Lower is emerged first: the distance in blocks to the nearest
+		player that wants it, see BlockEmergeQueue::getPriority()
+	*/
+	s16 priority;
+	// Generated even if no peer wants it (added with peer_id=0)
+	bool generate;
+
+	QueuedBlockEmerge():
+		priority(0),
+		generate(false)
+	{
+	}
 };
 
 /*
@@ -52,104 +81,127 @@ struct QueuedBlockEmerge
 class BlockEmergeQueue
 {
 public:
-	BlockEmergeQueue()
-	{
-		m_mutex.Init();
-	}
-
-	~BlockEmergeQueue()
-	{
-		JMutexAutoLock lock(m_mutex);
-
-		core::list<QueuedBlockEmerge*>::Iterator i;
-		for(i=m_queue.begin(); i!=m_queue.end(); i++)
-		{
-			QueuedBlockEmerge *q = *i;
-			delete q;
-		}
-	}
+	BlockEmergeQueue();
+	~BlockEmergeQueue();
 	
 	/*
-		peer_id=0 adds with nobody to send to
+		peer_id=0 adds with nobody to send to; the block is generated
+		unless flags has BLOCK_EMERGE_FLAG_FROMDISK.
+		d is the distance of the block from the player in blocks.
 	*/
-	void addBlock(u16 peer_id, v3s16 pos, u8 flags)
-	{
-		DSTACK(__FUNCTION_NAME);
-	
-		JMutexAutoLock lock(m_mutex);
+	void addBlock(u16 peer_id, v3s16 pos, u8 flags, s16 d=0);
 
-		if(peer_id != 0)
-		{
-			/*
-				Find if block is already in queue.
-				If it is, update the peer to it and quit.
-			*/
-			core::list<QueuedBlockEmerge*>::Iterator i;
-			for(i=m_queue.begin(); i!=m_queue.end(); i++)
-			{
-				QueuedBlockEmerge *q = *i;
-				if(q->pos == pos)
-				{
-					q->peer_ids[peer_id] = flags;
-					return;
-				}
-			}
-		}
-		
-		/*
-			Add the block
-		*/
-		QueuedBlockEmerge *q = new QueuedBlockEmerge;
-		q->pos = pos;
-		if(peer_id != 0)
-			q->peer_ids[peer_id] = flags;
-		m_queue.push_back(q);
-	}
+	/*
+		Returned pointer must be deleted.
+		The block with the lowest priority is returned first.
+		The block is being emerged until done() is called with it.
+		Blocks near one being emerged are left in the queue, so that
+		the areas generated for them don't overlap.
+		Returns NULL if queue is empty or has only such blocks.
+	*/
+	QueuedBlockEmerge * pop();
 
-	// Returned pointer must be deleted
-	// Returns NULL if queue is empty
-	QueuedBlockEmerge * pop()
-	{
-		JMutexAutoLock lock(m_mutex);
+	// Call when the block returned by pop() has been emerged
+	void done(QueuedBlockEmerge *q);
 
-		core::list<QueuedBlockEmerge*>::Iterator i = m_queue.begin();
-		if(i == m_queue.end())
-			return NULL;
-		QueuedBlockEmerge *q = *i;
-		m_queue.erase(i);
-		return q;
-	}
+	/*
+		Recalculates the priorities from the blocks the players are at
+		(key = peer_id). Peers that are gone or more than max_d blocks
+		away are removed from the blocks, and blocks nobody wants any
+		more are removed from the queue.
+		Returns the number of blocks removed.
+	*/
+	u32 reprioritize(core::map<u16, v3s16> &peer_blockpos, s16 max_d);
 
 	u32 size()
 	{
 		JMutexAutoLock lock(m_mutex);
 		return m_queue.size();
 	}
+
+	/*
+		Adds to dst the positions of up to max_count queued blocks that
+		are at most d blocks from p on every axis. They stay queued.
+	*/
+	void getNear(v3s16 p, s16 d, u32 max_count, core::list<v3s16> &dst);
 	
-	u32 peerItemCount(u16 peer_id)
-	{
-		JMutexAutoLock lock(m_mutex);
+	u32 peerItemCount(u16 peer_id);
 
-		u32 count = 0;
+	/*
+		Records the milliseconds from a client asking for a block to be
+		emerged to the block being sent to it; see Server::SendBlocks()
+	*/
+	void addWaitTime(u32 wait_ms);
+	/*
+		The times given to addWaitTime() for the recently sent blocks,
+		at percentile 0...100. 0 if none have been recorded.
+	*/
+	u32 getWaitPercentile(u32 percentile);
 
-		core::list<QueuedBlockEmerge*>::Iterator i;
-		for(i=m_queue.begin(); i!=m_queue.end(); i++)
-		{
-			QueuedBlockEmerge *q = *i;
-			if(q->peer_ids.find(peer_id) != NULL)
-				count++;
-		}
+private:
+	/*
+		Generating a block changes the blocks next to it, so the
+		areas of two blocks overlap if they are at most 2 blocks apart
+	*/
+	bool isNearEmerging(v3s16 p);
 
-		return count;
-	}
+	static s16 getPriority(s16 d, u8 flags);
 
-private:
 	core::list<QueuedBlockEmerge*> m_queue;
+	// Popped and not done yet
+	core::map<v3s16, bool> m_emerging;
+	// Wait times of the last sent blocks; a ring buffer
+	core::array<u32> m_wait_times;
+	u32 m_wait_times_next;
 	JMutex m_mutex;
 };
 
 class Server;
 
+/*
+	TOCLIENT_BLOCKDATA packets of recently sent blocks, so that a block
+	that many clients want is serialized and compressed only once.
+	A packet is reused only while the block is unchanged (see
+	MapBlock::getChangeStamp()).
+
+	Used by the server thread only; environment should be locked.
+*/
+class BlockSendCache
+{
+public:
+	BlockSendCache();
+
+	// max_blocks = 0 disables the cache
+	void setMaxBlocks(u32 max_blocks);
+	// Level passed to the codec, see compressWithCodec()
+	void setCompressionLevel(s32 level)
+	{
+		m_compression_level = level;
+	}
+	// Returns the packet for sending block in format ver, compressed
+	// with codec (if ver supports choosing it)
+	SharedBuffer<u8> get(MapBlock *block, u8 ver, u8 codec);
+	// Forgets packets that haven't been used for max_age seconds
+	void removeUnused(float dtime, float max_age);
+	u32 size()
+	{
+		return m_packets.size();
+	}
+
+private:
+	struct CachedPacket
+	{
+		u64 stamp;
+		u8 ver;
+		u8 codec;
+		SharedBuffer<u8> data;
+		float unused_time;
+	};
+	core::map<v3s16, CachedPacket> m_packets;
+	u32 m_max_blocks;
+	s32 m_compression_level;
+};
+
 class ServerThread : public SimpleThread
 {
 	Server *m_server;
@@ -179,6 +231,9 @@ class EmergeThread : public SimpleThread
 
 	void * Thread();
 
+	// Environment should be locked; block may be NULL
+	void activateEmerged(MapBlock *block, bool enable_mapgen_debug_info);
+
 	void trigger()
 	{
 		setRun(true);
@@ -239,6 +294,8 @@ class RemoteClient
 	u16 net_proto_version;
 	// Version is stored in here after INIT before INIT2
 	u8 pending_serialization_version;
+	// Codec of the blocks sent to the client, chosen in INIT
+	u8 compression_codec;
 
 	RemoteClient():
 		m_time_from_building(9999),
@@ -248,6 +305,7 @@ class RemoteClient
 		serialization_version = SER_FMT_VER_INVALID;
 		net_proto_version = 0;
 		pending_serialization_version = SER_FMT_VER_INVALID;
+		compression_codec = CODEC_ZLIB;
 		m_nearest_unsent_d = 0;
 		m_nearest_unsent_reset_timer = 0.0;
 		m_nothing_to_send_counter = 0;
@@ -280,6 +338,15 @@ class RemoteClient
 
 	void SentBlock(v3s16 p);
 
+	/*
+		Forgets the emerge request made by GetNextBlocks() for block p.
+		Returns false if there was none, else sets wait_ms to the time
+		since the request.
+	*/
+	bool takeEmergeRequest(v3s16 p, u32 &wait_ms);
+	// Forgets emerge requests older than max_age_ms
+	void removeOldEmergeRequests(u32 max_age_ms);
+
 	void SetBlockNotSent(v3s16 p);
 	void SetBlocksNotSent(core::map<v3s16, MapBlock*> &blocks);
 
@@ -344,6 +411,12 @@ class RemoteClient
 	*/
 	core::map<v3s16, float> m_blocks_sending;
 
+	/*
+		Blocks that were queued for emerging for this client and haven't
+		been sent yet. Value is porting::getTimeMs() of the first request.
+	*/
+	core::map<v3s16, u32> m_emerge_requests;
+
 	/*
 		Count of excess GotBlocks().
 		There is an excess amount because the client sometimes
@@ -477,6 +550,14 @@ class Server : public con::PeerHandler, public MapEventReceiver,
 		return m_banmanager.getBanDescription(ip_or_name);
 	}
 
+	/*
+		Background pre-generation of the blocks from p_min to p_max
+		(the /#pregen command). Returns false if the box is too big.
+	*/
+	bool startPregen(v3s16 p_min, v3s16 p_max);
+	void stopPregen();
+	std::wstring getPregenStatus();
+
 	Address getPeerAddress(u16 peer_id)
 	{
 		return m_con.GetPeerAddress(peer_id);
@@ -530,11 +611,19 @@ class Server : public con::PeerHandler, public MapEventReceiver,
 	void setBlockNotSent(v3s16 p);
 	
 	// Environment and Connection must be locked when called
-	void SendBlockNoLock(u16 peer_id, MapBlock *block, u8 ver);
+	void SendBlockNoLock(u16 peer_id, MapBlock *block, u8 ver, u8 codec);
 	
 	// Sends blocks to clients (locks env and con on its own)
 	void SendBlocks(float dtime);
 
+	// Starts the emerge threads that are not running
+	void triggerEmergeThreads();
+	/*
+		Tells m_pregen which of its queued blocks have been generated.
+		Environment must be locked.
+	*/
+	void updatePregenInFlight();
+
 	/*
 		Something random
 	*/
@@ -582,11 +671,17 @@ class Server : public con::PeerHandler, public MapEventReceiver,
 	float m_print_info_timer;
 	float m_objectdata_timer;
 	float m_emergethread_trigger_timer;
+	float m_emerge_reprioritize_timer;
 	float m_savemap_timer;
+	float m_backup_timer;
+	// Microseconds the previous AsyncRunStep() took
+	u32 m_step_time_us;
 	IntervalLimiter m_map_timer_and_unload_interval;
 	
 	// NOTE: If connection and environment are both to be locked,
-	// environment shall be locked first.
+	// environment shall be locked first. They are locked with
+	// ProfiledAutoLock, which shows the time waited for them in the
+	// profiler as "env" and "con".
 
 	// Environment
 	ServerEnvironment m_env;
@@ -603,6 +698,9 @@ class Server : public con::PeerHandler, public MapEventReceiver,
 
 	// Bann checking
 	BanManager m_banmanager;
+
+	// Blocks to pre-generate in the background
+	MapPregenerator m_pregen;
 	
 	/*
 		Threads
@@ -615,10 +713,14 @@ class Server : public con::PeerHandler, public MapEventReceiver,
 
 	// The server mainly operates in this thread
 	ServerThread m_thread;
-	// This thread fetches and generates map
-	EmergeThread m_emergethread;
-	// Queue of block coordinates to be processed by the emerge thread
+	// These threads fetch and generate map (num_emerge_threads)
+	core::array<EmergeThread*> m_emergethreads;
+	// Queue of block coordinates to be processed by the emerge threads
 	BlockEmergeQueue m_emerge_queue;
+	// Packets of blocks being sent (behind the env mutex)
+	BlockSendCache m_block_send_cache;
+	// Preferred codec of the blocks sent to clients
+	u8 m_compression_codec;
 	
 	/*
 		Time related stuff
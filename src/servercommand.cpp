@@ -305,6 +305,96 @@ void cmd_clearobjects(std::wostringstream &os,
 	ctx->flags |= SEND_TO_OTHERS;
 }
 
+void cmd_backup(std::wostringstream &os,
+	ServerCommandContext *ctx)
+{
+	if((ctx->privs & PRIV_SERVER) ==0)
+	{
+		os<<L"-!- You don't have permission to do that";
+		return;
+	}
+
+	bool full = (ctx->parms.size() > 1 && ctx->parms[1] == L"full");
+	std::string dir = ctx->env->getServerMap().startBackup(full);
+	if(dir == "")
+	{
+		os<<L"-!- A backup is running already";
+		return;
+	}
+
+	actionstream<<ctx->player->getName()<<" starts a backup to "
+			<<dir<<std::endl;
+
+	os<<L"-!- Backing up the map to "<<narrow_to_wide(dir);
+}
+
+void cmd_pregen(std::wostringstream &os,
+	ServerCommandContext *ctx)
+{
+	if((ctx->privs & PRIV_SERVER) ==0)
+	{
+		os<<L"-!- You don't have permission to do that";
+		return;
+	}
+
+	if(ctx->parms.size() == 1)
+	{
+		os<<L"-!- "<<ctx->server->getPregenStatus();
+		return;
+	}
+
+	if(ctx->parms[1] == L"stop")
+	{
+		ctx->server->stopPregen();
+		actionstream<<ctx->player->getName()
+				<<" stops the pre-generation"<<std::endl;
+		os<<L"-!- Pre-generation stopped";
+		return;
+	}
+
+	// Blocks within a radius of the player or between two nodes
+	v3s16 p_min, p_max;
+	if(ctx->parms.size() == 2)
+	{
+		s16 r = rangelim(stoi(ctx->parms[1]), 0,
+				MAP_GENERATION_LIMIT / MAP_BLOCKSIZE);
+		v3s16 p = getNodeBlockPos(
+				floatToInt(ctx->player->getPosition(), BS));
+		p_min = p - v3s16(r,r,r);
+		p_max = p + v3s16(r,r,r);
+	}
+	else if(ctx->parms.size() == 3)
+	{
+		std::vector<std::wstring> c1 = str_split(ctx->parms[1], L',');
+		std::vector<std::wstring> c2 = str_split(ctx->parms[2], L',');
+		if(c1.size() != 3 || c2.size() != 3)
+		{
+			os<<L"-!- Usage: pregen [<radius>|<x,y,z> <x,y,z>|stop]";
+			return;
+		}
+		p_min = getNodeBlockPos(v3s16(stoi(c1[0]), stoi(c1[1]),
+				stoi(c1[2])));
+		p_max = getNodeBlockPos(v3s16(stoi(c2[0]), stoi(c2[1]),
+				stoi(c2[2])));
+	}
+	else
+	{
+		os<<L"-!- Usage: pregen [<radius>|<x,y,z> <x,y,z>|stop]";
+		return;
+	}
+
+	if(ctx->server->startPregen(p_min, p_max) == false)
+	{
+		os<<L"-!- Too many blocks";
+		return;
+	}
+
+	actionstream<<ctx->player->getName()<<" starts pre-generating blocks "
+			<<PP(p_min)<<"..."<<PP(p_max)<<std::endl;
+
+	os<<L"-!- "<<ctx->server->getPregenStatus();
+}
+
 
 //j
 void cmd_clanNew(std::wostringstream &os,
@@ -478,7 +568,7 @@ std::wstring processServerCommand(ServerCommandContext *ctx)
 		os<<L"-!- Available commands: ";
 		os<<L"status privs ";
 		if(privs & PRIV_SERVER)
-			os<<L"shutdown setting ";
+			os<<L"shutdown setting backup pregen ";
 		if(privs & PRIV_SETTIME)
 			os<<L" time";
 		if(privs & PRIV_TELEPORT)
@@ -508,6 +598,10 @@ std::wstring processServerCommand(ServerCommandContext *ctx)
 		cmd_me(os, ctx);
 	else if(ctx->parms[0] == L"clearobjects")
 		cmd_clearobjects(os, ctx);
+	else if(ctx->parms[0] == L"backup")
+		cmd_backup(os, ctx);
+	else if(ctx->parms[0] == L"pregen")
+		cmd_pregen(os, ctx);
 	else if(ctx->parms[0] == L"die")
 		cmd_die(os, ctx);
 	else if(ctx->parms[0] == L"clan-new")
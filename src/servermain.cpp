@@ -212,6 +212,33 @@ int main(int argc, char *argv[])
 	allowed_options.insert("enable-unittests", ValueSpec(VALUETYPE_FLAG));
 	allowed_options.insert("map-dir", ValueSpec(VALUETYPE_STRING));
 	allowed_options.insert("info-on-stderr", ValueSpec(VALUETYPE_FLAG));
+	allowed_options.insert("convert-block-keys", ValueSpec(VALUETYPE_STRING,
+			"Convert the database keys of the map to linear or morton and exit"));
+	allowed_options.insert("migrate-map", ValueSpec(VALUETYPE_STRING,
+			"Copy every block of the map into a new map in the given"
+			" directory and exit"));
+	allowed_options.insert("migrate-backend", ValueSpec(VALUETYPE_STRING,
+			"Backend of the map made by --migrate-map"
+			" (default: map_backend)"));
+	allowed_options.insert("migrate-rewrite", ValueSpec(VALUETYPE_FLAG,
+			"Convert the blocks to the newest format and"
+			" map_compression_codec in --migrate-map"));
+	allowed_options.insert("migrate-threads", ValueSpec(VALUETYPE_STRING,
+			"Threads converting blocks for --migrate-rewrite (default: 4)"));
+	allowed_options.insert("migrate-compact", ValueSpec(VALUETYPE_FLAG,
+			"Free unused space of the map made by --migrate-map (sqlite3)"));
+	allowed_options.insert("apply-backup", ValueSpec(VALUETYPE_STRING,
+			"Write the blocks of the backup in the given directory into"
+			" the map and exit"));
+	allowed_options.insert("benchmark-compression", ValueSpec(VALUETYPE_STRING,
+			"Compress the given number of blocks of the map with each codec,"
+			" print the results and exit"));
+	allowed_options.insert("benchmark-mapgen", ValueSpec(VALUETYPE_STRING,
+			"Generate the blocks within the given radius of the origin"
+			" in an empty map, print the time taken and a hash of the"
+			" result and exit"));
+	allowed_options.insert("benchmark-seed", ValueSpec(VALUETYPE_STRING,
+			"Seed of --benchmark-mapgen (default: 0)"));
 
 	Settings cmd_args;
 	
@@ -355,6 +382,122 @@ int main(int argc, char *argv[])
 	else if(g_settings->exists("map-dir"))
 		map_dir = g_settings->get("map-dir");
 	
+	/*
+		Offline conversion of the database keys
+	*/
+	if(cmd_args.exists("convert-block-keys"))
+	{
+		if(fs::PathExists(map_dir) == false)
+		{
+			errorstream<<"Map directory \""<<map_dir<<"\" not found"
+					<<std::endl;
+			return 1;
+		}
+		BlockKeyEncoding to = parseBlockKeyEncoding(
+				lowercase(trim(cmd_args.get("convert-block-keys"))));
+		{
+			ServerMap map(map_dir);
+			map.convertBlockKeys(to);
+		}
+		actionstream<<"Converted block keys of "<<map_dir<<" to "
+				<<getBlockKeyEncodingName(to)<<std::endl;
+		return 0;
+	}
+
+	/*
+		Offline copying of the map into another backend
+	*/
+	if(cmd_args.exists("migrate-map"))
+	{
+		if(fs::PathExists(map_dir) == false)
+		{
+			errorstream<<"Map directory \""<<map_dir<<"\" not found"
+					<<std::endl;
+			return 1;
+		}
+		std::string backend = g_settings->get("map_backend");
+		if(cmd_args.exists("migrate-backend"))
+			backend = cmd_args.get("migrate-backend");
+		u32 threads = 4;
+		if(cmd_args.exists("migrate-threads"))
+			threads = rangelim(cmd_args.getS32("migrate-threads"), 1, 64);
+		{
+			ServerMap map(map_dir);
+			map.migrate(cmd_args.get("migrate-map"),
+					lowercase(trim(backend)), threads,
+					cmd_args.getFlag("migrate-rewrite"),
+					cmd_args.getFlag("migrate-compact"));
+		}
+		return 0;
+	}
+
+	/*
+		Restoring of backups: a full backup is a map directory of its
+		own, incremental ones are applied on it in the order they
+		were made in
+	*/
+	if(cmd_args.exists("apply-backup"))
+	{
+		if(fs::PathExists(map_dir) == false)
+		{
+			errorstream<<"Map directory \""<<map_dir<<"\" not found"
+					<<std::endl;
+			return 1;
+		}
+		std::string backup_dir = cmd_args.get("apply-backup");
+		if(fs::PathExists(backup_dir + DIR_DELIM + "map_meta.txt") == false)
+		{
+			errorstream<<"\""<<backup_dir<<"\" is not a complete backup"
+					<<std::endl;
+			return 1;
+		}
+		{
+			ServerMap map(map_dir);
+			map.importBlocks(backup_dir);
+		}
+		return 0;
+	}
+
+	/*
+		Offline benchmark of the compression codecs on the blocks
+		of the map
+	*/
+	if(cmd_args.exists("benchmark-compression"))
+	{
+		if(fs::PathExists(map_dir) == false)
+		{
+			errorstream<<"Map directory \""<<map_dir<<"\" not found"
+					<<std::endl;
+			return 1;
+		}
+		ServerMap map(map_dir);
+		map.benchmarkCompression(rangelim(
+				cmd_args.getS32("benchmark-compression"), 1, 1000000));
+		return 0;
+	}
+
+	/*
+		Benchmark of the map generator in a map that is thrown away
+	*/
+	if(cmd_args.exists("benchmark-mapgen"))
+	{
+		std::string dir = porting::path_userdata + DIR_DELIM
+				+ "mapgen_benchmark";
+		fs::RecursiveDelete(dir);
+		g_settings->set("map_backend", "memory");
+		g_settings->set("map_journal", "false");
+		g_settings->set("fixed_map_seed", "0");
+		if(cmd_args.exists("benchmark-seed"))
+			g_settings->set("fixed_map_seed", cmd_args.get("benchmark-seed"));
+		{
+			ServerMap map(dir);
+			map.benchmarkMapgen(rangelim(
+					cmd_args.getS32("benchmark-mapgen"), 0, 100));
+		}
+		fs::RecursiveDelete(dir);
+		return 0;
+	}
+
 	// Create server
 	Server server(map_dir.c_str(), configpath);
 	server.start(port);
@@ -29,11 +29,23 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "serialization.h"
 #include "voxel.h"
 #include <sstream>
+#include <fstream>
 #include "porting.h"
 #include "content_mapnode.h"
 #include "mapsector.h"
+#include "mapblock.h"
 #include "settings.h"
 #include "log.h"
+#include "database.h"
+#include "database_folders.h"
+#include "database_region.h"
+#include "mapmigrate.h"
+#include "filesys.h"
+#include "mapgen.h"
+#include "noise.h"
+#include "server.h"
+#include "pregen.h"
+#include "jobpool.h"
 
 /*
 	Asserts that the exception occurs
@@ -211,6 +223,63 @@ struct TestCompress
 		}
 
 		}
+
+		{ // Every codec, followed by more data in the same stream
+
+		std::string texts[4];
+		texts[1] = "a";
+		texts[2] = "abcabcabcabcabcabcabcabcabcabcabcabcXYZ0123456789";
+		for(u32 i=0; i<3000; i++)
+			texts[3] += (char)(i % 7 == 0 ? myrand() : i / 50);
+		for(u8 codec=0; codec<CODEC_COUNT; codec++)
+		for(u32 i=0; i<sizeof(texts)/sizeof(texts[0]); i++)
+		{
+			std::ostringstream os(std::ios_base::binary);
+			compressWithCodec(texts[i], os, codec, 1);
+			os<<"end";
+			std::istringstream is(os.str(), std::ios_base::binary);
+			std::ostringstream os2(std::ios_base::binary);
+			decompressWithCodec(is, os2);
+			assert(os2.str() == texts[i]);
+			char end[4] = {0};
+			is.read(end, 3);
+			assert(std::string(end) == "end");
+		}
+
+		// Corrupt LZ4 data is an error, not a crash
+		std::ostringstream os(std::ios_base::binary);
+		compressLZ4(texts[2], os);
+		std::string corrupt = os.str();
+		corrupt[8] = (char)0xff;
+		std::istringstream is(corrupt, std::ios_base::binary);
+		std::ostringstream os2(std::ios_base::binary);
+		bool failed = false;
+		try{
+			decompressLZ4(is, os2);
+		}
+		catch(SerializationError &e)
+		{
+			failed = true;
+		}
+		assert(failed);
+
+		// So is a header with sizes that don't fit together
+		u8 header[8];
+		writeU32(&header[0], 10);
+		writeU32(&header[4], 0xffffffff);
+		std::istringstream is2(std::string((char*)header, 8) + "end",
+				std::ios_base::binary);
+		failed = false;
+		try{
+			decompressLZ4(is2, os2);
+		}
+		catch(SerializationError &e)
+		{
+			failed = true;
+		}
+		assert(failed);
+
+		}
 	}
 };
 
@@ -705,6 +774,707 @@ struct TestMapSector
 };
 #endif
 
+struct TestMapBlockSerialization
+{
+	void Run()
+	{
+		MapBlock b(NULL, v3s16(1,-2,3));
+		for(u16 z=0; z<MAP_BLOCKSIZE; z++)
+		for(u16 y=0; y<MAP_BLOCKSIZE; y++)
+		for(u16 x=0; x<MAP_BLOCKSIZE; x++)
+		{
+			MapNode n(y < 8 ? CONTENT_STONE : CONTENT_AIR);
+			n.param1 = y < 8 ? 0 : LIGHT_SUN;
+			if(x == 3 && z == 5)
+			{
+				n.setContent(CONTENT_TORCH);
+				n.param1 = y;
+				n.param2 = z;
+			}
+			b.setNode(v3s16(x,y,z), n);
+		}
+		b.setOwner(1234);
+
+		for(u8 ver=21; ver<=SER_FMT_VER_HIGHEST; ver++)
+		for(u8 codec=0; codec<(ver >= 23 ? CODEC_COUNT : 1); codec++)
+		{
+			std::ostringstream os(std::ios_base::binary);
+			b.serialize(os, ver, codec, -1);
+			std::istringstream is(os.str(), std::ios_base::binary);
+			MapBlock b2(NULL, v3s16(1,-2,3));
+			b2.deSerialize(is, ver);
+			assert(b2.getOwner() == 1234);
+			assert(b2.getContentTypeCount() == 3);
+			assert(b2.getContentCount(CONTENT_TORCH) == MAP_BLOCKSIZE);
+			for(u16 z=0; z<MAP_BLOCKSIZE; z++)
+			for(u16 y=0; y<MAP_BLOCKSIZE; y++)
+			for(u16 x=0; x<MAP_BLOCKSIZE; x++)
+				assert(b2.getNode(v3s16(x,y,z)) == b.getNode(v3s16(x,y,z)));
+		}
+
+		// A uniform block is almost nothing
+		MapBlock air(NULL, v3s16(0,0,0));
+		for(u16 z=0; z<MAP_BLOCKSIZE; z++)
+		for(u16 y=0; y<MAP_BLOCKSIZE; y++)
+		for(u16 x=0; x<MAP_BLOCKSIZE; x++)
+		{
+			MapNode n(CONTENT_AIR);
+			air.setNode(v3s16(x,y,z), n);
+		}
+		std::ostringstream os(std::ios_base::binary);
+		air.serialize(os, 22);
+		assert(os.str().size() < 32);
+		std::ostringstream os2(std::ios_base::binary);
+		air.serialize(os2, SER_FMT_VER_HIGHEST, CODEC_LZ4, 1);
+		assert(os2.str().size() < 32);
+
+		// Stored blocks can be rewritten in the newest format by threads
+		BlockRewritePool pool(2, CODEC_LZ4, 1);
+		for(u32 j=0; j<4; j++)
+		{
+			BlockBatch *batch = new BlockBatch;
+			for(s16 i=0; i<10; i++)
+			{
+				std::ostringstream os(std::ios_base::binary);
+				u8 ver = 21;
+				os.write((char*)&ver, 1);
+				b.serialize(os, ver);
+				b.serializeDiskExtra(os, ver);
+				batch->blocks.insert(v3s16(i,j,0), os.str());
+			}
+			batch->blocks.insert(v3s16(0,j,1), "\x15garbage");
+			pool.push(batch);
+		}
+		u32 rewritten = 0;
+		while(pool.inFlight() != 0)
+		{
+			BlockBatch *batch = pool.pop(100);
+			if(batch == NULL)
+				continue;
+			assert(batch->failed == 1);
+			for(core::map<v3s16, std::string>::Iterator
+					i = batch->blocks.getIterator();
+					i.atEnd() == false; i++)
+			{
+				if(i.getNode()->getKey().Z == 1)
+					continue;
+				std::istringstream is(i.getNode()->getValue(),
+						std::ios_base::binary);
+				u8 ver = 0;
+				is.read((char*)&ver, 1);
+				assert(ver == SER_FMT_VER_HIGHEST);
+				MapBlock b2(NULL, v3s16(0,0,0));
+				b2.deSerialize(is, ver);
+				assert(b2.getOwner() == 1234);
+				assert(b2.getNode(v3s16(3,4,5)) == b.getNode(v3s16(3,4,5)));
+				rewritten++;
+			}
+			delete batch;
+		}
+		assert(rewritten == 40);
+	}
+};
+
+struct TestMapBlockContents
+{
+	void Run()
+	{
+		MapBlock b(NULL, v3s16(0,0,0));
+		u32 nodecount = MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE;
+		assert(b.isAllContent(CONTENT_IGNORE));
+		assert(b.getContentTypeCount() == 1);
+
+		MapNode air(CONTENT_AIR);
+		for(u16 z=0; z<MAP_BLOCKSIZE; z++)
+		for(u16 y=0; y<MAP_BLOCKSIZE; y++)
+		for(u16 x=0; x<MAP_BLOCKSIZE; x++)
+			b.setNode(v3s16(x,y,z), air);
+		assert(b.isAllContent(CONTENT_AIR));
+		assert(b.hasContent(CONTENT_IGNORE) == false);
+
+		// A content past 0x80 and one that shares its bit in the mask
+		MapNode n(CONTENT_MESE);
+		b.setNode(v3s16(1,2,3), n);
+		assert(b.getContentCount(CONTENT_MESE) == 1);
+		assert(b.hasContent(CONTENT_MESE + 64) == false);
+		assert(b.getContentCount(CONTENT_AIR) == nodecount - 1);
+		b.setNodeNoCheck(v3s16(1,2,3), air);
+		assert(b.hasContent(CONTENT_MESE) == false);
+		assert(b.getContentTypeCount() == 1);
+
+		// A dummy block has no nodes
+		MapBlock dummy(NULL, v3s16(0,0,0), true);
+		assert(dummy.getContentTypeCount() == 0);
+		assert(dummy.hasContent(CONTENT_IGNORE) == false);
+
+		// A placeholder takes the nodes and counts of a loaded block
+		b.setNode(v3s16(1,2,3), n);
+		b.setGenerated(true);
+		dummy.takeContents(&b);
+		assert(b.isDummy());
+		assert(dummy.isGenerated());
+		assert(dummy.getNode(v3s16(1,2,3)) == n);
+		assert(dummy.getContentCount(CONTENT_MESE) == 1);
+	}
+};
+
+struct TestDirtyBlocks
+{
+	void Run()
+	{
+		Map map(dstream);
+		MapBlock b1(&map, v3s16(1,2,3));
+		MapBlock b2(&map, v3s16(-1,2,3));
+		MapBlock dummy(&map, v3s16(0,0,0), true);
+		// New blocks are dirty, dummies aren't
+		assert(map.getDirtyBlockCount() == 2);
+
+		MapNode n(CONTENT_AIR);
+		b1.setNode(v3s16(0,0,0), n);
+		b1.setTimestamp(10);
+		assert(map.getDirtyBlockCount() == 2);
+
+		dummy.unDummify();
+		assert(map.getDirtyBlockCount() == 3);
+
+		// A block made without a map joins the dirty set of the map it
+		// is given when it changes the next time
+		MapBlock loaded(NULL, v3s16(5,5,5));
+		loaded.setNode(v3s16(0,0,0), n);
+		loaded.setParent(&map);
+		assert(map.getDirtyBlockCount() == 3);
+		loaded.setNode(v3s16(1,0,0), n);
+		assert(map.getDirtyBlockCount() == 4);
+	}
+};
+
+struct TestNoise
+{
+	void Run()
+	{
+		/*
+			The bulk functions give what the point ones give. The last
+			bits can differ when built with -ffast-math.
+		*/
+		const double e = 1e-12;
+		double xs[] = {-7.3, -1.0, -0.5, 0.0, 0.25, 0.999, 1.0, 3.5, 77.7};
+		double ys[] = {-2.0, -0.01, 0.0, 0.4, 5.5};
+		double zs[] = {-3.25, 0.0, 0.75, 12.0};
+		const int sx = sizeof(xs)/sizeof(xs[0]);
+		const int sy = sizeof(ys)/sizeof(ys[0]);
+		const int sz = sizeof(zs)/sizeof(zs[0]);
+		double d2[sx*sy];
+		double d3[sx*sy*sz];
+
+		for(int abs=0; abs<2; abs++)
+		{
+			noise2d_perlin_bulk(d2, 1, sx, xs, sx, ys, sy, 15, 4, 0.6, abs);
+			for(int y=0; y<sy; y++)
+			for(int x=0; x<sx; x++)
+			{
+				double v = abs ?
+						noise2d_perlin_abs(xs[x], ys[y], 15, 4, 0.6) :
+						noise2d_perlin(xs[x], ys[y], 15, 4, 0.6);
+				assert(fabs(d2[y*sx + x] - v) < e);
+			}
+
+			noise3d_perlin_bulk(d3, 1, sx, sx*sy, xs, sx, ys, sy, zs, sz,
+					-3, 5, 0.45, abs);
+			for(int z=0; z<sz; z++)
+			for(int y=0; y<sy; y++)
+			for(int x=0; x<sx; x++)
+			{
+				double v = abs ?
+						noise3d_perlin_abs(xs[x], ys[y], zs[z], -3, 5, 0.45) :
+						noise3d_perlin(xs[x], ys[y], zs[z], -3, 5, 0.45);
+				assert(fabs(d3[(z*sy + y)*sx + x] - v) < e);
+			}
+		}
+
+		NoiseType types[] = {NOISE_CONSTANT_ONE, NOISE_PERLIN,
+				NOISE_PERLIN_ABS, NOISE_PERLIN_CONTOUR,
+				NOISE_PERLIN_CONTOUR_FLIP_YZ};
+		for(u32 i=0; i<sizeof(types)/sizeof(types[0]); i++)
+		{
+			NoiseParams param(types[i], 52534, 4, 0.5, 50, 12.0);
+			noise3d_param_bulk(param, d3, xs, sx, ys, sy, zs, sz);
+			for(int z=0; z<sz; z++)
+			for(int y=0; y<sy; y++)
+			for(int x=0; x<sx; x++)
+				assert(fabs(d3[(z*sy + y)*sx + x]
+						- noise3d_param(param, xs[x], ys[y], zs[z])) < e);
+		}
+	}
+};
+
+struct TestSectorNoiseCache
+{
+	void Run()
+	{
+		mapgen::SectorNoiseCache cache(2);
+
+		// Blocks come out the same through the cache
+		v3s16 ps[] = {v3s16(1,0,-1), v3s16(1,-1,-1), v3s16(-2,1,3)};
+		for(u32 i=0; i<sizeof(ps)/sizeof(ps[0]); i++)
+		{
+			MapBlock b1(NULL, ps[i]);
+			MapBlock b2(NULL, ps[i]);
+			mapgen::make_block_alone(12345, ps[i], &b1);
+			mapgen::make_block_alone(12345, ps[i], &b2, &cache);
+			assert(b1.getIsUnderground() == b2.getIsUnderground());
+			for(s16 z=0; z<MAP_BLOCKSIZE; z++)
+			for(s16 y=0; y<MAP_BLOCKSIZE; y++)
+			for(s16 x=0; x<MAP_BLOCKSIZE; x++)
+			{
+				MapNode n1 = b1.getNodeNoEx(v3s16(x,y,z));
+				MapNode n2 = b2.getNodeNoEx(v3s16(x,y,z));
+				assert(n1.param0 == n2.param0);
+				assert(n1.param2 == n2.param2);
+			}
+		}
+		// Only the sectors used last are kept
+		assert(cache.size() == 2);
+		assert(cache.getHitRate() > 0);
+
+		// Ground levels are found once
+		v2s16 p2d(-20, 37);
+		s16 level = mapgen::find_ground_level_from_noise(12345, p2d, 1);
+		assert(cache.getGroundLevel(12345, p2d, 1) == level);
+		assert(cache.getGroundLevel(12345, p2d, 1) == level);
+		assert(cache.getGroundLevel(12345, p2d, 3)
+				== mapgen::find_ground_level_from_noise(12345, p2d, 3));
+
+		// Another seed empties the cache
+		cache.getGroundLevel(54321, p2d, 4);
+		assert(cache.size() == 1);
+	}
+};
+
+struct TestMapgen
+{
+	void Run()
+	{
+		// Generating a block alone always gives the same nodes
+		v3s16 ps[] = {v3s16(0,0,0), v3s16(3,-1,-2), v3s16(-5,1,4)};
+		for(u32 i=0; i<sizeof(ps)/sizeof(ps[0]); i++)
+		{
+			MapBlock b1(NULL, ps[i]);
+			MapBlock b2(NULL, ps[i]);
+			mapgen::make_block_alone(12345, ps[i], &b1);
+			mapgen::make_block_alone(12345, ps[i], &b2);
+			assert(b1.getIsUnderground() == b2.getIsUnderground());
+			for(s16 z=0; z<MAP_BLOCKSIZE; z++)
+			for(s16 y=0; y<MAP_BLOCKSIZE; y++)
+			for(s16 x=0; x<MAP_BLOCKSIZE; x++)
+			{
+				MapNode n1 = b1.getNodeNoEx(v3s16(x,y,z));
+				MapNode n2 = b2.getNodeNoEx(v3s16(x,y,z));
+				assert(n1.param0 == n2.param0);
+				assert(n1.param2 == n2.param2);
+			}
+		}
+
+		// Changing a pristine block makes it not pristine
+		MapBlock b(NULL, v3s16(0,0,0));
+		b.setPristine(true);
+		b.setTimestamp(10);
+		assert(b.isPristine());
+		MapNode n(CONTENT_AIR);
+		b.setNode(v3s16(0,0,0), n);
+		assert(b.isPristine() == false);
+	}
+};
+
+struct TestEmergeQueue
+{
+	void Run()
+	{
+		BlockEmergeQueue q;
+		q.addBlock(1, v3s16(10,0,0), BLOCK_EMERGE_FLAG_FROMDISK, 1);
+		q.addBlock(1, v3s16(20,0,0), 0, 3);
+		q.addBlock(2, v3s16(30,0,0), 0, 2);
+		q.addBlock(1, v3s16(31,0,0), 0, 0);
+		assert(q.size() == 4);
+
+		// Nearest first, blocks only loaded from disk later
+		QueuedBlockEmerge *e = q.pop();
+		assert(e->pos == v3s16(31,0,0));
+		// (30,0,0) is next to the one being emerged
+		QueuedBlockEmerge *e2 = q.pop();
+		assert(e2->pos == v3s16(20,0,0));
+		q.done(e);
+		q.done(e2);
+		delete e;
+		delete e2;
+
+		assert(q.getWaitPercentile(50) == 0);
+		q.addWaitTime(30);
+		q.addWaitTime(10);
+		q.addWaitTime(20);
+		assert(q.getWaitPercentile(0) == 10);
+		assert(q.getWaitPercentile(50) == 20);
+		assert(q.getWaitPercentile(100) == 30);
+
+		// Peer 2 is gone and peer 1 has moved away from (10,0,0)
+		core::map<u16, v3s16> peers;
+		peers.insert(1, v3s16(30,0,0));
+		assert(q.reprioritize(peers, 5) == 2);
+		assert(q.size() == 0);
+
+		// Blocks queued by nobody are generated after the others
+		q.addBlock(0, v3s16(0,0,0), 0, BLOCK_EMERGE_PREGEN_PRIORITY);
+		q.addBlock(1, v3s16(40,0,0), 0, 7);
+		e = q.pop();
+		assert(e->pos == v3s16(40,0,0));
+		delete e;
+		e = q.pop();
+		assert(e->generate == true);
+		delete e;
+	}
+};
+
+struct TestMapPregenerator
+{
+	void Run()
+	{
+		std::string path = porting::path_userdata + DIR_DELIM
+				+ "test_pregen.txt";
+		fs::RecursiveDelete(path);
+
+		MapPregenerator pregen(path);
+		assert(pregen.isRunning() == false);
+		assert(pregen.start(v3s16(-1,1,0), v3s16(1,0,1)));
+		assert(pregen.getTotal() == 12);
+
+		// Columns from the top down
+		v3s16 p;
+		assert(pregen.next(p) && p == v3s16(-1,1,0));
+		pregen.setQueued(p);
+		assert(pregen.next(p) && p == v3s16(-1,0,0));
+		assert(pregen.next(p) && p == v3s16(-1,1,1));
+		for(u32 i=0; i<5; i++)
+		{
+			assert(pregen.next(p));
+			if(i == 3)
+				pregen.setQueued(p);
+		}
+		assert(p == v3s16(0,0,1));
+
+		// Resumes with the first block that is still queued
+		pregen.setGenerated(v3s16(-1,1,0));
+		assert(pregen.getInFlightCount() == 1);
+		pregen.save();
+		MapPregenerator resumed(path);
+		assert(resumed.isRunning());
+		assert(resumed.getDone() == 6);
+		assert(resumed.getTotal() == 12);
+		for(u32 i=0; i<6; i++)
+			assert(resumed.next(p));
+		assert(p == v3s16(1,0,1));
+		assert(resumed.next(p) == false);
+		assert(resumed.isRunning() == false);
+
+		// Done, the file is removed
+		resumed.save();
+		assert(fs::PathExists(path) == false);
+
+		assert(pregen.start(v3s16(-2048,-2048,-2048),
+				v3s16(2047,2047,2047)) == false);
+	}
+};
+
+struct TestJobPool
+{
+	class CountJob : public Job
+	{
+	public:
+		u32 count;
+		void run()
+		{
+			count++;
+		}
+	};
+
+	void Run()
+	{
+		for(u32 thread_count=0; thread_count<3; thread_count++)
+		{
+			JobPool pool(thread_count);
+			assert(pool.getThreadCount() == thread_count);
+			core::array<CountJob> jobs;
+			for(u32 i=0; i<100; i++)
+			{
+				CountJob job;
+				job.count = 0;
+				jobs.push_back(job);
+			}
+			core::array<Job*> jobptrs;
+			for(u32 i=0; i<jobs.size(); i++)
+				jobptrs.push_back(&jobs[i]);
+			// Each job runs once in each run
+			for(u32 k=0; k<2; k++)
+				pool.run(jobptrs);
+			for(u32 i=0; i<jobs.size(); i++)
+				assert(jobs[i].count == 2);
+			// Nothing to run
+			core::array<Job*> none;
+			pool.run(none);
+		}
+	}
+};
+
+struct TestLiquids
+{
+	// The blocks (0,0,0) and (1,0,0) with a floor of stone
+	class LiquidMap : public Map
+	{
+	public:
+		LiquidMap():
+			Map(dstream)
+		{
+			for(s16 x=0; x<2; x++)
+			{
+				MapSector *sector = new ServerMapSector(this, v2s16(x,0));
+				m_sectors.insert(v2s16(x,0), sector);
+				MapBlock *block = sector->createBlankBlock(0);
+				v3s16 p;
+				for(p.Z=0; p.Z<MAP_BLOCKSIZE; p.Z++)
+				for(p.Y=0; p.Y<MAP_BLOCKSIZE; p.Y++)
+				for(p.X=0; p.X<MAP_BLOCKSIZE; p.X++)
+				{
+					MapNode n(p.Y == 0 ? CONTENT_STONE : CONTENT_AIR);
+					block->setNode(p, n);
+				}
+			}
+		}
+		void addSource(v3s16 p)
+		{
+			MapNode n(CONTENT_WATERSOURCE);
+			setNode(p, n);
+			m_transforming_liquid.push_back(p);
+		}
+		u32 getQueueSize()
+		{
+			return m_transforming_liquid.size();
+		}
+	};
+
+	void Run()
+	{
+		LiquidMap maps[2];
+		for(u32 k=0; k<2; k++)
+		{
+			// Same result with and without threads
+			JobPool pool(k * 2);
+			maps[k].addSource(v3s16(15,1,8));
+			for(u32 i=0; i<50 && maps[k].getQueueSize() != 0; i++)
+			{
+				core::map<v3s16, MapBlock*> modified_blocks;
+				maps[k].transformLiquids(modified_blocks, &pool, 10000);
+			}
+			assert(maps[k].getQueueSize() == 0);
+		}
+
+		// Flows over the edge of the block; not on stone
+		assert(maps[0].getNodeNoEx(v3s16(16,1,8)).getContent()
+				== CONTENT_WATER);
+		assert(maps[0].getNodeNoEx(v3s16(14,1,8)).getContent()
+				== CONTENT_WATER);
+		assert(maps[0].getNodeNoEx(v3s16(15,0,8)).getContent()
+				== CONTENT_STONE);
+		assert(maps[0].getNodeNoEx(v3s16(15,2,8)).getContent()
+				== CONTENT_AIR);
+		// One level lower a node further
+		for(s16 d=1; d<=LIQUID_LEVEL_MAX+1; d++)
+		{
+			MapNode n = maps[0].getNodeNoEx(v3s16(15+d,1,8));
+			assert(n.getContent() == CONTENT_WATER);
+			assert((n.param2 & LIQUID_LEVEL_MASK) == LIQUID_LEVEL_MAX+1-d);
+		}
+		assert(maps[0].getNodeNoEx(v3s16(15+LIQUID_LEVEL_MAX+2,1,8))
+				.getContent() == CONTENT_AIR);
+
+		v3s16 p;
+		for(p.Z=0; p.Z<MAP_BLOCKSIZE; p.Z++)
+		for(p.Y=0; p.Y<MAP_BLOCKSIZE; p.Y++)
+		for(p.X=0; p.X<MAP_BLOCKSIZE*2; p.X++)
+		{
+			MapNode n0 = maps[0].getNodeNoEx(p);
+			MapNode n1 = maps[1].getNodeNoEx(p);
+			assert(n0.getContent() == n1.getContent());
+			assert(n0.param2 == n1.param2);
+		}
+	}
+};
+
+struct TestDatabase
+{
+	void Run()
+	{
+		v3s16 ps[] = {v3s16(0,0,0), v3s16(-1,2,-3), v3s16(2047,-2048,1),
+				v3s16(-2048,2047,-2048)};
+		for(u32 i=0; i<sizeof(ps)/sizeof(ps[0]); i++)
+		{
+			s64 k = Database::getBlockAsInteger(ps[i]);
+			assert(Database::getIntegerAsBlock(k) == ps[i]);
+			k = Database::getBlockAsInteger(ps[i], BLOCKKEY_MORTON);
+			assert(Database::getIntegerAsBlock(k, BLOCKKEY_MORTON) == ps[i]);
+		}
+		// An aligned cube is a contiguous key range
+		assert(Database::getBlockAsInteger(v3s16(1,1,1), BLOCKKEY_MORTON)
+				- Database::getBlockAsInteger(v3s16(0,0,0), BLOCKKEY_MORTON)
+				== 7);
+
+		MemoryDatabase db;
+		core::list<v3s16> list;
+		std::string data;
+		db.beginSave();
+		db.saveBlock(v3s16(1,2,3), "foo");
+		db.saveBlock(v3s16(-1,2,3), "bar");
+		db.saveBlock(v3s16(1,2,3), "baz");
+		db.endSave();
+		assert(db.loadBlock(v3s16(1,2,3), data) && data == "baz");
+		assert(db.loadBlock(v3s16(3,2,1), data) == false);
+		db.listAllLoadableBlocks(list);
+		assert(list.size() == 2);
+		core::list<v3s16> wanted;
+		wanted.push_back(v3s16(1,2,3));
+		wanted.push_back(v3s16(3,2,1));
+		core::map<v3s16, std::string> loaded;
+		db.loadBlocks(wanted, loaded);
+		assert(loaded.size() == 1);
+		assert(loaded.find(v3s16(1,2,3))->getValue() == "baz");
+		db.deleteBlock(v3s16(1,2,3));
+		assert(db.loadBlock(v3s16(1,2,3), data) == false);
+
+		{
+			// A block saved again is read from the new layout, not from
+			// the copy left in the old one
+			std::string dir = porting::path_userdata + DIR_DELIM
+					+ "test_folders_db";
+			fs::RecursiveDelete(dir);
+			v3s16 p(1,-2,3);
+			std::string dir1 = FolderDatabase::getSectorDir(dir,
+					v2s16(p.X, p.Z), 1);
+			assert(fs::CreateAllDirs(dir1));
+			std::string path1 = dir1 + DIR_DELIM
+					+ FolderDatabase::getBlockFilename(p);
+			std::ofstream os(path1.c_str(), std::ios_base::binary);
+			os<<"old";
+			os.close();
+			FolderDatabase folders(dir);
+			assert(folders.loadBlock(p, data) && data == "old");
+			folders.saveBlock(p, "new");
+			assert(folders.loadBlock(p, data) && data == "new");
+			folders.deleteBlock(p);
+			assert(folders.loadBlock(p, data) == false);
+			fs::RecursiveDelete(dir);
+		}
+
+		{
+			std::string dir = porting::path_userdata + DIR_DELIM
+					+ "test_region_db";
+			fs::RecursiveDelete(dir);
+			{
+				RegionDatabase region(dir);
+				region.beginSave();
+				region.saveBlock(v3s16(1,2,3), "foo");
+				region.saveBlock(v3s16(-1,2,3), std::string(1000, 'x'));
+				region.endSave();
+				assert(region.loadBlock(v3s16(1,2,3), data) && data == "foo");
+				// Outside of a save these are written right away
+				region.saveBlock(v3s16(1,2,3), "bar");
+				region.deleteBlock(v3s16(-1,2,3));
+				assert(region.loadBlock(v3s16(1,2,3), data) && data == "bar");
+				assert(region.loadBlock(v3s16(-1,2,3), data) == false);
+				region.beginSave();
+				region.saveBlock(v3s16(1,2,4), "baz");
+				region.endSave();
+			}
+			{
+				RegionDatabase region(dir);
+				assert(region.loadBlock(v3s16(1,2,3), data) && data == "bar");
+				assert(region.loadBlock(v3s16(1,2,4), data) && data == "baz");
+				assert(region.loadBlock(v3s16(-1,2,3), data) == false);
+				list.clear();
+				region.listAllLoadableBlocks(list);
+				assert(list.size() == 2);
+			}
+			{
+				// Until endSave() the file has the old version, and its
+				// data isn't overwritten
+				RegionDatabase region(dir);
+				region.beginSave();
+				region.saveBlock(v3s16(1,2,3), "new");
+				RegionDatabase other(dir);
+				assert(other.loadBlock(v3s16(1,2,3), data) && data == "bar");
+				region.endSave();
+				RegionDatabase reopened(dir);
+				assert(reopened.loadBlock(v3s16(1,2,3), data) && data == "new");
+			}
+			fs::RecursiveDelete(dir);
+		}
+
+		BlockPresenceFilter filter;
+		filter.reset(100);
+		for(s16 y=-50; y<50; y++)
+			filter.add(v3s16(3,y,-7));
+		for(s16 y=-50; y<50; y++)
+			assert(filter.mayContain(v3s16(3,y,-7)));
+		u32 false_positives = 0;
+		for(s16 y=-50; y<50; y++)
+			false_positives += filter.mayContain(v3s16(4,y,-7));
+		assert(false_positives < 5);
+		assert(filter.isFull() == false);
+
+		// Backups aren't supported by every backend
+		bool failed = false;
+		assert(db.startBackup(porting::path_userdata) == false);
+		assert(db.backupStep(64, failed) == false && failed == false);
+
+		std::string journal_path = porting::path_userdata + DIR_DELIM
+				+ "test_map_journal";
+		remove(journal_path.c_str());
+		remove((journal_path + ".old").c_str());
+		core::map<v3s16, bool> rotated;
+		{
+			BlockJournal journal;
+			journal.open(journal_path);
+			assert(journal.isOpen());
+			journal.add(v3s16(1,2,3));
+			journal.add(v3s16(-4,5,-6));
+			journal.add(v3s16(1,2,3));
+			assert(journal.size() == 2);
+		}
+		{
+			// Positions survive a restart
+			BlockJournal journal;
+			journal.open(journal_path);
+			assert(journal.size() == 2);
+			journal.rotate(rotated);
+			assert(rotated.size() == 2 && journal.size() == 0);
+			journal.add(v3s16(7,8,9));
+		}
+		{
+			// Until rotationDone(), rotated positions come back
+			BlockJournal journal;
+			journal.open(journal_path);
+			assert(journal.size() == 3);
+			rotated.clear();
+			journal.rotate(rotated);
+			journal.rotationDone();
+		}
+		{
+			BlockJournal journal;
+			journal.open(journal_path);
+			assert(journal.size() == 0);
+		}
+		assert(rotated.find(v3s16(-4,5,-6)) != NULL);
+		assert(rotated.find(v3s16(7,8,9)) != NULL);
+		remove(journal_path.c_str());
+	}
+};
+
 struct TestSocket
 {
 	void Run()
@@ -1110,6 +1880,17 @@ void run_tests()
 	TEST(TestVoxelManipulator);
 	//TEST(TestMapBlock);
 	//TEST(TestMapSector);
+	TEST(TestMapBlockSerialization);
+	TEST(TestMapBlockContents);
+	TEST(TestDirtyBlocks);
+	TEST(TestNoise);
+	TEST(TestMapgen);
+	TEST(TestSectorNoiseCache);
+	TEST(TestEmergeQueue);
+	TEST(TestMapPregenerator);
+	TEST(TestJobPool);
+	TEST(TestLiquids);
+	TEST(TestDatabase);
 	if(INTERNET_SIMULATOR == false){
 		TEST(TestSocket);
 		dout_con<<"=== BEGIN RUNNING UNIT TESTS FOR CONNECTION ==="<<std::endl;